@@ -47,7 +47,9 @@ extern "C" {
 
 /* Exported macro ------------------------------------------------------------*/
 /* USER CODE BEGIN EM */
-
+/* Code that runs while the flash is busy, copied to RAM with .data by the
+   startup: a fetch from the flash would stall until the erase or program ends */
+#define RAM_FUNC  __attribute__( ( section( ".RamFunc" ), noinline ) )
 /* USER CODE END EM */
 
 /* Exported functions prototypes ---------------------------------------------*/
@@ -36,6 +36,7 @@ volatile const uint32_t version __attribute__((section (".version"))) =  0U | (
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+#define VECTORS_NUM  ( 16U + ( uint32_t )RNG_IRQn + 1U )  /* Cortex-M3 exceptions and device IRQs */
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -43,19 +44,63 @@ volatile const uint32_t version __attribute__((section (".version"))) =  0U | (
 /* USER CODE END PM */
 
 /* Private variables ---------------------------------------------------------*/
+DMA_HandleTypeDef hdma_memtomem_dma2_stream0;
 
 /* USER CODE BEGIN PV */
+static uint32_t ramVectors[VECTORS_NUM] __attribute__( ( aligned( 512 ) ) );  /* VTOR alignment: next power of 2 of the size */
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 /* USER CODE BEGIN PFP */
+static void VectorsToRam( void );
+static void DfuLoop( void ) __attribute__( ( noreturn ) );
 
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+/**
+  * @brief  Move the vector table to RAM.
+  *         A sector erase stalls every fetch from the flash for up to 2 s,
+  *         the vector fetch of the USB interrupt included. With the table
+  *         and the USB interrupt path in RAM the host is answered meanwhile.
+  * @retval None
+  */
+static void VectorsToRam( void )
+{
+  const uint32_t* vectors = ( const uint32_t* )SCB->VTOR;
+  uint32_t        i       = 0U;
+
+  __disable_irq();
+  for ( i=0U; i<VECTORS_NUM; i++ )
+  {
+    ramVectors[i] = vectors[i];
+  }
+  SCB->VTOR = ( uint32_t )ramVectors;
+  __DSB();
+  __enable_irq();
+}
+
+/**
+  * @brief  DFU main loop, run from RAM: the jobs return here with an erase
+  *         or a program they started still running.
+  * @retval None
+  */
+RAM_FUNC static void DfuLoop( void )
+{
+  for ( ;; )
+  {
+    if ( MX_USB_DEVICE_Process() == 0U )
+    {
+      /* Sleep until the USB or the FLASH interrupt. An interrupt between the
+         check and the WFE sets the event register, the WFE returns at once */
+      __WFE();
+    }
+  }
+}
 
 /* USER CODE END 0 */
 
@@ -85,10 +130,14 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   /* USER CODE BEGIN 2 */
-  if ( ( HAL_GPIO_ReadPin( BOOT1_GPIO_Port, BOOT1_Pin ) == GPIO_PIN_RESET ) &&
-       ( HAL_GPIO_ReadPin( BOOT2_GPIO_Port, BOOT2_Pin ) == GPIO_PIN_RESET ) )
+  /* Stay in DFU mode as well while the application image is not verified */
+  if ( ( ( HAL_GPIO_ReadPin( BOOT1_GPIO_Port, BOOT1_Pin ) == GPIO_PIN_RESET ) &&
+         ( HAL_GPIO_ReadPin( BOOT2_GPIO_Port, BOOT2_Pin ) == GPIO_PIN_RESET ) ) ||
+       ( MEM_If_IsImageValid() == 0U ) )
   {
+    VectorsToRam();
     MX_USB_DEVICE_Init();
     HAL_GPIO_WritePin( LED1_GPIO_Port,    LED1_Pin,    GPIO_PIN_RESET );
     HAL_GPIO_WritePin( LED2_GPIO_Port,    LED2_Pin,    GPIO_PIN_RESET );
@@ -117,6 +166,7 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
+    DfuLoop();
   }
   /* USER CODE END 3 */
 }
@@ -161,6 +211,43 @@ void SystemClock_Config(void)
   }
 }
 
+/**
+  * Enable DMA controller clock
+  * Configure DMA for memory to memory transfers
+  *   hdma_memtomem_dma2_stream0
+  */
+static void MX_DMA_Init(void)
+{
+
+  /* DMA controller clock enable */
+  __HAL_RCC_DMA2_CLK_ENABLE();
+
+  /* Configure DMA request hdma_memtomem_dma2_stream0 on DMA2_Stream0 */
+  hdma_memtomem_dma2_stream0.Instance = DMA2_Stream0;
+  hdma_memtomem_dma2_stream0.Init.Channel = DMA_CHANNEL_0;
+  hdma_memtomem_dma2_stream0.Init.Direction = DMA_MEMORY_TO_MEMORY;
+  hdma_memtomem_dma2_stream0.Init.PeriphInc = DMA_PINC_ENABLE;
+  hdma_memtomem_dma2_stream0.Init.MemInc = DMA_MINC_DISABLE;
+  hdma_memtomem_dma2_stream0.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+  hdma_memtomem_dma2_stream0.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+  hdma_memtomem_dma2_stream0.Init.Mode = DMA_NORMAL;
+  hdma_memtomem_dma2_stream0.Init.Priority = DMA_PRIORITY_LOW;
+  hdma_memtomem_dma2_stream0.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+  hdma_memtomem_dma2_stream0.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+  hdma_memtomem_dma2_stream0.Init.MemBurst = DMA_MBURST_SINGLE;
+  hdma_memtomem_dma2_stream0.Init.PeriphBurst = DMA_PBURST_SINGLE;
+  if (HAL_DMA_Init(&hdma_memtomem_dma2_stream0) != HAL_OK)
+  {
+    Error_Handler( );
+  }
+
+  /* DMA interrupt init */
+  /* DMA2_Stream0_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA2_Stream0_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+
+}
+
 /**
   * @brief GPIO Initialization Function
   * @param None
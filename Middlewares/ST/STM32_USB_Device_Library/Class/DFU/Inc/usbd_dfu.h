@@ -41,14 +41,65 @@ extern "C" {
 /** @defgroup USBD_DFU_Exported_Defines
   * @{
   */
+/* The class data comes from the static pool of usbd_conf.c, not the heap */
+#undef  USBD_malloc
+#undef  USBD_free
+#define USBD_malloc                    USBD_static_malloc
+#define USBD_free                      USBD_static_free
+
 #ifndef USBD_DFU_MAX_ITF_NUM
 #define USBD_DFU_MAX_ITF_NUM            1U
 #endif /* USBD_DFU_MAX_ITF_NUM */
 
+#ifdef DFU_XFER_SIZE
+#undef  USBD_DFU_XFER_SIZE
+#define USBD_DFU_XFER_SIZE             DFU_XFER_SIZE  /* Build override of the .ioc wTransferSize, 2048U or 4096U */
+#endif /* DFU_XFER_SIZE */
+
 #ifndef USBD_DFU_XFER_SIZE
 #define USBD_DFU_XFER_SIZE             1024U
 #endif /* USBD_DFU_XFER_SIZE */
 
+#if ((USBD_DFU_XFER_SIZE % 64U) != 0U) || (USBD_DFU_XFER_SIZE > 4096U)
+#error "ERROR: usbd_dfu.h: USBD_DFU_XFER_SIZE must be a multiple of the EP0 packet size, up to 4096!"
+#endif /* USBD_DFU_XFER_SIZE check */
+
+#ifndef USBD_DFU_BUFFER_NUM
+#define USBD_DFU_BUFFER_NUM            2U  /* One block is received while the other one is written */
+#endif /* USBD_DFU_BUFFER_NUM */
+
+#if (USBD_DFU_BUFFER_NUM < 2U)
+#error "ERROR: usbd_dfu.h: at least two buffers are required to overlap reception and writing!"
+#endif /* (USBD_DFU_BUFFER_NUM < 2U) */
+
+#ifndef USBD_DFU_STREAM
+#define USBD_DFU_STREAM                1U  /* A block is written packet by packet while it is received */
+#endif /* USBD_DFU_STREAM */
+
+#ifndef USBD_FIFO_PROFILE_DFU
+#define USBD_FIFO_PROFILE_DFU          1U  /* OTG FS FIFOs laid out for EP0 only by usb_device.c, 0 - generated layout */
+#endif /* USBD_FIFO_PROFILE_DFU */
+
+#ifndef USBD_DFU_JOB_NUM
+#define USBD_DFU_JOB_NUM               4U  /* Size of the media job queue, one slot is kept free */
+#endif /* USBD_DFU_JOB_NUM */
+
+#ifndef USBD_DFU_TAG_SIZE
+#define USBD_DFU_TAG_SIZE              16U  /* Length of the image tag set with DFU_CMD_TAG */
+#endif /* USBD_DFU_TAG_SIZE */
+
+#ifndef USBD_DFU_DIGEST_SIZE
+#define USBD_DFU_DIGEST_SIZE           16U  /* Largest DFU_CMD_HASH result */
+#endif /* USBD_DFU_DIGEST_SIZE */
+
+#ifndef USBD_DFU_NONCE_SIZE
+#define USBD_DFU_NONCE_SIZE            12U  /* Nonce of the image encryption, the end of the image descriptor */
+#endif /* USBD_DFU_NONCE_SIZE */
+
+#ifndef USBD_DFU_INFO_SIZE
+#define USBD_DFU_INFO_SIZE             (12U + USBD_DFU_NONCE_SIZE)  /* Length of the image descriptor set with DFU_CMD_IMAGE */
+#endif /* USBD_DFU_INFO_SIZE */
+
 #ifndef USBD_DFU_APP_DEFAULT_ADD
 #define USBD_DFU_APP_DEFAULT_ADD       0x08008000U /* The first sector (32 KB) is reserved for DFU code */
 #endif /* USBD_DFU_APP_DEFAULT_ADD */
@@ -107,9 +158,30 @@ extern "C" {
 #define DFU_CMD_GETCOMMANDS            0x00U
 #define DFU_CMD_SETADDRESSPOINTER      0x21U
 #define DFU_CMD_ERASE                  0x41U
+#define DFU_CMD_HASH                   0x31U  /* Digest of a media area, read back with UPLOAD block 1 */
+#define DFU_CMD_TAG                    0x32U  /* Expected MAC of the image, checked on manifestation */
+#define DFU_CMD_IMAGE                  0x33U  /* Image descriptor: length, CRC32 and version checked on manifestation, cipher nonce */
+#define DFU_CMD_SESSION                0x34U  /* New nonce of the encrypted read-out, read back with UPLOAD block 1 */
+
+/* DFU_CMD_IMAGE descriptor, sent before the DNLOAD blocks of the image:
+     bytes 0..11  - image length, CRC32 and version, little endian words;
+     bytes 12..23 - nonce of the image encryption, USBD_DFU_NONCE_SIZE bytes.
+   The host draws a new random nonce for every image it encrypts, the media
+   decrypts the blocks with it until the manifestation ends the descriptor.
+   The DFU_CMD_TAG MAC covers bytes 0..11 of the descriptor, then the image
+   as the flash holds it after the download, whatever blocks were sent */
+
+/* DFU_CMD_HASH algorithms, optional byte after the length */
+#define DFU_HASH_CRC32                 0x00U  /* CRC32 by the CRC unit, 4 bytes */
+#define DFU_HASH_CMAC                  0x01U  /* AES-CMAC with the digest key, 16 bytes */
+#define DFU_HASH_SESSION               0x02U  /* Job of DFU_CMD_SESSION: no area, the 16-byte nonce as the digest */
 
 #define DFU_MEDIA_ERASE                0x00U
 #define DFU_MEDIA_PROGRAM              0x01U
+#define DFU_MEDIA_HASH                 0x02U
+#define DFU_MEDIA_MANIFEST             0x03U
+
+#define DFU_NO_JOB                     0xFFU
 
 /**************************************************/
 /* Other defines                                  */
@@ -157,21 +229,52 @@ typedef  void (*pFunction)(void);
   * @{
   */
 
+typedef union
+{
+  uint32_t d32[USBD_DFU_XFER_SIZE / 4U];
+  uint8_t  d8[USBD_DFU_XFER_SIZE];
+}
+USBD_DFU_BufferTypeDef;
+
+/* Media operation deferred from the USB interrupt to USBD_DFU_Process */
+typedef struct
+{
+  uint32_t             addr;
+  __IO uint32_t        length;  /* Grows with every packet while the block is streamed */
+  uint32_t             done;    /* Bytes of the block already written */
+  uint8_t              cmd;     /* DFU_MEDIA_ERASE, DFU_MEDIA_PROGRAM, DFU_MEDIA_HASH or DFU_MEDIA_MANIFEST */
+  uint8_t              buffer;  /* Index of the buffer holding the data to program */
+  __IO uint8_t         stream;  /* The block is still being received */
+  uint8_t              ReservedForAlign;
+}
+USBD_DFU_JobTypeDef;
+
 typedef struct
 {
-  union
-  {
-    uint32_t d32[USBD_DFU_XFER_SIZE / 4U];
-    uint8_t  d8[USBD_DFU_XFER_SIZE];
-  } buffer;
+  USBD_DFU_BufferTypeDef *buffer;  /* USBD_DFU_BUFFER_NUM blocks of the static arena */
+  USBD_DFU_JobTypeDef  job[USBD_DFU_JOB_NUM];
 
   uint32_t             wblock_num;
   uint32_t             wlength;
   uint32_t             data_ptr;
   uint32_t             alt_setting;
+  uint32_t             job_chunk;  /* Bytes of the head job handed to the media, 0 - none */
+
+  __IO uint8_t         job_head;   /* Next job to run, advanced by USBD_DFU_Process */
+  __IO uint8_t         job_tail;   /* Next free slot, advanced by the USB interrupt */
+  __IO uint8_t         job_error;  /* DFU error code of the last failed job */
+  uint8_t              rx_buffer;
+  uint8_t              rx_job;     /* Program job of the block being streamed, DFU_NO_JOB - none */
+  uint8_t              rx_open;    /* The data stage of a DNLOAD is being received */
+  __IO uint8_t         abort_job;  /* First job after a DFU_ABORT or CLRSTATUS, the media drops its session before it, DFU_NO_JOB - none */
+
+  uint8_t              tag[USBD_DFU_TAG_SIZE];
+  uint8_t              info[USBD_DFU_INFO_SIZE];
+  uint8_t              digest[USBD_DFU_DIGEST_SIZE];  /* Result of the last DFU_CMD_HASH */
 
   uint8_t              dev_status[DFU_STATUS_DEPTH];
-  uint8_t              ReservedForAlign[2];
+  uint8_t              manif_job;  /* The DFU_MEDIA_MANIFEST job of this manifestation is queued */
+  uint8_t              hash_alg;   /* Algorithm of the DFU_CMD_HASH job */
   uint8_t              dev_state;
   uint8_t              manif_state;
 }
@@ -186,6 +289,9 @@ typedef struct
   uint16_t (* Write)(uint8_t *src, uint8_t *dest, uint32_t Len);
   uint8_t *(* Read)(uint8_t *src, uint8_t *dest, uint32_t Len);
   uint16_t (* GetStatus)(uint32_t Add, uint8_t cmd, uint8_t *buff);
+  uint16_t (* Hash)(uint32_t Add, uint32_t Len, uint8_t Alg, uint8_t *digest);
+  uint16_t (* Manifest)(const uint8_t *tag, const uint8_t *info);
+  uint16_t (* Abort)(void);
 }
 USBD_DFU_MediaTypeDef;
 /**
@@ -217,6 +323,11 @@ extern USBD_ClassTypeDef  USBD_DFU;
   */
 uint8_t  USBD_DFU_RegisterMedia(USBD_HandleTypeDef   *pdev,
                                 USBD_DFU_MediaTypeDef *fops);
+
+uint8_t  USBD_DFU_Process(USBD_HandleTypeDef *pdev);
+
+void    *USBD_static_malloc(uint32_t size);
+void     USBD_static_free(void *p);
 /**
   * @}
   */
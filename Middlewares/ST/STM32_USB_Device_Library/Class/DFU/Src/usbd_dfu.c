@@ -87,6 +87,7 @@ EndBSPDependencies */
 /** @defgroup USBD_DFU_Private_Macros
   * @{
   */
+#define DFU_DIGEST_LEN(alg)   (((alg) == DFU_HASH_CRC32) ? 4U : 16U)
 
 /**
   * @}
@@ -147,6 +148,21 @@ static void DFU_Abort(USBD_HandleTypeDef *pdev);
 
 static void DFU_Leave(USBD_HandleTypeDef *pdev);
 
+static uint8_t DFU_IsRequestReady(USBD_DFU_HandleTypeDef *hdfu);
+
+static uint8_t DFU_IsBufferBusy(USBD_DFU_HandleTypeDef *hdfu, uint8_t index);
+
+static uint8_t DFU_IsHashPending(USBD_DFU_HandleTypeDef *hdfu);
+
+static void DFU_JobStatus(USBD_HandleTypeDef *pdev);
+
+static void DFU_PostJob(USBD_DFU_HandleTypeDef *hdfu, uint8_t cmd, uint32_t addr, uint32_t length);
+
+static void DFU_DropBlock(USBD_DFU_HandleTypeDef *hdfu);
+
+#if (USBD_DFU_STREAM > 0U)
+static uint8_t DFU_OpenStream(USBD_DFU_HandleTypeDef *hdfu, uint32_t addr);
+#endif
 
 /**
   * @}
@@ -156,6 +172,9 @@ static void DFU_Leave(USBD_HandleTypeDef *pdev);
   * @{
   */
 
+/* Transfer buffers, kept out of the heap so the RAM budget is checked at link time */
+static USBD_DFU_BufferTypeDef USBD_DFU_Arena[USBD_DFU_BUFFER_NUM];
+
 USBD_ClassTypeDef  USBD_DFU =
 {
   USBD_DFU_Init,
@@ -238,7 +257,7 @@ __ALIGN_BEGIN static uint8_t USBD_DFU_CfgDesc[USB_DFU_CONFIG_DESC_SIZ] __ALIGN_E
   0x00,
   /*WARNING: In DMA mode the multiple MPS packets feature is still not supported
    ==> In this case, when using DMA USBD_DFU_XFER_SIZE should be set to 64 in usbd_conf.h */
-  TRANSFER_SIZE_BYTES(USBD_DFU_XFER_SIZE),       /* TransferSize = 1024 Byte*/
+  TRANSFER_SIZE_BYTES(USBD_DFU_XFER_SIZE),       /* TransferSize = USBD_DFU_XFER_SIZE Byte*/
   0x1A,                                /* bcdDFUVersion*/
   0x01
   /***********************************************************/
@@ -296,6 +315,21 @@ static uint8_t  USBD_DFU_Init(USBD_HandleTypeDef *pdev,
     hdfu->wblock_num = 0U;
     hdfu->wlength = 0U;
 
+    hdfu->job_head = 0U;
+    hdfu->job_tail = 0U;
+    hdfu->job_error = DFU_ERROR_NONE;
+    hdfu->buffer = USBD_DFU_Arena;
+    hdfu->rx_buffer = 0U;
+    hdfu->rx_job = DFU_NO_JOB;
+    hdfu->rx_open = 0U;
+    hdfu->abort_job = DFU_NO_JOB;
+    hdfu->job_chunk = 0U;
+    hdfu->hash_alg = DFU_HASH_CRC32;
+    (void)USBD_memset(hdfu->digest, 0, USBD_DFU_DIGEST_SIZE);
+    hdfu->manif_job = 0U;
+    (void)USBD_memset(hdfu->tag, 0, USBD_DFU_TAG_SIZE);
+    (void)USBD_memset(hdfu->info, 0, USBD_DFU_INFO_SIZE);
+
     hdfu->manif_state = DFU_MANIFEST_COMPLETE;
     hdfu->dev_state = DFU_STATE_IDLE;
 
@@ -365,6 +399,14 @@ static uint8_t  USBD_DFU_Setup(USBD_HandleTypeDef *pdev,
 
   hdfu = (USBD_DFU_HandleTypeDef *) pdev->pClassData;
 
+  /* A SETUP ends an unfinished data stage: the block is dropped */
+  if (hdfu->rx_open != 0U)
+  {
+    DFU_DropBlock(hdfu);
+    hdfu->dev_state = DFU_STATE_DNLOAD_IDLE;
+    hdfu->dev_status[4] = hdfu->dev_state;
+  }
+
   switch (req->bmRequest & USB_REQ_TYPE_MASK)
   {
     case USB_REQ_TYPE_VENDOR:
@@ -518,6 +560,29 @@ static uint8_t  USBD_DFU_DataIn(USBD_HandleTypeDef *pdev,
   */
 static uint8_t  USBD_DFU_EP0_RxReady(USBD_HandleTypeDef *pdev)
 {
+  USBD_DFU_HandleTypeDef   *hdfu;
+  USBD_DFU_JobTypeDef      *job;
+
+  hdfu = (USBD_DFU_HandleTypeDef *) pdev->pClassData;
+
+  if ((hdfu->rx_job != DFU_NO_JOB) && (hdfu->job[hdfu->rx_job].stream != 0U))
+  {
+    job = &hdfu->job[hdfu->rx_job];
+
+    /* Hand the packets received so far over to USBD_DFU_Process, the
+       length is published before the end of the stream */
+    job->length = USBD_CtlGetRxLength(pdev);
+    if (job->length >= hdfu->wlength)
+    {
+      job->stream = 0U;
+      hdfu->rx_open = 0U;
+    }
+  }
+  else
+  {
+    /* The whole block is in the buffer */
+    hdfu->rx_open = 0U;
+  }
 
   return USBD_OK;
 }
@@ -537,31 +602,73 @@ static uint8_t  USBD_DFU_EP0_TxReady(USBD_HandleTypeDef *pdev)
 
   if (hdfu->dev_state == DFU_STATE_DNLOAD_BUSY)
   {
+    /* The media jobs queued before can not make room for this request yet:
+       keep it in the receive buffer, it is handled on the next GETSTATUS */
+    if (DFU_IsRequestReady(hdfu) == 0U)
+    {
+      hdfu->dev_state = DFU_STATE_DNLOAD_SYNC;
+      hdfu->dev_status[4] = hdfu->dev_state;
+      return USBD_OK;
+    }
+
     /* Decode the Special Command*/
     if (hdfu->wblock_num == 0U)
     {
-      if ((hdfu->buffer.d8[0] == DFU_CMD_GETCOMMANDS) && (hdfu->wlength == 1U))
+      if ((hdfu->buffer[hdfu->rx_buffer].d8[0] == DFU_CMD_GETCOMMANDS) && (hdfu->wlength == 1U))
       {
 
       }
-      else if ((hdfu->buffer.d8[0] == DFU_CMD_SETADDRESSPOINTER) && (hdfu->wlength == 5U))
+      else if ((hdfu->buffer[hdfu->rx_buffer].d8[0] == DFU_CMD_SETADDRESSPOINTER) && (hdfu->wlength == 5U))
       {
-        hdfu->data_ptr = hdfu->buffer.d8[1];
-        hdfu->data_ptr += (uint32_t)hdfu->buffer.d8[2] << 8;
-        hdfu->data_ptr += (uint32_t)hdfu->buffer.d8[3] << 16;
-        hdfu->data_ptr += (uint32_t)hdfu->buffer.d8[4] << 24;
+        hdfu->data_ptr = hdfu->buffer[hdfu->rx_buffer].d8[1];
+        hdfu->data_ptr += (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[2] << 8;
+        hdfu->data_ptr += (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[3] << 16;
+        hdfu->data_ptr += (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[4] << 24;
       }
-      else if ((hdfu->buffer.d8[0] == DFU_CMD_ERASE) && (hdfu->wlength == 5U))
+      else if ((hdfu->buffer[hdfu->rx_buffer].d8[0] == DFU_CMD_ERASE) && (hdfu->wlength == 5U))
       {
-        hdfu->data_ptr = hdfu->buffer.d8[1];
-        hdfu->data_ptr += (uint32_t)hdfu->buffer.d8[2] << 8;
-        hdfu->data_ptr += (uint32_t)hdfu->buffer.d8[3] << 16;
-        hdfu->data_ptr += (uint32_t)hdfu->buffer.d8[4] << 24;
+        hdfu->data_ptr = hdfu->buffer[hdfu->rx_buffer].d8[1];
+        hdfu->data_ptr += (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[2] << 8;
+        hdfu->data_ptr += (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[3] << 16;
+        hdfu->data_ptr += (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[4] << 24;
 
-        if (((USBD_DFU_MediaTypeDef *)pdev->pUserData)->Erase(hdfu->data_ptr) != USBD_OK)
-        {
-          return USBD_FAIL;
-        }
+        /* The sector is erased by USBD_DFU_Process */
+        DFU_PostJob(hdfu, DFU_MEDIA_ERASE, hdfu->data_ptr, 0U);
+      }
+      else if ((hdfu->buffer[hdfu->rx_buffer].d8[0] == DFU_CMD_HASH) &&
+               ((hdfu->wlength == 9U) || (hdfu->wlength == 10U)))
+      {
+        /* Without the algorithm byte the digest is a CRC32 */
+        hdfu->hash_alg = (hdfu->wlength == 10U) ? hdfu->buffer[hdfu->rx_buffer].d8[9] : DFU_HASH_CRC32;
+
+        addr = hdfu->buffer[hdfu->rx_buffer].d8[1];
+        addr += (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[2] << 8;
+        addr += (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[3] << 16;
+        addr += (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[4] << 24;
+
+        /* The length follows the address, the area is hashed by USBD_DFU_Process
+           after the blocks queued before */
+        DFU_PostJob(hdfu, DFU_MEDIA_HASH, addr,
+                    (uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[5] |
+                    ((uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[6] << 8) |
+                    ((uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[7] << 16) |
+                    ((uint32_t)hdfu->buffer[hdfu->rx_buffer].d8[8] << 24));
+      }
+      else if ((hdfu->buffer[hdfu->rx_buffer].d8[0] == DFU_CMD_SESSION) && (hdfu->wlength == 1U))
+      {
+        /* The media draws the nonce as the digest of a hash job, after the blocks queued before */
+        hdfu->hash_alg = DFU_HASH_SESSION;
+        DFU_PostJob(hdfu, DFU_MEDIA_HASH, 0U, 0U);
+      }
+      else if ((hdfu->buffer[hdfu->rx_buffer].d8[0] == DFU_CMD_TAG) && (hdfu->wlength == (1U + USBD_DFU_TAG_SIZE)))
+      {
+        /* Checked by the DFU_MEDIA_MANIFEST job */
+        (void)USBD_memcpy(hdfu->tag, &hdfu->buffer[hdfu->rx_buffer].d8[1], USBD_DFU_TAG_SIZE);
+      }
+      else if ((hdfu->buffer[hdfu->rx_buffer].d8[0] == DFU_CMD_IMAGE) && (hdfu->wlength == (1U + USBD_DFU_INFO_SIZE)))
+      {
+        /* Checked by the DFU_MEDIA_MANIFEST job */
+        (void)USBD_memcpy(hdfu->info, &hdfu->buffer[hdfu->rx_buffer].d8[1], USBD_DFU_INFO_SIZE);
       }
       else
       {
@@ -582,12 +689,15 @@ static uint8_t  USBD_DFU_EP0_TxReady(USBD_HandleTypeDef *pdev)
         /* Decode the required address */
         addr = ((hdfu->wblock_num - 2U) * USBD_DFU_XFER_SIZE) + hdfu->data_ptr;
 
-        /* Preform the write operation */
-        if (((USBD_DFU_MediaTypeDef *)pdev->pUserData)->Write(hdfu->buffer.d8,
-                                                              (uint8_t *)addr, hdfu->wlength) != USBD_OK)
+        /* Hand the block over to USBD_DFU_Process and receive the next one
+           into the other buffer while this one is written. A streamed
+           block is queued since its DNLOAD */
+        if (hdfu->rx_job == DFU_NO_JOB)
         {
-          return USBD_FAIL;
+          DFU_PostJob(hdfu, DFU_MEDIA_PROGRAM, addr, hdfu->wlength);
         }
+        hdfu->rx_job = DFU_NO_JOB;
+        hdfu->rx_buffer = (uint8_t)((hdfu->rx_buffer + 1U) % USBD_DFU_BUFFER_NUM);
       }
     }
 
@@ -717,6 +827,129 @@ uint8_t  USBD_DFU_RegisterMedia(USBD_HandleTypeDef   *pdev,
   return 0U;
 }
 
+/**
+* @brief  USBD_DFU_Process
+*         Run the next media job posted by the USB interrupt. Called from the
+*         main loop, so that the flash is erased and programmed outside of the
+*         USB interrupt. One job is run per call, a job whose media call
+*         returns USBD_BUSY stays queued and is run again.
+* @param  pdev: device instance
+* @retval 1 if a job was completed, 0 if there was none or it is still busy
+*/
+uint8_t USBD_DFU_Process(USBD_HandleTypeDef *pdev)
+{
+  USBD_DFU_HandleTypeDef   *hdfu;
+  USBD_DFU_MediaTypeDef    *fops;
+  USBD_DFU_JobTypeDef      *job;
+  uint16_t                 status;
+  uint8_t                  error = DFU_ERROR_WRITE;
+  uint8_t                  stream;
+
+  hdfu = (USBD_DFU_HandleTypeDef *) pdev->pClassData;
+  fops = (USBD_DFU_MediaTypeDef *) pdev->pUserData;
+
+  if (hdfu == NULL)
+  {
+    return 0U;
+  }
+
+  /* The writes of an aborted download are done, the next ones start a new
+     session of the media */
+  if (hdfu->abort_job == hdfu->job_head)
+  {
+    hdfu->abort_job = DFU_NO_JOB;
+    if (fops->Abort != NULL)
+    {
+      (void)fops->Abort();
+    }
+  }
+
+  if (hdfu->job_head == hdfu->job_tail)
+  {
+    return 0U;
+  }
+
+  job = &hdfu->job[hdfu->job_head];
+
+  switch (job->cmd)
+  {
+    case DFU_MEDIA_ERASE:
+      status = fops->Erase(job->addr);
+      error = DFU_ERROR_ERASE;
+      break;
+
+    case DFU_MEDIA_HASH:
+      (void)USBD_memset(hdfu->digest, 0, USBD_DFU_DIGEST_SIZE);
+      status = (fops->Hash != NULL) ? fops->Hash(job->addr, job->length, hdfu->hash_alg, hdfu->digest) : (uint16_t)USBD_FAIL;
+      error = DFU_ERROR_ADDRESS;
+      break;
+
+    case DFU_MEDIA_MANIFEST:
+      status = fops->Manifest(hdfu->tag, hdfu->info);
+      if (status != USBD_BUSY)
+      {
+        (void)USBD_memset(hdfu->tag, 0, USBD_DFU_TAG_SIZE);
+        (void)USBD_memset(hdfu->info, 0, USBD_DFU_INFO_SIZE);
+      }
+      error = DFU_ERROR_VERIFY;
+      break;
+
+    default:
+      /* The bytes received so far, the chunk is kept while the media is busy */
+      if (hdfu->job_chunk == 0U)
+      {
+        stream = job->stream;
+        hdfu->job_chunk = job->length - job->done;
+        if ((hdfu->job_chunk == 0U) && (stream != 0U))
+        {
+          /* Wait for the next packet of a streamed block */
+          return 0U;
+        }
+      }
+      status = USBD_OK;
+      if (hdfu->job_chunk != 0U)
+      {
+        status = fops->Write(&hdfu->buffer[job->buffer].d8[job->done],
+                             (uint8_t *)(job->addr + job->done), hdfu->job_chunk);
+      }
+      if (status == USBD_OK)
+      {
+        job->done += hdfu->job_chunk;
+        hdfu->job_chunk = 0U;
+        stream = job->stream;
+        if ((stream != 0U) || (job->done < job->length))
+        {
+          /* The rest of the block is written on the next calls */
+          return 1U;
+        }
+      }
+      break;
+  }
+
+  if (status == USBD_BUSY)
+  {
+    /* Finished in the background, the job is run again */
+    return 0U;
+  }
+  hdfu->job_chunk = 0U;
+  if (status != USBD_OK)
+  {
+    hdfu->job_error = error;
+    /* Drop the jobs queued behind the failed one, a pending session end
+       moves along so that the head does not skip it */
+    hdfu->job_head = hdfu->job_tail;
+    if (hdfu->abort_job != DFU_NO_JOB)
+    {
+      hdfu->abort_job = hdfu->job_tail;
+    }
+  }
+  else
+  {
+    hdfu->job_head = (uint8_t)((hdfu->job_head + 1U) % USBD_DFU_JOB_NUM);
+  }
+  return 1U;
+}
+
 /******************************************************************************
      DFU Class requests management
 ******************************************************************************/
@@ -777,20 +1010,41 @@ static void DFU_Download(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
   hdfu = (USBD_DFU_HandleTypeDef *) pdev->pClassData;
 
   /* Data setup request */
-  if (req->wLength > 0U)
+  if (req->wLength > USBD_DFU_XFER_SIZE)
+  {
+    /* Larger than wTransferSize: the block does not fit the buffer */
+    USBD_CtlError(pdev, req);
+  }
+  else if (req->wLength > 0U)
   {
-    if ((hdfu->dev_state == DFU_STATE_IDLE) || (hdfu->dev_state == DFU_STATE_DNLOAD_IDLE))
+    /* The receive buffer is never written while a queued job still reads it */
+    if (((hdfu->dev_state == DFU_STATE_IDLE) || (hdfu->dev_state == DFU_STATE_DNLOAD_IDLE)) &&
+        (DFU_IsBufferBusy(hdfu, hdfu->rx_buffer) == 0U))
     {
       /* Update the global length and block number */
       hdfu->wblock_num = req->wValue;
       hdfu->wlength = req->wLength;
+      hdfu->rx_job = DFU_NO_JOB;
+      hdfu->rx_open = 1U;
 
       /* Update the state machine */
       hdfu->dev_state = DFU_STATE_DNLOAD_SYNC;
       hdfu->dev_status[4] = hdfu->dev_state;
 
+#if (USBD_DFU_STREAM > 0U)
+      /* A block is written packet by packet when the queue has a slot for it
+         now, else it is queued on the next GETSTATUS */
+      if ((hdfu->wblock_num > 1U) &&
+          (DFU_OpenStream(hdfu, ((hdfu->wblock_num - 2U) * USBD_DFU_XFER_SIZE) + hdfu->data_ptr) != 0U))
+      {
+        USBD_CtlPrepareRxStream(pdev, (uint8_t *)hdfu->buffer[hdfu->rx_buffer].d8,
+                                (uint16_t)hdfu->wlength);
+        return;
+      }
+#endif /* USBD_DFU_STREAM */
+
       /* Prepare the reception of the buffer over EP0 */
-      USBD_CtlPrepareRx(pdev, (uint8_t *)hdfu->buffer.d8,
+      USBD_CtlPrepareRx(pdev, (uint8_t *)hdfu->buffer[hdfu->rx_buffer].d8,
                         (uint16_t)hdfu->wlength);
     }
     /* Unsupported state */
@@ -807,6 +1061,7 @@ static void DFU_Download(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
     if (hdfu->dev_state == DFU_STATE_DNLOAD_IDLE || hdfu->dev_state == DFU_STATE_IDLE)
     {
       hdfu->manif_state = DFU_MANIFEST_IN_PROGRESS;
+      hdfu->manif_job = 0U;
       hdfu->dev_state = DFU_STATE_MANIFEST_SYNC;
       hdfu->dev_status[1] = 0U;
       hdfu->dev_status[2] = 0U;
@@ -838,7 +1093,11 @@ static void DFU_Upload(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
   uint32_t addr = 0U;
 
   /* Data setup request */
-  if (req->wLength > 0U)
+  if (req->wLength > USBD_DFU_XFER_SIZE)
+  {
+    USBD_CtlError(pdev, req);
+  }
+  else if (req->wLength > 0U)
   {
     if ((hdfu->dev_state == DFU_STATE_IDLE) || (hdfu->dev_state == DFU_STATE_UPLOAD_IDLE))
     {
@@ -858,12 +1117,32 @@ static void DFU_Upload(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
         hdfu->dev_status[4] = hdfu->dev_state;
 
         /* Store the values of all supported commands */
-        hdfu->buffer.d8[0] = DFU_CMD_GETCOMMANDS;
-        hdfu->buffer.d8[1] = DFU_CMD_SETADDRESSPOINTER;
-        hdfu->buffer.d8[2] = DFU_CMD_ERASE;
+        hdfu->buffer[hdfu->rx_buffer].d8[0] = DFU_CMD_GETCOMMANDS;
+        hdfu->buffer[hdfu->rx_buffer].d8[1] = DFU_CMD_SETADDRESSPOINTER;
+        hdfu->buffer[hdfu->rx_buffer].d8[2] = DFU_CMD_ERASE;
+        hdfu->buffer[hdfu->rx_buffer].d8[3] = DFU_CMD_HASH;
+        hdfu->buffer[hdfu->rx_buffer].d8[4] = DFU_CMD_TAG;
+        hdfu->buffer[hdfu->rx_buffer].d8[5] = DFU_CMD_IMAGE;
+        hdfu->buffer[hdfu->rx_buffer].d8[6] = DFU_CMD_SESSION;
 
         /* Send the status data over EP0 */
-        USBD_CtlSendData(pdev, (uint8_t *)(&(hdfu->buffer.d8[0])), 3U);
+        USBD_CtlSendData(pdev, (uint8_t *)(&(hdfu->buffer[hdfu->rx_buffer].d8[0])),
+                         (uint16_t)((hdfu->wlength < 7U) ? hdfu->wlength : 7U));
+      }
+      /* Result of the last DFU_CMD_HASH */
+      else if (hdfu->wblock_num == 1U)
+      {
+        hdfu->dev_state = DFU_STATE_UPLOAD_IDLE;
+
+        hdfu->dev_status[1] = 0U;
+        hdfu->dev_status[2] = 0U;
+        hdfu->dev_status[3] = 0U;
+        hdfu->dev_status[4] = hdfu->dev_state;
+
+        /* Send the digest over EP0 */
+        USBD_CtlSendData(pdev, hdfu->digest,
+                         (uint16_t)((hdfu->wlength < DFU_DIGEST_LEN(hdfu->hash_alg)) ?
+                                    hdfu->wlength : DFU_DIGEST_LEN(hdfu->hash_alg)));
       }
       else if (hdfu->wblock_num > 1U)
       {
@@ -876,11 +1155,24 @@ static void DFU_Upload(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 
         addr = ((hdfu->wblock_num - 2U) * USBD_DFU_XFER_SIZE) + hdfu->data_ptr;  /* Change is Accelerated*/
 
-        /* Return the physical address where data are stored */
-        phaddr = ((USBD_DFU_MediaTypeDef *)pdev->pUserData)->Read((uint8_t *)addr, hdfu->buffer.d8, hdfu->wlength);
+        /* Return the physical address where data are stored, the flash itself
+           when the media reads without a copy */
+        phaddr = ((USBD_DFU_MediaTypeDef *)pdev->pUserData)->Read((uint8_t *)addr, hdfu->buffer[hdfu->rx_buffer].d8, hdfu->wlength);
 
-        /* Send the status data over EP0 */
-        USBD_CtlSendData(pdev, phaddr, (uint16_t)hdfu->wlength);
+        if (phaddr == NULL)
+        {
+          /* Area not readable */
+          hdfu->dev_state = DFU_STATE_ERROR;
+          hdfu->dev_status[0] = DFU_ERROR_ADDRESS;
+          hdfu->dev_status[4] = hdfu->dev_state;
+
+          USBD_CtlError(pdev, req);
+        }
+        else
+        {
+          /* Send the status data over EP0 */
+          USBD_CtlSendData(pdev, phaddr, (uint16_t)hdfu->wlength);
+        }
       }
       else  /* unsupported hdfu->wblock_num */
       {
@@ -928,6 +1220,22 @@ static void DFU_GetStatus(USBD_HandleTypeDef *pdev)
 
   hdfu = (USBD_DFU_HandleTypeDef *) pdev->pClassData;
 
+  /* Report a failed media job */
+  if (hdfu->job_error != DFU_ERROR_NONE)
+  {
+    hdfu->wblock_num = 0U;
+    hdfu->wlength = 0U;
+    hdfu->rx_job = DFU_NO_JOB;
+
+    hdfu->dev_state = DFU_STATE_ERROR;
+    hdfu->dev_status[0] = hdfu->job_error;
+    hdfu->job_error = DFU_ERROR_NONE;
+    hdfu->dev_status[1] = 0U;
+    hdfu->dev_status[2] = 0U;
+    hdfu->dev_status[3] = 0U;
+    hdfu->dev_status[4] = hdfu->dev_state;
+  }
+
   switch (hdfu->dev_state)
   {
     case   DFU_STATE_DNLOAD_SYNC:
@@ -940,15 +1248,21 @@ static void DFU_GetStatus(USBD_HandleTypeDef *pdev)
         hdfu->dev_status[3] = 0U;
         hdfu->dev_status[4] = hdfu->dev_state;
 
-        if ((hdfu->wblock_num == 0U) && (hdfu->buffer.d8[0] == DFU_CMD_ERASE))
+        if (DFU_IsRequestReady(hdfu) == 0U)
         {
-          ((USBD_DFU_MediaTypeDef *)pdev->pUserData)->GetStatus(hdfu->data_ptr, DFU_MEDIA_ERASE, hdfu->dev_status);
-        }
-        else
-        {
-          ((USBD_DFU_MediaTypeDef *)pdev->pUserData)->GetStatus(hdfu->data_ptr, DFU_MEDIA_PROGRAM, hdfu->dev_status);
+          /* The request is handled once the running job is completed */
+          DFU_JobStatus(pdev);
         }
       }
+      else if (DFU_IsHashPending(hdfu) != 0U)
+      {
+        /* Report busy until the hash can be uploaded */
+        hdfu->dev_status[1] = 0U;
+        hdfu->dev_status[2] = 0U;
+        hdfu->dev_status[3] = 0U;
+        hdfu->dev_status[4] = DFU_STATE_DNLOAD_BUSY;
+        DFU_JobStatus(pdev);
+      }
       else  /* (hdfu->wlength==0)*/
       {
         hdfu->dev_state = DFU_STATE_DNLOAD_IDLE;
@@ -961,7 +1275,27 @@ static void DFU_GetStatus(USBD_HandleTypeDef *pdev)
       break;
 
     case   DFU_STATE_MANIFEST_SYNC :
-      if (hdfu->manif_state == DFU_MANIFEST_IN_PROGRESS)
+      if ((hdfu->manif_state == DFU_MANIFEST_IN_PROGRESS) && (hdfu->job_head != hdfu->job_tail))
+      {
+        /* Wait for the queued jobs to complete before leaving DFU mode */
+        hdfu->dev_status[1] = 0U;
+        hdfu->dev_status[2] = 0U;
+        hdfu->dev_status[3] = 0U;
+        DFU_JobStatus(pdev);
+      }
+      else if ((hdfu->manif_state == DFU_MANIFEST_IN_PROGRESS) && (hdfu->manif_job == 0U) &&
+               (((USBD_DFU_MediaTypeDef *)pdev->pUserData)->Manifest != NULL))
+      {
+        /* All blocks are written: let the media check the image */
+        DFU_PostJob(hdfu, DFU_MEDIA_MANIFEST, 0U, 0U);
+        hdfu->manif_job = 1U;
+
+        hdfu->dev_status[1] = 0U;
+        hdfu->dev_status[2] = 0U;
+        hdfu->dev_status[3] = 0U;
+        ((USBD_DFU_MediaTypeDef *)pdev->pUserData)->GetStatus(0U, DFU_MEDIA_MANIFEST, hdfu->dev_status);
+      }
+      else if (hdfu->manif_state == DFU_MANIFEST_IN_PROGRESS)
       {
         hdfu->dev_state = DFU_STATE_MANIFEST;
 
@@ -1007,6 +1341,8 @@ static void DFU_ClearStatus(USBD_HandleTypeDef *pdev)
 
   if (hdfu->dev_state == DFU_STATE_ERROR)
   {
+    /* The failed download is not resumed */
+    hdfu->abort_job = hdfu->job_tail;
     hdfu->dev_state = DFU_STATE_IDLE;
     hdfu->dev_status[0] = DFU_ERROR_NONE;/*bStatus*/
     hdfu->dev_status[1] = 0U;
@@ -1069,6 +1405,12 @@ static void DFU_Abort(USBD_HandleTypeDef *pdev)
     hdfu->dev_status[5] = 0U; /*iString*/
     hdfu->wblock_num = 0U;
     hdfu->wlength = 0U;
+
+    /* A block received but not confirmed by a GETSTATUS is dropped, the
+       jobs of the blocks before it are still written in order. The media
+       ends the session after them */
+    DFU_DropBlock(hdfu);
+    hdfu->abort_job = hdfu->job_tail;
   }
 }
 
@@ -1119,6 +1461,190 @@ static void DFU_Leave(USBD_HandleTypeDef *pdev)
   }
 }
 
+/**
+  * @brief  DFU_IsRequestReady
+  *         Check that the received DNLOAD request can be handled: the queue
+  *         has a free slot for its job and a program job leaves a free buffer
+  *         for the next block.
+  * @param  hdfu: DFU handle
+  * @retval 1 if the request can be handled, 0 else.
+  */
+static uint8_t DFU_IsRequestReady(USBD_DFU_HandleTypeDef *hdfu)
+{
+  uint8_t full = (((hdfu->job_tail + 1U) % USBD_DFU_JOB_NUM) == hdfu->job_head) ? 1U : 0U;
+
+  if (hdfu->wblock_num == 0U)
+  {
+    if ((hdfu->buffer[hdfu->rx_buffer].d8[0] == DFU_CMD_ERASE) ||
+        (hdfu->buffer[hdfu->rx_buffer].d8[0] == DFU_CMD_HASH))
+    {
+      return (full == 0U) ? 1U : 0U;
+    }
+    return 1U;
+  }
+
+  if (hdfu->wblock_num > 1U)
+  {
+    /* A streamed block has its job queued already */
+    if (((full != 0U) && (hdfu->rx_job == DFU_NO_JOB)) ||
+        (DFU_IsBufferBusy(hdfu, (uint8_t)((hdfu->rx_buffer + 1U) % USBD_DFU_BUFFER_NUM)) != 0U))
+    {
+      return 0U;
+    }
+  }
+  return 1U;
+}
+
+/**
+  * @brief  DFU_IsBufferBusy
+  *         Check whether a queued program job still uses the buffer.
+  * @param  hdfu: DFU handle
+  * @param  index: buffer index
+  * @retval 1 if the buffer is in use, 0 else.
+  */
+static uint8_t DFU_IsBufferBusy(USBD_DFU_HandleTypeDef *hdfu, uint8_t index)
+{
+  uint8_t i;
+
+  for (i = hdfu->job_head; i != hdfu->job_tail; i = (uint8_t)((i + 1U) % USBD_DFU_JOB_NUM))
+  {
+    if ((hdfu->job[i].cmd == DFU_MEDIA_PROGRAM) && (hdfu->job[i].buffer == index))
+    {
+      return 1U;
+    }
+  }
+  return 0U;
+}
+
+/**
+  * @brief  DFU_IsHashPending
+  *         Check whether a DFU_CMD_HASH job is still queued.
+  * @param  hdfu: DFU handle
+  * @retval 1 if the hash is not available yet, 0 else.
+  */
+static uint8_t DFU_IsHashPending(USBD_DFU_HandleTypeDef *hdfu)
+{
+  uint8_t i;
+
+  for (i = hdfu->job_head; i != hdfu->job_tail; i = (uint8_t)((i + 1U) % USBD_DFU_JOB_NUM))
+  {
+    if (hdfu->job[i].cmd == DFU_MEDIA_HASH)
+    {
+      return 1U;
+    }
+  }
+  return 0U;
+}
+
+/**
+  * @brief  DFU_JobStatus
+  *         Let the media fill in the bwPollTimeout of the running job, from
+  *         the next byte to write of a partly written block.
+  * @param  pdev: device instance
+  * @retval None
+  */
+static void DFU_JobStatus(USBD_HandleTypeDef *pdev)
+{
+  USBD_DFU_HandleTypeDef   *hdfu;
+  USBD_DFU_JobTypeDef      *job;
+
+  hdfu = (USBD_DFU_HandleTypeDef *) pdev->pClassData;
+  job = &hdfu->job[hdfu->job_head];
+
+  ((USBD_DFU_MediaTypeDef *)pdev->pUserData)->GetStatus(job->addr + job->done, job->cmd, hdfu->dev_status);
+}
+
+/**
+  * @brief  DFU_PostJob
+  *         Queue a media job for USBD_DFU_Process. The caller checks the free
+  *         space with DFU_IsRequestReady first.
+  * @param  hdfu: DFU handle
+  * @param  cmd: DFU_MEDIA_ERASE, DFU_MEDIA_PROGRAM, DFU_MEDIA_HASH or DFU_MEDIA_MANIFEST
+  * @param  addr: media address
+  * @param  length: number of bytes to program from the receive buffer or to hash
+  * @retval None
+  */
+static void DFU_PostJob(USBD_DFU_HandleTypeDef *hdfu, uint8_t cmd, uint32_t addr, uint32_t length)
+{
+  USBD_DFU_JobTypeDef *job = &hdfu->job[hdfu->job_tail];
+
+  job->addr = addr;
+  job->length = length;
+  job->done = 0U;
+  job->cmd = cmd;
+  job->buffer = hdfu->rx_buffer;
+  job->stream = 0U;
+
+  /* Publish the job once it is complete */
+  hdfu->job_tail = (uint8_t)((hdfu->job_tail + 1U) % USBD_DFU_JOB_NUM);
+}
+
+/**
+  * @brief  DFU_DropBlock
+  *         Drop the block of the DNLOAD being received or not confirmed yet.
+  *         A streamed block the media has not reached leaves the queue, one
+  *         it writes already ends with the packets handed over so far and the
+  *         next block is received into another buffer.
+  * @param  hdfu: DFU handle
+  * @retval None
+  */
+static void DFU_DropBlock(USBD_DFU_HandleTypeDef *hdfu)
+{
+  USBD_DFU_JobTypeDef *job;
+
+  if (hdfu->rx_job != DFU_NO_JOB)
+  {
+    job = &hdfu->job[hdfu->rx_job];
+    if (hdfu->rx_job == hdfu->job_head)
+    {
+      job->length = job->done + hdfu->job_chunk;
+      job->stream = 0U;
+      hdfu->rx_buffer = (uint8_t)((hdfu->rx_buffer + 1U) % USBD_DFU_BUFFER_NUM);
+    }
+    else
+    {
+      /* The job of the block is the last one queued */
+      hdfu->job_tail = hdfu->rx_job;
+    }
+    hdfu->rx_job = DFU_NO_JOB;
+  }
+  hdfu->rx_open = 0U;
+  hdfu->wblock_num = 0U;
+  hdfu->wlength = 0U;
+}
+
+#if (USBD_DFU_STREAM > 0U)
+/**
+  * @brief  DFU_OpenStream
+  *         Queue the program job of the block about to be received, its
+  *         length grows with every packet in USBD_DFU_EP0_RxReady.
+  * @param  hdfu: DFU handle
+  * @param  addr: media address of the block
+  * @retval 1 if the job is queued, 0 if the queue is full or the buffer in use.
+  */
+static uint8_t DFU_OpenStream(USBD_DFU_HandleTypeDef *hdfu, uint32_t addr)
+{
+  USBD_DFU_JobTypeDef *job = &hdfu->job[hdfu->job_tail];
+
+  if ((((hdfu->job_tail + 1U) % USBD_DFU_JOB_NUM) == hdfu->job_head) ||
+      (DFU_IsBufferBusy(hdfu, hdfu->rx_buffer) != 0U))
+  {
+    return 0U;
+  }
+
+  job->addr = addr;
+  job->length = 0U;
+  job->done = 0U;
+  job->cmd = DFU_MEDIA_PROGRAM;
+  job->buffer = hdfu->rx_buffer;
+  job->stream = 1U;
+  hdfu->rx_job = hdfu->job_tail;
+
+  hdfu->job_tail = (uint8_t)((hdfu->job_tail + 1U) % USBD_DFU_JOB_NUM);
+  return 1U;
+}
+#endif /* USBD_DFU_STREAM */
+
 /**
   * @}
   */
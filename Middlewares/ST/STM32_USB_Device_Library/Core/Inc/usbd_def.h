@@ -238,6 +238,7 @@ typedef struct
   uint32_t                total_length;
   uint32_t                rem_length;
   uint32_t                maxpacket;
+  uint32_t                is_stream;    /* EP0 OUT: the class is told of every packet */
 } USBD_EndpointTypeDef;
 
 /* USB Device handle structure */
@@ -89,6 +89,10 @@ USBD_StatusTypeDef USBD_CtlPrepareRx(USBD_HandleTypeDef  *pdev,
                                      uint8_t *pbuf,
                                      uint16_t len);
 
+USBD_StatusTypeDef USBD_CtlPrepareRxStream(USBD_HandleTypeDef  *pdev,
+                                           uint8_t *pbuf,
+                                           uint16_t len);
+
 USBD_StatusTypeDef  USBD_CtlContinueRx(USBD_HandleTypeDef  *pdev,
                                        uint8_t *pbuf,
                                        uint16_t len);
@@ -97,6 +101,8 @@ USBD_StatusTypeDef  USBD_CtlSendStatus(USBD_HandleTypeDef  *pdev);
 
 USBD_StatusTypeDef  USBD_CtlReceiveStatus(USBD_HandleTypeDef  *pdev);
 
+uint32_t  USBD_CtlGetRxLength(USBD_HandleTypeDef *pdev);
+
 uint32_t  USBD_GetRxCount(USBD_HandleTypeDef *pdev, uint8_t ep_addr);
 
 /**
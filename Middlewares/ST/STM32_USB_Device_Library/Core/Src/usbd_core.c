@@ -314,9 +314,19 @@ USBD_StatusTypeDef USBD_LL_DataOutStage(USBD_HandleTypeDef *pdev,
 
         USBD_CtlContinueRx(pdev, pdata,
                            (uint16_t)MIN(pep->rem_length, pep->maxpacket));
+
+        /* A streamed transfer hands every packet to the class */
+        if ((pep->is_stream != 0U) && (pdev->pClass->EP0_RxReady != NULL) &&
+            (pdev->dev_state == USBD_STATE_CONFIGURED))
+        {
+          pdev->pClass->EP0_RxReady(pdev);
+        }
       }
       else
       {
+        pep->rem_length = 0U;
+        pep->is_stream = 0U;
+
         if ((pdev->pClass->EP0_RxReady != NULL) &&
             (pdev->dev_state == USBD_STATE_CONFIGURED))
         {
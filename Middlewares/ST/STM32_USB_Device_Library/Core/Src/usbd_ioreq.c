@@ -130,6 +130,7 @@ USBD_StatusTypeDef USBD_CtlPrepareRx(USBD_HandleTypeDef *pdev,
   pdev->ep0_state = USBD_EP0_DATA_OUT;
   pdev->ep_out[0].total_length = len;
   pdev->ep_out[0].rem_length   = len;
+  pdev->ep_out[0].is_stream    = 0U;
 
   /* Start the transfer */
   USBD_LL_PrepareReceive(pdev, 0U, pbuf, len);
@@ -137,6 +138,24 @@ USBD_StatusTypeDef USBD_CtlPrepareRx(USBD_HandleTypeDef *pdev,
   return USBD_OK;
 }
 
+/**
+* @brief  USBD_CtlPrepareRxStream
+*         receive data on the ctl pipe, the class EP0_RxReady is called
+*         for every packet. USBD_CtlGetRxLength gives the bytes received.
+* @param  pdev: device instance
+* @param  buff: pointer to data buffer
+* @param  len: length of data to be received
+* @retval status
+*/
+USBD_StatusTypeDef USBD_CtlPrepareRxStream(USBD_HandleTypeDef *pdev,
+                                           uint8_t *pbuf, uint16_t len)
+{
+  (void)USBD_CtlPrepareRx(pdev, pbuf, len);
+  pdev->ep_out[0].is_stream = 1U;
+
+  return USBD_OK;
+}
+
 /**
 * @brief  USBD_CtlContinueRx
 *         continue receive data on the ctl pipe
@@ -187,6 +206,17 @@ USBD_StatusTypeDef USBD_CtlReceiveStatus(USBD_HandleTypeDef *pdev)
   return USBD_OK;
 }
 
+/**
+* @brief  USBD_CtlGetRxLength
+*         returns the bytes of the ctl pipe data stage received so far
+* @param  pdev: device instance
+* @retval Rx Data length
+*/
+uint32_t USBD_CtlGetRxLength(USBD_HandleTypeDef *pdev)
+{
+  return pdev->ep_out[0].total_length - pdev->ep_out[0].rem_length;
+}
+
 /**
 * @brief  USBD_GetRxCount
 *         returns the received data length
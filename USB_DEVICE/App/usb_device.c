@@ -33,6 +33,16 @@
 
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
+#if (USBD_FIFO_PROFILE_DFU == 1U)
+/* OTG FS FIFO RAM: 1.25 KB, in 32 bit words. DFU only uses EP0, so the
+   shared Rx FIFO gets room for 10 packets of 64 bytes plus the SETUP and
+   status entries, and the EP0 Tx FIFO gets the rest: 8 packets for UPLOAD. */
+#define USB_FS_FIFO_WORDS      320U
+#define USB_FS_RX_FIFO_WORDS   0xC0U
+#define USB_FS_TX0_FIFO_WORDS  ( USB_FS_FIFO_WORDS - USB_FS_RX_FIFO_WORDS )
+
+extern PCD_HandleTypeDef hpcd_USB_OTG_FS;
+#endif /* USBD_FIFO_PROFILE_DFU */
 
 /* USER CODE END PV */
 
@@ -55,6 +65,14 @@ USBD_HandleTypeDef hUsbDeviceFS;
  * -- Insert your external function declaration here --
  */
 /* USER CODE BEGIN 1 */
+/**
+  * Run the DFU work deferred from the USB interrupt
+  * @retval 1 if a job was completed, 0 if there is nothing to do until the next interrupt
+  */
+RAM_FUNC uint8_t MX_USB_DEVICE_Process(void)
+{
+  return USBD_DFU_Process(&hUsbDeviceFS);
+}
 
 /* USER CODE END 1 */
 
@@ -87,7 +105,13 @@ void MX_USB_DEVICE_Init(void)
   }
 
   /* USER CODE BEGIN USB_DEVICE_Init_PostTreatment */
-  
+#if (USBD_FIFO_PROFILE_DFU == 1U)
+  /* Over the layout of USBD_LL_Init: the host resets the bus after its
+     attach debounce only, and the reset flushes the FIFOs */
+  HAL_PCDEx_SetRxFiFo(&hpcd_USB_OTG_FS, USB_FS_RX_FIFO_WORDS);
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_FS, 0, USB_FS_TX0_FIFO_WORDS);
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_FS, 1, 0);
+#endif /* USBD_FIFO_PROFILE_DFU */
   /* USER CODE END USB_DEVICE_Init_PostTreatment */
 }
 
@@ -82,6 +82,8 @@ void MX_USB_DEVICE_Init(void);
  * -- Insert functions declaration here --
  */
 /* USER CODE BEGIN FD */
+/** USB Device background processing, called from the main loop. */
+uint8_t MX_USB_DEVICE_Process(void);
 
 /* USER CODE END FD */
 /**
@@ -22,7 +22,9 @@
 #include "usbd_dfu_if.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include <string.h>
 #include "aes.h"
+#include "lz4.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -50,6 +52,50 @@
   */
 
 /* USER CODE BEGIN PRIVATE_TYPES */
+/* Sector group of the flash geometry */
+typedef struct
+{
+  uint32_t sectors;
+  uint32_t size;     /* Bytes per sector */
+} MEM_If_GroupTypeDef;
+
+/* Sector located by MEM_If_GetSector */
+typedef struct
+{
+  uint32_t number;   /* FLASH_SECTOR_x */
+  uint32_t address;
+  uint32_t size;
+  uint32_t group;    /* Index in the geometry, for the erase time */
+} MEM_If_SectorTypeDef;
+
+/* Part of a DNLOAD block on its way through a write pipeline. The stages
+   work on the data in place and may narrow it */
+typedef struct
+{
+  uint8_t* data;
+  uint32_t adr;      /* DNLOAD address of data[0], the flash address behind a decompression */
+  uint32_t length;
+} MEM_If_BufferTypeDef;
+
+/* Stage of a write pipeline */
+typedef struct
+{
+  USBD_StatusTypeDef ( *run )( MEM_If_BufferTypeDef* buf );
+  const char*        name;
+  uint32_t           cycles;   /* DWT cycles spent in run(), without the stages it feeds */
+  uint32_t           calls;
+} MEM_If_StageTypeDef;
+
+/* Stages run in order on one buffer. A stage that returns USBD_BUSY is run
+   again by the next call for the same address, the stages before it not */
+typedef struct
+{
+  MEM_If_StageTypeDef* const* stage;
+  uint32_t                    count;
+  uint32_t                    next;    /* Stage to run */
+  uint32_t                    key;     /* Address the buffer came with */
+  MEM_If_BufferTypeDef        buf;     /* As the stages before next left it */
+} MEM_If_PipeTypeDef;
 
 /* USER CODE END PRIVATE_TYPES */
 
@@ -65,6 +111,58 @@
 #define FLASH_DESC_STR      "@Internal Flash/0x08008000/02*016Kg,01*064Kg,07*128Kg"
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+#define FLASH_PROGRAM_TIMEOUT  50000U  /* ms */
+#define FLASH_PSIZE_BYTES      4U      /* Program parallelism of FLASH_PSIZE_WORD */
+#define FLASH_WORD_TIME        16U     /* us, typical x32 programming time */
+#define FLASH_HASH_TIME        2U      /* ms, CRC32 of a 128 KB sector */
+#define RNG_TIMEOUT            2U      /* ms, a random word takes 40 cycles of the 48 MHz clock */
+#define IMAGE_MARKER_VALID     0x4B4F4D49U  /* Marker of a verified image */
+#define IMAGE_MARKER_REVOKED   0x00000000U  /* Programmed over the marker when a new download starts */
+#define IMAGE_LOG_ENB          ( ( IMAGE_AUTH_ENB > 0U ) || ( IMAGE_CRC_ENB > 0U ) )
+#define VERIFY_CHUNK           0x4000U  /* Words per DMA transfer to the CRC unit, 64 KB */
+#define VERIFY_CHUNK_TIME      1U       /* ms */
+#define MAC_CHUNK              0x1000U  /* Bytes of the image added to its MAC per run of the manifestation, 4 KB */
+#define VERIFY_IDLE            0U
+#define VERIFY_BUSY            1U
+#define VERIFY_DONE            2U
+#define VERIFY_ERROR           3U
+#define ASYNC_IDLE             0U
+#define ASYNC_START            1U       /* Block set up, no word started yet */
+#define ASYNC_BUSY             2U       /* Waiting for the FLASH interrupt */
+#define ASYNC_READY            3U       /* Word or sector done */
+#define ASYNC_ERROR            4U
+#define FLASH_PROGRAM_ERRORS   ( FLASH_SR_SOP | FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR )
+
+/* Views of the flash geometry lists */
+#define FLASH_DESC_FIRST( n, kb, ms )   #n "*" #kb "Kg"
+#define FLASH_DESC_NEXT( n, kb, ms )    "," #n "*" #kb "Kg"
+#if ( IMAGE_LZ4_ENB > 0U )
+  #define FLASH_DESC_LZ4    "/0x90000000/1*1024Kd"  /* IMAGE_LZ4_ADDRESS, written only */
+#else
+  #define FLASH_DESC_LZ4    ""
+#endif
+/* Media string built from the geometry, replaces the USBD_DFU_MEDIA string of the .ioc */
+#undef  FLASH_DESC_STR
+#define FLASH_DESC_STR      "@Internal Flash/0x08008000/" FLASH_APP_GEOMETRY( FLASH_DESC_FIRST, FLASH_DESC_NEXT ) FLASH_DESC_LZ4
+#define FLASH_GROUP( n, kb, ms )        { ( n ), ( ( kb ) * 1024U ) },
+#define FLASH_GROUP_TIME( n, kb, ms )   ( ms ),
+#define FLASH_GROUP_ONE( n, kb, ms )    1U +
+#define FLASH_GROUP_SECTORS( n, kb, ms )  ( n ) +
+#define FLASH_GROUP_BYTES( n, kb, ms )  ( ( n ) * ( kb ) * 1024U ) +
+#define FLASH_GROUPS           ( FLASH_BOOT_GEOMETRY( FLASH_GROUP_ONE ) FLASH_APP_GEOMETRY( FLASH_GROUP_ONE, FLASH_GROUP_ONE ) 0U )
+#define FLASH_SECTORS          ( FLASH_BOOT_GEOMETRY( FLASH_GROUP_SECTORS ) FLASH_APP_GEOMETRY( FLASH_GROUP_SECTORS, FLASH_GROUP_SECTORS ) 0U )
+#define FLASH_BOOT_BYTES       ( FLASH_BOOT_GEOMETRY( FLASH_GROUP_BYTES ) 0U )
+#define FLASH_BYTES            ( FLASH_BOOT_BYTES + FLASH_APP_GEOMETRY( FLASH_GROUP_BYTES, FLASH_GROUP_BYTES ) 0U )
+
+#if ( FLASH_BASE + FLASH_BOOT_BYTES ) != APP_ADDRESS
+  #error "The bootloader sectors of the flash geometry must end at APP_ADDRESS"
+#endif
+#if ( FLASH_BASE + FLASH_BYTES ) != ( FLASH_END + 1U )
+  #error "The flash geometry does not match the flash size of the device"
+#endif
+#if FLASH_SECTORS > 32U
+  #error "The erased sector mask holds 32 sectors"
+#endif
 
 /* USER CODE END PRIVATE_DEFINES */
 
@@ -78,6 +176,10 @@
   */
 
 /* USER CODE BEGIN PRIVATE_MACRO */
+/* Move an estimate a quarter of the way to the measured value */
+#define CALIBRATE( est, value )     ( ( ( ( est ) * 3U ) + ( value ) ) / 4U )
+/* Image length of a descriptor */
+#define IS_IMAGE_LENGTH( len )      ( ( ( len ) != 0U ) && ( ( ( len ) & 3U ) == 0U ) && ( ( len ) <= ( IMAGE_MARKER_ADDRESS - APP_ADDRESS ) ) )
 
 /* USER CODE END PRIVATE_MACRO */
 
@@ -93,9 +195,75 @@
 /* USER CODE BEGIN PRIVATE_VARIABLES */
 #if defined( ENCRYPTION )
   static const  uint8_t key[AES_KEYLEN]  = { 0x83, 0xF7, 0x79, 0x7F, 0x52, 0x1E, 0x37, 0xA2, 0x6B, 0xAF, 0xBB, 0xD0, 0x41, 0x77, 0x9A, 0xB5 };
-  static const  uint8_t iv[AES_BLOCKLEN] = { 0x49, 0x60, 0x7B, 0x42, 0x55, 0xE6, 0xE9, 0x4B, 0x3C, 0xC7, 0x76, 0xFB, 0x06, 0x67, 0xA9, 0xF2 };
+  #if ( ENCRYPTION_CTR == 0U )
+    static const  uint8_t iv[AES_BLOCKLEN] = { 0x49, 0x60, 0x7B, 0x42, 0x55, 0xE6, 0xE9, 0x4B, 0x3C, 0xC7, 0x76, 0xFB, 0x06, 0x67, 0xA9, 0xF2 };
+  #endif
   static struct AES_ctx ctx              = { 0U };
 #endif
+static MEM_If_GroupTypeDef flashGroup[FLASH_GROUPS] =                 /* Not const: read from RAM while the flash is busy */
+{
+  FLASH_BOOT_GEOMETRY( FLASH_GROUP ) FLASH_APP_GEOMETRY( FLASH_GROUP, FLASH_GROUP )
+};
+static uint32_t      eraseTime[FLASH_GROUPS] =                          /* ms, per sector group */
+{
+  FLASH_BOOT_GEOMETRY( FLASH_GROUP_TIME ) FLASH_APP_GEOMETRY( FLASH_GROUP_TIME, FLASH_GROUP_TIME )
+};
+static uint32_t      wordTime      = FLASH_WORD_TIME;  /* us, including the decryption */
+static __IO uint32_t busyAdr       = 0U;               /* Running operation, for GetStatus */
+static __IO uint32_t busyStart     = 0U;
+static __IO uint8_t  busyCmd       = DFU_MEDIA_ERASE;
+static __IO uint8_t  busy          = 0U;
+static __IO uint32_t erased        = 0U;               /* Sectors erased in this session, bit per sector */
+#if IMAGE_LOG_ENB
+  static uint8_t         revoked           = 0U;  /* The last descriptor is revoked in this session */
+#endif
+static __IO uint32_t verifyStart   = 0U;               /* Flash area fed to the CRC unit by DMA */
+static __IO uint32_t verifyAdr     = 0U;
+static __IO uint32_t verifyEnd     = 0U;
+static __IO uint32_t verifyCrc     = 0U;
+static __IO uint8_t  verifyState   = VERIFY_IDLE;
+#if ( FLASH_ASYNC_ENB > 0U )
+  static __IO uint8_t    asyncState        = ASYNC_IDLE;  /* Flash operation run by the FLASH interrupt */
+  static uint8_t         asyncCmd          = DFU_MEDIA_ERASE;
+  static uint32_t        asyncAdr          = 0U;          /* Sector or block of the operation, identifies the job */
+  static uint32_t        asyncNext         = 0U;          /* Next word to program */
+  static uint32_t        asyncEnd          = 0U;
+  static const uint32_t* asyncData         = NULL;
+#endif
+#if ( IMAGE_AUTH_ENB > 0U )
+  static const  uint8_t macKey[AES_KEYLEN] = { 0x1D, 0x8A, 0x62, 0xC4, 0x97, 0x3B, 0xF0, 0x5E, 0xA8, 0x27, 0x6C, 0x91, 0xD3, 0x0F, 0xB4, 0x58 };
+  static struct AES_ctx  macCtx            = { 0U };
+  static struct AES_cmac mac               = { 0U };
+  static uint32_t        macNext           = 0U;  /* Next flash address of the image MAC, 0 - not started */
+#endif
+#if ( IMAGE_LZ4_ENB > 0U )
+  static struct LZ4_stream lz       = { 0U };
+  static uint32_t          lzStage[IMAGE_LZ4_STAGE / 4U];  /* Words, programmed from here */
+  static uint32_t          lzNext   = 0U;  /* Address of the next block of the compressed stream, 0 - none */
+  static uint32_t          lzBlock  = 0U;  /* Block being decompressed, 0 - none */
+  static uint32_t          lzPos    = 0U;  /* Bytes of the block decoded so far */
+  static uint32_t          lzOut    = 0U;  /* Output programmed before the block, for GetStatus */
+  static uint8_t           lzBroken = 0U;  /* The stream did not end as an LZ4 block */
+#endif
+#if defined( CMAC ) && ( CMAC == 1 )
+  /* Shared with the line station, kept apart from the image MAC key so the
+     digests can not be used as image tags */
+  static const  uint8_t digestKey[AES_KEYLEN] = { 0x5C, 0xE1, 0x34, 0x8B, 0x0A, 0x7F, 0xD6, 0x29, 0x93, 0x4E, 0xB1, 0x66, 0x1F, 0xC8, 0x72, 0xAD };
+  static struct AES_ctx digestCtx             = { 0U };
+#endif
+#if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION )
+  /* Not the image key: the keystream of a read-out never decrypts an image file */
+  static const  uint8_t readKey[AES_KEYLEN] = { 0xA6, 0x13, 0xE8, 0x5D, 0x2F, 0xC4, 0x70, 0x9B, 0x36, 0xD1, 0x8E, 0x45, 0xFA, 0x07, 0x62, 0xBC };
+  static struct AES_ctx readCtx             = { 0U };
+  static uint8_t        readOpen            = 0U;  /* A DFU_CMD_SESSION drew the nonce, no flash change since */
+#endif
+#if ( READING_ENB > 0U ) && ( READING_POLICY > 0U )
+  static const uint32_t readRegion[][2U] =        /* Flash areas open to UPLOAD: start, end */
+  {
+    { APP_ADDRESS,          IMAGE_MARKER_ADDRESS },
+    { IMAGE_MARKER_ADDRESS, IMAGE_MARKER_END }
+  };
+#endif
 /* USER CODE END PRIVATE_VARIABLES */
 
 /**
@@ -110,6 +278,7 @@
 extern USBD_HandleTypeDef hUsbDeviceFS;
 
 /* USER CODE BEGIN EXPORTED_VARIABLES */
+extern DMA_HandleTypeDef hdma_memtomem_dma2_stream0;
 
 /* USER CODE END EXPORTED_VARIABLES */
 
@@ -130,6 +299,109 @@ static uint16_t MEM_If_DeInit_FS(void);
 static uint16_t MEM_If_GetStatus_FS(uint32_t Add, uint8_t Cmd, uint8_t *buffer);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
+static uint16_t MEM_If_Hash_FS(uint32_t Add, uint32_t Len, uint8_t Alg, uint8_t *digest);
+static uint16_t MEM_If_Manifest_FS(const uint8_t *tag, const uint8_t *info);
+static uint16_t MEM_If_Abort_FS(void);
+#if ( FLASH_ASYNC_ENB > 0U )
+  static USBD_StatusTypeDef MEM_If_ProgramNext( void );
+#else
+  static HAL_StatusTypeDef MEM_If_Program( uint32_t adr, const uint32_t* data, uint32_t length );
+#endif
+static uint32_t          MEM_If_SetBusy( uint32_t adr, uint8_t cmd );
+static void              MEM_If_GetSector( uint32_t adr, MEM_If_SectorTypeDef* sector );
+static uint8_t           MEM_If_IsBlank( const MEM_If_SectorTypeDef* sector );
+static USBD_StatusTypeDef MEM_If_RunPipe( MEM_If_PipeTypeDef* pipe, MEM_If_BufferTypeDef* buf );
+#if defined( ENCRYPTION )
+  static USBD_StatusTypeDef MEM_If_Decrypt( MEM_If_BufferTypeDef* buf );
+#endif
+#if ( IMAGE_LZ4_ENB > 0U )
+  static USBD_StatusTypeDef MEM_If_Decompress( MEM_If_BufferTypeDef* buf );
+  static USBD_StatusTypeDef MEM_If_FlushLz4( void );
+#endif
+static USBD_StatusTypeDef MEM_If_Clip( MEM_If_BufferTypeDef* buf );
+static USBD_StatusTypeDef MEM_If_Prepare( MEM_If_BufferTypeDef* buf );
+#if ( FLASH_SKIP_ERASED_ENB > 0U )
+  static USBD_StatusTypeDef MEM_If_SkipErased( MEM_If_BufferTypeDef* buf );
+#endif
+static USBD_StatusTypeDef MEM_If_Store( MEM_If_BufferTypeDef* buf );
+static uint32_t          MEM_If_Crc( uint32_t adr, uint32_t length );
+#if ( READING_ENB > 0U )
+  static uint8_t         MEM_If_IsReadable( uint32_t adr, uint32_t length );
+#endif
+#if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION )
+  static USBD_StatusTypeDef MEM_If_Random( uint8_t* out, uint32_t length );
+#endif
+static void              MEM_If_VerifyStart( uint32_t adr, uint32_t length );
+static void              MEM_If_VerifyNext( DMA_HandleTypeDef* hdma );
+static void              MEM_If_VerifyError( DMA_HandleTypeDef* hdma );
+#if IMAGE_LOG_ENB
+  static void               MEM_If_StartSession( void );
+  static IMAGE_InfoTypeDef* MEM_If_LogSlot( void );
+  static USBD_StatusTypeDef MEM_If_Revoke( void );
+#endif
+
+/* Write pipelines. The build picks the stages, the DNLOAD window the pipeline:
+   a block to the flash is decrypted and programmed where it was sent, a block of the compressed window is decompressed and the output
+   programmed in stages of IMAGE_LZ4_STAGE bytes */
+#if defined( ENCRYPTION )
+  static MEM_If_StageTypeDef stageDecrypt    = { MEM_If_Decrypt,      "decrypt",    0U, 0U };
+#endif
+#if ( IMAGE_LZ4_ENB > 0U )
+  static MEM_If_StageTypeDef stageDecompress = { MEM_If_Decompress,   "decompress", 0U, 0U };
+#endif
+static MEM_If_StageTypeDef   stageClip       = { MEM_If_Clip,         "clip",       0U, 0U };
+static MEM_If_StageTypeDef   stagePrepare    = { MEM_If_Prepare,      "prepare",    0U, 0U };
+#if ( FLASH_SKIP_ERASED_ENB > 0U )
+  static MEM_If_StageTypeDef stageSkip       = { MEM_If_SkipErased,   "skip",       0U, 0U };
+#endif
+static MEM_If_StageTypeDef   stageProgram    = { MEM_If_Store,        "program",    0U, 0U };
+
+/* Not const: the stage tables are read from RAM while the flash is busy */
+static MEM_If_StageTypeDef* flashStages[] =
+{
+  #if defined( ENCRYPTION )
+    &stageDecrypt,
+  #endif
+  &stageClip,
+  &stagePrepare,
+  #if ( FLASH_SKIP_ERASED_ENB > 0U )
+    &stageSkip,
+  #endif
+  &stageProgram
+};
+static MEM_If_PipeTypeDef flashPipe = { flashStages, ( sizeof( flashStages ) / sizeof( flashStages[0] ) ), 0U, 0U, { NULL, 0U, 0U } };
+#if ( IMAGE_LZ4_ENB > 0U )
+  static MEM_If_StageTypeDef* lzStages[] =
+  {
+    #if defined( ENCRYPTION )
+      &stageDecrypt,
+    #endif
+    &stageDecompress
+  };
+  /* Fed by the decompression with the full stage */
+  static MEM_If_StageTypeDef* lzOutStages[] =
+  {
+    &stageClip,
+    &stagePrepare,
+    #if ( FLASH_SKIP_ERASED_ENB > 0U )
+      &stageSkip,
+    #endif
+    &stageProgram
+  };
+  static MEM_If_PipeTypeDef lzPipe    = { lzStages, ( sizeof( lzStages ) / sizeof( lzStages[0] ) ), 0U, 0U, { NULL, 0U, 0U } };
+  static MEM_If_PipeTypeDef lzOutPipe = { lzOutStages, ( sizeof( lzOutStages ) / sizeof( lzOutStages[0] ) ), 0U, 0U, { NULL, 0U, 0U } };
+#endif
+static MEM_If_PipeTypeDef* writePipe[] =
+{
+  &flashPipe,
+  #if ( IMAGE_LZ4_ENB > 0U )
+    &lzPipe,
+    &lzOutPipe,
+  #endif
+};
+#if ( WRITE_CYCLES_ENB > 0U )
+  static uint32_t writeCycles = 0U;  /* Cycles of all stages so far, a stage takes off those of the stages it feeds */
+#endif
 
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
 
@@ -159,9 +431,50 @@ __ALIGN_BEGIN USBD_DFU_MediaTypeDef USBD_DFU_fops_FS __ALIGN_END =
 uint16_t MEM_If_Init_FS(void)
 {
   /* USER CODE BEGIN 0 */
-  #if defined( ENCRYPTION )
+  uint32_t i = 0U;
+  uint32_t j = 0U;
+
+  /* Hooks beyond the generated initializer, CubeMX would drop them there */
+  USBD_DFU_fops_FS.Hash     = MEM_If_Hash_FS;
+  USBD_DFU_fops_FS.Manifest = MEM_If_Manifest_FS;
+  USBD_DFU_fops_FS.Abort    = MEM_If_Abort_FS;
+  #if defined( ENCRYPTION ) && ( ENCRYPTION_CTR > 0U )
+    AES_init_ctx_enc( &ctx, key );
+  #elif defined( ENCRYPTION )
     AES_init_ctx_iv( &ctx, key, iv );
   #endif
+  #if ( IMAGE_AUTH_ENB > 0U )
+    AES_init_ctx_enc( &macCtx, macKey );
+  #endif
+  #if defined( CMAC ) && ( CMAC == 1 )
+    AES_init_ctx_enc( &digestCtx, digestKey );
+  #endif
+  #if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION )
+    AES_init_ctx_enc( &readCtx, readKey );
+    readOpen = 0U;
+  #endif
+  ( void )MEM_If_Abort_FS();
+  for ( i=0U; i<( sizeof( writePipe ) / sizeof( writePipe[0] ) ); i++ )
+  {
+    for ( j=0U; j<writePipe[i]->count; j++ )
+    {
+      writePipe[i]->stage[j]->cycles = 0U;
+      writePipe[i]->stage[j]->calls  = 0U;
+    }
+  }
+  #if ( WRITE_CYCLES_ENB > 0U )
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL        |= DWT_CTRL_CYCCNTENA_Msk;
+  #endif
+  __HAL_RCC_CRC_CLK_ENABLE();
+  #if ( FLASH_ASYNC_ENB > 0U )
+    if ( asyncState != ASYNC_BUSY )
+    {
+      asyncState = ASYNC_IDLE;
+    }
+    HAL_NVIC_SetPriority( FLASH_IRQn, 0U, 0U );
+    HAL_NVIC_EnableIRQ( FLASH_IRQn );
+  #endif
   HAL_StatusTypeDef flashStatus = HAL_ERROR;
   while ( flashStatus != HAL_OK )
   {
@@ -192,25 +505,97 @@ uint16_t MEM_If_DeInit_FS(void)
   * @param  Add: Address of sector to be erased.
   * @retval 0 if operation is successful, MAL_FAIL else.
   */
-uint16_t MEM_If_Erase_FS(uint32_t Add)
+RAM_FUNC uint16_t MEM_If_Erase_FS(uint32_t Add)
 {
   /* USER CODE BEGIN 2 */
-  uint32_t               pageError = 0U;
-  HAL_StatusTypeDef      status    = HAL_ERROR;
+  #if ( FLASH_ASYNC_ENB == 0U )
+    uint32_t             pageError = 0U;
+    uint32_t             start     = 0U;
+  #endif
   USBD_StatusTypeDef     res       = USBD_FAIL;
   FLASH_EraseInitTypeDef eraseInit;
+  MEM_If_SectorTypeDef   sector;
 
+  #if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION )
+    /* The same keystream over other content would give both away */
+    readOpen = 0U;
+  #endif
+  #if ( IMAGE_LZ4_ENB > 0U )
+    /* Not a memory, the decompressed image is erased on demand */
+    if ( Add >= IMAGE_LZ4_ADDRESS )
+    {
+      return ( USBD_OK );
+    }
+  #endif
+  #if IMAGE_LOG_ENB
+    if ( Add > BOOTLADER_SIZE )
+    {
+      res = MEM_If_Revoke();
+      if ( res != USBD_OK )
+      {
+        return ( res );
+      }
+    }
+  #endif
   if ( Add > BOOTLADER_SIZE ) {
+    MEM_If_GetSector( Add, &sector );
     eraseInit.TypeErase    = FLASH_TYPEERASE_SECTORS;
     eraseInit.Banks        = FLASH_BANK_1;
-    eraseInit.Sector       = GET_SECTOR( Add );
+    eraseInit.Sector       = sector.number;
     eraseInit.NbSectors    = 1U;
     eraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
-    status = HAL_FLASHEx_Erase( &eraseInit, &pageError );
-    if ( status == HAL_OK )
+    res                    = USBD_FAIL;
+    /* Every sector is erased once per session and only when it is dirty */
+    if ( ( erased & ( 1U << eraseInit.Sector ) ) != 0U )
     {
       res = USBD_OK;
     }
+  #if ( FLASH_ASYNC_ENB > 0U )
+    else if ( ( asyncState != ASYNC_IDLE ) && ( asyncCmd == DFU_MEDIA_ERASE ) && ( asyncAdr == sector.address ) )
+    {
+      /* The job is run again until the FLASH interrupt reports the end */
+      if ( asyncState == ASYNC_BUSY )
+      {
+        return ( USBD_BUSY );
+      }
+      if ( asyncState == ASYNC_READY )
+      {
+        eraseTime[sector.group] = CALIBRATE( eraseTime[sector.group], ( HAL_GetTick() - busyStart ) );
+        erased |= 1U << eraseInit.Sector;
+        res     = USBD_OK;
+      }
+      asyncState = ASYNC_IDLE;
+      busy       = 0U;
+    }
+  #endif
+    else if ( MEM_If_IsBlank( &sector ) > 0U )
+    {
+      erased |= 1U << eraseInit.Sector;
+      res     = USBD_OK;
+    }
+    else
+    {
+    #if ( FLASH_ASYNC_ENB > 0U )
+      ( void )MEM_If_SetBusy( Add, DFU_MEDIA_ERASE );
+      asyncCmd   = DFU_MEDIA_ERASE;
+      asyncAdr   = sector.address;
+      asyncState = ASYNC_BUSY;
+      if ( HAL_FLASHEx_Erase_IT( &eraseInit ) == HAL_OK )
+      {
+        return ( USBD_BUSY );
+      }
+      asyncState = ASYNC_IDLE;
+    #else
+      start = MEM_If_SetBusy( Add, DFU_MEDIA_ERASE );
+      if ( HAL_FLASHEx_Erase( &eraseInit, &pageError ) == HAL_OK )
+      {
+        eraseTime[sector.group] = CALIBRATE( eraseTime[sector.group], ( HAL_GetTick() - start ) );
+        erased |= 1U << eraseInit.Sector;
+        res     = USBD_OK;
+      }
+    #endif
+      busy = 0U;
+    }
   }
   else
   {
@@ -221,45 +606,28 @@ uint16_t MEM_If_Erase_FS(uint32_t Add)
 }
 
 /**
-  * @brief  Memory write routine.
+  * @brief  Memory write routine, the write pipeline of the address window.
   * @param  src: Pointer to the source buffer. Address to be written to.
   * @param  dest: Pointer to the destination buffer.
   * @param  Len: Number of data to be written (in bytes).
-  * @retval USBD_OK if operation is successful, MAL_FAIL else.
+  * @retval USBD_OK if operation is successful, USBD_BUSY while a sector is
+  *         erased or the block is programmed by the FLASH interrupt, MAL_FAIL else.
   */
-uint16_t MEM_If_Write_FS(uint8_t *src, uint8_t *dest, uint32_t Len)
+RAM_FUNC uint16_t MEM_If_Write_FS(uint8_t *src, uint8_t *dest, uint32_t Len)
 {
   /* USER CODE BEGIN 3 */
-  uint32_t           i      = 0U;
-  USBD_StatusTypeDef result = USBD_FAIL;
+  MEM_If_BufferTypeDef buf = { src, ( uint32_t )dest, Len };
 
-  #if defined( ENCRYPTION )
-    AES_CBC_decrypt_buffer( &ctx, src, Len );
+  #if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION )
+    readOpen = 0U;
   #endif
-  for ( i=0U; i<Len; i+=4U )
-  {
-	if ( ( uint32_t )( dest + i ) > BOOTLADER_SIZE )
-	{
-      if ( HAL_FLASH_Program( FLASH_TYPEPROGRAM_WORD, ( uint32_t )( dest + i ), *( uint32_t* )( src + i ) ) == HAL_OK )
-      {
-        if ( *( uint32_t* )( src + i ) != *( uint32_t* )( dest + i ) )
-        {
-          result = USBD_FAIL;
-          break;
-        }
-        else
-        {
-          result = USBD_OK;
-        }
-      }
-      else
-      {
-        result = USBD_FAIL;
-        break;
-      }
-	}
-  }
-  return result;
+  #if ( IMAGE_LZ4_ENB > 0U )
+    if ( buf.adr >= IMAGE_LZ4_ADDRESS )
+    {
+      return ( MEM_If_RunPipe( &lzPipe, &buf ) );
+    }
+  #endif
+  return ( MEM_If_RunPipe( &flashPipe, &buf ) );
   /* USER CODE END 3 */
 }
 
@@ -268,23 +636,37 @@ uint16_t MEM_If_Write_FS(uint8_t *src, uint8_t *dest, uint32_t Len)
   * @param  src: Pointer to the source buffer. Address to be written to.
   * @param  dest: Pointer to the destination buffer.
   * @param  Len: Number of data to be read (in bytes).
-  * @retval Pointer to the physical address where data should be read.
+  * @retval Pointer to the physical address where data should be read,
+  *         NULL if the area can not be read out.
   */
 uint8_t *MEM_If_Read_FS(uint8_t *src, uint8_t *dest, uint32_t Len)
 {
   /* Return a valid address to avoid HardFault */
   /* USER CODE BEGIN 4 */
   #if ( READING_ENB > 0 )
-    uint32_t i    = 0U;
-    uint8_t *psrc = src;
-
-    for ( i=0U; i<Len; i++ )
+    if ( MEM_If_IsReadable( ( uint32_t )src, Len ) == 0U )
     {
-      dest[i] = *psrc++;
+      return ( NULL );
     }
-    return ( uint8_t* )( dest );
+    #if ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION )
+      /* AES-CTR with the read-out key from the nonce of the session, the
+         counter follows from the address */
+      if ( readOpen == 0U )
+      {
+        return ( NULL );
+      }
+      memcpy( dest, src, Len );
+      AES_CTR_xcrypt_offset( &readCtx, dest, Len, ( ( uint32_t )src - FLASH_BASE ) );
+      return ( dest );
+    #elif ( READING_COPY > 0U )
+      memcpy( dest, src, Len );
+      return ( dest );
+    #else
+      /* The flash is memory mapped, EP0 is fed from it directly */
+      return ( src );
+    #endif
   #else
-    return (USBD_OK);
+    return ( NULL );
   #endif
   /* USER CODE END 4 */
 }
@@ -296,25 +678,1072 @@ uint8_t *MEM_If_Read_FS(uint8_t *src, uint8_t *dest, uint32_t Len)
   * @param  buffer: used for returning the time necessary for a program or an erase operation
   * @retval USBD_OK if operation is successful
   */
-uint16_t MEM_If_GetStatus_FS(uint32_t Add, uint8_t Cmd, uint8_t *buffer)
+RAM_FUNC uint16_t MEM_If_GetStatus_FS(uint32_t Add, uint8_t Cmd, uint8_t *buffer)
 {
   /* USER CODE BEGIN 5 */
+  uint32_t             time    = 0U;
+  uint32_t             elapsed = 0U;
+  /* The rest of the block from Add, a streamed block is written in parts */
+  uint32_t             bytes   = USBD_DFU_XFER_SIZE - ( ( Add - APP_ADDRESS ) % USBD_DFU_XFER_SIZE );
+  #if ( IMAGE_LZ4_ENB > 0U )
+    uint32_t           in      = 0U;
+    uint32_t           out     = 0U;
+  #endif
+  MEM_If_SectorTypeDef sector;
+
+  #if ( IMAGE_LZ4_ENB > 0U )
+    /* The output of a compressed block at the ratio of the stream before
+       it, less what is programmed since the block started. At most a stage:
+       the host is back when it is programmed, before the next block is due */
+    if ( Add >= IMAGE_LZ4_ADDRESS )
+    {
+      in  = Add - IMAGE_LZ4_ADDRESS;
+      out = ( lzBlock == Add ) ? lzOut : lz.out;
+      if ( in != 0U )
+      {
+        bytes = ( bytes * ( ( ( out - APP_ADDRESS ) * 16U ) / in ) ) / 16U;
+      }
+      bytes = ( ( lz.out - out ) < bytes ) ? ( bytes - ( lz.out - out ) ) : FLASH_PSIZE_BYTES;
+      bytes = ( bytes > IMAGE_LZ4_STAGE ) ? IMAGE_LZ4_STAGE : bytes;
+      Add   = lz.out;
+    }
+  #endif
+  MEM_If_GetSector( Add, &sector );
   switch (Cmd)
   {
     case DFU_MEDIA_PROGRAM:
+      time = ( ( ( bytes / FLASH_PSIZE_BYTES ) * wordTime ) + 999U ) / 1000U;
+      /* The block starts with the erase of its sector */
+      if ( ( Add > BOOTLADER_SIZE ) && ( ( erased & ( 1U << sector.number ) ) == 0U ) )
+      {
+        time += eraseTime[sector.group];
+      }
+      break;
+
+    case DFU_MEDIA_HASH:
+      time = FLASH_HASH_TIME;
+      break;
 
-    break;
+    case DFU_MEDIA_MANIFEST:
+      /* The rest of the image verification */
+      time = ( ( ( 100U - MEM_If_VerifyProgress() ) * ( ( IMAGE_MARKER_ADDRESS - APP_ADDRESS ) / ( VERIFY_CHUNK * 4U ) ) *
+                 VERIFY_CHUNK_TIME ) / 100U ) + 1U;
+      break;
 
     case DFU_MEDIA_ERASE:
     default:
-
-    break;
+      if ( Add > BOOTLADER_SIZE )
+      {
+        time = eraseTime[sector.group];
+      }
+      break;
+  }
+  /* Only the rest of an operation that is already running */
+  if ( ( busy != 0U ) && ( busyAdr == Add ) && ( busyCmd == Cmd ) )
+  {
+    elapsed = HAL_GetTick() - busyStart;
+    time    = ( elapsed < time ) ? ( time - elapsed ) : 1U;
   }
+  /* bwPollTimeout */
+  buffer[1] = ( uint8_t )( time );
+  buffer[2] = ( uint8_t )( time >> 8U );
+  buffer[3] = ( uint8_t )( time >> 16U );
   return (USBD_OK);
   /* USER CODE END 5 */
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+/**
+  * @brief  Hash routine, CRC32 of the flash area by the CRC unit.
+  *         Only whole sectors of the areas open to UPLOAD are hashed: the
+  *         CRC32 of a few words could be inverted to read them out. The
+  *         DFU_CMD_SESSION job comes here too, its nonce is read back as a digest.
+  * @param  Add: Start address of a sector from APP_ADDRESS on.
+  * @param  Len: Number of bytes to hash, up to the end of a sector.
+  * @param  Alg: DFU_HASH_CRC32 (poly 0x04C11DB7, init 0xFFFFFFFF, no reflection,
+  *         little endian), DFU_HASH_CMAC (AES-CMAC with the digest key) or
+  *         DFU_HASH_SESSION (new nonce of the encrypted read-out, no area).
+  * @param  digest: Returned digest.
+  * @retval USBD_OK if operation is successful, MAL_FAIL else.
+  */
+static uint16_t MEM_If_Hash_FS(uint32_t Add, uint32_t Len, uint8_t Alg, uint8_t *digest)
+{
+  #if defined( CMAC ) && ( CMAC == 1 )
+    struct AES_cmac    m;
+  #endif
+  uint32_t             crc = 0U;
+  MEM_If_SectorTypeDef first;
+  MEM_If_SectorTypeDef last;
+
+  #if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION )
+    if ( Alg == DFU_HASH_SESSION )
+    {
+      readOpen = 0U;
+      if ( MEM_If_Random( digest, AES_BLOCKLEN ) != USBD_OK )
+      {
+        return ( USBD_FAIL );
+      }
+      AES_ctx_set_iv( &readCtx, digest );
+      readOpen = 1U;
+      return ( USBD_OK );
+    }
+  #endif
+  if ( ( Len == 0U ) || ( Add < APP_ADDRESS ) || ( Add >= IMAGE_MARKER_END ) || ( Len > ( IMAGE_MARKER_END - Add ) ) )
+  {
+    return ( USBD_FAIL );
+  }
+  MEM_If_GetSector( Add, &first );
+  MEM_If_GetSector( ( Add + Len - 1U ), &last );
+  if ( ( Add != first.address ) || ( ( Add + Len ) != ( last.address + last.size ) ) )
+  {
+    return ( USBD_FAIL );
+  }
+  switch ( Alg )
+  {
+    case DFU_HASH_CRC32:
+      crc       = MEM_If_Crc( Add, Len );
+      digest[0] = ( uint8_t )crc;
+      digest[1] = ( uint8_t )( crc >> 8 );
+      digest[2] = ( uint8_t )( crc >> 16 );
+      digest[3] = ( uint8_t )( crc >> 24 );
+      break;
+    #if defined( CMAC ) && ( CMAC == 1 )
+      case DFU_HASH_CMAC:
+        AES_CMAC_init( &m );
+        AES_CMAC_update( &m, &digestCtx, ( const uint8_t* )Add, Len );
+        AES_CMAC_final( &m, &digestCtx, digest );
+        break;
+    #endif
+    default:
+      return ( USBD_FAIL );
+  }
+  return ( USBD_OK );
+}
+
+/**
+  * @brief  Manifestation routine, check of the downloaded image.
+  * @param  tag: Expected AES-CMAC of the descriptor and the image in flash.
+  * @param  info: Image descriptor: length, CRC32 and version, little endian words,
+  *         then the nonce of the image cipher.
+  * @retval USBD_OK if the image is verified and logged valid, USBD_BUSY while
+  *         the verification runs, MAL_FAIL else.
+  */
+RAM_FUNC static uint16_t MEM_If_Manifest_FS(const uint8_t *tag, const uint8_t *info)
+{
+  #if ( IMAGE_LZ4_ENB > 0U )
+    USBD_StatusTypeDef stage = USBD_OK;
+  #endif
+  #if IMAGE_LOG_ENB
+    IMAGE_InfoTypeDef  image;
+    IMAGE_InfoTypeDef* slot = MEM_If_LogSlot();
+    uint8_t            diff = 0U;
+    USBD_StatusTypeDef res  = USBD_FAIL;
+    #if ( IMAGE_AUTH_ENB > 0U )
+      uint8_t          calc[AES_BLOCKLEN];
+      uint8_t          i    = 0U;
+      uint32_t         n    = 0U;
+    #endif
+  #endif
+
+  #if ( IMAGE_LZ4_ENB > 0U )
+    /* The end of a compressed image is still in the stage */
+    if ( lzNext != 0U )
+    {
+      stage = ( LZ4_isEnd( &lz ) != 0U ) ? MEM_If_FlushLz4() : USBD_FAIL;
+      if ( stage == USBD_BUSY )
+      {
+        return ( USBD_BUSY );
+      }
+      lzNext   = 0U;
+      lzBroken = ( stage != USBD_OK ) ? 1U : 0U;
+    }
+  #endif
+  #if IMAGE_LOG_ENB
+    memcpy( &image, info, ( sizeof( image ) - sizeof( image.marker ) ) );
+    #if ( IMAGE_AUTH_ENB > 0U )
+      /* The MAC covers the descriptor and the image as the flash holds it, not
+         the blocks that built it: a delta update, a gap or a block sent again
+         give the same tag. A chunk per run, the job is called again until the end */
+      if ( ( revoked != 0U ) && ( IS_IMAGE_LENGTH( image.length ) != 0U ) )
+      {
+        if ( macNext == 0U )
+        {
+          AES_CMAC_update( &mac, &macCtx, info, ( sizeof( image ) - sizeof( image.marker ) ) );
+          macNext = APP_ADDRESS;
+        }
+        if ( macNext < ( APP_ADDRESS + image.length ) )
+        {
+          n = APP_ADDRESS + image.length - macNext;
+          n = ( n < MAC_CHUNK ) ? n : MAC_CHUNK;
+          AES_CMAC_update( &mac, &macCtx, ( const uint8_t* )macNext, n );
+          macNext += n;
+          return ( USBD_BUSY );
+        }
+      }
+    #endif
+    #if ( IMAGE_CRC_ENB > 0U )
+      /* The image is fed to the CRC unit by DMA, the job is called again until it is done */
+      if ( ( revoked != 0U ) && ( IS_IMAGE_LENGTH( image.length ) != 0U ) )
+      {
+        if ( verifyState == VERIFY_IDLE )
+        {
+          MEM_If_VerifyStart( APP_ADDRESS, image.length );
+        }
+        if ( verifyState == VERIFY_BUSY )
+        {
+          return ( USBD_BUSY );
+        }
+      }
+      if ( ( verifyState != VERIFY_DONE ) || ( verifyCrc != image.crc ) )
+      {
+        diff |= 1U;
+      }
+      verifyState = VERIFY_IDLE;
+    #endif
+    #if ( IMAGE_AUTH_ENB > 0U )
+      AES_CMAC_final( &mac, &macCtx, calc );
+      for ( i=0U; i<AES_BLOCKLEN; i++ )
+      {
+        diff |= calc[i] ^ tag[i];
+      }
+      diff |= ( macNext != ( APP_ADDRESS + image.length ) ) ? 1U : 0U;
+    #endif
+    #if ( IMAGE_LZ4_ENB > 0U )
+      diff    |= lzBroken;
+      lzBroken = 0U;
+    #endif
+    if ( revoked == 0U )
+    {
+      /* Nothing was written: leaving DFU mode, the boot check decides */
+      res = USBD_OK;
+    }
+    else if ( ( diff == 0U ) && ( ( uint32_t )slot < IMAGE_MARKER_END ) &&
+              ( HAL_FLASH_Program( FLASH_TYPEPROGRAM_WORD, ( uint32_t )&slot->length,  image.length )  == HAL_OK ) &&
+              ( HAL_FLASH_Program( FLASH_TYPEPROGRAM_WORD, ( uint32_t )&slot->crc,     image.crc )     == HAL_OK ) &&
+              ( HAL_FLASH_Program( FLASH_TYPEPROGRAM_WORD, ( uint32_t )&slot->version, image.version ) == HAL_OK ) &&
+              ( HAL_FLASH_Program( FLASH_TYPEPROGRAM_WORD, ( uint32_t )&slot->marker,  IMAGE_MARKER_VALID ) == HAL_OK ) )
+    {
+      res = USBD_OK;
+    }
+    /* The next download starts a new session */
+    MEM_If_StartSession();
+    erased = 0U;
+    return ( res );
+  #else
+    erased = 0U;
+    #if ( IMAGE_LZ4_ENB > 0U )
+      if ( lzBroken != 0U )
+      {
+        lzBroken = 0U;
+        return ( USBD_FAIL );
+      }
+    #endif
+    return ( USBD_OK );
+  #endif
+}
+
+/**
+  * @brief  End of a download the host gave up on, by DFU_ABORT or by
+  *         CLRSTATUS after an error: run after the writes queued before.
+  *         The next download is a new session, its sectors are erased again.
+  * @retval USBD_OK.
+  */
+static uint16_t MEM_If_Abort_FS(void)
+{
+  uint32_t i = 0U;
+
+  erased = 0U;
+  #if ( IMAGE_LZ4_ENB > 0U )
+    lzNext   = 0U;
+    lzBlock  = 0U;
+    lzBroken = 0U;
+  #endif
+  #if IMAGE_LOG_ENB
+    MEM_If_StartSession();
+  #endif
+  for ( i=0U; i<( sizeof( writePipe ) / sizeof( writePipe[0] ) ); i++ )
+  {
+    writePipe[i]->next = 0U;
+  }
+  return ( USBD_OK );
+}
+
+/**
+  * @brief  Check the application image with its descriptor in the image log.
+  *         Only the last descriptor counts, a revoked or incomplete one stops the boot.
+  *         The image behind a valid descriptor was verified at manifestation, the
+  *         CRC32 of the flash is computed again with IMAGE_BOOT_CRC_ENB only.
+  * @retval 1 if the image can be started, 0 else.
+  */
+uint8_t MEM_If_IsImageValid( void )
+{
+  #if IMAGE_LOG_ENB
+    const IMAGE_InfoTypeDef* image = MEM_If_LogSlot();
+
+    if ( ( uint32_t )image == IMAGE_MARKER_ADDRESS )
+    {
+      return 0U;
+    }
+    image--;
+    if ( ( image->marker != IMAGE_MARKER_VALID ) || ( IS_IMAGE_LENGTH( image->length ) == 0U ) )
+    {
+      return 0U;
+    }
+    #if ( IMAGE_CRC_ENB > 0U ) && ( IMAGE_BOOT_CRC_ENB > 0U )
+      /* Also catches a change of the flash after the manifestation */
+      __HAL_RCC_CRC_CLK_ENABLE();
+      if ( MEM_If_Crc( APP_ADDRESS, image->length ) != image->crc )
+      {
+        return 0U;
+      }
+    #endif
+  #endif
+  return 1U;
+}
+
+/**
+  * @brief  CRC32 of a flash area by the CRC unit, fed a word per bus access.
+  * @param  adr: Word aligned start address.
+  * @param  length: Number of bytes, multiple of 4.
+  * @retval CRC32 (poly 0x04C11DB7, init 0xFFFFFFFF, no reflection).
+  */
+static uint32_t MEM_If_Crc( uint32_t adr, uint32_t length )
+{
+  const uint32_t* data = ( const uint32_t* )adr;
+  const uint32_t* end  = data + ( length / 4U );
+
+  CRC->CR = CRC_CR_RESET;
+  while ( ( end - data ) >= 4 )
+  {
+    CRC->DR = data[0U];
+    CRC->DR = data[1U];
+    CRC->DR = data[2U];
+    CRC->DR = data[3U];
+    data   += 4U;
+  }
+  while ( data < end )
+  {
+    CRC->DR = *data++;
+  }
+  return CRC->DR;
+}
+
+/**
+  * @brief  Progress of the image verification started on manifestation.
+  * @retval Percent of the image fed to the CRC unit.
+  */
+RAM_FUNC uint8_t MEM_If_VerifyProgress( void )
+{
+  uint32_t done = verifyAdr - verifyStart;
+  uint32_t size = verifyEnd - verifyStart;
+
+  if ( ( verifyState != VERIFY_BUSY ) || ( size == 0U ) )
+  {
+    return 100U;
+  }
+  return ( uint8_t )( ( done / ( ( size + 99U ) / 100U ) ) );
+}
+
+#if ( READING_ENB > 0U )
+/**
+  * @brief  Check that an area may be read out with UPLOAD.
+  * @param  adr: Start address.
+  * @param  length: Number of bytes.
+  * @retval 1 if the whole area is inside the flash and, with READING_POLICY,
+  *         inside one of the read out regions, 0 else.
+  */
+static uint8_t MEM_If_IsReadable( uint32_t adr, uint32_t length )
+{
+  #if ( READING_POLICY > 0U )
+    uint32_t i = 0U;
+  #endif
+
+  if ( ( adr < FLASH_BASE ) || ( adr > FLASH_END ) || ( length > ( ( FLASH_END + 1U ) - adr ) ) )
+  {
+    return 0U;
+  }
+  #if ( READING_POLICY > 0U )
+    for ( i=0U; i<( sizeof( readRegion ) / sizeof( readRegion[0] ) ); i++ )
+    {
+      if ( ( adr >= readRegion[i][0] ) && ( adr < readRegion[i][1] ) &&
+           ( length <= ( readRegion[i][1] - adr ) ) )
+      {
+        return 1U;
+      }
+    }
+    return 0U;
+  #else
+    return 1U;
+  #endif
+}
+#endif
+
+#if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION )
+/**
+  * @brief  Random bytes of the RNG peripheral.
+  * @param  out: Returned bytes.
+  * @param  length: Number of bytes.
+  * @retval USBD_OK, USBD_FAIL on a seed or clock error of the RNG.
+  */
+static USBD_StatusTypeDef MEM_If_Random( uint8_t* out, uint32_t length )
+{
+  uint32_t start = HAL_GetTick();
+  uint32_t word  = 0U;
+  uint32_t i     = 0U;
+
+  __HAL_RCC_RNG_CLK_ENABLE();
+  RNG->CR |= RNG_CR_RNGEN;
+  while ( i < length )
+  {
+    if ( ( ( RNG->SR & ( RNG_SR_SECS | RNG_SR_CECS ) ) != 0U ) || ( ( HAL_GetTick() - start ) > RNG_TIMEOUT ) )
+    {
+      return ( USBD_FAIL );
+    }
+    if ( ( RNG->SR & RNG_SR_DRDY ) != 0U )
+    {
+      word = RNG->DR;
+      memcpy( &out[i], &word, ( ( length - i ) < 4U ) ? ( length - i ) : 4U );
+      i += 4U;
+    }
+  }
+  return ( USBD_OK );
+}
+#endif
+
+/**
+  * @brief  Start the CRC of a flash area in the background.
+  *         DMA2 copies the area to the CRC data register in chunks of
+  *         VERIFY_CHUNK words, the completion callback chains the chunks.
+  * @param  adr: Word aligned start address.
+  * @param  length: Number of bytes, multiple of 4.
+  * @retval None.
+  */
+static void MEM_If_VerifyStart( uint32_t adr, uint32_t length )
+{
+  verifyStart = adr;
+  verifyAdr   = adr;
+  verifyEnd   = adr + length;
+  verifyState = VERIFY_BUSY;
+  CRC->CR     = CRC_CR_RESET;
+  hdma_memtomem_dma2_stream0.XferCpltCallback  = MEM_If_VerifyNext;
+  hdma_memtomem_dma2_stream0.XferErrorCallback = MEM_If_VerifyError;
+  MEM_If_VerifyNext( &hdma_memtomem_dma2_stream0 );
+}
+
+/**
+  * @brief  Transfer complete callback: start the next chunk or finish.
+  * @param  hdma: DMA handle.
+  * @retval None.
+  */
+static void MEM_If_VerifyNext( DMA_HandleTypeDef* hdma )
+{
+  uint32_t adr   = verifyAdr;
+  uint32_t words = ( verifyEnd - adr ) / 4U;
+
+  if ( words == 0U )
+  {
+    verifyCrc   = CRC->DR;
+    verifyState = VERIFY_DONE;
+    return;
+  }
+  if ( words > VERIFY_CHUNK )
+  {
+    words = VERIFY_CHUNK;
+  }
+  verifyAdr = adr + ( words * 4U );
+  if ( HAL_DMA_Start_IT( hdma, adr, ( uint32_t )&CRC->DR, words ) != HAL_OK )
+  {
+    verifyState = VERIFY_ERROR;
+  }
+}
+
+/**
+  * @brief  Transfer error callback.
+  * @param  hdma: DMA handle.
+  * @retval None.
+  */
+static void MEM_If_VerifyError( DMA_HandleTypeDef* hdma )
+{
+  UNUSED( hdma );
+  verifyState = VERIFY_ERROR;
+}
+
+#if IMAGE_LOG_ENB
+/**
+  * @brief  Reset the image MAC and the log state for a new download.
+  * @retval None.
+  */
+static void MEM_If_StartSession( void )
+{
+  #if ( IMAGE_AUTH_ENB > 0U )
+    AES_CMAC_init( &mac );
+    macNext = 0U;
+  #endif
+  revoked = 0U;
+}
+
+/**
+  * @brief  Find the first blank descriptor of the image log.
+  *         Every manifested download takes the next descriptor, the last
+  *         programmed one describes the image in flash.
+  * @retval Blank descriptor, IMAGE_MARKER_END if the log is full.
+  */
+RAM_FUNC static IMAGE_InfoTypeDef* MEM_If_LogSlot( void )
+{
+  IMAGE_InfoTypeDef* slot = ( IMAGE_InfoTypeDef* )IMAGE_MARKER_ADDRESS;
+
+  while ( ( ( uint32_t )slot < IMAGE_MARKER_END ) && ( slot->length != 0xFFFFFFFFU ) )
+  {
+    slot++;
+  }
+  return slot;
+}
+
+/**
+  * @brief  Revoke the last descriptor before the first change of the flash in
+  *         the session, so that an interrupted download is never booted.
+  *         A full log is erased with its sector, the image has to be sent
+  *         again up to the end of the flash then.
+  * @retval USBD_OK if the descriptor is revoked, USBD_BUSY while the log
+  *         sector is erased, USBD_FAIL else.
+  */
+RAM_FUNC static USBD_StatusTypeDef MEM_If_Revoke( void )
+{
+  USBD_StatusTypeDef res  = USBD_OK;
+  IMAGE_InfoTypeDef* slot = NULL;
+
+  if ( revoked == 0U )
+  {
+    revoked = 1U;
+    slot    = MEM_If_LogSlot();
+    if ( ( uint32_t )slot == IMAGE_MARKER_END )
+    {
+      res = ( USBD_StatusTypeDef )MEM_If_Erase_FS( IMAGE_MARKER_ADDRESS );
+    }
+    else if ( ( ( uint32_t )slot > IMAGE_MARKER_ADDRESS ) && ( slot[-1].marker != IMAGE_MARKER_REVOKED ) )
+    {
+      res = ( HAL_FLASH_Program( FLASH_TYPEPROGRAM_WORD, ( uint32_t )&slot[-1].marker, IMAGE_MARKER_REVOKED ) == HAL_OK ) ? USBD_OK : USBD_FAIL;
+    }
+    if ( res != USBD_OK )
+    {
+      revoked = 0U;
+    }
+  }
+  return res;
+}
+#endif
+
+/**
+  * @brief  Mark the start of a media operation for MEM_If_GetStatus_FS.
+  * @param  adr: Address of the operation.
+  * @param  cmd: DFU_MEDIA_ERASE or DFU_MEDIA_PROGRAM.
+  * @retval Tick at the start of the operation.
+  */
+static uint32_t MEM_If_SetBusy( uint32_t adr, uint8_t cmd )
+{
+  busyAdr   = adr;
+  busyCmd   = cmd;
+  busyStart = HAL_GetTick();
+  busy      = 1U;
+  return busyStart;
+}
+
+/**
+  * @brief  Locate the sector of an address in the flash geometry.
+  *         The groups are walked in address order, the sector inside the
+  *         group follows from its size. An address past the end gives the
+  *         last sector.
+  * @param  adr: Flash address.
+  * @param  sector: Returned sector number, start, size and group.
+  * @retval None.
+  */
+RAM_FUNC static void MEM_If_GetSector( uint32_t adr, MEM_If_SectorTypeDef* sector )
+{
+  uint32_t group = 0U;
+  uint32_t start = FLASH_BASE;
+  uint32_t first = 0U;
+  uint32_t index = 0U;
+
+  for ( group=0U; group<( FLASH_GROUPS - 1U ); group++ )
+  {
+    if ( ( adr - start ) < ( flashGroup[group].sectors * flashGroup[group].size ) )
+    {
+      break;
+    }
+    start += flashGroup[group].sectors * flashGroup[group].size;
+    first += flashGroup[group].sectors;
+  }
+  index = ( adr - start ) / flashGroup[group].size;
+  if ( index >= flashGroup[group].sectors )
+  {
+    index = flashGroup[group].sectors - 1U;
+  }
+  sector->number  = first + index;
+  sector->address = start + ( index * flashGroup[group].size );
+  sector->size    = flashGroup[group].size;
+  sector->group   = group;
+}
+
+/**
+  * @brief  Check that the whole sector is erased.
+  *         Four words are combined per step and the scan stops at the
+  *         first programmed word.
+  * @param  sector: The sector.
+  * @retval 1 if the sector is blank, 0 else.
+  */
+static uint8_t MEM_If_IsBlank( const MEM_If_SectorTypeDef* sector )
+{
+  const uint32_t* adr = ( const uint32_t* )sector->address;
+  const uint32_t* end = adr + ( sector->size / 4U );
+
+  while ( adr < end )
+  {
+    if ( ( adr[0U] & adr[1U] & adr[2U] & adr[3U] ) != 0xFFFFFFFFU )
+    {
+      return 0U;
+    }
+    adr += 4U;
+  }
+  return 1U;
+}
+
+/**
+  * @brief  Run the stages of a write pipeline on a buffer.
+  * @param  pipe: The pipeline.
+  * @param  buf: The buffer, returned as the stages narrowed it.
+  * @retval USBD_OK once every stage is done, USBD_BUSY while a stage is busy
+  *         and the call is to be repeated, USBD_FAIL else.
+  */
+RAM_FUNC static USBD_StatusTypeDef MEM_If_RunPipe( MEM_If_PipeTypeDef* pipe, MEM_If_BufferTypeDef* buf )
+{
+  USBD_StatusTypeDef   res     = USBD_OK;
+  MEM_If_StageTypeDef* stage   = NULL;
+  #if ( WRITE_CYCLES_ENB > 0U )
+    uint32_t           start   = 0U;
+    uint32_t           before  = 0U;
+    uint32_t           elapsed = 0U;
+  #endif
+
+  if ( ( pipe->next == 0U ) || ( pipe->key != buf->adr ) )
+  {
+    pipe->next = 0U;
+    pipe->key  = buf->adr;
+    pipe->buf  = *buf;
+  }
+  while ( ( res == USBD_OK ) && ( pipe->next < pipe->count ) && ( pipe->buf.length != 0U ) )
+  {
+    stage = pipe->stage[pipe->next];
+    #if ( WRITE_CYCLES_ENB > 0U )
+      before = writeCycles;
+      start  = DWT->CYCCNT;
+    #endif
+    res = stage->run( &pipe->buf );
+    #if ( WRITE_CYCLES_ENB > 0U )
+      elapsed        = DWT->CYCCNT - start;
+      stage->cycles += elapsed - ( writeCycles - before );
+      writeCycles    = before + elapsed;
+    #endif
+    stage->calls++;
+    if ( res == USBD_OK )
+    {
+      pipe->next++;
+    }
+  }
+  *buf = pipe->buf;
+  if ( res != USBD_BUSY )
+  {
+    pipe->next = 0U;
+  }
+  return res;
+}
+
+#if defined( ENCRYPTION )
+/**
+  * @brief  Write stage: decrypt the part in place.
+  * @param  buf: The part, the AES-CTR counter follows from the nonce of the
+  *         image descriptor and the address of the part.
+  * @retval USBD_OK.
+  */
+static USBD_StatusTypeDef MEM_If_Decrypt( MEM_If_BufferTypeDef* buf )
+{
+  #if ( ENCRYPTION_CTR > 0U )
+    USBD_DFU_HandleTypeDef* hdfu                  = ( USBD_DFU_HandleTypeDef* )hUsbDeviceFS.pClassData;
+    uint8_t                 counter[AES_BLOCKLEN] = { 0U };
+
+    /* A new nonce for every image: the same address of two images never shares a keystream.
+       Every block is decrypted on its own, a block sent again is decrypted the same way */
+    memcpy( counter, &hdfu->info[USBD_DFU_INFO_SIZE - USBD_DFU_NONCE_SIZE], USBD_DFU_NONCE_SIZE );
+    AES_ctx_set_iv( &ctx, counter );
+    AES_CTR_xcrypt_offset( &ctx, buf->data, buf->length, ( buf->adr - FLASH_BASE ) );
+  #else
+    AES_CBC_decrypt_buffer( &ctx, buf->data, buf->length );
+  #endif
+  return ( USBD_OK );
+}
+#endif
+
+/**
+  * @brief  Write stage: keep the part to the application flash. The words
+  *         over the bootloader are left out, the image descriptor is revoked
+  *         before the first change of the flash.
+  * @param  buf: The part, narrowed to the application.
+  * @retval USBD_OK, USBD_BUSY while the log sector is erased, USBD_FAIL if
+  *         nothing is left or the part runs past the image area.
+  */
+static USBD_StatusTypeDef MEM_If_Clip( MEM_If_BufferTypeDef* buf )
+{
+  uint32_t offset = 0U;
+
+  if ( buf->adr <= BOOTLADER_SIZE )
+  {
+    offset = ( ( BOOTLADER_SIZE - buf->adr ) & ~3U ) + 4U;
+    if ( offset >= buf->length )
+    {
+      return ( USBD_FAIL );
+    }
+    buf->data   += offset;
+    buf->adr    += offset;
+    buf->length -= offset;
+  }
+  #if IMAGE_LOG_ENB
+    if ( ( buf->adr + buf->length ) > IMAGE_MARKER_ADDRESS )
+    {
+      return ( USBD_FAIL );
+    }
+    return ( MEM_If_Revoke() );
+  #else
+    if ( ( buf->adr + buf->length ) > ( FLASH_END + 1U ) )
+    {
+      return ( USBD_FAIL );
+    }
+    return ( USBD_OK );
+  #endif
+}
+
+/**
+  * @brief  Write stage: erase the sectors of the part that are not erased in
+  *         this session.
+  * @param  buf: The part.
+  * @retval USBD_OK if the whole part is ready for programming, USBD_BUSY
+  *         while a sector is erased, USBD_FAIL else.
+  */
+RAM_FUNC static USBD_StatusTypeDef MEM_If_Prepare( MEM_If_BufferTypeDef* buf )
+{
+  USBD_StatusTypeDef   res = USBD_OK;
+  uint32_t             adr = buf->adr;
+  uint32_t             end = buf->adr + buf->length;
+  MEM_If_SectorTypeDef sector;
+
+  while ( ( adr < end ) && ( res == USBD_OK ) )
+  {
+    MEM_If_GetSector( adr, &sector );
+    if ( ( erased & ( 1U << sector.number ) ) == 0U )
+    {
+      res = ( USBD_StatusTypeDef )MEM_If_Erase_FS( sector.address );
+    }
+    adr = sector.address + sector.size;
+  }
+  return res;
+}
+
+#if ( FLASH_SKIP_ERASED_ENB > 0U )
+/**
+  * @brief  Write stage: leave out the erased words at both ends of the part,
+  *         the flash under them is erased already. A part of erased words
+  *         only, as the gaps of an image, is not programmed at all.
+  * @param  buf: The part, narrowed to its first and last programmed word.
+  * @retval USBD_OK.
+  */
+static USBD_StatusTypeDef MEM_If_SkipErased( MEM_If_BufferTypeDef* buf )
+{
+  const uint32_t* word  = ( const uint32_t* )buf->data;
+  uint32_t        first = 0U;
+  uint32_t        end   = buf->length / 4U;
+
+  while ( ( first < end ) && ( word[first] == 0xFFFFFFFFU ) )
+  {
+    first++;
+  }
+  /* A part that ends inside a word keeps its end */
+  if ( ( buf->length & 3U ) == 0U )
+  {
+    while ( ( end > first ) && ( word[end - 1U] == 0xFFFFFFFFU ) )
+    {
+      end--;
+    }
+    buf->length = end * 4U;
+  }
+  buf->data   += first * 4U;
+  buf->adr    += first * 4U;
+  buf->length -= first * 4U;
+  return ( USBD_OK );
+}
+#endif
+
+/**
+  * @brief  Write stage: program the erased part, by the FLASH interrupt or
+  *         in one pass.
+  * @param  buf: Word aligned part, kept until it is programmed.
+  * @retval USBD_OK if the part is programmed, USBD_BUSY while the FLASH
+  *         interrupt programs it and the call is to be repeated, USBD_FAIL else.
+  */
+RAM_FUNC static USBD_StatusTypeDef MEM_If_Store( MEM_If_BufferTypeDef* buf )
+{
+  #if ( FLASH_ASYNC_ENB > 0U )
+    if ( ( asyncState != ASYNC_IDLE ) && ( asyncCmd == DFU_MEDIA_PROGRAM ) && ( asyncAdr == buf->adr ) )
+    {
+      return ( MEM_If_ProgramNext() );
+    }
+    ( void )MEM_If_SetBusy( buf->adr, DFU_MEDIA_PROGRAM );
+    asyncCmd   = DFU_MEDIA_PROGRAM;
+    asyncAdr   = buf->adr;
+    asyncNext  = buf->adr;
+    asyncEnd   = buf->adr + buf->length;
+    asyncData  = ( const uint32_t* )buf->data;
+    asyncState = ASYNC_START;
+    return ( MEM_If_ProgramNext() );
+  #else
+    USBD_StatusTypeDef result = USBD_FAIL;
+    uint32_t           start  = MEM_If_SetBusy( buf->adr, DFU_MEDIA_PROGRAM );
+    uint32_t           time   = 0U;
+
+    if ( MEM_If_Program( buf->adr, ( const uint32_t* )buf->data, buf->length ) == HAL_OK )
+    {
+      /* The tick is too coarse for short writes */
+      time = HAL_GetTick() - start;
+      if ( time > 0U )
+      {
+        wordTime = CALIBRATE( wordTime, ( ( time * 1000U * FLASH_PSIZE_BYTES ) / buf->length ) );
+      }
+      result = USBD_OK;
+    }
+    busy = 0U;
+    return result;
+  #endif
+}
+
+#if ( IMAGE_LZ4_ENB > 0U )
+/**
+  * @brief  Write stage: decompress a block of the compressed image into the
+  *         flash. The blocks from IMAGE_LZ4_ADDRESS on, in address order, are
+  *         one LZ4 block of the image for APP_ADDRESS; a block to
+  *         IMAGE_LZ4_ADDRESS starts the stream again. The block is decoded
+  *         into the stage, which is programmed by lzOutPipe whenever it is
+  *         full. The stage is run again meanwhile and goes on from lzPos.
+  * @param  buf: The decrypted block in the compressed window.
+  * @retval USBD_OK once the block is decoded, USBD_BUSY while a sector is
+  *         erased or the stage programmed, USBD_FAIL else.
+  */
+RAM_FUNC static USBD_StatusTypeDef MEM_If_Decompress( MEM_If_BufferTypeDef* buf )
+{
+  USBD_StatusTypeDef res = USBD_OK;
+
+  if ( lzBlock != buf->adr )
+  {
+    if ( buf->adr == IMAGE_LZ4_ADDRESS )
+    {
+      LZ4_init( &lz, ( uint8_t* )lzStage, IMAGE_LZ4_STAGE, APP_ADDRESS );
+      lzNext = buf->adr;
+    }
+    if ( buf->adr != lzNext )
+    {
+      return ( USBD_FAIL );
+    }
+    lzOut   = lz.out;
+    lzBlock = buf->adr;
+    lzPos   = 0U;
+  }
+  while ( res == USBD_OK )
+  {
+    if ( lz.length == lz.size )
+    {
+      res = MEM_If_FlushLz4();
+    }
+    else if ( ( lzPos < buf->length ) || ( lz.state == LZ4_MATCH ) )
+    {
+      lzPos += LZ4_decode( &lz, &buf->data[lzPos], ( buf->length - lzPos ) );
+      if ( lz.state == LZ4_ERROR )
+      {
+        res = USBD_FAIL;
+      }
+    }
+    else
+    {
+      break;
+    }
+  }
+  if ( res != USBD_BUSY )
+  {
+    lzBlock = 0U;
+    lzNext  = ( res == USBD_OK ) ? ( buf->adr + buf->length ) : 0U;
+  }
+  return res;
+}
+
+/**
+  * @brief  Program the stage at its output address. The last one of the
+  *         image is padded to a word with erased bytes.
+  * @retval USBD_OK once the stage is programmed and empty, USBD_BUSY while
+  *         a sector is erased or the stage programmed, USBD_FAIL else.
+  */
+RAM_FUNC static USBD_StatusTypeDef MEM_If_FlushLz4( void )
+{
+  USBD_StatusTypeDef   res = USBD_OK;
+  MEM_If_BufferTypeDef buf = { lz.stage, lz.out, ( ( lz.length + 3U ) & ~3U ) };
+
+  if ( buf.length != 0U )
+  {
+    memset( &lz.stage[lz.length], 0xFF, ( buf.length - lz.length ) );
+    res = MEM_If_RunPipe( &lzOutPipe, &buf );
+  }
+  if ( res == USBD_OK )
+  {
+    LZ4_stored( &lz );
+  }
+  return res;
+}
+#endif
+
+#if ( FLASH_ASYNC_ENB > 0U )
+/**
+  * @brief  Continue the block programmed by the FLASH interrupt.
+  *         One word is started per call, the end of operation interrupt
+  *         marks it ready and the DFU job is run again for the next one.
+  * @retval USBD_BUSY while words are left, USBD_OK when the whole block is
+  *         programmed, USBD_FAIL else.
+  */
+RAM_FUNC static USBD_StatusTypeDef MEM_If_ProgramNext( void )
+{
+  USBD_StatusTypeDef result = USBD_BUSY;
+  uint32_t           time   = 0U;
+
+  if ( asyncState == ASYNC_READY )
+  {
+    #if ( IMAGE_CRC_ENB == 0U )
+      if ( *( __IO uint32_t* )asyncNext != *asyncData )
+      {
+        asyncState = ASYNC_ERROR;
+      }
+    #endif
+    asyncNext += 4U;
+    asyncData++;
+  }
+  if ( asyncState == ASYNC_ERROR )
+  {
+    result = USBD_FAIL;
+  }
+  else if ( asyncState == ASYNC_BUSY )
+  {
+    return ( USBD_BUSY );
+  }
+  else if ( asyncNext >= asyncEnd )
+  {
+    /* The tick is too coarse for short writes */
+    time = HAL_GetTick() - busyStart;
+    if ( time > 0U )
+    {
+      wordTime = CALIBRATE( wordTime, ( ( time * 1000U * FLASH_PSIZE_BYTES ) / ( asyncEnd - asyncAdr ) ) );
+    }
+    result = USBD_OK;
+  }
+  else
+  {
+    asyncState = ASYNC_BUSY;
+    if ( HAL_FLASH_Program_IT( FLASH_TYPEPROGRAM_WORD, asyncNext, *asyncData ) == HAL_OK )
+    {
+      return ( USBD_BUSY );
+    }
+    result = USBD_FAIL;
+  }
+  asyncState = ASYNC_IDLE;
+  busy       = 0U;
+  return result;
+}
+
+/**
+  * @brief  FLASH end of operation callback: the word or the sector is done.
+  * @param  ReturnValue: Programmed address, 0xFFFFFFFF at the end of an erase.
+  * @retval None.
+  */
+RAM_FUNC void HAL_FLASH_EndOfOperationCallback( uint32_t ReturnValue )
+{
+  if ( ( asyncState == ASYNC_BUSY ) && ( ( asyncCmd == DFU_MEDIA_PROGRAM ) || ( ReturnValue == 0xFFFFFFFFU ) ) )
+  {
+    asyncState = ASYNC_READY;
+  }
+}
+
+/**
+  * @brief  FLASH error callback.
+  * @param  ReturnValue: Faulty address or sector.
+  * @retval None.
+  */
+RAM_FUNC void HAL_FLASH_OperationErrorCallback( uint32_t ReturnValue )
+{
+  UNUSED( ReturnValue );
+  if ( asyncState != ASYNC_IDLE )
+  {
+    asyncState = ASYNC_ERROR;
+  }
+}
+
+#else
+/**
+  * @brief  Program a block of words into the flash.
+  *         PG and PSIZE are set once for the whole block and the words are
+  *         streamed with a single BSY wait each. Without the CRC check of the
+  *         whole image on manifestation the block is verified with one read
+  *         back pass after the programming.
+  * @param  adr: Word aligned flash address.
+  * @param  data: Pointer to the source words.
+  * @param  length: Number of bytes to be written.
+  * @retval HAL_OK if the block is programmed and verified, HAL_ERROR else.
+  */
+RAM_FUNC static HAL_StatusTypeDef MEM_If_Program( uint32_t adr, const uint32_t* data, uint32_t length )
+{
+  HAL_StatusTypeDef status = HAL_ERROR;
+  __IO uint32_t*    dest   = ( __IO uint32_t* )adr;
+  uint32_t          words  = ( length + 3U ) / 4U;
+  uint32_t          i      = 0U;
+  uint32_t          sr     = 0U;
+
+  if ( FLASH_WaitForLastOperation( FLASH_PROGRAM_TIMEOUT ) == HAL_OK )
+  {
+    __HAL_FLASH_CLEAR_FLAG( FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR |
+                            FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR );
+    FLASH->CR &= CR_PSIZE_MASK;
+    FLASH->CR |= FLASH_PSIZE_WORD | FLASH_CR_PG;
+    for ( i=0U; i<words; i++ )
+    {
+      dest[i] = data[i];
+      do
+      {
+        sr = FLASH->SR;
+      } while ( ( sr & FLASH_SR_BSY ) != 0U );
+      if ( ( sr & FLASH_PROGRAM_ERRORS ) != 0U )
+      {
+        break;
+      }
+    }
+    FLASH->CR &= ~FLASH_CR_PG;
+    if ( i == words )
+    {
+      status = HAL_OK;
+      #if ( IMAGE_CRC_ENB == 0U )
+        for ( i=0U; i<words; i++ )
+        {
+          if ( dest[i] != data[i] )
+          {
+            status = HAL_ERROR;
+            break;
+          }
+        }
+      #endif
+    }
+  }
+  return status;
+}
+#endif
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
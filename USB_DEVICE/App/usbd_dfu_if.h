@@ -51,7 +51,46 @@
 /* USER CODE BEGIN EXPORTED_DEFINES */
 #define BOOTLADER_SIZE 	0x08007FFFU
 #define APP_ADDRESS    	0x08008000U
-#define READING_ENB     0U
+/* Flash geometry, sector groups in address order: G( sectors, KB, typical x32 erase time in ms ).
+   The bootloader groups come first, another STM32F2/F4 density only changes these two lists */
+#define FLASH_BOOT_GEOMETRY( G )        G( 2, 16, 250U )
+#define FLASH_APP_GEOMETRY( G1, G )     G1( 2, 16, 250U ) G( 1, 64, 550U ) G( 7, 128, 1000U )
+#ifndef READING_ENB
+#define READING_ENB     0U  /* UPLOAD of the flash, can be set by the build */
+#endif /* READING_ENB */
+#define READING_COPY    0U  /* UPLOAD: 0 - sent straight from the flash, 1 - copied to the transfer buffer */
+#ifndef READING_ENCRYPT
+#define READING_ENCRYPT 1U  /* UPLOAD encrypted with the read-out key and the nonce of a DFU_CMD_SESSION */
+#endif /* READING_ENCRYPT */
+#define READING_POLICY  1U  /* UPLOAD limited to the application and the image log, never the bootloader */
+#define ENCRYPTION_CTR  1U  /* Image cipher: 1 - AES-CTR, counter block: descriptor nonce, then big endian (address - FLASH_BASE) / 16; 0 - AES-CBC */
+#define IMAGE_AUTH_ENB  1U  /* Boot only an image whose AES-CMAC of the descriptor and the flash was verified at download */
+#define IMAGE_CRC_ENB   1U  /* Log only an image that matches the CRC32 of its descriptor at manifestation */
+#ifndef IMAGE_BOOT_CRC_ENB
+#define IMAGE_BOOT_CRC_ENB 0U  /* Boot check: 1 - the CRC32 of the whole image on every reset as well, 0 - the valid descriptor only */
+#endif /* IMAGE_BOOT_CRC_ENB */
+#ifndef FLASH_ASYNC_ENB
+#define FLASH_ASYNC_ENB 1U  /* Erase and program driven by the FLASH interrupt, the jobs return USBD_BUSY meanwhile */
+#endif /* FLASH_ASYNC_ENB */
+#define IMAGE_MARKER_ADDRESS 0x080FFC00U  /* Image descriptor log, the last 1 KB of the flash is not for the image */
+#define IMAGE_MARKER_END     0x08100000U
+#ifndef IMAGE_LZ4_ENB
+#define IMAGE_LZ4_ENB   1U  /* DNLOAD to IMAGE_LZ4_ADDRESS: the image as one LZ4 block, decompressed to APP_ADDRESS */
+#endif /* IMAGE_LZ4_ENB */
+#define IMAGE_LZ4_ADDRESS    0x90000000U  /* Download window of the compressed image, not a memory of the device */
+#define IMAGE_LZ4_STAGE      1024U        /* Bytes of decompressed output collected in RAM per programming */
+#ifndef FLASH_SKIP_ERASED_ENB
+#define FLASH_SKIP_ERASED_ENB 1U  /* Erased words at the ends of a written part are left to the erase, not programmed */
+#endif /* FLASH_SKIP_ERASED_ENB */
+#ifndef WRITE_CYCLES_ENB
+#define WRITE_CYCLES_ENB 1U  /* DWT cycles spent in every stage of the write pipeline, for the debugger */
+#endif /* WRITE_CYCLES_ENB */
+#if ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION ) && ( ENCRYPTION_CTR == 0U )
+  #error "READING_ENCRYPT needs the AES-CTR image cipher"
+#endif
+#if ( IMAGE_LZ4_ENB > 0U ) && defined( ENCRYPTION ) && ( ENCRYPTION_CTR == 0U )
+  #error "IMAGE_LZ4_ENB needs the AES-CTR image cipher, the compressed stream is not padded to AES blocks"
+#endif
 /* USER CODE END EXPORTED_DEFINES */
 
 /**
@@ -64,6 +103,14 @@
   */
 
 /* USER CODE BEGIN EXPORTED_TYPES */
+/* Image descriptor, one per manifested download in the log at IMAGE_MARKER_ADDRESS */
+typedef struct
+{
+  uint32_t length;   /* Bytes of the image from APP_ADDRESS, multiple of 4 */
+  uint32_t crc;      /* CRC32 of the image as computed by the CRC unit */
+  uint32_t version;
+  uint32_t marker;   /* IMAGE_MARKER_VALID once verified, 0 when revoked */
+} IMAGE_InfoTypeDef;
 
 /* USER CODE END EXPORTED_TYPES */
 
@@ -77,7 +124,7 @@
   */
 
 /* USER CODE BEGIN EXPORTED_MACRO */
-#define GET_SECTOR( adr )	 ( ( adr < 0x08003FFFU )?FLASH_SECTOR_0:( ( adr < 0x08007FFFU )?FLASH_SECTOR_1:( ( adr < 0x0800BFFFU )?FLASH_SECTOR_2:( ( adr < 0x0800FFFFU )?FLASH_SECTOR_3:( ( adr < 0x0801FFFFU )?FLASH_SECTOR_4:( ( adr < 0x0803FFFFU )?FLASH_SECTOR_5:( ( adr < 0x0805FFFFU )?FLASH_SECTOR_6:( ( adr < 0x0807FFFFU )?FLASH_SECTOR_7:( ( adr < 0x0809FFFFU )?FLASH_SECTOR_8:( ( adr < 0x080BFFFFU )?FLASH_SECTOR_9:( ( adr < 0x080DFFFFU )?FLASH_SECTOR_10:FLASH_SECTOR_11 ) ) ) ) ) ) ) ) ) ) )
+
 /* USER CODE END EXPORTED_MACRO */
 
 /**
@@ -106,6 +153,8 @@ extern USBD_DFU_MediaTypeDef USBD_DFU_fops_FS;
   */
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+uint8_t MEM_If_IsImageValid( void );
+uint8_t MEM_If_VerifyProgress( void );
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 
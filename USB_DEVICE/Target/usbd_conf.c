@@ -26,6 +26,7 @@
 #include "usbd_core.h"
 
 /* USER CODE BEGIN Includes */
+#include "usbd_dfu.h"
 
 /* USER CODE END Includes */
 
@@ -35,6 +36,12 @@
 
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
+/* Class data pool: one block per class instance, sized for the DFU handle */
+#define USBD_POOL_BLOCKS       USBD_DFU_MAX_ITF_NUM
+#define USBD_POOL_BLOCK_WORDS  ( ( sizeof( USBD_DFU_HandleTypeDef ) + 3U ) / 4U )
+
+static uint32_t usbdPool[USBD_POOL_BLOCKS][USBD_POOL_BLOCK_WORDS];  /* On 32-bit boundary */
+static uint8_t  usbdPoolUsed[USBD_POOL_BLOCKS];
 
 /* USER CODE END PV */
 
@@ -57,7 +64,48 @@ USBD_StatusTypeDef USBD_Get_USB_Status(HAL_StatusTypeDef hal_status);
 /* Private functions ---------------------------------------------------------*/
 
 /* USER CODE BEGIN 1 */
+/**
+  * @brief  Static single-size allocator for the USB class data.
+  *         Replaces the heap: the pool is sized at compile time and placed
+  *         in .bss, so its RAM is accounted at link time.
+  * @param  size: Size of the block
+  * @retval Pointer to the block, NULL if it is too large or the pool is used up
+  */
+void *USBD_static_malloc(uint32_t size)
+{
+  uint32_t i;
+
+  if (size <= sizeof(usbdPool[0]))
+  {
+    for (i = 0U; i < USBD_POOL_BLOCKS; i++)
+    {
+      if (usbdPoolUsed[i] == 0U)
+      {
+        usbdPoolUsed[i] = 1U;
+        return usbdPool[i];
+      }
+    }
+  }
+  return NULL;
+}
 
+/**
+  * @brief  Release a block of the class data pool.
+  * @param  p: Block returned by USBD_static_malloc
+  * @retval None
+  */
+void USBD_static_free(void *p)
+{
+  uint32_t i;
+
+  for (i = 0U; i < USBD_POOL_BLOCKS; i++)
+  {
+    if (p == usbdPool[i])
+    {
+      usbdPoolUsed[i] = 0U;
+    }
+  }
+}
 /* USER CODE END 1 */
 
 /*******************************************************************************
@@ -12,21 +12,29 @@
 // The #ifndef-guard allows it to be configured before #include'ing or at compile time.
 #define CBC            1U    /* Cipher Block Chaining  */
 #define ECB            0U    /* Electronic Codebook */
-#define CTR 	       0U    /* Counter mode */
+#define CTR 	       1U    /* Counter mode */
+#define CMAC           1U    /* AES-CMAC message authentication (RFC 4493) */
 #define AES128         1U
+#define AES_TTABLE     1U    /* Cipher and InvCipher on 1 KB 32-bit T-tables instead of the byte-wise rounds */
 #define AES_BLOCKLEN   16U   /* Block length in bytes - AES is 128b block only */
 #define AES_KEYLEN     16U   /* Key length in bytes */
 #define AES_keyExpSize 176U
+#define AES_decKeySize 36U   /* Words of the decryption keys of the T-table backend, rounds 1..9 */
 
 struct AES_ctx
 {
   uint8_t RoundKey[AES_keyExpSize];
+#if defined(AES_TTABLE) && (AES_TTABLE == 1U) && ((defined(CBC) && (CBC == 1)) || (defined(ECB) && (ECB == 1)))
+  uint32_t DecKey[AES_decKeySize];  /* InvMixColumns of the round keys, set with the key */
+#endif
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
   uint8_t Iv[AES_BLOCKLEN];
 #endif
 };
 
 void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key);
+// Key setup of a context that only encrypts (CTR, CMAC): DecKey is not computed
+void AES_init_ctx_enc(struct AES_ctx* ctx, const uint8_t* key);
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
 void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv);
 void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv);
@@ -62,7 +70,29 @@ void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
 //        no IV should ever be reused with the same key
 void AES_CTR_xcrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
 
+// Random access variant: the counter of the first byte is IV + offset / AES_BLOCKLEN,
+// the IV in ctx is not changed. Buffers at any offset can be processed in any order.
+void AES_CTR_xcrypt_offset(const struct AES_ctx* ctx, uint8_t* buf, uint32_t length, uint32_t offset);
+
 #endif // #if defined(CTR) && (CTR == 1)
 
 
+#if defined(CMAC) && (CMAC == 1)
+
+// Streaming AES-CMAC. The context only needs AES_init_ctx_enc() with the MAC key,
+// the message can be passed to AES_CMAC_update() in pieces of any length.
+struct AES_cmac
+{
+  uint8_t X[AES_BLOCKLEN];  // Chaining value
+  uint8_t M[AES_BLOCKLEN];  // Last block, held back until more data or the final call
+  uint8_t n;                // Bytes in M
+};
+
+void AES_CMAC_init(struct AES_cmac* cm);
+void AES_CMAC_update(struct AES_cmac* cm, const struct AES_ctx* ctx, const uint8_t* buf, uint32_t length);
+void AES_CMAC_final(struct AES_cmac* cm, const struct AES_ctx* ctx, uint8_t* tag);
+
+#endif // #if defined(CMAC) && (CMAC == 1)
+
+
 #endif // _AES_H_
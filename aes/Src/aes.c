@@ -96,6 +96,80 @@ static const uint8_t rsbox[256U] = {
   0x60U, 0x51U, 0x7FU, 0xA9U, 0x19U, 0xB5U, 0x4AU, 0x0DU, 0x2DU, 0xE5U, 0x7AU, 0x9FU, 0x93U, 0xC9U, 0x9CU, 0xEFU,
   0xA0U, 0xE0U, 0x3BU, 0x4DU, 0xAEU, 0x2AU, 0xF5U, 0xB0U, 0xC8U, 0xEBU, 0xBBU, 0x3CU, 0x83U, 0x53U, 0x99U, 0x61U,
   0x17U, 0x2BU, 0x04U, 0x7EU, 0xBAU, 0x77U, 0xD6U, 0x26U, 0xE1U, 0x69U, 0x14U, 0x63U, 0x55U, 0x21U, 0x0CU, 0x7DU };
+#if defined(AES_TTABLE) && (AES_TTABLE == 1U)
+// Forward T-table: SubBytes and the first column of MixColumns in one lookup,
+// Te0[x] = { 02*sbox[x], sbox[x], sbox[x], 03*sbox[x] } (little endian).
+// The other columns are byte rotations of it.
+static const uint32_t Te0[256U] = {
+  0xA56363C6U, 0x847C7CF8U, 0x997777EEU, 0x8D7B7BF6U, 0x0DF2F2FFU, 0xBD6B6BD6U, 0xB16F6FDEU, 0x54C5C591U,
+  0x50303060U, 0x03010102U, 0xA96767CEU, 0x7D2B2B56U, 0x19FEFEE7U, 0x62D7D7B5U, 0xE6ABAB4DU, 0x9A7676ECU,
+  0x45CACA8FU, 0x9D82821FU, 0x40C9C989U, 0x877D7DFAU, 0x15FAFAEFU, 0xEB5959B2U, 0xC947478EU, 0x0BF0F0FBU,
+  0xECADAD41U, 0x67D4D4B3U, 0xFDA2A25FU, 0xEAAFAF45U, 0xBF9C9C23U, 0xF7A4A453U, 0x967272E4U, 0x5BC0C09BU,
+  0xC2B7B775U, 0x1CFDFDE1U, 0xAE93933DU, 0x6A26264CU, 0x5A36366CU, 0x413F3F7EU, 0x02F7F7F5U, 0x4FCCCC83U,
+  0x5C343468U, 0xF4A5A551U, 0x34E5E5D1U, 0x08F1F1F9U, 0x937171E2U, 0x73D8D8ABU, 0x53313162U, 0x3F15152AU,
+  0x0C040408U, 0x52C7C795U, 0x65232346U, 0x5EC3C39DU, 0x28181830U, 0xA1969637U, 0x0F05050AU, 0xB59A9A2FU,
+  0x0907070EU, 0x36121224U, 0x9B80801BU, 0x3DE2E2DFU, 0x26EBEBCDU, 0x6927274EU, 0xCDB2B27FU, 0x9F7575EAU,
+  0x1B090912U, 0x9E83831DU, 0x742C2C58U, 0x2E1A1A34U, 0x2D1B1B36U, 0xB26E6EDCU, 0xEE5A5AB4U, 0xFBA0A05BU,
+  0xF65252A4U, 0x4D3B3B76U, 0x61D6D6B7U, 0xCEB3B37DU, 0x7B292952U, 0x3EE3E3DDU, 0x712F2F5EU, 0x97848413U,
+  0xF55353A6U, 0x68D1D1B9U, 0x00000000U, 0x2CEDEDC1U, 0x60202040U, 0x1FFCFCE3U, 0xC8B1B179U, 0xED5B5BB6U,
+  0xBE6A6AD4U, 0x46CBCB8DU, 0xD9BEBE67U, 0x4B393972U, 0xDE4A4A94U, 0xD44C4C98U, 0xE85858B0U, 0x4ACFCF85U,
+  0x6BD0D0BBU, 0x2AEFEFC5U, 0xE5AAAA4FU, 0x16FBFBEDU, 0xC5434386U, 0xD74D4D9AU, 0x55333366U, 0x94858511U,
+  0xCF45458AU, 0x10F9F9E9U, 0x06020204U, 0x817F7FFEU, 0xF05050A0U, 0x443C3C78U, 0xBA9F9F25U, 0xE3A8A84BU,
+  0xF35151A2U, 0xFEA3A35DU, 0xC0404080U, 0x8A8F8F05U, 0xAD92923FU, 0xBC9D9D21U, 0x48383870U, 0x04F5F5F1U,
+  0xDFBCBC63U, 0xC1B6B677U, 0x75DADAAFU, 0x63212142U, 0x30101020U, 0x1AFFFFE5U, 0x0EF3F3FDU, 0x6DD2D2BFU,
+  0x4CCDCD81U, 0x140C0C18U, 0x35131326U, 0x2FECECC3U, 0xE15F5FBEU, 0xA2979735U, 0xCC444488U, 0x3917172EU,
+  0x57C4C493U, 0xF2A7A755U, 0x827E7EFCU, 0x473D3D7AU, 0xAC6464C8U, 0xE75D5DBAU, 0x2B191932U, 0x957373E6U,
+  0xA06060C0U, 0x98818119U, 0xD14F4F9EU, 0x7FDCDCA3U, 0x66222244U, 0x7E2A2A54U, 0xAB90903BU, 0x8388880BU,
+  0xCA46468CU, 0x29EEEEC7U, 0xD3B8B86BU, 0x3C141428U, 0x79DEDEA7U, 0xE25E5EBCU, 0x1D0B0B16U, 0x76DBDBADU,
+  0x3BE0E0DBU, 0x56323264U, 0x4E3A3A74U, 0x1E0A0A14U, 0xDB494992U, 0x0A06060CU, 0x6C242448U, 0xE45C5CB8U,
+  0x5DC2C29FU, 0x6ED3D3BDU, 0xEFACAC43U, 0xA66262C4U, 0xA8919139U, 0xA4959531U, 0x37E4E4D3U, 0x8B7979F2U,
+  0x32E7E7D5U, 0x43C8C88BU, 0x5937376EU, 0xB76D6DDAU, 0x8C8D8D01U, 0x64D5D5B1U, 0xD24E4E9CU, 0xE0A9A949U,
+  0xB46C6CD8U, 0xFA5656ACU, 0x07F4F4F3U, 0x25EAEACFU, 0xAF6565CAU, 0x8E7A7AF4U, 0xE9AEAE47U, 0x18080810U,
+  0xD5BABA6FU, 0x887878F0U, 0x6F25254AU, 0x722E2E5CU, 0x241C1C38U, 0xF1A6A657U, 0xC7B4B473U, 0x51C6C697U,
+  0x23E8E8CBU, 0x7CDDDDA1U, 0x9C7474E8U, 0x211F1F3EU, 0xDD4B4B96U, 0xDCBDBD61U, 0x868B8B0DU, 0x858A8A0FU,
+  0x907070E0U, 0x423E3E7CU, 0xC4B5B571U, 0xAA6666CCU, 0xD8484890U, 0x05030306U, 0x01F6F6F7U, 0x120E0E1CU,
+  0xA36161C2U, 0x5F35356AU, 0xF95757AEU, 0xD0B9B969U, 0x91868617U, 0x58C1C199U, 0x271D1D3AU, 0xB99E9E27U,
+  0x38E1E1D9U, 0x13F8F8EBU, 0xB398982BU, 0x33111122U, 0xBB6969D2U, 0x70D9D9A9U, 0x898E8E07U, 0xA7949433U,
+  0xB69B9B2DU, 0x221E1E3CU, 0x92878715U, 0x20E9E9C9U, 0x49CECE87U, 0xFF5555AAU, 0x78282850U, 0x7ADFDFA5U,
+  0x8F8C8C03U, 0xF8A1A159U, 0x80898909U, 0x170D0D1AU, 0xDABFBF65U, 0x31E6E6D7U, 0xC6424284U, 0xB86868D0U,
+  0xC3414182U, 0xB0999929U, 0x772D2D5AU, 0x110F0F1EU, 0xCBB0B07BU, 0xFC5454A8U, 0xD6BBBB6DU, 0x3A16162CU };
+// Inverse T-table: InvSubBytes and the first column of InvMixColumns in one lookup,
+// Td0[x] = { 0e*rsbox[x], 09*rsbox[x], 0d*rsbox[x], 0b*rsbox[x] } (little endian).
+// The other columns are byte rotations of it.
+static const uint32_t Td0[256U] = {
+  0x50A7F451U, 0x5365417EU, 0xC3A4171AU, 0x965E273AU, 0xCB6BAB3BU, 0xF1459D1FU, 0xAB58FAACU, 0x9303E34BU,
+  0x55FA3020U, 0xF66D76ADU, 0x9176CC88U, 0x254C02F5U, 0xFCD7E54FU, 0xD7CB2AC5U, 0x80443526U, 0x8FA362B5U,
+  0x495AB1DEU, 0x671BBA25U, 0x980EEA45U, 0xE1C0FE5DU, 0x02752FC3U, 0x12F04C81U, 0xA397468DU, 0xC6F9D36BU,
+  0xE75F8F03U, 0x959C9215U, 0xEB7A6DBFU, 0xDA595295U, 0x2D83BED4U, 0xD3217458U, 0x2969E049U, 0x44C8C98EU,
+  0x6A89C275U, 0x78798EF4U, 0x6B3E5899U, 0xDD71B927U, 0xB64FE1BEU, 0x17AD88F0U, 0x66AC20C9U, 0xB43ACE7DU,
+  0x184ADF63U, 0x82311AE5U, 0x60335197U, 0x457F5362U, 0xE07764B1U, 0x84AE6BBBU, 0x1CA081FEU, 0x942B08F9U,
+  0x58684870U, 0x19FD458FU, 0x876CDE94U, 0xB7F87B52U, 0x23D373ABU, 0xE2024B72U, 0x578F1FE3U, 0x2AAB5566U,
+  0x0728EBB2U, 0x03C2B52FU, 0x9A7BC586U, 0xA50837D3U, 0xF2872830U, 0xB2A5BF23U, 0xBA6A0302U, 0x5C8216EDU,
+  0x2B1CCF8AU, 0x92B479A7U, 0xF0F207F3U, 0xA1E2694EU, 0xCDF4DA65U, 0xD5BE0506U, 0x1F6234D1U, 0x8AFEA6C4U,
+  0x9D532E34U, 0xA055F3A2U, 0x32E18A05U, 0x75EBF6A4U, 0x39EC830BU, 0xAAEF6040U, 0x069F715EU, 0x51106EBDU,
+  0xF98A213EU, 0x3D06DD96U, 0xAE053EDDU, 0x46BDE64DU, 0xB58D5491U, 0x055DC471U, 0x6FD40604U, 0xFF155060U,
+  0x24FB9819U, 0x97E9BDD6U, 0xCC434089U, 0x779ED967U, 0xBD42E8B0U, 0x888B8907U, 0x385B19E7U, 0xDBEEC879U,
+  0x470A7CA1U, 0xE90F427CU, 0xC91E84F8U, 0x00000000U, 0x83868009U, 0x48ED2B32U, 0xAC70111EU, 0x4E725A6CU,
+  0xFBFF0EFDU, 0x5638850FU, 0x1ED5AE3DU, 0x27392D36U, 0x64D90F0AU, 0x21A65C68U, 0xD1545B9BU, 0x3A2E3624U,
+  0xB1670A0CU, 0x0FE75793U, 0xD296EEB4U, 0x9E919B1BU, 0x4FC5C080U, 0xA220DC61U, 0x694B775AU, 0x161A121CU,
+  0x0ABA93E2U, 0xE52AA0C0U, 0x43E0223CU, 0x1D171B12U, 0x0B0D090EU, 0xADC78BF2U, 0xB9A8B62DU, 0xC8A91E14U,
+  0x8519F157U, 0x4C0775AFU, 0xBBDD99EEU, 0xFD607FA3U, 0x9F2601F7U, 0xBCF5725CU, 0xC53B6644U, 0x347EFB5BU,
+  0x7629438BU, 0xDCC623CBU, 0x68FCEDB6U, 0x63F1E4B8U, 0xCADC31D7U, 0x10856342U, 0x40229713U, 0x2011C684U,
+  0x7D244A85U, 0xF83DBBD2U, 0x1132F9AEU, 0x6DA129C7U, 0x4B2F9E1DU, 0xF330B2DCU, 0xEC52860DU, 0xD0E3C177U,
+  0x6C16B32BU, 0x99B970A9U, 0xFA489411U, 0x2264E947U, 0xC48CFCA8U, 0x1A3FF0A0U, 0xD82C7D56U, 0xEF903322U,
+  0xC74E4987U, 0xC1D138D9U, 0xFEA2CA8CU, 0x360BD498U, 0xCF81F5A6U, 0x28DE7AA5U, 0x268EB7DAU, 0xA4BFAD3FU,
+  0xE49D3A2CU, 0x0D927850U, 0x9BCC5F6AU, 0x62467E54U, 0xC2138DF6U, 0xE8B8D890U, 0x5EF7392EU, 0xF5AFC382U,
+  0xBE805D9FU, 0x7C93D069U, 0xA92DD56FU, 0xB31225CFU, 0x3B99ACC8U, 0xA77D1810U, 0x6E639CE8U, 0x7BBB3BDBU,
+  0x097826CDU, 0xF418596EU, 0x01B79AECU, 0xA89A4F83U, 0x656E95E6U, 0x7EE6FFAAU, 0x08CFBC21U, 0xE6E815EFU,
+  0xD99BE7BAU, 0xCE366F4AU, 0xD4099FEAU, 0xD67CB029U, 0xAFB2A431U, 0x31233F2AU, 0x3094A5C6U, 0xC066A235U,
+  0x37BC4E74U, 0xA6CA82FCU, 0xB0D090E0U, 0x15D8A733U, 0x4A9804F1U, 0xF7DAEC41U, 0x0E50CD7FU, 0x2FF69117U,
+  0x8DD64D76U, 0x4DB0EF43U, 0x544DAACCU, 0xDF0496E4U, 0xE3B5D19EU, 0x1B886A4CU, 0xB81F2CC1U, 0x7F516546U,
+  0x04EA5E9DU, 0x5D358C01U, 0x737487FAU, 0x2E410BFBU, 0x5A1D67B3U, 0x52D2DB92U, 0x335610E9U, 0x1347D66DU,
+  0x8C61D79AU, 0x7A0CA137U, 0x8E14F859U, 0x893C13EBU, 0xEE27A9CEU, 0x35C961B7U, 0xEDE51CE1U, 0x3CB1477AU,
+  0x59DFD29CU, 0x3F73F255U, 0x79CE1418U, 0xBF37C773U, 0xEACDF753U, 0x5BAAFD5FU, 0x146F3DDFU, 0x86DB4478U,
+  0x81F3AFCAU, 0x3EC468B9U, 0x2C342438U, 0x5F40A3C2U, 0x72C31D16U, 0x0C25E2BCU, 0x8B493C28U, 0x41950DFFU,
+  0x7101A839U, 0xDEB30C08U, 0x9CE4B4D8U, 0x90C15664U, 0x6184CB7BU, 0x70B632D5U, 0x745C6C48U, 0x4257B8D0U };
+#endif // #if defined(AES_TTABLE) && (AES_TTABLE == 1U)
 // The round constant word array, Rcon[i], contains the values given by
 // x to the power (i-1) being powers of x (x is denoted as {02}) in the field GF(2^8)
 static const uint8_t Rcon[11U] = {
@@ -118,6 +192,28 @@ static const uint8_t Rcon[11U] = {
 #define getSBoxValue(num)  ( sbox[( num )])
 #define getSBoxInvert(num) ( rsbox[( num )])
 
+#if defined(AES_TTABLE) && (AES_TTABLE == 1U)
+#define ROTL8(x)           ( ( ( x ) << 8U )  | ( ( x ) >> 24U ) )
+#define ROTL16(x)          ( ( ( x ) << 16U ) | ( ( x ) >> 16U ) )
+#define ROTL24(x)          ( ( ( x ) << 24U ) | ( ( x ) >> 8U ) )
+// SubBytes and MixColumns of an output column, rows taken from the columns a, b, c and d
+#define MixT(a, b, c, d)     ( Te0[( a ) & 0xFFU] ^ ROTL8( Te0[( ( b ) >> 8U ) & 0xFFU] ) ^ \
+                               ROTL16( Te0[( ( c ) >> 16U ) & 0xFFU] ) ^ ROTL24( Te0[( d ) >> 24U] ) )
+// Last round: SubBytes only
+#define SubT(a, b, c, d)     ( ( uint32_t )getSBoxValue( ( a ) & 0xFFU ) ^ \
+                               ( ( uint32_t )getSBoxValue( ( ( b ) >> 8U ) & 0xFFU ) << 8U ) ^ \
+                               ( ( uint32_t )getSBoxValue( ( ( c ) >> 16U ) & 0xFFU ) << 16U ) ^ \
+                               ( ( uint32_t )getSBoxValue( ( d ) >> 24U ) << 24U ) )
+// InvSubBytes and InvMixColumns of an output column, rows taken from the columns a, b, c and d
+#define InvMixT(a, b, c, d)  ( Td0[( a ) & 0xFFU] ^ ROTL8( Td0[( ( b ) >> 8U ) & 0xFFU] ) ^ \
+                               ROTL16( Td0[( ( c ) >> 16U ) & 0xFFU] ) ^ ROTL24( Td0[( d ) >> 24U] ) )
+// Last round: InvSubBytes only
+#define InvSubT(a, b, c, d)  ( ( uint32_t )getSBoxInvert( ( a ) & 0xFFU ) ^ \
+                               ( ( uint32_t )getSBoxInvert( ( ( b ) >> 8U ) & 0xFFU ) << 8U ) ^ \
+                               ( ( uint32_t )getSBoxInvert( ( ( c ) >> 16U ) & 0xFFU ) << 16U ) ^ \
+                               ( ( uint32_t )getSBoxInvert( ( d ) >> 24U ) << 24U ) )
+#endif // #if defined(AES_TTABLE) && (AES_TTABLE == 1U)
+
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
 static void KeyExpansion( uint8_t* RoundKey, const uint8_t* Key )
 {
@@ -170,7 +266,38 @@ static void KeyExpansion( uint8_t* RoundKey, const uint8_t* Key )
   return;
 }
 
+#if ((defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)) && (defined(AES_TTABLE) && (AES_TTABLE == 1U))
+// The decryption keys of the equivalent inverse cipher: InvMixColumns of the round keys 1..Nr-1.
+// InvMixT expects the S-box output, so every key byte is passed through the S-box first.
+static void InvMixRoundKeys( uint32_t* dk, const uint8_t* RoundKey )
+{
+  uint8_t  i = 0U;
+  uint32_t w = 0U;
+
+  for ( i=0U; i<( ( Nr - 1U ) * Nb ); ++i )
+  {
+    memcpy( &w, &RoundKey[( Nb * 4U ) + ( i * 4U )], 4U );
+    w = ( uint32_t )getSBoxValue( w & 0xFFU ) |
+        ( ( uint32_t )getSBoxValue( ( w >> 8U ) & 0xFFU ) << 8U ) |
+        ( ( uint32_t )getSBoxValue( ( w >> 16U ) & 0xFFU ) << 16U ) |
+        ( ( uint32_t )getSBoxValue( w >> 24U ) << 24U );
+    dk[i] = InvMixT( w, w, w, w );
+  }
+  return;
+}
+#endif
+
 void AES_init_ctx( struct AES_ctx* ctx, const uint8_t* key )
+{
+  KeyExpansion( ctx->RoundKey, key );
+#if ((defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)) && (defined(AES_TTABLE) && (AES_TTABLE == 1U))
+  InvMixRoundKeys( ctx->DecKey, ctx->RoundKey );
+#endif
+  return;
+}
+
+// The round keys only: CTR, CMAC and the encryption of ECB and CBC never read DecKey
+void AES_init_ctx_enc( struct AES_ctx* ctx, const uint8_t* key )
 {
   KeyExpansion( ctx->RoundKey, key );
   return;
@@ -180,6 +307,9 @@ void AES_init_ctx( struct AES_ctx* ctx, const uint8_t* key )
 void AES_init_ctx_iv( struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv )
 {
   KeyExpansion( ctx->RoundKey, key );
+#if ((defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)) && (defined(AES_TTABLE) && (AES_TTABLE == 1U))
+  InvMixRoundKeys( ctx->DecKey, ctx->RoundKey );
+#endif
   memcpy ( ctx->Iv, iv, AES_BLOCKLEN );
   return;
 }
@@ -190,6 +320,7 @@ void AES_ctx_set_iv( struct AES_ctx* ctx, const uint8_t* iv )
 }
 #endif
 
+#if !(defined(AES_TTABLE) && (AES_TTABLE == 1U))
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
 static void AddRoundKey( uint8_t round, state_t* state, const uint8_t* RoundKey )
@@ -284,6 +415,7 @@ static void MixColumns(state_t* state)
   }
   return;
 }
+#endif // #if !AES_TTABLE
 
 // Multiply is used to multiply numbers in the field GF(2^8)
 // Note: The last call to xtime() is unneeded, but often ends up generating a smaller binary
@@ -292,7 +424,7 @@ static void MixColumns(state_t* state)
 
 
 
-#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+#if ((defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)) && !(defined(AES_TTABLE) && (AES_TTABLE == 1U))
 // MixColumns function mixes the columns of the state matrix.
 // The method used to multiply may be difficult to understand for the inexperienced.
 // Please use the references to gain more information.
@@ -361,8 +493,44 @@ static void InvShiftRows( state_t* state )
   ( *state )[3U][3U] = temp;
   return;
 }
-#endif // #if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+#endif // #if ((defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)) && !AES_TTABLE
 
+#if defined(AES_TTABLE) && (AES_TTABLE == 1U)
+// Cipher on 32-bit columns: one table lookup per byte and round
+// instead of SubBytes, ShiftRows and the xtime() of MixColumns.
+// CTR and CMAC, the ciphers of the download and the image MAC, only run this direction.
+static void Cipher( state_t* state, const uint8_t* RoundKey )
+{
+  uint8_t  round = 0U;
+  uint32_t s[4U];
+  uint32_t t[4U];
+  uint32_t k[4U];
+
+  memcpy( s, state, AES_BLOCKLEN );
+  memcpy( k, RoundKey, AES_BLOCKLEN );
+  s[0U] ^= k[0U];
+  s[1U] ^= k[1U];
+  s[2U] ^= k[2U];
+  s[3U] ^= k[3U];
+  // Row r of an output column comes from the column r places to the right (ShiftRows)
+  for ( round=1U; round<Nr; ++round )
+  {
+    memcpy( k, &RoundKey[round * Nb * 4U], AES_BLOCKLEN );
+    t[0U] = MixT( s[0U], s[1U], s[2U], s[3U] ) ^ k[0U];
+    t[1U] = MixT( s[1U], s[2U], s[3U], s[0U] ) ^ k[1U];
+    t[2U] = MixT( s[2U], s[3U], s[0U], s[1U] ) ^ k[2U];
+    t[3U] = MixT( s[3U], s[0U], s[1U], s[2U] ) ^ k[3U];
+    memcpy( s, t, AES_BLOCKLEN );
+  }
+  memcpy( k, &RoundKey[Nr * Nb * 4U], AES_BLOCKLEN );
+  t[0U] = SubT( s[0U], s[1U], s[2U], s[3U] ) ^ k[0U];
+  t[1U] = SubT( s[1U], s[2U], s[3U], s[0U] ) ^ k[1U];
+  t[2U] = SubT( s[2U], s[3U], s[0U], s[1U] ) ^ k[2U];
+  t[3U] = SubT( s[3U], s[0U], s[1U], s[2U] ) ^ k[3U];
+  memcpy( state, t, AES_BLOCKLEN );
+  return;
+}
+#else
 // Cipher is the main function that encrypts the PlainText.
 static void Cipher( state_t* state, const uint8_t* RoundKey )
 {
@@ -388,8 +556,44 @@ static void Cipher( state_t* state, const uint8_t* RoundKey )
   AddRoundKey( Nr, state, RoundKey );
   return;
 }
+#endif // #if defined(AES_TTABLE) && (AES_TTABLE == 1U)
 
-#if (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
+#if ((defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)) && (defined(AES_TTABLE) && (AES_TTABLE == 1U))
+// InvCipher on 32-bit columns: one table lookup per byte and round
+// instead of InvShiftRows, InvSubBytes and the GF(2^8) multiplications of InvMixColumns.
+static void InvCipher( state_t* state, const uint8_t* RoundKey, const uint32_t* dk )
+{
+  uint8_t         round = 0U;
+  const uint32_t* rk    = NULL;
+  uint32_t        s[4U];
+  uint32_t        t[4U];
+  uint32_t        k[4U];
+
+  memcpy( s, state, AES_BLOCKLEN );
+  memcpy( k, &RoundKey[Nr * Nb * 4U], AES_BLOCKLEN );
+  s[0U] ^= k[0U];
+  s[1U] ^= k[1U];
+  s[2U] ^= k[2U];
+  s[3U] ^= k[3U];
+  // Row r of an output column comes from the column r places to the left (InvShiftRows)
+  for ( round=( Nr - 1U ); round>0U; --round )
+  {
+    rk    = &dk[( round - 1U ) * Nb];
+    t[0U] = InvMixT( s[0U], s[3U], s[2U], s[1U] ) ^ rk[0U];
+    t[1U] = InvMixT( s[1U], s[0U], s[3U], s[2U] ) ^ rk[1U];
+    t[2U] = InvMixT( s[2U], s[1U], s[0U], s[3U] ) ^ rk[2U];
+    t[3U] = InvMixT( s[3U], s[2U], s[1U], s[0U] ) ^ rk[3U];
+    memcpy( s, t, AES_BLOCKLEN );
+  }
+  memcpy( k, RoundKey, AES_BLOCKLEN );
+  t[0U] = InvSubT( s[0U], s[3U], s[2U], s[1U] ) ^ k[0U];
+  t[1U] = InvSubT( s[1U], s[0U], s[3U], s[2U] ) ^ k[1U];
+  t[2U] = InvSubT( s[2U], s[1U], s[0U], s[3U] ) ^ k[2U];
+  t[3U] = InvSubT( s[3U], s[2U], s[1U], s[0U] ) ^ k[3U];
+  memcpy( state, t, AES_BLOCKLEN );
+  return;
+}
+#elif (defined(CBC) && CBC == 1) || (defined(ECB) && ECB == 1)
 static void InvCipher( state_t* state, const uint8_t* RoundKey )
 {
   uint8_t round = 0U;
@@ -432,7 +636,11 @@ void AES_ECB_encrypt( const struct AES_ctx* ctx, uint8_t* buf )
 void AES_ECB_decrypt( const struct AES_ctx* ctx, uint8_t* buf )
 {
   // The next function call decrypts the PlainText with the Key using AES algorithm.
+#if defined(AES_TTABLE) && (AES_TTABLE == 1U)
+  InvCipher( ( state_t* )buf, ctx->RoundKey, ctx->DecKey );
+#else
   InvCipher( ( state_t* )buf, ctx->RoundKey );
+#endif
   return;
 }
 
@@ -479,7 +687,11 @@ void AES_CBC_decrypt_buffer( struct AES_ctx* ctx, uint8_t* buf,  uint32_t length
   for ( i=0U; i<length; i+=AES_BLOCKLEN )
   {
     memcpy( storeNextIv, buf, AES_BLOCKLEN );
+#if defined(AES_TTABLE) && (AES_TTABLE == 1U)
+    InvCipher( ( state_t* )buf, ctx->RoundKey, ctx->DecKey );
+#else
     InvCipher( ( state_t* )buf, ctx->RoundKey );
+#endif
     XorWithIv( buf, ctx->Iv );
     memcpy( ctx->Iv, storeNextIv, AES_BLOCKLEN );
     buf += AES_BLOCKLEN;
@@ -507,7 +719,7 @@ void AES_CTR_xcrypt_buffer( struct AES_ctx* ctx, uint8_t* buf, uint32_t length )
       memcpy( buffer, ctx->Iv, AES_BLOCKLEN );
       Cipher( ( state_t* )buffer, ctx->RoundKey );
       /* Increment Iv and handle overflow */
-      for ( bi=(AES_BLOCKLEN - 1U); bi>=0U; --bi )
+      for ( bi=(AES_BLOCKLEN - 1); bi>=0; --bi )
       {
 	/* inc will overflow */
         if ( ctx->Iv[bi] == 255U )
@@ -518,12 +730,116 @@ void AES_CTR_xcrypt_buffer( struct AES_ctx* ctx, uint8_t* buf, uint32_t length )
         ctx->Iv[bi] += 1U;
         break;   
       }
-      bi = 0U;
+      bi = 0;
     }
     buf[i] = ( buf[i] ^ buffer[bi] );
   }
   return;
 }
 
+void AES_CTR_xcrypt_offset( const struct AES_ctx* ctx, uint8_t* buf, uint32_t length, uint32_t offset )
+{
+  uint8_t  buffer[AES_BLOCKLEN];
+  uint32_t block = offset / AES_BLOCKLEN;
+  uint32_t carry = 0U;
+  uint32_t i     = 0U;
+  uint32_t bi    = offset % AES_BLOCKLEN;
+  int      k;
+
+  while ( i < length )
+  {
+    /* Counter = IV + block, big endian */
+    carry = block;
+    for ( k=(AES_BLOCKLEN - 1); k>=0; --k )
+    {
+      carry    += ctx->Iv[k];
+      buffer[k] = ( uint8_t )carry;
+      carry   >>= 8U;
+    }
+    Cipher( ( state_t* )buffer, ctx->RoundKey );
+    for ( ; ( bi < AES_BLOCKLEN ) && ( i < length ); ++bi, ++i )
+    {
+      buf[i] ^= buffer[bi];
+    }
+    bi = 0U;
+    block++;
+  }
+  return;
+}
+
 #endif // #if defined(CTR) && (CTR == 1)
 
+
+
+#if defined(CMAC) && (CMAC == 1)
+
+// Subkey derivation: multiplication by x in GF(2^128)
+static void CmacDouble( uint8_t* k )
+{
+  uint8_t i     = 0U;
+  uint8_t carry = ( uint8_t )( ( k[0U] >> 7U ) * 0x87U );
+
+  for ( i=0U; i<( AES_BLOCKLEN - 1U ); ++i )
+  {
+    k[i] = ( uint8_t )( ( k[i] << 1U ) | ( k[i + 1U] >> 7U ) );
+  }
+  k[AES_BLOCKLEN - 1U] = ( uint8_t )( k[AES_BLOCKLEN - 1U] << 1U ) ^ carry;
+  return;
+}
+
+void AES_CMAC_init( struct AES_cmac* cm )
+{
+  memset( cm, 0, sizeof( struct AES_cmac ) );
+  return;
+}
+
+void AES_CMAC_update( struct AES_cmac* cm, const struct AES_ctx* ctx, const uint8_t* buf, uint32_t length )
+{
+  uint32_t i = 0U;
+  uint8_t  j = 0U;
+
+  for ( i=0U; i<length; ++i )
+  {
+    // A full block is only chained once it is known not to be the last one
+    if ( cm->n == AES_BLOCKLEN )
+    {
+      for ( j=0U; j<AES_BLOCKLEN; ++j )
+      {
+        cm->X[j] ^= cm->M[j];
+      }
+      Cipher( ( state_t* )cm->X, ctx->RoundKey );
+      cm->n = 0U;
+    }
+    cm->M[cm->n++] = buf[i];
+  }
+  return;
+}
+
+void AES_CMAC_final( struct AES_cmac* cm, const struct AES_ctx* ctx, uint8_t* tag )
+{
+  uint8_t k[AES_BLOCKLEN];
+  uint8_t j = 0U;
+
+  memset( k, 0, AES_BLOCKLEN );
+  Cipher( ( state_t* )k, ctx->RoundKey );
+  CmacDouble( k );
+  // Complete block: K1, else padding and K2
+  if ( cm->n < AES_BLOCKLEN )
+  {
+    cm->M[cm->n] = 0x80U;
+    for ( j=( cm->n + 1U ); j<AES_BLOCKLEN; ++j )
+    {
+      cm->M[j] = 0U;
+    }
+    CmacDouble( k );
+  }
+  for ( j=0U; j<AES_BLOCKLEN; ++j )
+  {
+    tag[j] = cm->X[j] ^ cm->M[j] ^ k[j];
+  }
+  Cipher( ( state_t* )tag, ctx->RoundKey );
+  AES_CMAC_init( cm );
+  return;
+}
+
+#endif // #if defined(CMAC) && (CMAC == 1)
@@ -0,0 +1,56 @@
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <stdint.h>
+
+/*
+  Streaming decoder of the LZ4 block format: one block, as LZ4_compress_default()
+  writes it, fed in pieces of any length.
+
+  The output is collected in a small RAM stage that the caller empties to memory
+  mapped storage at increasing addresses, with LZ4_stored(). A match that reaches
+  further back than the stage is copied from the storage itself, so the 64 KB
+  window of the format costs no RAM: only the stage and this context.
+*/
+
+#define LZ4_MIN_MATCH   4U
+#define LZ4_MAX_OFFSET  65535U
+
+/* Decoder states, the field of the sequence expected next */
+#define LZ4_TOKEN       0U
+#define LZ4_LITERAL_LEN 1U  /* Extra bytes of the literal length */
+#define LZ4_LITERALS    2U
+#define LZ4_OFFSET_LOW  3U  /* The only state where the block may end */
+#define LZ4_OFFSET_HIGH 4U
+#define LZ4_MATCH_LEN   5U  /* Extra bytes of the match length */
+#define LZ4_MATCH       6U
+#define LZ4_ERROR       7U
+
+struct LZ4_stream
+{
+  uint8_t* stage;     /* Output not stored yet */
+  uint32_t size;      /* Bytes of the stage */
+  uint32_t length;    /* Bytes in the stage */
+  uint32_t base;      /* Address of the first output byte */
+  uint32_t out;       /* Address of stage[0] */
+  uint32_t count;     /* Literal or match bytes left */
+  uint32_t offset;
+  uint8_t  token;
+  uint8_t  state;
+};
+
+// Start a block whose output is stored from base on.
+void     LZ4_init(struct LZ4_stream* s, uint8_t* stage, uint32_t size, uint32_t base);
+
+// Decode until the input is used up or the stage is full, a match is also
+// continued without input. Returns the number of input bytes consumed.
+// A malformed block leaves the state LZ4_ERROR.
+uint32_t LZ4_decode(struct LZ4_stream* s, const uint8_t* src, uint32_t length);
+
+// The stage is stored at s->out: the next output starts an empty stage.
+void     LZ4_stored(struct LZ4_stream* s);
+
+// 1 when the input ended after the literals of a sequence, as a block does.
+uint8_t  LZ4_isEnd(const struct LZ4_stream* s);
+
+#endif // _LZ4_H_
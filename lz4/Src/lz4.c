@@ -0,0 +1,164 @@
+/*
+
+Streaming decoder of the LZ4 block format (lz4_Block_format.md of the LZ4 project).
+
+A block is a list of sequences:
+
+  token  literal length (high nibble) and match length - 4 (low nibble),
+         15 in a nibble is continued by bytes that are added up to a byte below 255
+  literals
+  offset 2 bytes little endian, back from the current output, 0 is not valid
+  match  copied from the output, it may overlap the bytes it produces
+
+The last sequence of a block ends after its literals. The decoder is a state
+machine over these fields, so the block can be cut anywhere: into the DNLOAD
+blocks of a download here.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <string.h>
+#include "lz4.h"
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static uint32_t Min(uint32_t a, uint32_t b)
+{
+  return (a < b) ? a : b;
+}
+
+// Copy match bytes to the stage. The part older than the stage is read from
+// the storage, the part in the stage byte by byte as it may overlap the output.
+static void CopyMatch(struct LZ4_stream* s)
+{
+  uint32_t       n   = 0U;
+  uint32_t       i   = 0U;
+  uint8_t*       dst = &s->stage[s->length];
+  const uint8_t* ref = dst - s->offset;
+
+  if (s->offset > s->length)
+  {
+    n = Min(Min(s->count, (s->offset - s->length)), (s->size - s->length));
+    memcpy(dst, (const uint8_t*)(s->out + s->length - s->offset), n);
+  }
+  else
+  {
+    n = Min(s->count, (s->size - s->length));
+    for (i = 0U; i < n; ++i)
+    {
+      dst[i] = ref[i];
+    }
+  }
+  s->length += n;
+  s->count  -= n;
+  if (s->count == 0U)
+  {
+    s->state = LZ4_TOKEN;
+  }
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+void LZ4_init(struct LZ4_stream* s, uint8_t* stage, uint32_t size, uint32_t base)
+{
+  s->stage  = stage;
+  s->size   = size;
+  s->length = 0U;
+  s->base   = base;
+  s->out    = base;
+  s->count  = 0U;
+  s->offset = 0U;
+  s->token  = 0U;
+  s->state  = LZ4_TOKEN;
+}
+
+uint32_t LZ4_decode(struct LZ4_stream* s, const uint8_t* src, uint32_t length)
+{
+  uint32_t pos = 0U;
+  uint32_t n   = 0U;
+  uint8_t  b   = 0U;
+
+  while ((s->state != LZ4_ERROR) && (s->length < s->size) && ((pos < length) || (s->state == LZ4_MATCH)))
+  {
+    switch (s->state)
+    {
+      case LZ4_TOKEN:
+        s->token = src[pos++];
+        s->count = (uint32_t)s->token >> 4U;
+        s->state = (s->count == 15U) ? LZ4_LITERAL_LEN : ((s->count != 0U) ? LZ4_LITERALS : LZ4_OFFSET_LOW);
+        break;
+
+      case LZ4_LITERAL_LEN:
+        b         = src[pos++];
+        s->count += b;
+        if (b != 255U)
+        {
+          s->state = LZ4_LITERALS;
+        }
+        break;
+
+      case LZ4_LITERALS:
+        n = Min(Min(s->count, (length - pos)), (s->size - s->length));
+        memcpy(&s->stage[s->length], &src[pos], n);
+        pos       += n;
+        s->length += n;
+        s->count  -= n;
+        if (s->count == 0U)
+        {
+          s->state = LZ4_OFFSET_LOW;
+        }
+        break;
+
+      case LZ4_OFFSET_LOW:
+        s->offset = src[pos++];
+        s->state  = LZ4_OFFSET_HIGH;
+        break;
+
+      case LZ4_OFFSET_HIGH:
+        s->offset |= (uint32_t)src[pos++] << 8U;
+        s->count   = s->token & 0x0FU;
+        s->state   = (s->count == 15U) ? LZ4_MATCH_LEN : LZ4_MATCH;
+        s->count  += (s->count == 15U) ? 0U : LZ4_MIN_MATCH;
+        // Only back into the output of this block
+        if ((s->offset == 0U) || (s->offset > (s->out + s->length - s->base)))
+        {
+          s->state = LZ4_ERROR;
+        }
+        break;
+
+      case LZ4_MATCH_LEN:
+        b         = src[pos++];
+        s->count += b;
+        if (b != 255U)
+        {
+          s->count += LZ4_MIN_MATCH;
+          s->state  = LZ4_MATCH;
+        }
+        break;
+
+      case LZ4_MATCH:
+      default:
+        CopyMatch(s);
+        break;
+    }
+  }
+  return pos;
+}
+
+void LZ4_stored(struct LZ4_stream* s)
+{
+  s->out   += s->length;
+  s->length = 0U;
+}
+
+uint8_t LZ4_isEnd(const struct LZ4_stream* s)
+{
+  return (s->state == LZ4_OFFSET_LOW) ? 1U : 0U;
+}
@@ -0,0 +1,79 @@
+/**
+  ******************************************************************************
+  * @file           : core_cm3.h
+  * @brief          : Cortex-M3 core header for the host tests.
+  ******************************************************************************
+  * Found before Drivers/CMSIS/Include on the include path of the test_native
+  * environment. The compiler abstraction of cmsis_gcc.h is given here for the
+  * host compiler, the instructions with an effect on the emulated device
+  * (interrupt mask, sleep, stack pointer, reset) call into the simulator, and
+  * the register definitions come from the original header.
+  ******************************************************************************
+  */
+
+#ifndef __SIM_CORE_CM3_H
+#define __SIM_CORE_CM3_H
+
+#include <stdint.h>
+
+/* Replaces cmsis_gcc.h, included by cmsis_compiler.h */
+#define __CMSIS_GCC_H
+
+#define __ASM                                  __asm
+#define __INLINE                               inline
+#define __STATIC_INLINE                        static inline
+#define __STATIC_FORCEINLINE                   __attribute__((always_inline)) static inline
+#define __NO_RETURN                            __attribute__((__noreturn__))
+#define __USED                                 __attribute__((used))
+#define __WEAK                                 __attribute__((weak))
+#define __PACKED                               __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT                        struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION                         union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)                           __attribute__((aligned(x)))
+#define __RESTRICT                             __restrict
+#define __COMPILER_BARRIER()                   __asm volatile("":::"memory")
+
+/* Emulated device, test/sim.c */
+void     SIM_EnableIrq( void );
+void     SIM_DisableIrq( void );
+uint32_t SIM_GetPrimask( void );
+void     SIM_SetPrimask( uint32_t primask );
+void     SIM_WaitForEvent( void );
+void     SIM_SendEvent( void );
+__NO_RETURN void SIM_SetMsp( uint32_t topOfMainStack );
+__NO_RETURN void SIM_SystemReset( void );
+
+#define __enable_irq()                         SIM_EnableIrq()
+#define __disable_irq()                        SIM_DisableIrq()
+#define __get_PRIMASK()                        SIM_GetPrimask()
+#define __set_PRIMASK( primask )               SIM_SetPrimask( primask )
+#define __WFI()                                SIM_WaitForEvent()
+#define __WFE()                                SIM_WaitForEvent()
+#define __SEV()                                SIM_SendEvent()
+#define __set_MSP( topOfMainStack )            SIM_SetMsp( topOfMainStack )
+
+#define __NOP()                                __COMPILER_BARRIER()
+#define __ISB()                                __COMPILER_BARRIER()
+#define __DSB()                                __COMPILER_BARRIER()
+#define __DMB()                                __COMPILER_BARRIER()
+
+__STATIC_FORCEINLINE uint32_t __RBIT( uint32_t value )
+{
+  uint32_t result = 0U;
+  for ( uint32_t i = 0U; i < 32U; i++ )
+  {
+    result = ( result << 1U ) | ( ( value >> i ) & 1U );
+  }
+  return result;
+}
+
+#define __CLZ( value )                         ( ( value ) == 0U ? 32U : ( uint32_t ) __builtin_clz( value ) )
+#define __REV( value )                         __builtin_bswap32( value )
+#define __REV16( value )                       ( ( ( ( value ) & 0xFF00FF00U ) >> 8U ) | ( ( ( value ) & 0x00FF00FFU ) << 8U ) )
+
+#include_next <core_cm3.h>
+
+#undef  NVIC_SystemReset
+#define NVIC_SystemReset                       SIM_SystemReset
+
+#endif /* __SIM_CORE_CM3_H */
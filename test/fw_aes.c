@@ -0,0 +1,10 @@
+/* AES of the bootloader, also the cipher of the image tool in sim_dfu.c */
+#include "sim.h"
+
+SIM_RAM_BEGIN( Aes )
+
+SIM_FLASH_CODE_BEGIN( Aes )
+#include "../aes/Src/aes.c"
+SIM_FLASH_CODE_END( Aes )
+
+SIM_RAM_END( Aes )
@@ -0,0 +1,17 @@
+/* Core/Src of the bootloader built for the emulated device of sim.c, main()
+   renamed: it runs as a coroutine started by SIM_Boot() */
+#include "sim.h"
+
+SIM_RAM_BEGIN( Core )
+
+#define main bootloader_main
+SIM_FLASH_CODE_BEGIN( Main )
+#include "../Core/Src/main.c"
+SIM_FLASH_CODE_END( Main )
+#include "../Core/Src/stm32f2xx_it.c"
+SIM_FLASH_CODE_BEGIN( Msp )
+#include "../Core/Src/stm32f2xx_hal_msp.c"
+#include "../Core/Src/system_stm32f2xx.c"
+SIM_FLASH_CODE_END( Msp )
+
+SIM_RAM_END( Core )
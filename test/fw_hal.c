@@ -0,0 +1,19 @@
+/* The HAL drivers of the bootloader; the PCD driver is sim_usb.c */
+#include "sim.h"
+
+SIM_RAM_BEGIN( Hal )
+
+#include "../Drivers/STM32F2xx_HAL_Driver/Src/stm32f2xx_hal.c"
+SIM_FLASH_CODE_BEGIN( HalDma )
+#include "../Drivers/STM32F2xx_HAL_Driver/Src/stm32f2xx_hal_cortex.c"
+#include "../Drivers/STM32F2xx_HAL_Driver/Src/stm32f2xx_hal_dma.c"
+SIM_FLASH_CODE_END( HalDma )
+#include "../Drivers/STM32F2xx_HAL_Driver/Src/stm32f2xx_hal_flash.c"
+#include "../Drivers/STM32F2xx_HAL_Driver/Src/stm32f2xx_hal_flash_ex.c"
+SIM_FLASH_CODE_BEGIN( HalRcc )
+#include "../Drivers/STM32F2xx_HAL_Driver/Src/stm32f2xx_hal_gpio.c"
+#include "../Drivers/STM32F2xx_HAL_Driver/Src/stm32f2xx_hal_rcc.c"
+#include "../Drivers/STM32F2xx_HAL_Driver/Src/stm32f2xx_hal_rcc_ex.c"
+SIM_FLASH_CODE_END( HalRcc )
+
+SIM_RAM_END( Hal )
@@ -0,0 +1,10 @@
+/* LZ4 decoder of the bootloader */
+#include "sim.h"
+
+SIM_RAM_BEGIN( Lz4 )
+
+SIM_FLASH_CODE_BEGIN( Lz4 )
+#include "../lz4/Src/lz4.c"
+SIM_FLASH_CODE_END( Lz4 )
+
+SIM_RAM_END( Lz4 )
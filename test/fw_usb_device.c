@@ -0,0 +1,83 @@
+/* USB_DEVICE of the bootloader. The media interface is opened to the tests
+   by the functions after it: its keys, the marker of a valid image, the
+   sector lookup and the counters of the write stages */
+#include "sim.h"
+
+SIM_RAM_BEGIN( UsbDevice )
+
+SIM_FLASH_CODE_BEGIN( UsbDevice )
+#include "../USB_DEVICE/App/usb_device.c"
+SIM_FLASH_CODE_END( UsbDevice )
+#include "../USB_DEVICE/App/usbd_desc.c"
+#include "../USB_DEVICE/Target/usbd_conf.c"
+SIM_FLASH_CODE_BEGIN( DfuIf )
+#include "../USB_DEVICE/App/usbd_dfu_if.c"
+SIM_FLASH_CODE_END( DfuIf )
+
+SIM_RAM_END( UsbDevice )
+
+const uint8_t* SIM_FwKey( void )
+{
+  return key;
+}
+
+const uint8_t* SIM_FwIv( void )
+{
+#if ( ENCRYPTION_CTR > 0U )
+  return NULL;
+#else
+  return iv;
+#endif
+}
+
+const uint8_t* SIM_FwMacKey( void )
+{
+  return macKey;
+}
+
+const uint8_t* SIM_FwDigestKey( void )
+{
+  return digestKey;
+}
+
+/* NULL in a build without the encrypted read-out */
+const uint8_t* SIM_FwReadKey( void )
+{
+  #if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U ) && defined( ENCRYPTION )
+    return readKey;
+  #else
+    return NULL;
+  #endif
+}
+
+uint32_t SIM_FwGetSector( uint32_t address )
+{
+  MEM_If_SectorTypeDef sector;
+
+  MEM_If_GetSector( address, &sector );
+  return sector.number;
+}
+
+uint32_t SIM_FwImageMarker( void )
+{
+  return IMAGE_MARKER_VALID;
+}
+
+/* Counters of the stage of that name in the write pipelines, -1 if no
+   pipeline of the build has it */
+int SIM_FwStage( const char* name, uint32_t* cycles, uint32_t* calls )
+{
+  for ( uint32_t i=0U; i<( sizeof( writePipe ) / sizeof( writePipe[0] ) ); i++ )
+  {
+    for ( uint32_t j=0U; j<writePipe[i]->count; j++ )
+    {
+      if ( strcmp( writePipe[i]->stage[j]->name, name ) == 0 )
+      {
+        *cycles = writePipe[i]->stage[j]->cycles;
+        *calls  = writePipe[i]->stage[j]->calls;
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,11 @@
+/* USB device library: core and DFU class */
+#include "sim.h"
+
+SIM_RAM_BEGIN( UsbLib )
+
+#include "../Middlewares/ST/STM32_USB_Device_Library/Core/Src/usbd_core.c"
+#include "../Middlewares/ST/STM32_USB_Device_Library/Core/Src/usbd_ctlreq.c"
+#include "../Middlewares/ST/STM32_USB_Device_Library/Core/Src/usbd_ioreq.c"
+#include "../Middlewares/ST/STM32_USB_Device_Library/Class/DFU/Src/usbd_dfu.c"
+
+SIM_RAM_END( UsbLib )
@@ -0,0 +1,1593 @@
+/**
+  ******************************************************************************
+  * @file           : sim.c
+  * @brief          : Emulated STM32F207 running the bootloader on the host.
+  ******************************************************************************
+  * Memory: every region the firmware addresses is a shared memory object
+  * mapped twice, at the device address for the firmware and anywhere for
+  * the simulator (the backdoor). The flash and the pages of CRC/RCC/FLASH,
+  * DMA and the System Control Space are read only, the flash is not even
+  * readable while BSY is set, nor are the DWT and RNG pages: an access faults, the fault handler completes
+  * whatever the access waits for (the flash operation), opens the page and
+  * single-steps the instruction with the trap flag, the trap handler closes
+  * the page again and gives the written words their register semantics.
+  *
+  * Execution: main() of the bootloader runs on a stack of its own and
+  * returns to the test at its WFE once the time of SIM_Run() is over. The
+  * interrupts enabled in the NVIC are taken at the WFE, the USB interrupt
+  * is raised by the test with SIM_Irq() while the firmware sleeps.
+  *
+  * Code placement: the firmware is built with -finstrument-functions. A call
+  * into or a return to a function that the linker script leaves in the flash
+  * waits for a running flash operation, as a flash read does.
+  *
+  * Limits: x86-64 Linux, interrupts only preempt the main loop at its WFE.
+  ******************************************************************************
+  */
+
+#define _GNU_SOURCE
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "sim.h"
+#include "stm32f2xx_it.h"
+
+#if !defined( __x86_64__ ) || !defined( __linux__ )
+  #error "The emulated device single-steps register accesses with the x86-64 trap flag on Linux"
+#endif
+
+#define SIM_PAGE                0x1000U
+#define SIM_EFLAGS_TF           0x100U
+#define SIM_PF_WRITE            0x2U       /* Page fault error code: write access */
+#define SIM_STACK_SIZE          0x100000U
+#define SIM_RAM_REGIONS         16U
+#define SIM_CODE_REGIONS        16U
+#define SIM_NEVER               UINT64_MAX
+#define SIM_IRQ_STORM           100000U    /* Interrupts taken at one WFE without time passing */
+#define SIM_SCS_PAGE            ( SCS_BASE & ~( SIM_PAGE - 1U ) )
+#define SIM_DWT_PAGE            ( DWT_BASE & ~( SIM_PAGE - 1U ) )
+#define SIM_FLASH_R_PAGE        ( FLASH_R_BASE & ~( SIM_PAGE - 1U ) )
+#define SIM_RNG_PAGE            ( RNG_BASE & ~( SIM_PAGE - 1U ) )
+#define SIM_NVIC_ISER           0xE000E100U
+#define SIM_NVIC_ICER           0xE000E180U
+#define SIM_NVIC_ISPR           0xE000E200U
+#define SIM_NVIC_ICPR           0xE000E280U
+#define SIM_NVIC_WORDS          8U
+#define SIM_FLASH_ERRORS        ( FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR )
+#define SIM_REG( adr )          ( *SIM_Backdoor( adr ) )
+#define SIM_DMA_STREAMS         8U
+#define SIM_CYCLES( n )         ( ( ( uint64_t )( n ) * 1000000000ULL ) / SIM_HCLK_HZ )
+#define SIM_TRAP_SAMPLES        1000U      /* Trapped reads timed for the cost of a trap */
+
+
+typedef struct
+{
+  uint32_t  base;
+  uint32_t  size;
+  int       prot;       /* Of the mapping seen by the firmware */
+  uint8_t*  backdoor;   /* The same memory, always writable */
+} SIM_RegionTypeDef;
+
+typedef struct
+{
+  uint8_t   busy;
+  uint64_t  end;
+  uint8_t   key;        /* KEYR sequence: 1 after KEY1 */
+} SIM_FlashOpTypeDef;
+
+typedef struct
+{
+  uint8_t   busy;
+  uint64_t  end;
+} SIM_DmaStreamTypeDef;
+
+typedef struct
+{
+  uint8_t*  base;
+  size_t    size;
+  uint8_t*  initial;    /* Content before the first boot */
+} SIM_RamTypeDef;
+
+typedef struct
+{
+  const uint8_t* begin;
+  const uint8_t* end;
+  const uint8_t* constBegin;      /* Page aligned */
+  const uint8_t* constEnd;
+} SIM_CodeTypeDef;
+
+typedef struct
+{
+  IRQn_Type irq;
+  void      ( *handler )( void );
+} SIM_VectorTypeDef;
+
+/* Address space of the firmware */
+static SIM_RegionTypeDef simRegion[] =
+{
+  { FLASH_BASE,        SIM_FLASH_SIZE, PROT_READ,              NULL },
+  { 0x1FFF0000U,       0x00010000U,    PROT_READ | PROT_WRITE, NULL },  /* System memory, OTP, UID, option bytes */
+  { PERIPH_BASE,       0x00030000U,    PROT_READ | PROT_WRITE, NULL },  /* APB1, APB2, AHB1 */
+  { AHB2PERIPH_BASE,   0x00061000U,    PROT_READ | PROT_WRITE, NULL },  /* USB OTG FS, DCMI, RNG */
+  { PERIPH_BB_BASE,    0x02000000U,    PROT_NONE,              NULL },  /* Bit-band alias of the peripherals */
+  { 0xE0000000U,       0x00100000U,    PROT_READ | PROT_WRITE, NULL },  /* Cortex-M3 private peripherals */
+};
+
+/* Pages of the emulated registers, every access is trapped */
+static const uint32_t simTrapped[] = { CRC_BASE & ~( SIM_PAGE - 1U ), DMA1_BASE & ~( SIM_PAGE - 1U ), SIM_SCS_PAGE, SIM_DWT_PAGE,
+                                       SIM_RNG_PAGE };
+
+/* Handlers of stm32f2xx_it.c by IRQ number, lower numbers first as the NVIC does at equal priority */
+static const SIM_VectorTypeDef simVector[] =
+{
+  { FLASH_IRQn,        FLASH_IRQHandler },
+  { DMA2_Stream0_IRQn, DMA2_Stream0_IRQHandler },
+};
+static const IRQn_Type simDmaIrq[2U][SIM_DMA_STREAMS] =
+{
+  { DMA1_Stream0_IRQn, DMA1_Stream1_IRQn, DMA1_Stream2_IRQn, DMA1_Stream3_IRQn,
+    DMA1_Stream4_IRQn, DMA1_Stream5_IRQn, DMA1_Stream6_IRQn, DMA1_Stream7_IRQn },
+  { DMA2_Stream0_IRQn, DMA2_Stream1_IRQn, DMA2_Stream2_IRQn, DMA2_Stream3_IRQn,
+    DMA2_Stream4_IRQn, DMA2_Stream5_IRQn, DMA2_Stream6_IRQn, DMA2_Stream7_IRQn },
+};
+static const uint8_t simDmaShift[4U] = { 0U, 6U, 16U, 22U };
+
+/* STM32F207xG: sector size in KB and typical x32 erase time in ms */
+static const uint32_t simSectorKb[SIM_FLASH_SECTORS] = { 16U, 16U, 16U, 16U, 64U, 128U, 128U, 128U, 128U, 128U, 128U, 128U };
+static const uint32_t simSectorMs[SIM_FLASH_SECTORS] = { 250U, 250U, 250U, 250U, 550U, 1000U, 1000U, 1000U, 1000U, 1000U, 1000U, 1000U };
+
+/* Access being single-stepped */
+static struct
+{
+  uint32_t  page;       /* 0 - none */
+  uint32_t  adr;
+  uint8_t   write;
+  uint32_t  snapshot[SIM_PAGE / 4U];
+} simTrap;
+
+static uint8_t               simMapped     = 0U;
+static SIM_RamTypeDef        simRam[SIM_RAM_REGIONS];
+static uint32_t              simRamCount   = 0U;
+static SIM_CodeTypeDef       simCode[SIM_CODE_REGIONS];
+static uint32_t              simCodeCount  = 0U;
+static SIM_StateTypeDef      simState      = SIM_OFF;
+static uint64_t              simNow        = 0U;
+static uint64_t              simDeadline   = 0U;
+static SIM_FlashOpTypeDef    simFlashOp    = { 0 };
+static SIM_FlashStatsTypeDef simFlashStats = { 0 };
+static SIM_DmaStreamTypeDef  simDma[2U][SIM_DMA_STREAMS];
+static uint32_t              simNvicEnabled[SIM_NVIC_WORDS];
+static uint32_t              simNvicPending[SIM_NVIC_WORDS];
+static uint64_t              simTickNext   = SIM_NEVER;
+static uint64_t              simTickPeriod = 0U;
+static uint8_t               simTickPending = 0U;
+static uint8_t               simPrimask    = 0U;
+static uint8_t               simEvent      = 0U;
+static uint8_t               simInDevice   = 0U;
+static uint8_t               simInIrq      = 0U;
+static jmp_buf               simIrqExit;
+static uint32_t              simAppStack   = 0U;
+static uint8_t               simBootPins   = 0x3U;
+static uint64_t              simFwNs       = 0U;   /* Host time of the firmware code, outside the traps */
+static uint64_t              simFwSince    = 0U;   /* Host time the firmware code runs since, 0 - it does not */
+static uint64_t              simTrapNs     = 0U;   /* Host time of a trap that the handlers do not see */
+static uint32_t              simDwtOffset  = 0U;   /* CYCCNT less the cycles of SIM_DwtCount() */
+static uint64_t              simRngState   = 0x2545F4914F6CDD1DULL;  /* Not reset: every session draws other numbers */
+static ucontext_t            simHostCtx;
+static ucontext_t            simDeviceCtx;
+static uint8_t               simStack[SIM_STACK_SIZE] __attribute__( ( aligned( 16 ) ) );
+
+extern int      bootloader_main( void );
+extern uint32_t SystemCoreClock;
+
+static void               SIM_Fatal( const char* what, uint32_t adr );
+static SIM_RegionTypeDef* SIM_Region( uint32_t adr );
+static uint32_t*          SIM_Backdoor( uint32_t adr );
+static uint8_t            SIM_IsTrapped( uint32_t page );
+static void               SIM_Protect( uint32_t page );
+static void               SIM_FlashProtect( void );
+static void               SIM_Advance( uint64_t t );
+static uint64_t           SIM_NextEvent( void );
+static void               SIM_Access( uint32_t adr, uint8_t write );
+static void               SIM_Write( uint32_t adr, uint32_t old, uint32_t val );
+static void               SIM_FlashWrite( uint32_t adr, uint32_t old, uint32_t val );
+static void               SIM_FlashRegWrite( uint32_t adr, uint32_t old, uint32_t val );
+static void               SIM_FlashStart( uint64_t ns );
+static void               SIM_FlashDone( void );
+static void               SIM_CrcWrite( uint32_t adr, uint32_t val );
+static void               SIM_RccWrite( uint32_t adr, uint32_t val );
+static void               SIM_ScsWrite( uint32_t adr, uint32_t old, uint32_t val );
+static void               SIM_DmaWrite( uint32_t adr, uint32_t old, uint32_t val );
+static void               SIM_FwRuns( uint8_t runs );
+static void               SIM_FwTrap( void );
+static void               SIM_TrapCalibrate( void );
+static void               SIM_RngRead( uint32_t adr );
+static void               SIM_DwtRead( uint32_t adr );
+static void               SIM_DwtWrite( uint32_t adr, uint32_t old, uint32_t val );
+static void               SIM_DmaStart( uint8_t ctrl, uint8_t stream );
+static void               SIM_DmaDone( uint8_t ctrl, uint8_t stream );
+static uint8_t            SIM_IrqLevel( IRQn_Type irq );
+static uint8_t            SIM_TakeIrqs( void );
+static void               SIM_Sleep( uint64_t until, uint8_t wake );
+static void               SIM_Yield( void );
+static void               SIM_Stop( SIM_StateTypeDef state );
+static void               SIM_DeviceMain( void );
+static void               SIM_OnFault( int sig, siginfo_t* info, void* context );
+static void               SIM_OnTrace( int sig, siginfo_t* info, void* context );
+static void               SIM_Fetch( const void* adr ) __attribute__( ( no_instrument_function ) );
+static uint8_t            SIM_FetchConst( const void* adr );
+void                      __cyg_profile_func_enter( void* fn, void* site ) __attribute__( ( no_instrument_function ) );
+void                      __cyg_profile_func_exit( void* fn, void* site ) __attribute__( ( no_instrument_function ) );
+
+/* Memory ----------------------------------------------------------------------*/
+/**
+  * @brief  Map the address space of the firmware, once per process.
+  * @retval None.
+  */
+static void SIM_Map( void )
+{
+  struct sigaction action;
+  uint32_t         i = 0U;
+
+  for ( i=0U; i<( sizeof( simRegion ) / sizeof( simRegion[0] ) ); i++ )
+  {
+    int   fd  = memfd_create( "sim", 0 );
+    void* dev = MAP_FAILED;
+
+    if ( ( fd < 0 ) || ( ftruncate( fd, simRegion[i].size ) != 0 ) )
+    {
+      SIM_Fatal( "memory object", simRegion[i].base );
+    }
+    dev = mmap( ( void* )( uintptr_t )simRegion[i].base, simRegion[i].size, simRegion[i].prot,
+                MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0 );
+    simRegion[i].backdoor = mmap( NULL, simRegion[i].size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( ( dev != ( void* )( uintptr_t )simRegion[i].base ) || ( simRegion[i].backdoor == MAP_FAILED ) )
+    {
+      SIM_Fatal( "device address taken", simRegion[i].base );
+    }
+    close( fd );
+  }
+  for ( i=0U; i<( sizeof( simTrapped ) / sizeof( simTrapped[0] ) ); i++ )
+  {
+    SIM_Protect( simTrapped[i] );
+  }
+
+  memset( &action, 0, sizeof( action ) );
+  action.sa_flags     = SA_SIGINFO | SA_NODEFER;
+  action.sa_sigaction = SIM_OnFault;
+  sigaction( SIGSEGV, &action, NULL );
+  action.sa_sigaction = SIM_OnTrace;
+  sigaction( SIGTRAP, &action, NULL );
+  simMapped = 1U;
+  SIM_TrapCalibrate();
+}
+
+static SIM_RegionTypeDef* SIM_Region( uint32_t adr )
+{
+  for ( uint32_t i=0U; i<( sizeof( simRegion ) / sizeof( simRegion[0] ) ); i++ )
+  {
+    if ( ( adr >= simRegion[i].base ) && ( ( adr - simRegion[i].base ) < simRegion[i].size ) )
+    {
+      return &simRegion[i];
+    }
+  }
+  return NULL;
+}
+
+static uint32_t* SIM_Backdoor( uint32_t adr )
+{
+  SIM_RegionTypeDef* region = SIM_Region( adr );
+
+  if ( region == NULL )
+  {
+    SIM_Fatal( "access outside the emulated memory", adr );
+  }
+  return ( uint32_t* )( region->backdoor + ( ( adr & ~3U ) - region->base ) );
+}
+
+static uint8_t SIM_IsTrapped( uint32_t page )
+{
+  if ( ( page - PERIPH_BB_BASE ) < 0x02000000U )
+  {
+    return 1U;
+  }
+  for ( uint32_t i=0U; i<( sizeof( simTrapped ) / sizeof( simTrapped[0] ) ); i++ )
+  {
+    if ( simTrapped[i] == page )
+    {
+      return 1U;
+    }
+  }
+  return 0U;
+}
+
+/**
+  * @brief  Close a page again after the access. The flash and the register
+  *         pages are only readable: no register read has a side effect, but
+  *         while BSY is set a read of the flash or of FLASH->SR waits for the
+  *         operation. The bit-band alias and the DWT cycle counter are filled
+  *         in for every access.
+  * @param  page: Page address.
+  * @retval None.
+  */
+static void SIM_Protect( uint32_t page )
+{
+  int prot = PROT_READ;
+
+  if ( ( ( page - PERIPH_BB_BASE ) < 0x02000000U ) || ( page == SIM_DWT_PAGE ) || ( page == SIM_RNG_PAGE ) ||
+       ( ( simFlashOp.busy != 0U ) && ( ( SIM_IsTrapped( page ) == 0U ) || ( page == SIM_FLASH_R_PAGE ) ) ) )
+  {
+    prot = PROT_NONE;
+  }
+  mprotect( ( void* )( uintptr_t )page, SIM_PAGE, prot );
+}
+
+static void SIM_FlashProtect( void )
+{
+  int prot = ( simFlashOp.busy != 0U ) ? PROT_NONE : PROT_READ;
+
+  mprotect( ( void* )( uintptr_t )FLASH_BASE, SIM_FLASH_SIZE, prot );
+  SIM_Protect( SIM_FLASH_R_PAGE );
+  for ( uint32_t i=0U; i<simCodeCount; i++ )
+  {
+    if ( simCode[i].constEnd > simCode[i].constBegin )
+    {
+      mprotect( ( void* )simCode[i].constBegin, ( size_t )( simCode[i].constEnd - simCode[i].constBegin ), prot );
+    }
+  }
+}
+
+static void SIM_Fatal( const char* what, uint32_t adr )
+{
+  char msg[160];
+  int  len = snprintf( msg, sizeof( msg ), "SIM: %s at 0x%08X, t = %llu ns\n", what, ( unsigned )adr,
+                       ( unsigned long long )simNow );
+
+  ( void )!write( STDERR_FILENO, msg, ( size_t )len );
+  abort();
+}
+
+/* Bit-band alias word of a peripheral bit */
+static uint32_t SIM_BitBandWord( uint32_t alias )
+{
+  return PERIPH_BASE + ( ( ( alias - PERIPH_BB_BASE ) >> 5U ) & ~3U );
+}
+
+static uint32_t SIM_BitBandMask( uint32_t alias )
+{
+  return 1UL << ( ( ( alias - PERIPH_BB_BASE ) >> 2U ) & 31U );
+}
+
+/**
+  * @brief  Before an access to an alias page: every alias word reads the
+  *         peripheral bit it stands for.
+  */
+static void SIM_BitBandFill( uint32_t page )
+{
+  uint32_t* alias = SIM_Backdoor( page );
+
+  for ( uint32_t i=0U; i<( SIM_PAGE / 4U ); i++ )
+  {
+    uint32_t adr = page + ( i * 4U );
+
+    alias[i] = ( ( SIM_REG( SIM_BitBandWord( adr ) ) & SIM_BitBandMask( adr ) ) != 0U ) ? 1U : 0U;
+  }
+}
+
+/**
+  * @brief  A word written to the alias sets or clears its peripheral bit,
+  *         a read-modify-write of the peripheral register.
+  */
+static void SIM_BitBandWrite( uint32_t alias, uint32_t val )
+{
+  uint32_t adr = SIM_BitBandWord( alias );
+  uint32_t old = SIM_REG( adr );
+  uint32_t now = ( ( val & 1U ) != 0U ) ? ( old | SIM_BitBandMask( alias ) ) : ( old & ~SIM_BitBandMask( alias ) );
+
+  SIM_REG( adr ) = now;
+  if ( SIM_IsTrapped( adr & ~( SIM_PAGE - 1U ) ) != 0U )
+  {
+    SIM_Write( adr, old, now );
+  }
+}
+
+/* Traps -----------------------------------------------------------------------*/
+static void SIM_OnFault( int sig, siginfo_t* info, void* context )
+{
+  ucontext_t* uc    = ( ucontext_t* )context;
+  uintptr_t   adr   = ( uintptr_t )info->si_addr;
+  uint8_t     write = ( ( uc->uc_mcontext.gregs[REG_ERR] & SIM_PF_WRITE ) != 0 ) ? 1U : 0U;
+  uint32_t    page  = ( uint32_t )adr & ~( SIM_PAGE - 1U );
+
+  ( void )sig;
+  SIM_FwTrap();
+  if ( SIM_FetchConst( ( const void* )adr ) != 0U )
+  {
+    /* A read of firmware constants stalled until the end of the operation */
+    SIM_FwRuns( simInDevice );
+    return;
+  }
+  if ( ( adr > 0xFFFFFFFFU ) || ( SIM_Region( ( uint32_t )adr ) == NULL ) || ( simTrap.page != 0U ) )
+  {
+    signal( SIGSEGV, SIG_DFL );
+    SIM_Fatal( "invalid access", ( uint32_t )adr );
+  }
+  SIM_Access( ( uint32_t )adr, write );
+  if ( ( write == 0U ) && ( SIM_IsTrapped( page ) == 0U ) )
+  {
+    /* A flash read stalled until the end of the operation, readable again */
+    SIM_FwRuns( simInDevice );
+    return;
+  }
+  if ( ( page - PERIPH_BB_BASE ) < 0x02000000U )
+  {
+    SIM_BitBandFill( page );
+  }
+  memcpy( simTrap.snapshot, SIM_Backdoor( page ), SIM_PAGE );
+  simTrap.page  = page;
+  simTrap.adr   = ( uint32_t )adr;
+  simTrap.write = write;
+  mprotect( ( void* )( uintptr_t )page, SIM_PAGE, PROT_READ | PROT_WRITE );
+  uc->uc_mcontext.gregs[REG_EFL] |= SIM_EFLAGS_TF;
+}
+
+static void SIM_OnTrace( int sig, siginfo_t* info, void* context )
+{
+  ucontext_t*     uc    = ( ucontext_t* )context;
+  uint32_t        page  = simTrap.page;
+  const uint32_t* now   = NULL;
+  uint32_t        count = 0U;
+  uint32_t        word[SIM_PAGE / 4U];
+  uint32_t        val[SIM_PAGE / 4U];
+
+  ( void )info;
+  if ( page == 0U )
+  {
+    signal( sig, SIG_DFL );
+    raise( sig );
+    return;
+  }
+  uc->uc_mcontext.gregs[REG_EFL] &= ~( greg_t )SIM_EFLAGS_TF;
+  simTrap.page = 0U;
+  SIM_Protect( page );
+  /* The words the instruction wrote, before their handlers change others */
+  now = SIM_Backdoor( page );
+  for ( uint32_t i=0U; i<( SIM_PAGE / 4U ); i++ )
+  {
+    if ( ( now[i] != simTrap.snapshot[i] ) || ( ( simTrap.write != 0U ) && ( i == ( ( simTrap.adr - page ) / 4U ) ) ) )
+    {
+      word[count] = i;
+      val[count]  = now[i];
+      count++;
+    }
+  }
+  for ( uint32_t i=0U; i<count; i++ )
+  {
+    SIM_Write( page + ( word[i] * 4U ), simTrap.snapshot[word[i]], val[i] );
+  }
+  SIM_FwRuns( simInDevice );
+}
+
+/**
+  * @brief  Before an access: the bus waits for a running flash operation,
+  *         the CRC unit takes its cycles per word.
+  * @param  adr: Address accessed.
+  * @param  write: 1 for a write.
+  * @retval None.
+  */
+static void SIM_Access( uint32_t adr, uint8_t write )
+{
+  uint8_t flash = 0U;
+
+  if ( ( adr - PERIPH_BB_BASE ) < 0x02000000U )
+  {
+    adr = SIM_BitBandWord( adr );
+  }
+  flash = ( ( adr - FLASH_BASE ) < SIM_FLASH_SIZE ) ? 1U : 0U;
+
+  if ( ( simFlashOp.busy != 0U ) &&
+       ( ( flash != 0U ) || ( ( adr == ( uint32_t )&FLASH->SR ) && ( write == 0U ) ) ||
+         ( ( write != 0U ) && ( ( adr == ( uint32_t )&FLASH->CR ) || ( adr == ( uint32_t )&FLASH->KEYR ) ) ) ) )
+  {
+    /* A flash access stalls the CPU, a BSY poll loop ends with the operation */
+    simFlashStats.stalls += flash;
+    SIM_Advance( simFlashOp.end );
+  }
+  if ( ( write != 0U ) && ( adr == ( uint32_t )&CRC->DR ) )
+  {
+    SIM_Advance( simNow + SIM_CYCLES( SIM_CRC_WORD_CYCLES ) );
+  }
+  if ( write == 0U )
+  {
+    SIM_DwtRead( adr );
+    SIM_RngRead( adr );
+  }
+}
+
+/**
+  * @brief  A word written by the firmware or the DMA.
+  * @param  adr: Word address.
+  * @param  old: Value before the write.
+  * @param  val: Value written, already in the memory.
+  * @retval None.
+  */
+static void SIM_Write( uint32_t adr, uint32_t old, uint32_t val )
+{
+  uint32_t page = adr & ~( SIM_PAGE - 1U );
+
+  if ( ( adr - FLASH_BASE ) < SIM_FLASH_SIZE )
+  {
+    SIM_FlashWrite( adr, old, val );
+  }
+  else if ( ( adr - PERIPH_BB_BASE ) < 0x02000000U )
+  {
+    SIM_BitBandWrite( adr, val );
+  }
+  else if ( page == SIM_SCS_PAGE )
+  {
+    SIM_ScsWrite( adr, old, val );
+  }
+  else if ( page == SIM_DWT_PAGE )
+  {
+    SIM_DwtWrite( adr, old, val );
+  }
+  else if ( ( adr - FLASH_R_BASE ) < 0x400U )
+  {
+    SIM_FlashRegWrite( adr, old, val );
+  }
+  else if ( ( adr - CRC_BASE ) < 0x400U )
+  {
+    SIM_CrcWrite( adr, val );
+  }
+  else if ( ( adr - RCC_BASE ) < 0x400U )
+  {
+    SIM_RccWrite( adr, val );
+  }
+  else if ( ( adr - DMA1_BASE ) < 0x800U )
+  {
+    SIM_DmaWrite( adr, old, val );
+  }
+}
+
+/**
+  * @brief  Fetch of firmware code at a call or a return: code in the flash
+  *         waits for a running flash operation. Code the test calls outside
+  *         of the device, such as the AES of the host tool, does not.
+  * @param  adr: Address of the code.
+  * @retval None.
+  */
+static void SIM_Fetch( const void* adr )
+{
+  if ( ( simFlashOp.busy == 0U ) || ( ( simInDevice == 0U ) && ( simInIrq == 0U ) ) )
+  {
+    return;
+  }
+  for ( uint32_t i=0U; i<simCodeCount; i++ )
+  {
+    if ( ( ( const uint8_t* )adr >= simCode[i].begin ) && ( ( const uint8_t* )adr < simCode[i].end ) )
+    {
+      simFlashStats.fetches++;
+      SIM_Advance( simFlashOp.end );
+      return;
+    }
+  }
+}
+
+/**
+  * @brief  Read of a firmware constant, a fault on its pages while BSY is
+  *         set: .rodata is in the flash and waits for the operation as well.
+  * @param  adr: Address read.
+  * @retval 1 if the address is a constant of the firmware in the flash.
+  */
+static uint8_t SIM_FetchConst( const void* adr )
+{
+  for ( uint32_t i=0U; i<simCodeCount; i++ )
+  {
+    if ( ( ( const uint8_t* )adr >= simCode[i].constBegin ) && ( ( const uint8_t* )adr < simCode[i].constEnd ) )
+    {
+      simFlashStats.stalls++;
+      SIM_Advance( simFlashOp.end );
+      return 1U;
+    }
+  }
+  return 0U;
+}
+
+void __cyg_profile_func_enter( void* fn, void* site )
+{
+  ( void )site;
+  SIM_Fetch( fn );
+}
+
+void __cyg_profile_func_exit( void* fn, void* site )
+{
+  ( void )fn;
+  SIM_Fetch( site );
+}
+
+/* FLASH -----------------------------------------------------------------------*/
+uint32_t SIM_FlashSector( uint32_t address )
+{
+  uint32_t adr = FLASH_BASE;
+
+  for ( uint32_t i=0U; i<SIM_FLASH_SECTORS; i++ )
+  {
+    adr += simSectorKb[i] * 1024U;
+    if ( ( address >= FLASH_BASE ) && ( address < adr ) )
+    {
+      return i;
+    }
+  }
+  return SIM_FLASH_SECTORS;
+}
+
+static uint32_t SIM_SectorBase( uint32_t sector )
+{
+  uint32_t adr = FLASH_BASE;
+
+  for ( uint32_t i=0U; i<sector; i++ )
+  {
+    adr += simSectorKb[i] * 1024U;
+  }
+  return adr;
+}
+
+static void SIM_FlashError( uint32_t flag )
+{
+  SIM_REG( ( uint32_t )&FLASH->SR ) |= flag;
+  simFlashStats.errors++;
+}
+
+/**
+  * @brief  Word written to the flash memory: programmed if the sequence is
+  *         right, a programmed bit stays 0 until the sector is erased.
+  */
+static void SIM_FlashWrite( uint32_t adr, uint32_t old, uint32_t val )
+{
+  uint32_t cr = SIM_REG( ( uint32_t )&FLASH->CR );
+
+  SIM_REG( adr ) = old;
+  if ( ( ( cr & FLASH_CR_LOCK ) != 0U ) || ( ( cr & FLASH_CR_PG ) == 0U ) || ( ( cr & ( FLASH_CR_SER | FLASH_CR_MER ) ) != 0U ) )
+  {
+    SIM_FlashError( FLASH_SR_PGSERR );
+    return;
+  }
+  if ( ( cr & FLASH_CR_PSIZE ) != FLASH_PSIZE_WORD )
+  {
+    SIM_FlashError( FLASH_SR_PGPERR );
+    return;
+  }
+  SIM_REG( adr ) = old & val;
+  simFlashStats.words++;
+  simFlashStats.reprograms += ( old != 0xFFFFFFFFU ) ? 1U : 0U;
+  simFlashStats.bootWrites += ( adr < APP_ADDRESS ) ? 1U : 0U;
+  simFlashStats.programNs  += SIM_FLASH_WORD_NS;
+  SIM_FlashStart( SIM_FLASH_WORD_NS );
+}
+
+static void SIM_FlashRegWrite( uint32_t adr, uint32_t old, uint32_t val )
+{
+  uint32_t* reg = SIM_Backdoor( adr );
+
+  simFlashStats.regWrites++;
+  if ( adr == ( uint32_t )&FLASH->KEYR )
+  {
+    if ( val == FLASH_KEY1 )
+    {
+      simFlashOp.key = 1U;
+    }
+    else
+    {
+      if ( ( simFlashOp.key != 0U ) && ( val == FLASH_KEY2 ) )
+      {
+        SIM_REG( ( uint32_t )&FLASH->CR ) &= ~FLASH_CR_LOCK;
+      }
+      simFlashOp.key = 0U;
+    }
+    *reg = 0U;
+  }
+  else if ( adr == ( uint32_t )&FLASH->OPTKEYR )
+  {
+    *reg = 0U;
+  }
+  else if ( adr == ( uint32_t )&FLASH->SR )
+  {
+    /* Error and EOP flags cleared by writing 1, BSY read only */
+    *reg = old & ~( val & ( FLASH_SR_EOP | SIM_FLASH_ERRORS ) );
+  }
+  else if ( adr == ( uint32_t )&FLASH->CR )
+  {
+    if ( ( old & FLASH_CR_LOCK ) != 0U )
+    {
+      *reg = old;
+      return;
+    }
+    if ( ( ( val & FLASH_CR_STRT ) != 0U ) && ( ( old & FLASH_CR_STRT ) == 0U ) && ( simFlashOp.busy == 0U ) )
+    {
+      if ( ( val & FLASH_CR_MER ) != 0U )
+      {
+        memset( SIM_Backdoor( FLASH_BASE ), 0xFF, SIM_FLASH_SIZE );
+        simFlashStats.bootWrites++;
+        simFlashStats.eraseNs += SIM_MS( 16000U );
+        SIM_FlashStart( SIM_MS( 16000U ) );
+      }
+      else if ( ( val & FLASH_CR_SER ) != 0U )
+      {
+        uint32_t sector = ( val & FLASH_CR_SNB ) >> FLASH_CR_SNB_Pos;
+
+        if ( sector >= SIM_FLASH_SECTORS )
+        {
+          SIM_FlashError( FLASH_SR_WRPERR );
+          *reg = val & ~FLASH_CR_STRT;
+          return;
+        }
+        memset( SIM_Backdoor( SIM_SectorBase( sector ) ), 0xFF, simSectorKb[sector] * 1024U );
+        simFlashStats.erases[sector]++;
+        simFlashStats.bootWrites += ( SIM_SectorBase( sector ) < APP_ADDRESS ) ? 1U : 0U;
+        simFlashStats.eraseNs    += SIM_MS( simSectorMs[sector] );
+        SIM_FlashStart( SIM_MS( simSectorMs[sector] ) );
+      }
+      else
+      {
+        val &= ~FLASH_CR_STRT;
+      }
+    }
+    *reg = val;
+  }
+}
+
+static void SIM_FlashStart( uint64_t ns )
+{
+  simFlashOp.busy = 1U;
+  simFlashOp.end  = simNow + ns;
+  SIM_REG( ( uint32_t )&FLASH->SR ) |= FLASH_SR_BSY;
+  SIM_FlashProtect();
+}
+
+static void SIM_FlashDone( void )
+{
+  simFlashOp.busy = 0U;
+  SIM_REG( ( uint32_t )&FLASH->SR ) &= ~FLASH_SR_BSY;
+  SIM_REG( ( uint32_t )&FLASH->CR ) &= ~FLASH_CR_STRT;
+  if ( ( SIM_REG( ( uint32_t )&FLASH->CR ) & FLASH_CR_EOPIE ) != 0U )
+  {
+    /* EOP is only set with its interrupt enabled */
+    SIM_REG( ( uint32_t )&FLASH->SR ) |= FLASH_SR_EOP;
+  }
+  SIM_FlashProtect();
+}
+
+/* CRC, RCC --------------------------------------------------------------------*/
+static uint32_t SIM_CrcWord( uint32_t crc, uint32_t word )
+{
+  crc ^= word;
+  for ( uint32_t i=0U; i<32U; i++ )
+  {
+    crc = ( ( crc & 0x80000000U ) != 0U ) ? ( ( crc << 1U ) ^ 0x04C11DB7U ) : ( crc << 1U );
+  }
+  return crc;
+}
+
+static void SIM_CrcWrite( uint32_t adr, uint32_t val )
+{
+  static uint32_t crc = 0xFFFFFFFFU;
+
+  if ( adr == ( uint32_t )&CRC->DR )
+  {
+    crc = SIM_CrcWord( crc, val );
+    SIM_REG( adr ) = crc;
+  }
+  else if ( adr == ( uint32_t )&CRC->CR )
+  {
+    if ( ( val & CRC_CR_RESET ) != 0U )
+    {
+      crc = 0xFFFFFFFFU;
+      SIM_REG( ( uint32_t )&CRC->DR ) = crc;
+    }
+    SIM_REG( adr ) = 0U;
+  }
+  else
+  {
+    SIM_REG( adr ) = val & 0xFFU;
+  }
+}
+
+uint32_t SIM_Crc32( const uint8_t* data, uint32_t length )
+{
+  uint32_t crc = 0xFFFFFFFFU;
+  uint32_t word;
+
+  for ( uint32_t i=0U; ( i + 4U ) <= length; i += 4U )
+  {
+    memcpy( &word, &data[i], 4U );
+    crc = SIM_CrcWord( crc, word );
+  }
+  return crc;
+}
+
+/**
+  * @brief  Clocks: every oscillator and the PLL are ready as soon as they
+  *         are switched on, the system clock switch at once.
+  */
+static void SIM_RccWrite( uint32_t adr, uint32_t val )
+{
+  if ( adr == ( uint32_t )&RCC->CR )
+  {
+    val &= ~( RCC_CR_HSIRDY | RCC_CR_HSERDY | RCC_CR_PLLRDY | RCC_CR_PLLI2SRDY );
+    val |= ( ( val & RCC_CR_HSION ) != 0U ) ? RCC_CR_HSIRDY : 0U;
+    val |= ( ( val & RCC_CR_HSEON ) != 0U ) ? RCC_CR_HSERDY : 0U;
+    val |= ( ( val & RCC_CR_PLLON ) != 0U ) ? RCC_CR_PLLRDY : 0U;
+    val |= ( ( val & RCC_CR_PLLI2SON ) != 0U ) ? RCC_CR_PLLI2SRDY : 0U;
+  }
+  else if ( adr == ( uint32_t )&RCC->CFGR )
+  {
+    val = ( val & ~RCC_CFGR_SWS ) | ( ( val & RCC_CFGR_SW ) << 2U );
+  }
+  SIM_REG( adr ) = val;
+}
+
+/* RNG -------------------------------------------------------------------------*/
+/**
+  * @brief  Before a read: with its clock and RNGEN a new random word is
+  *         ready at every read of DR, the seed and clock are never in error.
+  */
+static void SIM_RngRead( uint32_t adr )
+{
+  uint8_t on = ( ( ( SIM_REG( ( uint32_t )&RCC->AHB2ENR ) & RCC_AHB2ENR_RNGEN ) != 0U ) &&
+                 ( ( SIM_REG( ( uint32_t )&RNG->CR ) & RNG_CR_RNGEN ) != 0U ) ) ? 1U : 0U;
+
+  if ( ( adr & ~( SIM_PAGE - 1U ) ) != SIM_RNG_PAGE )
+  {
+    return;
+  }
+  SIM_REG( ( uint32_t )&RNG->SR ) = ( on != 0U ) ? RNG_SR_DRDY : 0U;
+  if ( ( adr == ( uint32_t )&RNG->DR ) && ( on != 0U ) )
+  {
+    simRngState ^= simRngState >> 12U;
+    simRngState ^= simRngState << 25U;
+    simRngState ^= simRngState >> 27U;
+    SIM_REG( adr ) = ( uint32_t )( ( simRngState * 0x2545F4914F6CDD1DULL ) >> 32U );
+  }
+}
+
+/* DWT -------------------------------------------------------------------------*/
+static uint64_t SIM_HostNs( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( ( uint64_t )ts.tv_sec * 1000000000ULL ) + ( uint64_t )ts.tv_nsec;
+}
+
+/**
+  * @brief  The firmware code runs from now on (1), or the simulator does (0):
+  *         a trap, the host side of SIM_Run().
+  */
+static void SIM_FwRuns( uint8_t runs )
+{
+  uint64_t now = SIM_HostNs();
+
+  if ( simFwSince != 0U )
+  {
+    simFwNs += now - simFwSince;
+  }
+  simFwSince = ( runs != 0U ) ? now : 0U;
+}
+
+/**
+  * @brief  The firmware code stopped at a trap. The kernel delivers the
+  *         signal before the handler runs and returns to the firmware after
+  *         it: that time is taken off as it was calibrated.
+  */
+static void SIM_FwTrap( void )
+{
+  uint64_t now = SIM_HostNs();
+
+  if ( simFwSince != 0U )
+  {
+    simFwNs += ( ( now - simFwSince ) > simTrapNs ) ? ( ( now - simFwSince ) - simTrapNs ) : 0U;
+  }
+  simFwSince = 0U;
+}
+
+/**
+  * @brief  Host time of a trap outside its handlers, from trapped reads that
+  *         follow each other as if the firmware ran.
+  */
+static void SIM_TrapCalibrate( void )
+{
+  simFwNs     = 0U;
+  simInDevice = 1U;
+  SIM_FwRuns( 1U );
+  /* The handlers read the state the loop leaves to them */
+  __atomic_signal_fence( __ATOMIC_SEQ_CST );
+  for ( uint32_t i=0U; i<SIM_TRAP_SAMPLES; i++ )
+  {
+    ( void )DWT->CYCCNT;
+  }
+  __atomic_signal_fence( __ATOMIC_SEQ_CST );
+  SIM_FwRuns( 0U );
+  simInDevice = 0U;
+  simTrapNs   = simFwNs / SIM_TRAP_SAMPLES;
+  simFwNs     = 0U;
+}
+
+/**
+  * @brief  Cycles of the virtual time and of the host time the firmware code
+  *         took: the CPU time of the device is not modelled, that of the host
+  *         stands in for it.
+  */
+static uint32_t SIM_DwtCount( void )
+{
+  return ( uint32_t )( ( ( simNow + simFwNs ) * ( SIM_HCLK_HZ / 1000000ULL ) ) / 1000ULL );
+}
+
+/* Before a read: CYCCNT counts while CYCCNTENA is set */
+static void SIM_DwtRead( uint32_t adr )
+{
+  if ( ( adr == ( uint32_t )&DWT->CYCCNT ) && ( ( SIM_REG( ( uint32_t )&DWT->CTRL ) & DWT_CTRL_CYCCNTENA_Msk ) != 0U ) )
+  {
+    SIM_REG( adr ) = SIM_DwtCount() + simDwtOffset;
+  }
+}
+
+static void SIM_DwtWrite( uint32_t adr, uint32_t old, uint32_t val )
+{
+  if ( adr == ( uint32_t )&DWT->CYCCNT )
+  {
+    simDwtOffset = val - SIM_DwtCount();
+  }
+  else if ( adr == ( uint32_t )&DWT->CTRL )
+  {
+    if ( ( ( val & DWT_CTRL_CYCCNTENA_Msk ) != 0U ) && ( ( old & DWT_CTRL_CYCCNTENA_Msk ) == 0U ) )
+    {
+      /* Counts on from the value it was stopped at */
+      simDwtOffset = SIM_REG( ( uint32_t )&DWT->CYCCNT ) - SIM_DwtCount();
+    }
+    else if ( ( ( val & DWT_CTRL_CYCCNTENA_Msk ) == 0U ) && ( ( old & DWT_CTRL_CYCCNTENA_Msk ) != 0U ) )
+    {
+      SIM_REG( ( uint32_t )&DWT->CYCCNT ) = SIM_DwtCount() + simDwtOffset;
+    }
+  }
+}
+
+/* DMA -------------------------------------------------------------------------*/
+static uint32_t SIM_DmaStream( uint8_t ctrl, uint8_t stream )
+{
+  return ( ( ctrl == 0U ) ? DMA1_BASE : DMA2_BASE ) + 0x10U + ( 0x18U * stream );
+}
+
+static uint32_t* SIM_DmaIsr( uint8_t ctrl, uint8_t stream )
+{
+  return SIM_Backdoor( ( ( ctrl == 0U ) ? DMA1_BASE : DMA2_BASE ) + ( ( stream < 4U ) ? 0x00U : 0x04U ) );
+}
+
+static void SIM_DmaWrite( uint32_t adr, uint32_t old, uint32_t val )
+{
+  uint8_t  ctrl = ( adr >= DMA2_BASE ) ? 1U : 0U;
+  uint32_t off  = adr - ( ( ctrl == 0U ) ? DMA1_BASE : DMA2_BASE );
+  uint8_t  stream;
+
+  if ( off < 0x08U )
+  {
+    /* LISR, HISR: read only */
+    SIM_REG( adr ) = old;
+  }
+  else if ( off < 0x10U )
+  {
+    /* LIFCR, HIFCR: clear the flags written with 1 */
+    SIM_REG( adr - 0x08U ) &= ~val;
+    SIM_REG( adr ) = 0U;
+  }
+  else if ( ( ( off - 0x10U ) % 0x18U ) == 0U )
+  {
+    stream = ( uint8_t )( ( off - 0x10U ) / 0x18U );
+    if ( ( ( val & DMA_SxCR_EN ) != 0U ) && ( ( old & DMA_SxCR_EN ) == 0U ) )
+    {
+      SIM_DmaStart( ctrl, stream );
+    }
+    else if ( ( ( val & DMA_SxCR_EN ) == 0U ) && ( simDma[ctrl][stream].busy != 0U ) )
+    {
+      /* Disabled while running: stopped with the transfer complete flag */
+      SIM_DmaDone( ctrl, stream );
+    }
+  }
+}
+
+/**
+  * @brief  Memory to memory transfer: the data moves at once, the stream
+  *         completes after its bus cycles, delayed by a busy flash.
+  */
+static void SIM_DmaStart( uint8_t ctrl, uint8_t stream )
+{
+  uint32_t base = SIM_DmaStream( ctrl, stream );
+  uint32_t cr   = SIM_REG( base );
+  uint32_t n    = SIM_REG( base + 0x04U ) & 0xFFFFU;
+  uint32_t src  = SIM_REG( base + 0x08U );
+  uint32_t dst  = SIM_REG( base + 0x0CU );
+  uint32_t size = 1U << ( ( cr & DMA_SxCR_PSIZE ) >> DMA_SxCR_PSIZE_Pos );
+  uint64_t from = ( simFlashOp.busy != 0U ) ? simFlashOp.end : simNow;
+
+  if ( ( cr & DMA_SxCR_DIR ) != DMA_SxCR_DIR_1 )
+  {
+    SIM_Fatal( "DMA direction not emulated", base );
+  }
+  if ( size != 4U )
+  {
+    SIM_Fatal( "DMA item size not emulated", base );
+  }
+  for ( uint32_t i=0U; i<n; i++ )
+  {
+    uint32_t* to  = SIM_Backdoor( dst );
+    uint32_t  old = *to;
+
+    *to = *SIM_Backdoor( src );
+    if ( SIM_IsTrapped( dst & ~( SIM_PAGE - 1U ) ) != 0U )
+    {
+      SIM_Write( dst, old, *to );
+    }
+    src += ( ( cr & DMA_SxCR_PINC ) != 0U ) ? size : 0U;
+    dst += ( ( cr & DMA_SxCR_MINC ) != 0U ) ? size : 0U;
+  }
+  simDma[ctrl][stream].busy = 1U;
+  simDma[ctrl][stream].end  = from + SIM_CYCLES( ( uint64_t )n * SIM_DMA_WORD_CYCLES );
+  simFlashStats.dmaNs      += simDma[ctrl][stream].end - simNow;
+}
+
+static void SIM_DmaDone( uint8_t ctrl, uint8_t stream )
+{
+  uint32_t base = SIM_DmaStream( ctrl, stream );
+
+  simDma[ctrl][stream].busy = 0U;
+  SIM_REG( base )          &= ~DMA_SxCR_EN;
+  SIM_REG( base + 0x04U )   = 0U;
+  *SIM_DmaIsr( ctrl, stream ) |= ( uint32_t )( DMA_LISR_TCIF0 | DMA_LISR_HTIF0 ) << simDmaShift[stream % 4U];
+}
+
+/* System Control Space --------------------------------------------------------*/
+static void SIM_ScsWrite( uint32_t adr, uint32_t old, uint32_t val )
+{
+  uint32_t word;
+
+  ( void )old;
+  if ( ( adr >= SIM_NVIC_ISER ) && ( adr < ( SIM_NVIC_ICPR + ( 4U * SIM_NVIC_WORDS ) ) ) )
+  {
+    word = ( adr & 0x7FU ) / 4U;
+    if ( word >= SIM_NVIC_WORDS )
+    {
+      return;
+    }
+    switch ( adr & ~0x7FU )
+    {
+      case SIM_NVIC_ISER: simNvicEnabled[word] |= val;  break;
+      case SIM_NVIC_ICER: simNvicEnabled[word] &= ~val; break;
+      case SIM_NVIC_ISPR: simNvicPending[word] |= val;  break;
+      default:            simNvicPending[word] &= ~val; break;
+    }
+    SIM_REG( SIM_NVIC_ISER + ( 4U * word ) ) = simNvicEnabled[word];
+    SIM_REG( SIM_NVIC_ICER + ( 4U * word ) ) = simNvicEnabled[word];
+    SIM_REG( SIM_NVIC_ISPR + ( 4U * word ) ) = simNvicPending[word];
+    SIM_REG( SIM_NVIC_ICPR + ( 4U * word ) ) = simNvicPending[word];
+  }
+  else if ( adr == ( uint32_t )&SysTick->CTRL )
+  {
+    if ( ( val & SysTick_CTRL_ENABLE_Msk ) != 0U )
+    {
+      simTickPeriod = ( ( uint64_t )( SIM_REG( ( uint32_t )&SysTick->LOAD ) + 1U ) * 1000000000ULL ) /
+                      ( ( SystemCoreClock != 0U ) ? SystemCoreClock : HSI_VALUE );
+      simTickNext   = simNow + simTickPeriod;
+    }
+    else
+    {
+      simTickNext = SIM_NEVER;
+    }
+  }
+}
+
+/* Time and interrupts -----------------------------------------------------------*/
+static uint64_t SIM_NextEvent( void )
+{
+  uint64_t next = simTickNext;
+
+  if ( ( simFlashOp.busy != 0U ) && ( simFlashOp.end < next ) )
+  {
+    next = simFlashOp.end;
+  }
+  for ( uint8_t c=0U; c<2U; c++ )
+  {
+    for ( uint8_t s=0U; s<SIM_DMA_STREAMS; s++ )
+    {
+      if ( ( simDma[c][s].busy != 0U ) && ( simDma[c][s].end < next ) )
+      {
+        next = simDma[c][s].end;
+      }
+    }
+  }
+  return next;
+}
+
+/**
+  * @brief  Let the hardware run until t, no firmware is called.
+  * @param  t: Time in ns.
+  * @retval None.
+  */
+static void SIM_Advance( uint64_t t )
+{
+  uint64_t next = SIM_NextEvent();
+
+  while ( next <= t )
+  {
+    simNow = ( next > simNow ) ? next : simNow;
+    if ( ( simFlashOp.busy != 0U ) && ( simFlashOp.end <= simNow ) )
+    {
+      SIM_FlashDone();
+    }
+    for ( uint8_t c=0U; c<2U; c++ )
+    {
+      for ( uint8_t s=0U; s<SIM_DMA_STREAMS; s++ )
+      {
+        if ( ( simDma[c][s].busy != 0U ) && ( simDma[c][s].end <= simNow ) )
+        {
+          SIM_DmaDone( c, s );
+        }
+      }
+    }
+    if ( simTickNext <= simNow )
+    {
+      simTickPending = 1U;
+      simTickNext   += simTickPeriod;
+    }
+    next = SIM_NextEvent();
+  }
+  simNow = ( t > simNow ) ? t : simNow;
+}
+
+static uint8_t SIM_IrqLevel( IRQn_Type irq )
+{
+  uint32_t sr = SIM_REG( ( uint32_t )&FLASH->SR );
+  uint32_t cr = SIM_REG( ( uint32_t )&FLASH->CR );
+
+  if ( ( simNvicPending[irq / 32U] & ( 1UL << ( irq % 32U ) ) ) != 0U )
+  {
+    return 1U;
+  }
+  if ( irq == FLASH_IRQn )
+  {
+    return ( ( ( ( sr & FLASH_SR_EOP ) != 0U ) && ( ( cr & FLASH_CR_EOPIE ) != 0U ) ) ||
+             ( ( ( sr & SIM_FLASH_ERRORS ) != 0U ) && ( ( cr & FLASH_IT_ERR ) != 0U ) ) ) ? 1U : 0U;
+  }
+  for ( uint8_t c=0U; c<2U; c++ )
+  {
+    for ( uint8_t s=0U; s<SIM_DMA_STREAMS; s++ )
+    {
+      if ( simDmaIrq[c][s] == irq )
+      {
+        uint32_t base  = SIM_DmaStream( c, s );
+        uint32_t flags = *SIM_DmaIsr( c, s ) >> simDmaShift[s % 4U];
+        uint32_t scr   = SIM_REG( base );
+        uint32_t fcr   = SIM_REG( base + 0x14U );
+
+        return ( ( ( flags & DMA_LISR_TCIF0 ) && ( scr & DMA_SxCR_TCIE ) ) ||
+                 ( ( flags & DMA_LISR_HTIF0 ) && ( scr & DMA_SxCR_HTIE ) ) ||
+                 ( ( flags & DMA_LISR_TEIF0 ) && ( scr & DMA_SxCR_TEIE ) ) ||
+                 ( ( flags & DMA_LISR_DMEIF0 ) && ( scr & DMA_SxCR_DMEIE ) ) ||
+                 ( ( flags & DMA_LISR_FEIF0 ) && ( fcr & DMA_SxFCR_FEIE ) ) ) ? 1U : 0U;
+      }
+    }
+  }
+  return 0U;
+}
+
+/**
+  * @brief  Take the pending exceptions, SysTick first.
+  * @retval 1 if one was taken.
+  */
+static uint8_t SIM_TakeIrqs( void )
+{
+  uint8_t  taken = 0U;
+  uint32_t count = 0U;
+
+  while ( simPrimask == 0U )
+  {
+    void ( *handler )( void ) = NULL;
+
+    if ( ( simTickPending != 0U ) && ( ( SIM_REG( ( uint32_t )&SysTick->CTRL ) & SysTick_CTRL_TICKINT_Msk ) != 0U ) )
+    {
+      simTickPending = 0U;
+      handler        = SysTick_Handler;
+    }
+    for ( uint32_t i=0U; ( handler == NULL ) && ( i<( sizeof( simVector ) / sizeof( simVector[0] ) ) ); i++ )
+    {
+      if ( ( ( simNvicEnabled[simVector[i].irq / 32U] & ( 1UL << ( simVector[i].irq % 32U ) ) ) != 0U ) &&
+           ( SIM_IrqLevel( simVector[i].irq ) != 0U ) )
+      {
+        simNvicPending[simVector[i].irq / 32U] &= ~( 1UL << ( simVector[i].irq % 32U ) );
+        handler = simVector[i].handler;
+      }
+    }
+    if ( handler == NULL )
+    {
+      break;
+    }
+    if ( ++count > SIM_IRQ_STORM )
+    {
+      SIM_Fatal( "interrupt not cleared by its handler", 0U );
+    }
+    handler();
+    taken    = 1U;
+    simEvent = 1U;
+  }
+  return taken;
+}
+
+/**
+  * @brief  Sleep of the firmware until an interrupt, or the time given.
+  *         The test gets the CPU back when its time is over.
+  * @param  until: Time to return at, SIM_NEVER for none.
+  * @param  wake: 1 to return on an event, WFE.
+  * @retval None.
+  */
+static void SIM_Sleep( uint64_t until, uint8_t wake )
+{
+  for ( ;; )
+  {
+    ( void )SIM_TakeIrqs();
+    if ( ( wake != 0U ) && ( simEvent != 0U ) )
+    {
+      simEvent = 0U;
+      return;
+    }
+    if ( simNow >= until )
+    {
+      return;
+    }
+    uint64_t next = SIM_NextEvent();
+    next = ( next < until ) ? next : until;
+    if ( next > simDeadline )
+    {
+      SIM_Advance( simDeadline );
+      SIM_Yield();
+    }
+    else
+    {
+      SIM_Advance( next );
+    }
+  }
+}
+
+static void SIM_Yield( void )
+{
+  SIM_FwRuns( 0U );
+  simInDevice = 0U;
+  swapcontext( &simDeviceCtx, &simHostCtx );
+  simInDevice = 1U;
+  SIM_FwRuns( 1U );
+}
+
+/**
+  * @brief  The firmware is gone: reset, jump to the application or halt.
+  *         Never returns to the firmware.
+  */
+static void SIM_Stop( SIM_StateTypeDef state )
+{
+  simState = state;
+  if ( simInIrq != 0U )
+  {
+    longjmp( simIrqExit, 1 );
+  }
+  if ( simInDevice == 0U )
+  {
+    SIM_Fatal( "firmware stopped outside of the device", 0U );
+  }
+  simInDevice = 0U;
+  setcontext( &simHostCtx );
+  abort();
+}
+
+static void SIM_DeviceMain( void )
+{
+  SystemInit();
+  ( void )bootloader_main();
+  SIM_Fatal( "main() returned", 0U );
+}
+
+/* CMSIS core functions of test/core_cm3.h --------------------------------------*/
+void SIM_EnableIrq( void )
+{
+  simPrimask = 0U;
+}
+
+void SIM_DisableIrq( void )
+{
+  /* Error_Handler() masks the interrupts before its endless loop */
+  if ( ( ( uintptr_t )__builtin_return_address( 0 ) - ( uintptr_t )Error_Handler ) < 0x40U )
+  {
+    SIM_Fatal( "Error_Handler", 0U );
+  }
+  simPrimask = 1U;
+}
+
+uint32_t SIM_GetPrimask( void )
+{
+  return simPrimask;
+}
+
+void SIM_SetPrimask( uint32_t primask )
+{
+  simPrimask = ( uint8_t )( primask & 1U );
+}
+
+void SIM_WaitForEvent( void )
+{
+  if ( simInDevice == 0U )
+  {
+    SIM_Fatal( "WFE outside of the device", 0U );
+  }
+  if ( simEvent != 0U )
+  {
+    simEvent = 0U;
+    return;
+  }
+  SIM_Sleep( SIM_NEVER, 1U );
+}
+
+void SIM_SendEvent( void )
+{
+  simEvent = 1U;
+}
+
+void SIM_SetMsp( uint32_t topOfMainStack )
+{
+  simAppStack = topOfMainStack;
+  SIM_Stop( SIM_APPLICATION );
+  for ( ;; ) { }
+}
+
+void SIM_SystemReset( void )
+{
+  SIM_Stop( SIM_RESET );
+  for ( ;; ) { }
+}
+
+/* HAL time base ---------------------------------------------------------------*/
+uint32_t HAL_GetTick( void )
+{
+  return ( uint32_t )( simNow / SIM_MS( 1U ) );
+}
+
+void HAL_Delay( uint32_t Delay )
+{
+  uint64_t until = simNow + SIM_MS( Delay ) + ( ( Delay < HAL_MAX_DELAY ) ? SIM_MS( 1U ) : 0U );
+
+  if ( simInDevice != 0U )
+  {
+    SIM_Sleep( until, 0U );
+  }
+  else
+  {
+    SIM_Advance( until );
+  }
+}
+
+/* Test interface ----------------------------------------------------------------*/
+/**
+  * @brief  RAM of the firmware, registered by the markers of a test/fw_*.c
+  *         file before main() of the tests.
+  * @param  begin: First marker, the variables follow it.
+  * @param  end: Last marker.
+  * @retval None.
+  */
+void SIM_RamRegion( void* begin, void* end )
+{
+  SIM_RamTypeDef* ram = &simRam[simRamCount];
+
+  if ( ( ( uint8_t* )end <= ( uint8_t* )begin ) || ( simRamCount >= SIM_RAM_REGIONS ) )
+  {
+    SIM_Fatal( "firmware RAM markers out of order, build with -fno-toplevel-reorder", ( uint32_t )( uintptr_t )begin );
+  }
+  ram->base    = ( uint8_t* )begin;
+  ram->size    = ( size_t )( ( uint8_t* )end - ( uint8_t* )begin );
+  ram->initial = malloc( ram->size );
+  memcpy( ram->initial, ram->base, ram->size );
+  simRamCount++;
+}
+
+/**
+  * @brief  Code of the firmware in the flash, registered by the markers of a
+  *         test/fw_*.c file before main() of the tests.
+  * @param  begin: First marker, the functions follow it.
+  * @param  end: Last marker.
+  * @param  constBegin: First marker in .rodata, the constants follow it.
+  * @param  constEnd: Last marker in .rodata, may equal constBegin.
+  * @retval None.
+  */
+void SIM_CodeRegion( const void* begin, const void* end, const void* constBegin, const void* constEnd )
+{
+  if ( ( ( const uint8_t* )end <= ( const uint8_t* )begin ) || ( ( const uint8_t* )constEnd < ( const uint8_t* )constBegin ) ||
+       ( simCodeCount >= SIM_CODE_REGIONS ) )
+  {
+    SIM_Fatal( "firmware code markers out of order, build with -fno-toplevel-reorder", ( uint32_t )( uintptr_t )begin );
+  }
+  simCode[simCodeCount].begin      = ( const uint8_t* )begin;
+  simCode[simCodeCount].end        = ( const uint8_t* )end;
+  simCode[simCodeCount].constBegin = ( const uint8_t* )constBegin;
+  simCode[simCodeCount].constEnd   = ( const uint8_t* )constEnd;
+  simCodeCount++;
+}
+
+/**
+  * @brief  Power on: flash erased, no firmware running, time 0.
+  */
+void SIM_PowerOn( void )
+{
+  if ( simMapped == 0U )
+  {
+    SIM_Map();
+  }
+  simState    = SIM_OFF;
+  simNow      = 0U;
+  simFlashOp  = ( SIM_FlashOpTypeDef ){ 0 };
+  SIM_FlashProtect();
+  memset( SIM_Backdoor( FLASH_BASE ), 0xFF, SIM_FLASH_SIZE );
+  memset( &simFlashStats, 0, sizeof( simFlashStats ) );
+  simBootPins = 0x3U;
+}
+
+/**
+  * @brief  Reset of the device: registers at their reset value, main() of
+  *         the bootloader runs until its first WFE.
+  */
+void SIM_Boot( void )
+{
+  static const uint32_t uid[3U] = { 0x00350028U, 0x4D4B5011U, 0x20383651U };
+
+  if ( simMapped == 0U )
+  {
+    SIM_PowerOn();
+  }
+  simFlashOp.busy = 0U;
+  simFlashOp.key  = 0U;
+  SIM_FlashProtect();
+  memset( SIM_Backdoor( PERIPH_BASE ), 0, 0x00030000U );
+  memset( SIM_Backdoor( AHB2PERIPH_BASE ), 0, 0x00061000U );
+  memset( SIM_Backdoor( 0xE0000000U ), 0, 0x00100000U );
+  memset( SIM_Backdoor( 0x1FFF0000U ), 0xFF, 0x00010000U );
+  memcpy( SIM_Backdoor( UID_BASE ), uid, sizeof( uid ) );
+  for ( uint32_t i=0U; i<simRamCount; i++ )
+  {
+    memcpy( simRam[i].base, simRam[i].initial, simRam[i].size );
+  }
+  memset( simDma, 0, sizeof( simDma ) );
+  memset( simNvicEnabled, 0, sizeof( simNvicEnabled ) );
+  memset( simNvicPending, 0, sizeof( simNvicPending ) );
+  SIM_REG( ( uint32_t )&RCC->CR )      = 0x00000083U;
+  SIM_REG( ( uint32_t )&RCC->PLLCFGR ) = 0x24003010U;
+  SIM_REG( ( uint32_t )&FLASH->CR )    = FLASH_CR_LOCK;
+  SIM_REG( ( uint32_t )&FLASH->OPTCR ) = 0x0FFFAAEDU;
+  SIM_REG( ( uint32_t )&CRC->DR )      = 0xFFFFFFFFU;
+
+  SIM_REG( ( uint32_t )&GPIOA->MODER ) = 0xA8000000U;
+  SIM_REG( ( uint32_t )&GPIOB->MODER ) = 0x00000280U;
+  SIM_REG( ( uint32_t )&SCB->CPUID )   = 0x412FC231U;
+  SIM_REG( ( uint32_t )&DBGMCU->IDCODE ) = 0x20006411U;
+  SIM_SetBootPins( ( simBootPins & 1U ), ( uint8_t )( simBootPins >> 1U ) );
+  SIM_CrcWrite( ( uint32_t )&CRC->CR, CRC_CR_RESET );
+
+  simTickNext    = SIM_NEVER;
+  simTickPending = 0U;
+  simPrimask     = 0U;
+  simEvent       = 0U;
+  simAppStack    = 0U;
+
+  getcontext( &simDeviceCtx );
+  simDeviceCtx.uc_stack.ss_sp   = simStack;
+  simDeviceCtx.uc_stack.ss_size = sizeof( simStack );
+  simDeviceCtx.uc_link          = NULL;
+  makecontext( &simDeviceCtx, SIM_DeviceMain, 0 );
+  simState = SIM_BOOTLOADER;
+  SIM_RunUntil( simNow );
+}
+
+void SIM_RunUntil( uint64_t t )
+{
+  if ( ( simState == SIM_BOOTLOADER ) && ( simInDevice == 0U ) && ( simInIrq == 0U ) )
+  {
+    simDeadline = t;
+    simInDevice = 1U;
+    SIM_FwRuns( 1U );
+    swapcontext( &simHostCtx, &simDeviceCtx );
+    SIM_FwRuns( 0U );
+    simInDevice = 0U;
+  }
+  SIM_Advance( t );
+}
+
+void SIM_Run( uint64_t ns )
+{
+  SIM_RunUntil( simNow + ns );
+}
+
+uint64_t SIM_Now( void )
+{
+  return simNow;
+}
+
+SIM_StateTypeDef SIM_State( void )
+{
+  return simState;
+}
+
+uint32_t SIM_AppStack( void )
+{
+  return simAppStack;
+}
+
+uint8_t SIM_InDevice( void )
+{
+  return simInDevice;
+}
+
+/**
+  * @brief  Interrupt raised by a peripheral outside of the emulation, the
+  *         USB controller: taken while the firmware sleeps at its WFE.
+  * @param  handler: Interrupt code of the firmware.
+  * @param  arg: Its argument.
+  * @retval None.
+  */
+void SIM_Irq( void ( *handler )( void* ), void* arg )
+{
+  if ( ( simState != SIM_BOOTLOADER ) || ( simInDevice != 0U ) || ( simPrimask != 0U ) )
+  {
+    return;
+  }
+  simInIrq = 1U;
+  if ( setjmp( simIrqExit ) == 0 )
+  {
+    handler( arg );
+  }
+  simInIrq = 0U;
+  simEvent = 1U;
+}
+
+void SIM_SetBootPins( uint8_t boot1, uint8_t boot2 )
+{
+  uint32_t idr = 0U;
+
+  simBootPins = ( uint8_t )( ( boot1 & 1U ) | ( ( boot2 & 1U ) << 1U ) );
+  if ( simMapped != 0U )
+  {
+    idr  = SIM_REG( ( uint32_t )&BOOT1_GPIO_Port->IDR ) & ~( uint32_t )( BOOT1_Pin | BOOT2_Pin );
+    idr |= ( boot1 != 0U ) ? BOOT1_Pin : 0U;
+    idr |= ( boot2 != 0U ) ? BOOT2_Pin : 0U;
+    SIM_REG( ( uint32_t )&BOOT1_GPIO_Port->IDR ) = idr;
+  }
+}
+
+/**
+  * @brief  Flash content set outside of the bootloader, as by a debugger.
+  */
+void SIM_FlashLoad( uint32_t address, const void* data, uint32_t length )
+{
+  memcpy( ( uint8_t* )SIM_Backdoor( FLASH_BASE ) + ( address - FLASH_BASE ), data, length );
+}
+
+void SIM_FlashFill( uint32_t address, uint8_t value, uint32_t length )
+{
+  memset( ( uint8_t* )SIM_Backdoor( FLASH_BASE ) + ( address - FLASH_BASE ), value, length );
+}
+
+void SIM_FlashSet( uint32_t address, uint32_t word )
+{
+  SIM_REG( address ) = word;
+}
+
+SIM_FlashStatsTypeDef* SIM_FlashStats( void )
+{
+  return &simFlashStats;
+}
@@ -0,0 +1,213 @@
+/**
+  ******************************************************************************
+  * @file           : sim.h
+  * @brief          : Emulated STM32F207 running the bootloader on the host.
+  ******************************************************************************
+  * The firmware is compiled unchanged for the host (test/fw_*.c) and runs as a
+  * coroutine under a virtual clock. Flash, system memory and the peripheral
+  * space are mapped at their addresses, the accesses to FLASH, RCC and the
+  * NVIC are trapped and given the register semantics of the reference
+  * manual. The USB OTG controller is replaced at the HAL_PCD level by a host
+  * that runs the control transfers packet by packet (test/sim_usb.c).
+  *
+  * Time advances with the flash operations, the USB packets and the sleeps
+  * of the firmware; the CPU time of the firmware itself is not modelled.
+  * DWT->CYCCNT counts that time and, for the firmware code, the host time
+  * it takes instead.
+  ******************************************************************************
+  */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include "main.h"
+#include "usbd_dfu.h"
+#include "usbd_dfu_if.h"
+
+/* Emulated device: typical values of the STM32F207 datasheet at 120 MHz ------*/
+#define SIM_HCLK_HZ             120000000ULL
+#define SIM_FLASH_WORD_NS       16000ULL      /* Word program, x32 parallelism */
+#define SIM_CRC_WORD_CYCLES     4ULL          /* CRC unit, per word written to CRC->DR */
+#define SIM_DMA_WORD_CYCLES     8ULL          /* Memory to memory from the flash, per word */
+#define SIM_FLASH_SECTORS       12U
+#define SIM_FLASH_SIZE          0x00100000U
+
+/* USB full speed host ---------------------------------------------------------*/
+#define SIM_USB_FRAME_NS        1000000ULL    /* A control transfer starts on the next SOF */
+#define SIM_USB_EP0_SIZE        64U
+#define SIM_USB_STALL           ( -1 )
+#define SIM_USB_NODEV           ( -2 )
+#define SIM_USB_TIMEOUT         ( -3 )
+
+#define SIM_MS( ms )            ( ( uint64_t )( ms ) * 1000000ULL )
+#define SIM_US( us )            ( ( uint64_t )( us ) * 1000ULL )
+
+typedef enum
+{
+  SIM_OFF = 0U,         /* Not powered */
+  SIM_BOOTLOADER,       /* main() of the bootloader running */
+  SIM_APPLICATION,      /* The bootloader jumped to the application */
+  SIM_RESET,            /* NVIC_SystemReset, SIM_Boot() starts the bootloader again */
+} SIM_StateTypeDef;
+
+/* Flash interface activity since SIM_PowerOn() */
+typedef struct
+{
+  uint32_t erases[ SIM_FLASH_SECTORS ];
+  uint32_t words;           /* Words programmed */
+  uint32_t reprograms;      /* Words programmed over a value other than 0xFFFFFFFF */
+  uint32_t bootWrites;      /* Erases and words below APP_ADDRESS, never expected */
+  uint32_t errors;          /* Operations that set an error flag of FLASH->SR */
+  uint32_t stalls;          /* Flash accesses of the CPU while BSY was set */
+  uint32_t fetches;         /* Calls into and returns to flash code while BSY was set */
+  uint32_t regWrites;       /* Writes to the FLASH registers */
+  uint64_t eraseNs;
+  uint64_t programNs;
+  uint64_t dmaNs;
+} SIM_FlashStatsTypeDef;
+
+/* USB activity of the host since SIM_USB_ResetStats() */
+typedef struct
+{
+  uint32_t transfers;       /* Control transfers */
+  uint32_t packets;         /* SETUP, DATA and status transactions */
+  uint32_t naks;
+  uint32_t stalls;
+  uint64_t bytesOut;        /* Data stage payload */
+  uint64_t bytesIn;
+  uint64_t busNs;           /* Time of the transfers from SOF to the status stage */
+  uint64_t pollNs;          /* Time the host waited on bwPollTimeout */
+  uint32_t dnloads;
+  uint32_t uploads;
+  uint32_t getstatus;
+} SIM_UsbStatsTypeDef;
+
+/* Last DFU_GETSTATUS answer */
+typedef struct
+{
+  uint8_t  status;
+  uint32_t pollTimeout;
+  uint8_t  state;
+} SIM_DfuStatusTypeDef;
+
+/* RAM of the firmware: the .data and .bss of a test/fw_*.c file between its
+   two markers are set back to their initial values by every SIM_Boot(), as the
+   startup code does. With -fno-toplevel-reorder, as in the test_native
+   environment, GCC puts the variables in source order after the uninitialized
+   globals and before the static variables of the functions: the .bss markers
+   are one of each */
+#define SIM_RAM_BEGIN( name )                                                         \
+  static uint32_t simRam##name##Data[1U] = { 1U };                                    \
+  uint32_t        simRam##name##Bss[1U];
+#define SIM_RAM_END( name )                                                           \
+  static uint32_t simRam##name##DataEnd[1U] = { 1U };                                 \
+  __attribute__( ( constructor ) ) static void SIM_Ram##name( void )                  \
+  {                                                                                   \
+    static uint32_t bssEnd[1U];                                                       \
+                                                                                      \
+    SIM_RamRegion( simRam##name##Data, simRam##name##DataEnd );                       \
+    SIM_RamRegion( simRam##name##Bss, bssEnd );                                       \
+  }
+
+/* Code of the firmware in the flash: the functions of a test/fw_*.c file
+   between these two markers, the objects STM32F207ZGTX_FLASH.ld leaves in
+   .text, and the const objects between them, left in .rodata. The functions
+   outside them, the .RamFunc sections included, run from RAM. Built with
+   -finstrument-functions, a call into or a return to flash code while BSY is
+   set stalls the CPU until the end of the operation; the constants sit in
+   pages of their own, a read of them while BSY is set stalls as well */
+#define SIM_FLASH_CODE_BEGIN( name )                                                  \
+  __asm__( ".pushsection .text\n" "simFlash" #name "Begin:\n" ".popsection\n"         \
+           ".pushsection .rodata\n" ".balign 4096\n" "simFlash" #name "Const:\n"       \
+           ".popsection" );
+#define SIM_FLASH_CODE_END( name )                                                    \
+  __asm__( ".pushsection .text\n" "simFlash" #name "End:\n" ".popsection\n"           \
+           ".pushsection .rodata\n" ".balign 4096\n" "simFlash" #name "ConstEnd:\n"    \
+           ".popsection" );                                                           \
+  extern const uint8_t simFlash##name##Begin[];                                       \
+  extern const uint8_t simFlash##name##End[];                                         \
+  extern const uint8_t simFlash##name##Const[];                                       \
+  extern const uint8_t simFlash##name##ConstEnd[];                                    \
+  __attribute__( ( constructor ) ) static void SIM_FlashCode##name( void )            \
+  {                                                                                   \
+    SIM_CodeRegion( simFlash##name##Begin, simFlash##name##End,                       \
+                    simFlash##name##Const, simFlash##name##ConstEnd );                \
+  }
+
+/* Device ----------------------------------------------------------------------*/
+void                   SIM_RamRegion( void* begin, void* end );
+void                   SIM_CodeRegion( const void* begin, const void* end, const void* constBegin,
+                                       const void* constEnd );
+void                   SIM_PowerOn( void );
+void                   SIM_Boot( void );
+void                   SIM_Run( uint64_t ns );
+void                   SIM_RunUntil( uint64_t t );
+uint64_t               SIM_Now( void );
+SIM_StateTypeDef       SIM_State( void );
+uint32_t               SIM_AppStack( void );
+void                   SIM_SetBootPins( uint8_t boot1, uint8_t boot2 );
+void                   SIM_FlashLoad( uint32_t address, const void* data, uint32_t length );
+void                   SIM_FlashFill( uint32_t address, uint8_t value, uint32_t length );
+void                   SIM_FlashSet( uint32_t address, uint32_t word );
+uint32_t               SIM_FlashSector( uint32_t address );
+SIM_FlashStatsTypeDef* SIM_FlashStats( void );
+void                   SIM_Irq( void ( *handler )( void* ), void* arg );
+uint8_t                SIM_InDevice( void );
+
+/* USB host --------------------------------------------------------------------*/
+void                   SIM_USB_Reset( void );
+int                    SIM_USB_Control( uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                                        uint16_t wIndex, uint16_t wLength, uint8_t* data );
+int                    SIM_USB_ControlCut( uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                                           uint16_t wIndex, uint16_t wLength, const uint8_t* data, uint16_t sent );
+int                    SIM_USB_Enumerate( void );
+int                    SIM_USB_String( uint8_t index, char* str, uint16_t size );
+void                   SIM_USB_ResetStats( void );
+SIM_UsbStatsTypeDef*   SIM_USB_Stats( void );
+uint32_t               SIM_USB_RxFifo( void );
+uint32_t               SIM_USB_TxFifo( uint8_t fifo );
+
+/* DFU host, the requests as dfu-util sends them --------------------------------*/
+int                    SIM_DFU_Enter( void );
+int                    SIM_DFU_GetStatus( SIM_DfuStatusTypeDef* status );
+int                    SIM_DFU_ClrStatus( void );
+int                    SIM_DFU_Abort( void );
+int                    SIM_DFU_Dnload( uint16_t block, const uint8_t* data, uint16_t length );
+int                    SIM_DFU_DnloadCut( uint16_t block, const uint8_t* data, uint16_t length, uint16_t sent );
+int                    SIM_DFU_Upload( uint16_t block, uint8_t* data, uint16_t length );
+int                    SIM_DFU_Wait( SIM_DfuStatusTypeDef* status );
+int                    SIM_DFU_Command( const uint8_t* command, uint16_t length, SIM_DfuStatusTypeDef* status );
+int                    SIM_DFU_SetAddress( uint32_t address );
+int                    SIM_DFU_Erase( uint32_t address );
+int                    SIM_DFU_Hash( uint32_t address, uint32_t length, uint8_t algorithm, uint8_t* digest );
+int                    SIM_DFU_Session( uint8_t* nonce );
+int                    SIM_DFU_Image( const uint8_t* tag, uint32_t length, uint32_t crc, uint32_t version );
+int                    SIM_DFU_Download( uint32_t address, const uint8_t* data, uint32_t length );
+int                    SIM_DFU_Read( uint32_t address, uint8_t* data, uint32_t length );
+int                    SIM_DFU_Manifest( void );
+uint16_t               SIM_DFU_TransferSize( void );
+
+/* Host tool: image format of the bootloader -------------------------------------*/
+uint32_t               SIM_Crc32( const uint8_t* data, uint32_t length );
+void                   SIM_ImageNonce( const uint8_t* nonce );
+void                   SIM_ImageEncrypt( uint32_t address, uint8_t* data, uint32_t length );
+void                   SIM_ImageTag( const uint8_t* image, uint32_t length, uint32_t version, uint8_t* tag );
+void                   SIM_DigestCmac( const uint8_t* data, uint32_t length, uint8_t* digest );
+void                   SIM_ReadDecrypt( uint32_t address, uint8_t* data, uint32_t length, const uint8_t* nonce );
+int                    SIM_DFU_Flash( const uint8_t* image, uint32_t length, uint32_t version );
+uint32_t               SIM_ImageCompress( const uint8_t* data, uint32_t length, uint8_t* out );
+int                    SIM_DFU_FlashLz4( const uint8_t* image, uint32_t length, uint32_t version );
+void                   SIM_Random( uint8_t* data, uint32_t length, uint32_t seed );
+
+/* Firmware internals opened by test/fw_usb_device.c ----------------------------*/
+const uint8_t*         SIM_FwKey( void );
+const uint8_t*         SIM_FwIv( void );
+const uint8_t*         SIM_FwMacKey( void );
+const uint8_t*         SIM_FwDigestKey( void );
+const uint8_t*         SIM_FwReadKey( void );
+uint32_t               SIM_FwGetSector( uint32_t address );
+uint32_t               SIM_FwImageMarker( void );
+int                    SIM_FwStage( const char* name, uint32_t* cycles, uint32_t* calls );
+
+#endif /* __SIM_H__ */
@@ -0,0 +1,553 @@
+/**
+  ******************************************************************************
+  * @file           : sim_dfu.c
+  * @brief          : DFU host of the tests and the image tool of the bootloader.
+  ******************************************************************************
+  * The requests are sent as dfu-util sends them for a DfuSe device, with one
+  * difference: a download sets the address pointer once and numbers the
+  * blocks from 2 on, it does not set the address again for every block.
+  *
+  * The image tool builds what the release scripts send: the image with the
+  * AES-CTR or AES-CBC encryption of ENCRYPTION_CTR and the keys of
+  * usbd_dfu_if.c, a new AES-CTR nonce in the descriptor of every image, the
+  * AES-CMAC tag of the descriptor and the image, the CRC32 of the CRC unit
+  * the device hashes the flash with, and the LZ4 block of a compressed
+  * download.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "aes.h"
+#include "lz4.h"
+
+#define DFU_REQ_DNLOAD          1U
+#define DFU_REQ_UPLOAD          2U
+#define DFU_REQ_GETSTATUS       3U
+#define DFU_REQ_CLRSTATUS       4U
+#define DFU_REQ_ABORT           6U
+#define DFU_OUT                 0x21U
+#define DFU_IN                  0xA1U
+
+static uint8_t  simImageNonce[USBD_DFU_NONCE_SIZE] = { 0U };  /* Nonce of the image being built */
+static uint32_t simImageCount                      = 0U;      /* Images built with a nonce of their own */
+
+/* DFU requests ------------------------------------------------------------------*/
+/**
+  * @brief  Reset with the boot pins closed and enumerate: a new DFU session.
+  * @retval 0, or a USB error.
+  */
+int SIM_DFU_Enter( void )
+{
+  SIM_SetBootPins( 0U, 0U );
+  SIM_Boot();
+  return SIM_USB_Enumerate();
+}
+
+int SIM_DFU_GetStatus( SIM_DfuStatusTypeDef* status )
+{
+  uint8_t buf[6] = { 0U };
+  int     res    = SIM_USB_Control( DFU_IN, DFU_REQ_GETSTATUS, 0U, 0U, sizeof( buf ), buf );
+
+  /* A reset after the answer still delivered it */
+  if ( ( res >= ( int )sizeof( buf ) ) || ( res == SIM_USB_NODEV ) )
+  {
+    status->status      = buf[0];
+    status->pollTimeout = buf[1] | ( ( uint32_t )buf[2] << 8U ) | ( ( uint32_t )buf[3] << 16U );
+    status->state       = buf[4];
+  }
+  return ( res < 0 ) ? res : ( ( res < ( int )sizeof( buf ) ) ? SIM_USB_STALL : 0 );
+}
+
+int SIM_DFU_ClrStatus( void )
+{
+  return SIM_USB_Control( DFU_OUT, DFU_REQ_CLRSTATUS, 0U, 0U, 0U, NULL );
+}
+
+int SIM_DFU_Abort( void )
+{
+  return SIM_USB_Control( DFU_OUT, DFU_REQ_ABORT, 0U, 0U, 0U, NULL );
+}
+
+int SIM_DFU_Dnload( uint16_t block, const uint8_t* data, uint16_t length )
+{
+  return SIM_USB_Control( DFU_OUT, DFU_REQ_DNLOAD, block, 0U, length, ( uint8_t* )data );
+}
+
+/**
+  * @brief  DNLOAD of a block the host gives up on after sent bytes.
+  */
+int SIM_DFU_DnloadCut( uint16_t block, const uint8_t* data, uint16_t length, uint16_t sent )
+{
+  return SIM_USB_ControlCut( DFU_OUT, DFU_REQ_DNLOAD, block, 0U, length, data, sent );
+}
+
+int SIM_DFU_Upload( uint16_t block, uint8_t* data, uint16_t length )
+{
+  return SIM_USB_Control( DFU_IN, DFU_REQ_UPLOAD, block, 0U, length, data );
+}
+
+/**
+  * @brief  GETSTATUS until the device is done with the last request, waiting
+  *         bwPollTimeout between the polls.
+  * @retval 0 when idle without error, 1 on a DFU error in status, or a USB error.
+  */
+int SIM_DFU_Wait( SIM_DfuStatusTypeDef* status )
+{
+  SIM_DfuStatusTypeDef local;
+  int                  res = 0;
+
+  status = ( status != NULL ) ? status : &local;
+  for ( ;; )
+  {
+    res = SIM_DFU_GetStatus( status );
+    if ( res < 0 )
+    {
+      return res;
+    }
+    if ( ( status->state != DFU_STATE_DNLOAD_SYNC ) && ( status->state != DFU_STATE_DNLOAD_BUSY ) &&
+         ( status->state != DFU_STATE_MANIFEST_SYNC ) )
+    {
+      break;
+    }
+    SIM_Run( SIM_MS( status->pollTimeout ) );
+    SIM_USB_Stats()->pollNs += SIM_MS( status->pollTimeout );
+  }
+  return ( ( status->status == DFU_ERROR_NONE ) && ( status->state != DFU_STATE_ERROR ) ) ? 0 : 1;
+}
+
+int SIM_DFU_Command( const uint8_t* command, uint16_t length, SIM_DfuStatusTypeDef* status )
+{
+  int res = SIM_DFU_Dnload( 0U, command, length );
+
+  return ( res < 0 ) ? res : SIM_DFU_Wait( status );
+}
+
+static void SIM_DFU_Put32( uint8_t* buf, uint32_t value )
+{
+  buf[0] = ( uint8_t )value;
+  buf[1] = ( uint8_t )( value >> 8U );
+  buf[2] = ( uint8_t )( value >> 16U );
+  buf[3] = ( uint8_t )( value >> 24U );
+}
+
+static int SIM_DFU_AddressCommand( uint8_t cmd, uint32_t address )
+{
+  uint8_t buf[5] = { cmd };
+
+  SIM_DFU_Put32( &buf[1], address );
+  return SIM_DFU_Command( buf, sizeof( buf ), NULL );
+}
+
+int SIM_DFU_SetAddress( uint32_t address )
+{
+  return SIM_DFU_AddressCommand( DFU_CMD_SETADDRESSPOINTER, address );
+}
+
+int SIM_DFU_Erase( uint32_t address )
+{
+  return SIM_DFU_AddressCommand( DFU_CMD_ERASE, address );
+}
+
+/**
+  * @brief  Digest of a flash area computed by the device, DFU_HASH_CRC32
+  *         or DFU_HASH_CMAC, read back as UPLOAD block 1.
+  * @retval Bytes of the digest, 1 if the device refused the area, or a USB error.
+  */
+int SIM_DFU_Hash( uint32_t address, uint32_t length, uint8_t algorithm, uint8_t* digest )
+{
+  uint8_t buf[10] = { DFU_CMD_HASH };
+  int     res     = 0;
+
+  SIM_DFU_Put32( &buf[1], address );
+  SIM_DFU_Put32( &buf[5], length );
+  buf[9] = algorithm;
+  res    = SIM_DFU_Command( buf, sizeof( buf ), NULL );
+  res    = ( res != 0 ) ? res : SIM_DFU_Abort();
+  if ( res == 0 )
+  {
+    res = SIM_DFU_Upload( 1U, digest, USBD_DFU_DIGEST_SIZE );
+    ( void )SIM_DFU_Abort();
+  }
+  return res;
+}
+
+/**
+  * @brief  New session of the encrypted read-out: the nonce the device drew,
+  *         read back as UPLOAD block 1.
+  * @retval Bytes of the nonce, 1 if the device refused it, or a USB error.
+  */
+int SIM_DFU_Session( uint8_t* nonce )
+{
+  uint8_t buf[1] = { DFU_CMD_SESSION };
+  int     res    = 0;
+
+  res = SIM_DFU_Command( buf, sizeof( buf ), NULL );
+  res = ( res != 0 ) ? res : SIM_DFU_Abort();
+  if ( res == 0 )
+  {
+    res = SIM_DFU_Upload( 1U, nonce, AES_BLOCKLEN );
+    ( void )SIM_DFU_Abort();
+  }
+  return res;
+}
+
+int SIM_DFU_Image( const uint8_t* tag, uint32_t length, uint32_t crc, uint32_t version )
+{
+  uint8_t buf[1U + USBD_DFU_INFO_SIZE] = { DFU_CMD_TAG };
+  int     res                          = 0;
+
+  memcpy( &buf[1], tag, USBD_DFU_TAG_SIZE );
+  res = SIM_DFU_Command( buf, 1U + USBD_DFU_TAG_SIZE, NULL );
+  if ( res == 0 )
+  {
+    buf[0] = DFU_CMD_IMAGE;
+    SIM_DFU_Put32( &buf[1], length );
+    SIM_DFU_Put32( &buf[5], crc );
+    SIM_DFU_Put32( &buf[9], version );
+    memcpy( &buf[13], simImageNonce, USBD_DFU_NONCE_SIZE );
+    res = SIM_DFU_Command( buf, 1U + USBD_DFU_INFO_SIZE, NULL );
+  }
+  return res;
+}
+
+/**
+  * @brief  Blocks of wTransferSize from an address, each one acknowledged
+  *         by the device before the next. The device erases the sectors.
+  */
+int SIM_DFU_Download( uint32_t address, const uint8_t* data, uint32_t length )
+{
+  uint16_t xfer = SIM_DFU_TransferSize();
+  int      res  = SIM_DFU_SetAddress( address );
+
+  for ( uint32_t i=0U; ( res == 0 ) && ( i < length ); i += xfer )
+  {
+    uint16_t n = ( uint16_t )( ( ( length - i ) < xfer ) ? ( length - i ) : xfer );
+
+    res = SIM_DFU_Dnload( ( uint16_t )( 2U + ( i / xfer ) ), &data[i], n );
+    res = ( res < 0 ) ? res : SIM_DFU_Wait( NULL );
+  }
+  return res;
+}
+
+/**
+  * @brief  UPLOAD blocks of wTransferSize from an address, then ABORT.
+  * @retval 0 when all of it was read, or a USB error, a short block stalls.
+  */
+int SIM_DFU_Read( uint32_t address, uint8_t* data, uint32_t length )
+{
+  uint16_t xfer = SIM_DFU_TransferSize();
+  int      res  = SIM_DFU_SetAddress( address );
+
+  res = ( res != 0 ) ? res : SIM_DFU_Abort();
+  for ( uint32_t i=0U; ( res >= 0 ) && ( i < length ); i += xfer )
+  {
+    uint16_t n = ( uint16_t )( ( ( length - i ) < xfer ) ? ( length - i ) : xfer );
+
+    res = SIM_DFU_Upload( ( uint16_t )( 2U + ( i / xfer ) ), &data[i], n );
+    res = ( ( res >= 0 ) && ( res < n ) ) ? SIM_USB_STALL : res;
+  }
+  if ( res != SIM_USB_NODEV )
+  {
+    ( void )SIM_DFU_Abort();
+  }
+  return ( res < 0 ) ? res : 0;
+}
+
+/**
+  * @brief  Zero length DNLOAD, then GETSTATUS until the device leaves DFU
+  *         mode with its reset.
+  * @retval 0 on the reset, 1 if the image was refused, or a USB error.
+  */
+int SIM_DFU_Manifest( void )
+{
+  SIM_DfuStatusTypeDef status;
+  int                  res = SIM_DFU_Dnload( 0U, NULL, 0U );
+
+  if ( res < 0 )
+  {
+    return res;
+  }
+  res = SIM_DFU_Wait( &status );
+  if ( ( res == 0 ) && ( status.state == DFU_STATE_MANIFEST ) )
+  {
+    /* The reset comes with the answer of the GETSTATUS in MANIFEST */
+    res = SIM_DFU_GetStatus( &status );
+  }
+  if ( SIM_State() == SIM_RESET )
+  {
+    return 0;
+  }
+  return ( res < 0 ) ? res : 1;
+}
+
+/* Image tool --------------------------------------------------------------------*/
+/**
+  * @brief  Nonce of the image SIM_ImageEncrypt() encrypts and SIM_DFU_Image()
+  *         describes. NULL - zeros, the nonce of the device before the first
+  *         descriptor and after a manifestation.
+  */
+void SIM_ImageNonce( const uint8_t* nonce )
+{
+  if ( nonce == NULL )
+  {
+    memset( simImageNonce, 0, sizeof( simImageNonce ) );
+  }
+  else
+  {
+    memcpy( simImageNonce, nonce, sizeof( simImageNonce ) );
+  }
+}
+
+/**
+  * @brief  Encrypt the bytes a download sends to an address: AES-CTR counts
+  *         the blocks from FLASH_BASE after the image nonce, AES-CBC chains
+  *         them from the IV.
+  */
+void SIM_ImageEncrypt( uint32_t address, uint8_t* data, uint32_t length )
+{
+  struct AES_ctx ctx;
+
+#if ( ENCRYPTION_CTR > 0U )
+  uint8_t counter[AES_BLOCKLEN] = { 0U };
+
+  memcpy( counter, simImageNonce, sizeof( simImageNonce ) );
+  AES_init_ctx_enc( &ctx, SIM_FwKey() );
+  AES_ctx_set_iv( &ctx, counter );
+  AES_CTR_xcrypt_offset( &ctx, data, length, ( address - FLASH_BASE ) );
+#else
+  ( void )address;
+  AES_init_ctx_iv( &ctx, SIM_FwKey(), SIM_FwIv() );
+  AES_CBC_encrypt_buffer( &ctx, data, length );
+#endif
+}
+
+/**
+  * @brief  The release tool draws a new nonce for every image.
+  */
+static void SIM_ImageNewNonce( void )
+{
+  simImageCount++;
+  SIM_Random( simImageNonce, sizeof( simImageNonce ), ( simImageCount * 0x9E3779B9U ) );
+}
+
+/**
+  * @brief  The whole update as the release tool sends it: tag and
+  *         descriptor, the blocks encrypted, then the manifestation.
+  * @param  image: Image for APP_ADDRESS, length a multiple of 4.
+  * @retval 0 once the device reset after accepting the image, 1 if it was
+  *         refused, or a USB error.
+  */
+int SIM_DFU_Flash( const uint8_t* image, uint32_t length, uint32_t version )
+{
+  uint32_t n    = ( length + AES_BLOCKLEN - 1U ) & ~( AES_BLOCKLEN - 1U );
+  uint8_t* wire = malloc( n + 1U );
+  uint8_t  tag[USBD_DFU_TAG_SIZE];
+  int      res  = 0;
+
+  if ( wire == NULL )
+  {
+    return SIM_USB_TIMEOUT;
+  }
+  /* Whole AES blocks, the padding is written as erased bytes */
+  memset( wire, 0xFF, n );
+  memcpy( wire, image, length );
+  SIM_ImageNewNonce();
+  SIM_ImageEncrypt( APP_ADDRESS, wire, n );
+  SIM_ImageTag( image, length, version, tag );
+
+  res = SIM_DFU_Image( tag, length, SIM_Crc32( image, length ), version );
+  res = ( res != 0 ) ? res : SIM_DFU_Download( APP_ADDRESS, wire, n );
+  res = ( res != 0 ) ? res : SIM_DFU_Manifest();
+  SIM_ImageNonce( NULL );
+  free( wire );
+  return res;
+}
+
+/* LZ4 block format: a match is 4 bytes at least, the last 5 bytes are
+   literals and the last match starts 12 bytes before the end at the latest */
+#define LZ4_HASH_BITS           12U
+#define LZ4_LAST_LITERALS       5U
+#define LZ4_MATCH_LIMIT         12U
+
+static uint32_t SIM_Lz4Read32( const uint8_t* p )
+{
+  uint32_t v;
+
+  memcpy( &v, p, sizeof( v ) );
+  return v;
+}
+
+static uint32_t SIM_Lz4Hash( const uint8_t* p )
+{
+  return ( SIM_Lz4Read32( p ) * 2654435761U ) >> ( 32U - LZ4_HASH_BITS );
+}
+
+static uint8_t* SIM_Lz4Length( uint8_t* out, uint32_t n )
+{
+  for ( ; n >= 255U; n -= 255U )
+  {
+    *out++ = 255U;
+  }
+  *out++ = ( uint8_t )n;
+  return out;
+}
+
+static uint8_t* SIM_Lz4Sequence( uint8_t* out, const uint8_t* literals, uint32_t n, uint32_t offset, uint32_t match )
+{
+  uint8_t* token = out++;
+
+  *token = ( uint8_t )( ( ( n < 15U ) ? n : 15U ) << 4U );
+  if ( n >= 15U )
+  {
+    out = SIM_Lz4Length( out, n - 15U );
+  }
+  memcpy( out, literals, n );
+  out += n;
+  if ( match != 0U )
+  {
+    match -= LZ4_MIN_MATCH;
+    *out++  = ( uint8_t )offset;
+    *out++  = ( uint8_t )( offset >> 8U );
+    *token |= ( uint8_t )( ( match < 15U ) ? match : 15U );
+    if ( match >= 15U )
+    {
+      out = SIM_Lz4Length( out, match - 15U );
+    }
+  }
+  return out;
+}
+
+/**
+  * @brief  The image as one LZ4 block, as LZ4_compress_default() of the
+  *         release tool: greedy matches found with a hash of 4 bytes.
+  * @param  out: Room for length + length / 255 + 16 bytes.
+  * @retval Bytes of the block.
+  */
+uint32_t SIM_ImageCompress( const uint8_t* data, uint32_t length, uint8_t* out )
+{
+  static uint32_t table[1U << LZ4_HASH_BITS];  /* Position + 1 of the last 4 bytes of each hash */
+  uint8_t*        o      = out;
+  uint32_t        anchor = 0U;
+  uint32_t        i      = 0U;
+
+  memset( table, 0, sizeof( table ) );
+  while ( ( i + LZ4_MATCH_LIMIT ) < length )
+  {
+    uint32_t h   = SIM_Lz4Hash( &data[i] );
+    uint32_t ref = table[h];
+    uint32_t n   = LZ4_MIN_MATCH;
+
+    table[h] = i + 1U;
+    if ( ( ref == 0U ) || ( ( i - ( ref - 1U ) ) > LZ4_MAX_OFFSET ) ||
+         ( SIM_Lz4Read32( &data[ref - 1U] ) != SIM_Lz4Read32( &data[i] ) ) )
+    {
+      i++;
+      continue;
+    }
+    ref--;
+    while ( ( ( i + n ) < ( length - LZ4_LAST_LITERALS ) ) && ( data[ref + n] == data[i + n] ) )
+    {
+      n++;
+    }
+    o       = SIM_Lz4Sequence( o, &data[anchor], ( i - anchor ), ( i - ref ), n );
+    i      += n;
+    anchor  = i;
+    table[SIM_Lz4Hash( &data[i - 2U] )] = i - 1U;
+  }
+  o = SIM_Lz4Sequence( o, &data[anchor], ( length - anchor ), 0U, 0U );
+  return ( uint32_t )( o - out );
+}
+
+/**
+  * @brief  SIM_DFU_Flash() of the compressed image: the LZ4 block is
+  *         encrypted for IMAGE_LZ4_ADDRESS and sent there, the tag covers it
+  *         and the descriptor describes the image the device decompresses.
+  */
+int SIM_DFU_FlashLz4( const uint8_t* image, uint32_t length, uint32_t version )
+{
+  uint8_t* wire = malloc( length + ( length / 255U ) + 16U );
+  uint8_t  tag[USBD_DFU_TAG_SIZE];
+  uint32_t n    = 0U;
+  int      res  = 0;
+
+  if ( wire == NULL )
+  {
+    return SIM_USB_TIMEOUT;
+  }
+  n = SIM_ImageCompress( image, length, wire );
+  SIM_ImageNewNonce();
+  SIM_ImageEncrypt( IMAGE_LZ4_ADDRESS, wire, n );
+  SIM_ImageTag( image, length, version, tag );
+
+  res = SIM_DFU_Image( tag, length, SIM_Crc32( image, length ), version );
+  res = ( res != 0 ) ? res : SIM_DFU_Download( IMAGE_LZ4_ADDRESS, wire, n );
+  res = ( res != 0 ) ? res : SIM_DFU_Manifest();
+  SIM_ImageNonce( NULL );
+  free( wire );
+  return res;
+}
+
+/**
+  * @brief  AES-CMAC with the MAC key of the firmware over the descriptor
+  *         (length, CRC32, version) and the plain image: the tag of
+  *         SIM_DFU_Image(), whatever blocks build the image in the flash.
+  */
+void SIM_ImageTag( const uint8_t* image, uint32_t length, uint32_t version, uint8_t* tag )
+{
+  struct AES_ctx  ctx;
+  struct AES_cmac mac;
+  uint8_t         info[12];
+
+  SIM_DFU_Put32( &info[0], length );
+  SIM_DFU_Put32( &info[4], SIM_Crc32( image, length ) );
+  SIM_DFU_Put32( &info[8], version );
+  AES_init_ctx_enc( &ctx, SIM_FwMacKey() );
+  AES_CMAC_init( &mac );
+  AES_CMAC_update( &mac, &ctx, info, sizeof( info ) );
+  AES_CMAC_update( &mac, &ctx, image, length );
+  AES_CMAC_final( &mac, &ctx, tag );
+}
+
+/**
+  * @brief  DFU_HASH_CMAC of the line station, with the digest key.
+  */
+void SIM_DigestCmac( const uint8_t* data, uint32_t length, uint8_t* digest )
+{
+  struct AES_ctx  ctx;
+  struct AES_cmac mac;
+
+  AES_init_ctx_enc( &ctx, SIM_FwDigestKey() );
+  AES_CMAC_init( &mac );
+  AES_CMAC_update( &mac, &ctx, data, length );
+  AES_CMAC_final( &mac, &ctx, digest );
+}
+
+/**
+  * @brief  Decryption of an encrypted read-out, as the line station does it
+  *         with the read-out key and the nonce of the session.
+  */
+void SIM_ReadDecrypt( uint32_t address, uint8_t* data, uint32_t length, const uint8_t* nonce )
+{
+  struct AES_ctx ctx;
+
+  AES_init_ctx_enc( &ctx, SIM_FwReadKey() );
+  AES_ctx_set_iv( &ctx, nonce );
+  AES_CTR_xcrypt_offset( &ctx, data, length, ( address - FLASH_BASE ) );
+}
+
+/* Test images -------------------------------------------------------------------*/
+void SIM_Random( uint8_t* data, uint32_t length, uint32_t seed )
+{
+  uint32_t x = ( seed != 0U ) ? seed : 0x9E3779B9U;
+
+  for ( uint32_t i=0U; i<length; i++ )
+  {
+    x ^= x << 13U;
+    x ^= x >> 17U;
+    x ^= x << 5U;
+    data[i] = ( uint8_t )( x >> 24U );
+  }
+}
@@ -0,0 +1,566 @@
+/**
+  ******************************************************************************
+  * @file           : sim_usb.c
+  * @brief          : USB full speed host and the HAL_PCD driver of the device.
+  ******************************************************************************
+  * The OTG controller is not emulated: this file is the HAL_PCD driver the
+  * device library is linked with, and the host on the other end of the bus.
+  * The host runs the control transfers on EP0 transaction by transaction as
+  * the controller reports them: a transaction finds the endpoint armed by
+  * HAL_PCD_EP_Receive/Transmit, stalled or else NAKed, and its completion
+  * calls the HAL_PCD callbacks of usbd_conf.c as the OTG interrupt would.
+  *
+  * Timing: a control transfer starts on the next SOF, a transaction takes
+  * its bits on the bus (SYNC, PID, CRC, EOP and handshake included), the
+  * transactions of a transfer follow each other without idle frames.
+  ******************************************************************************
+  */
+
+#include <string.h>
+#include "sim.h"
+
+#define SIM_USB_SETUP_SIZE      8U
+#define SIM_USB_RESET_NS        SIM_MS( 10U )
+#define SIM_USB_NAK_LIMIT_NS    SIM_MS( 5000U )   /* libusb control transfer timeout of dfu-util */
+#define SIM_USB_TX_FIFOS        4U
+#define SIM_USB_REQ_GET_DESC    0x06U
+#define SIM_USB_REQ_SET_ADDR    0x05U
+#define SIM_USB_REQ_SET_CONFIG  0x09U
+#define SIM_USB_DESC_DEVICE     0x0100U
+#define SIM_USB_DESC_CONFIG     0x0200U
+#define SIM_USB_DESC_STRING     0x0300U
+
+extern PCD_HandleTypeDef hpcd_USB_OTG_FS;
+
+static uint8_t             simUsbConnected = 0U;
+static uint8_t             simUsbInArmed   = 0U;
+static uint8_t             simUsbOutArmed  = 0U;
+static uint16_t            simUsbRxFifo    = 0U;
+static uint16_t            simUsbTxFifo[SIM_USB_TX_FIFOS];
+static uint16_t            simUsbXferSize  = 0U;
+static SIM_UsbStatsTypeDef simUsbStats     = { 0 };
+
+/* Bits of a transaction with a payload of n bytes: token, data packet and
+   handshake with their SYNC, PID, CRC and EOP, plus the bus turnarounds */
+static uint64_t SIM_USB_PacketNs( uint32_t n )
+{
+  return ( ( 105ULL + ( 8ULL * n ) ) * 1000ULL ) / 12ULL;
+}
+
+/* HAL_PCD driver ----------------------------------------------------------------*/
+HAL_StatusTypeDef HAL_PCD_Init( PCD_HandleTypeDef* hpcd )
+{
+  for ( uint8_t i=0U; i<16U; i++ )
+  {
+    memset( &hpcd->IN_ep[i], 0, sizeof( hpcd->IN_ep[i] ) );
+    memset( &hpcd->OUT_ep[i], 0, sizeof( hpcd->OUT_ep[i] ) );
+    hpcd->IN_ep[i].is_in        = 1U;
+    hpcd->IN_ep[i].num          = i;
+    hpcd->IN_ep[i].tx_fifo_num  = i;
+    hpcd->IN_ep[i].type         = EP_TYPE_CTRL;
+    hpcd->OUT_ep[i].num         = i;
+    hpcd->OUT_ep[i].type        = EP_TYPE_CTRL;
+  }
+  hpcd->USB_Address = 0U;
+  hpcd->State       = HAL_PCD_STATE_READY;
+  simUsbInArmed     = 0U;
+  simUsbOutArmed    = 0U;
+  HAL_PCD_MspInit( hpcd );
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_DeInit( PCD_HandleTypeDef* hpcd )
+{
+  simUsbConnected = 0U;
+  hpcd->State     = HAL_PCD_STATE_RESET;
+  HAL_PCD_MspDeInit( hpcd );
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_Start( PCD_HandleTypeDef* hpcd )
+{
+  ( void )hpcd;
+  simUsbConnected = 1U;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_Stop( PCD_HandleTypeDef* hpcd )
+{
+  ( void )hpcd;
+  simUsbConnected = 0U;
+  return HAL_OK;
+}
+
+void HAL_PCD_IRQHandler( PCD_HandleTypeDef* hpcd )
+{
+  /* The host calls the callbacks itself */
+  ( void )hpcd;
+}
+
+HAL_StatusTypeDef HAL_PCD_SetAddress( PCD_HandleTypeDef* hpcd, uint8_t address )
+{
+  hpcd->USB_Address = address;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Open( PCD_HandleTypeDef* hpcd, uint8_t ep_addr, uint16_t ep_mps, uint8_t ep_type )
+{
+  PCD_EPTypeDef* ep = ( ( ep_addr & 0x80U ) != 0U ) ? &hpcd->IN_ep[ep_addr & EP_ADDR_MSK] :
+                                                       &hpcd->OUT_ep[ep_addr & EP_ADDR_MSK];
+
+  ep->num       = ep_addr & EP_ADDR_MSK;
+  ep->is_in     = ( ( ep_addr & 0x80U ) != 0U ) ? 1U : 0U;
+  ep->maxpacket = ep_mps;
+  ep->type      = ep_type;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Close( PCD_HandleTypeDef* hpcd, uint8_t ep_addr )
+{
+  PCD_EPTypeDef* ep = ( ( ep_addr & 0x80U ) != 0U ) ? &hpcd->IN_ep[ep_addr & EP_ADDR_MSK] :
+                                                       &hpcd->OUT_ep[ep_addr & EP_ADDR_MSK];
+
+  ep->maxpacket = 0U;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Flush( PCD_HandleTypeDef* hpcd, uint8_t ep_addr )
+{
+  ( void )hpcd;
+  ( void )ep_addr;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Receive( PCD_HandleTypeDef* hpcd, uint8_t ep_addr, uint8_t* pBuf, uint32_t len )
+{
+  PCD_EPTypeDef* ep = &hpcd->OUT_ep[ep_addr & EP_ADDR_MSK];
+
+  ep->xfer_buff  = pBuf;
+  ep->xfer_len   = len;
+  ep->xfer_count = 0U;
+  ep->is_in      = 0U;
+  if ( ( ep_addr & EP_ADDR_MSK ) == 0U )
+  {
+    simUsbOutArmed = 1U;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Transmit( PCD_HandleTypeDef* hpcd, uint8_t ep_addr, uint8_t* pBuf, uint32_t len )
+{
+  PCD_EPTypeDef* ep = &hpcd->IN_ep[ep_addr & EP_ADDR_MSK];
+
+  ep->xfer_buff  = pBuf;
+  ep->xfer_len   = len;
+  ep->xfer_count = 0U;
+  ep->is_in      = 1U;
+  if ( ( ep_addr & EP_ADDR_MSK ) == 0U )
+  {
+    simUsbInArmed = 1U;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_SetStall( PCD_HandleTypeDef* hpcd, uint8_t ep_addr )
+{
+  if ( ( ep_addr & 0x80U ) != 0U )
+  {
+    hpcd->IN_ep[ep_addr & EP_ADDR_MSK].is_stall = 1U;
+  }
+  else
+  {
+    hpcd->OUT_ep[ep_addr & EP_ADDR_MSK].is_stall = 1U;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_ClrStall( PCD_HandleTypeDef* hpcd, uint8_t ep_addr )
+{
+  if ( ( ep_addr & 0x80U ) != 0U )
+  {
+    hpcd->IN_ep[ep_addr & EP_ADDR_MSK].is_stall = 0U;
+  }
+  else
+  {
+    hpcd->OUT_ep[ep_addr & EP_ADDR_MSK].is_stall = 0U;
+  }
+  return HAL_OK;
+}
+
+uint32_t HAL_PCD_EP_GetRxCount( PCD_HandleTypeDef* hpcd, uint8_t ep_addr )
+{
+  return hpcd->OUT_ep[ep_addr & EP_ADDR_MSK].xfer_count;
+}
+
+HAL_StatusTypeDef HAL_PCDEx_SetRxFiFo( PCD_HandleTypeDef* hpcd, uint16_t size )
+{
+  ( void )hpcd;
+  simUsbRxFifo = size;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCDEx_SetTxFiFo( PCD_HandleTypeDef* hpcd, uint8_t fifo, uint16_t size )
+{
+  ( void )hpcd;
+  if ( fifo < SIM_USB_TX_FIFOS )
+  {
+    simUsbTxFifo[fifo] = size;
+  }
+  return HAL_OK;
+}
+
+/* OTG interrupt -----------------------------------------------------------------*/
+static void SIM_USB_IrqReset( void* arg )
+{
+  ( void )arg;
+  HAL_PCD_ResetCallback( &hpcd_USB_OTG_FS );
+}
+
+static void SIM_USB_IrqSetup( void* arg )
+{
+  ( void )arg;
+  HAL_PCD_SetupStageCallback( &hpcd_USB_OTG_FS );
+}
+
+static void SIM_USB_IrqDataOut( void* arg )
+{
+  ( void )arg;
+  HAL_PCD_DataOutStageCallback( &hpcd_USB_OTG_FS, 0U );
+}
+
+static void SIM_USB_IrqDataIn( void* arg )
+{
+  ( void )arg;
+  HAL_PCD_DataInStageCallback( &hpcd_USB_OTG_FS, 0U );
+}
+
+/* Host --------------------------------------------------------------------------*/
+static uint8_t SIM_USB_Present( void )
+{
+  return ( ( SIM_State() == SIM_BOOTLOADER ) && ( simUsbConnected != 0U ) ) ? 1U : 0U;
+}
+
+/**
+  * @brief  Time of one transaction on the bus, the device runs meanwhile.
+  */
+static void SIM_USB_Bus( uint32_t n )
+{
+  simUsbStats.packets++;
+  SIM_Run( SIM_USB_PacketNs( n ) );
+}
+
+/**
+  * @brief  Wait for EP0 to accept the next transaction: NAKs until the
+  *         endpoint is armed, the transfer limit of the host, or a STALL.
+  * @param  armed: Armed flag of the direction.
+  * @param  ep: Endpoint of the direction.
+  * @retval 0 when armed, SIM_USB_STALL, SIM_USB_NODEV or SIM_USB_TIMEOUT.
+  */
+static int SIM_USB_Handshake( const uint8_t* armed, const PCD_EPTypeDef* ep )
+{
+  uint64_t start = SIM_Now();
+
+  for ( ;; )
+  {
+    if ( SIM_USB_Present() == 0U )
+    {
+      return SIM_USB_NODEV;
+    }
+    if ( ep->is_stall != 0U )
+    {
+      simUsbStats.stalls++;
+      SIM_USB_Bus( 0U );
+      return SIM_USB_STALL;
+    }
+    if ( *armed != 0U )
+    {
+      return 0;
+    }
+    if ( ( SIM_Now() - start ) >= SIM_USB_NAK_LIMIT_NS )
+    {
+      return SIM_USB_TIMEOUT;
+    }
+    simUsbStats.naks++;
+    SIM_USB_Bus( 0U );
+  }
+}
+
+/**
+  * @brief  OUT transaction on EP0, data or status stage.
+  * @retval Bytes sent or an error.
+  */
+static int SIM_USB_Out( const uint8_t* data, uint16_t length )
+{
+  PCD_EPTypeDef* ep  = &hpcd_USB_OTG_FS.OUT_ep[0];
+  int            res = SIM_USB_Handshake( &simUsbOutArmed, ep );
+
+  if ( res != 0 )
+  {
+    return res;
+  }
+  SIM_USB_Bus( length );
+  if ( SIM_USB_Present() == 0U )
+  {
+    return SIM_USB_NODEV;
+  }
+  /* The controller writes the packet to the buffer and advances it */
+  if ( ( length > 0U ) && ( ep->xfer_buff != NULL ) )
+  {
+    memcpy( ep->xfer_buff, data, length );
+    ep->xfer_buff += length;
+  }
+  ep->xfer_count += length;
+  simUsbOutArmed  = 0U;
+  SIM_Irq( SIM_USB_IrqDataOut, NULL );
+  return ( SIM_USB_Present() != 0U ) ? ( int )length : SIM_USB_NODEV;
+}
+
+/**
+  * @brief  IN transaction on EP0, data or status stage: one packet of what
+  *         HAL_PCD_EP_Transmit armed.
+  * @retval Bytes received or an error. The bytes are in data even if the
+  *         device is gone after its interrupt.
+  */
+static int SIM_USB_In( uint8_t* data, uint16_t size )
+{
+  PCD_EPTypeDef* ep  = &hpcd_USB_OTG_FS.IN_ep[0];
+  int            res = SIM_USB_Handshake( &simUsbInArmed, ep );
+  uint32_t       n   = 0U;
+
+  if ( res != 0 )
+  {
+    return res;
+  }
+  n = ep->xfer_len - ep->xfer_count;
+  n = ( n < ep->maxpacket ) ? n : ep->maxpacket;
+  if ( ( data != NULL ) && ( n > 0U ) )
+  {
+    memcpy( data, ep->xfer_buff, ( n < size ) ? n : size );
+  }
+  SIM_USB_Bus( n );
+  if ( SIM_USB_Present() == 0U )
+  {
+    return SIM_USB_NODEV;
+  }
+  ep->xfer_buff  += n;
+  ep->xfer_count += n;
+  simUsbInArmed   = 0U;
+  SIM_Irq( SIM_USB_IrqDataIn, NULL );
+  return ( int )n;
+}
+
+void SIM_USB_Reset( void )
+{
+  simUsbInArmed  = 0U;
+  simUsbOutArmed = 0U;
+  SIM_Run( SIM_USB_RESET_NS );
+  if ( SIM_USB_Present() != 0U )
+  {
+    hpcd_USB_OTG_FS.IN_ep[0].is_stall  = 0U;
+    hpcd_USB_OTG_FS.OUT_ep[0].is_stall = 0U;
+    SIM_Irq( SIM_USB_IrqReset, NULL );
+  }
+}
+
+/**
+  * @brief  Control transfer on EP0. The host stops after sent bytes of an
+  *         OUT data stage when less than wLength, without a status stage.
+  * @retval Bytes of the data stage, or SIM_USB_STALL, SIM_USB_NODEV,
+  *         SIM_USB_TIMEOUT.
+  */
+static int SIM_USB_Transfer( uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                             uint16_t wIndex, uint16_t wLength, uint8_t* data, uint16_t sent )
+{
+  uint8_t  setup[SIM_USB_SETUP_SIZE] = { bmRequestType, bRequest, ( uint8_t )wValue, ( uint8_t )( wValue >> 8U ),
+                                         ( uint8_t )wIndex, ( uint8_t )( wIndex >> 8U ),
+                                         ( uint8_t )wLength, ( uint8_t )( wLength >> 8U ) };
+  uint8_t  in    = ( ( bmRequestType & 0x80U ) != 0U ) ? 1U : 0U;
+  uint64_t start = 0U;
+  int      done  = 0;
+  int      res   = 0;
+
+  if ( SIM_USB_Present() == 0U )
+  {
+    return SIM_USB_NODEV;
+  }
+  SIM_RunUntil( ( ( SIM_Now() / SIM_USB_FRAME_NS ) + 1U ) * SIM_USB_FRAME_NS );
+  start = SIM_Now();
+  simUsbStats.transfers++;
+  if ( ( bmRequestType & 0x7FU ) == 0x21U )
+  {
+    simUsbStats.dnloads   += ( bRequest == 1U ) ? 1U : 0U;
+    simUsbStats.uploads   += ( bRequest == 2U ) ? 1U : 0U;
+    simUsbStats.getstatus += ( bRequest == 3U ) ? 1U : 0U;
+  }
+
+  /* SETUP is always acknowledged, it clears the EP0 stall and any transfer */
+  SIM_USB_Bus( SIM_USB_SETUP_SIZE );
+  if ( SIM_USB_Present() == 0U )
+  {
+    return SIM_USB_NODEV;
+  }
+  memcpy( hpcd_USB_OTG_FS.Setup, setup, SIM_USB_SETUP_SIZE );
+  hpcd_USB_OTG_FS.IN_ep[0].is_stall  = 0U;
+  hpcd_USB_OTG_FS.OUT_ep[0].is_stall = 0U;
+  simUsbInArmed  = 0U;
+  simUsbOutArmed = 0U;
+  SIM_Irq( SIM_USB_IrqSetup, NULL );
+
+  /* Data stage */
+  while ( ( res >= 0 ) && ( done < ( int )sent ) )
+  {
+    uint16_t n = ( uint16_t )( sent - done );
+
+    n = ( n < SIM_USB_EP0_SIZE ) ? n : SIM_USB_EP0_SIZE;
+    if ( in != 0U )
+    {
+      res = SIM_USB_In( &data[done], n );
+      if ( res >= 0 )
+      {
+        done += ( res < ( int )n ) ? res : ( int )n;
+        if ( res < ( int )SIM_USB_EP0_SIZE )
+        {
+          /* Short packet: the data stage ends early */
+          break;
+        }
+      }
+    }
+    else
+    {
+      res   = SIM_USB_Out( &data[done], n );
+      done += ( res >= 0 ) ? res : 0;
+    }
+  }
+  simUsbStats.bytesIn  += ( in != 0U ) ? ( uint32_t )done : 0U;
+  simUsbStats.bytesOut += ( in == 0U ) ? ( uint32_t )done : 0U;
+
+  /* Status stage in the other direction */
+  if ( ( res >= 0 ) && ( sent == wLength ) )
+  {
+    res = ( ( in != 0U ) && ( wLength > 0U ) ) ? SIM_USB_Out( NULL, 0U ) : SIM_USB_In( NULL, 0U );
+  }
+  simUsbStats.busNs += SIM_Now() - start;
+  return ( res < 0 ) ? res : done;
+}
+
+/**
+  * @brief  Control transfer on EP0, as libusb_control_transfer().
+  * @retval Bytes of the data stage, or SIM_USB_STALL, SIM_USB_NODEV,
+  *         SIM_USB_TIMEOUT.
+  */
+int SIM_USB_Control( uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                     uint16_t wIndex, uint16_t wLength, uint8_t* data )
+{
+  return SIM_USB_Transfer( bmRequestType, bRequest, wValue, wIndex, wLength, data, wLength );
+}
+
+/**
+  * @brief  OUT control transfer the host gives up on: the data stage ends
+  *         after sent bytes, the next SETUP cuts it.
+  * @retval Bytes sent, or an error of SIM_USB_Control().
+  */
+int SIM_USB_ControlCut( uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                        uint16_t wIndex, uint16_t wLength, const uint8_t* data, uint16_t sent )
+{
+  return SIM_USB_Transfer( bmRequestType, bRequest, wValue, wIndex, wLength, ( uint8_t* )data,
+                           ( sent < wLength ) ? sent : wLength );
+}
+
+/**
+  * @brief  Bus reset and enumeration as a host does it: device descriptor,
+  *         address, configuration descriptor and configuration 1. The DFU
+  *         functional descriptor gives the transfer size.
+  * @retval 0 on success, an error of SIM_USB_Control else.
+  */
+int SIM_USB_Enumerate( void )
+{
+  uint8_t  desc[256];
+  uint16_t total = 0U;
+  int      res   = 0;
+
+  SIM_USB_Reset();
+  res = SIM_USB_Control( 0x80U, SIM_USB_REQ_GET_DESC, SIM_USB_DESC_DEVICE, 0U, 18U, desc );
+  if ( res < 0 )
+  {
+    return res;
+  }
+  res = SIM_USB_Control( 0x00U, SIM_USB_REQ_SET_ADDR, 1U, 0U, 0U, NULL );
+  if ( res < 0 )
+  {
+    return res;
+  }
+  res = SIM_USB_Control( 0x80U, SIM_USB_REQ_GET_DESC, SIM_USB_DESC_CONFIG, 0U, 9U, desc );
+  if ( res < 9 )
+  {
+    return ( res < 0 ) ? res : SIM_USB_STALL;
+  }
+  total = ( uint16_t )( desc[2] | ( desc[3] << 8U ) );
+  total = ( total < sizeof( desc ) ) ? total : ( uint16_t )sizeof( desc );
+  res   = SIM_USB_Control( 0x80U, SIM_USB_REQ_GET_DESC, SIM_USB_DESC_CONFIG, 0U, total, desc );
+  if ( res < 0 )
+  {
+    return res;
+  }
+  simUsbXferSize = 0U;
+  for ( int i=0; ( i + 7 ) <= res; i += ( desc[i] > 0U ) ? desc[i] : 1 )
+  {
+    if ( desc[i + 1] == DFU_DESCRIPTOR_TYPE )
+    {
+      simUsbXferSize = ( uint16_t )( desc[i + 5] | ( desc[i + 6] << 8U ) );
+    }
+  }
+  res = SIM_USB_Control( 0x00U, SIM_USB_REQ_SET_CONFIG, 1U, 0U, 0U, NULL );
+  return ( res < 0 ) ? res : 0;
+}
+
+/**
+  * @brief  String descriptor, US English, as ASCII.
+  * @param  index: Index of the string.
+  * @param  str: Returned string, terminated.
+  * @param  size: Size of str.
+  * @retval Characters of the string, or a USB error.
+  */
+int SIM_USB_String( uint8_t index, char* str, uint16_t size )
+{
+  uint8_t desc[256];
+  int     res = SIM_USB_Control( 0x80U, SIM_USB_REQ_GET_DESC, ( uint16_t )( SIM_USB_DESC_STRING | index ), 0x0409U,
+                                 sizeof( desc ), desc );
+  int     n   = 0;
+
+  if ( ( res < 2 ) || ( size == 0U ) )
+  {
+    return ( res < 0 ) ? res : SIM_USB_STALL;
+  }
+  res = ( desc[0] < res ) ? desc[0] : res;
+  for ( int i=2; ( ( i + 1 ) < res ) && ( ( n + 1 ) < size ); i += 2 )
+  {
+    str[n++] = ( char )desc[i];
+  }
+  str[n] = '\0';
+  return n;
+}
+
+uint16_t SIM_DFU_TransferSize( void )
+{
+  return simUsbXferSize;
+}
+
+void SIM_USB_ResetStats( void )
+{
+  memset( &simUsbStats, 0, sizeof( simUsbStats ) );
+}
+
+SIM_UsbStatsTypeDef* SIM_USB_Stats( void )
+{
+  return &simUsbStats;
+}
+
+uint32_t SIM_USB_RxFifo( void )
+{
+  return simUsbRxFifo;
+}
+
+uint32_t SIM_USB_TxFifo( uint8_t fifo )
+{
+  return ( fifo < SIM_USB_TX_FIFOS ) ? simUsbTxFifo[fifo] : 0U;
+}
@@ -0,0 +1,18 @@
+/* aes.c with the byte-wise Cipher and InvCipher, its functions renamed to AES_BW_ */
+#define AES_init_ctx            AES_BW_init_ctx
+#define AES_init_ctx_enc        AES_BW_init_ctx_enc
+#define AES_init_ctx_iv         AES_BW_init_ctx_iv
+#define AES_ctx_set_iv          AES_BW_ctx_set_iv
+#define AES_CBC_encrypt_buffer  AES_BW_CBC_encrypt_buffer
+#define AES_CBC_decrypt_buffer  AES_BW_CBC_decrypt_buffer
+#define AES_CTR_xcrypt_buffer   AES_BW_CTR_xcrypt_buffer
+#define AES_CTR_xcrypt_offset   AES_BW_CTR_xcrypt_offset
+#define AES_CMAC_init           AES_BW_CMAC_init
+#define AES_CMAC_update         AES_BW_CMAC_update
+#define AES_CMAC_final          AES_BW_CMAC_final
+
+#include "aes.h"
+#undef  AES_TTABLE
+#define AES_TTABLE  0U
+
+#include "../../aes/Src/aes.c"
@@ -0,0 +1,24 @@
+/**
+  ******************************************************************************
+  * @file           : aes_bytewise.h
+  * @brief          : aes.c built with AES_TTABLE 0, the reference of the T-table.
+  ******************************************************************************
+  */
+
+#ifndef __AES_BYTEWISE_H__
+#define __AES_BYTEWISE_H__
+
+#include "aes.h"
+
+void AES_BW_init_ctx( struct AES_ctx* ctx, const uint8_t* key );
+void AES_BW_init_ctx_enc( struct AES_ctx* ctx, const uint8_t* key );
+void AES_BW_init_ctx_iv( struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv );
+void AES_BW_ctx_set_iv( struct AES_ctx* ctx, const uint8_t* iv );
+void AES_BW_CBC_encrypt_buffer( struct AES_ctx* ctx, uint8_t* buf, uint32_t length );
+void AES_BW_CBC_decrypt_buffer( struct AES_ctx* ctx, uint8_t* buf, uint32_t length );
+void AES_BW_CTR_xcrypt_offset( const struct AES_ctx* ctx, uint8_t* buf, uint32_t length, uint32_t offset );
+void AES_BW_CMAC_init( struct AES_cmac* cm );
+void AES_BW_CMAC_update( struct AES_cmac* cm, const struct AES_ctx* ctx, const uint8_t* buf, uint32_t length );
+void AES_BW_CMAC_final( struct AES_cmac* cm, const struct AES_ctx* ctx, uint8_t* tag );
+
+#endif /* __AES_BYTEWISE_H__ */
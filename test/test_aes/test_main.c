@@ -0,0 +1,350 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : AES of the bootloader: known answers and the T-table backend.
+  ******************************************************************************
+  * The cipher as the firmware builds it (AES_TTABLE 1) is checked against the
+  * FIPS-197 and SP 800-38A vectors and against aes.c built with the byte-wise
+  * Cipher and InvCipher. The CBC decryption and CTR times of both backends are
+  * measured on the host, per 1 KB DNLOAD block and for an image of the whole
+  * application area; the key setup with the decryption keys is reported
+  * against a block.
+  * Host times only compare the backends, they are not the times of the MCU.
+  ******************************************************************************
+  */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "unity.h"
+#include "sim.h"
+#include "aes_bytewise.h"
+
+#define BLOCK_SIZE              1024U
+#define IMAGE_SIZE              ( FLASH_END + 1U - APP_ADDRESS )  /* The whole application area */
+#define BLOCK_RUNS              2000U
+
+typedef void ( *DecryptTypeDef )( struct AES_ctx* ctx, uint8_t* buf, uint32_t length );
+typedef void ( *XcryptTypeDef )( const struct AES_ctx* ctx, uint8_t* buf, uint32_t length, uint32_t offset );
+
+static const uint8_t key[AES_KEYLEN] =
+{
+  0x2BU, 0x7EU, 0x15U, 0x16U, 0x28U, 0xAEU, 0xD2U, 0xA6U, 0xABU, 0xF7U, 0x15U, 0x88U, 0x09U, 0xCFU, 0x4FU, 0x3CU
+};
+static const uint8_t iv[AES_BLOCKLEN] =
+{
+  0x00U, 0x01U, 0x02U, 0x03U, 0x04U, 0x05U, 0x06U, 0x07U, 0x08U, 0x09U, 0x0AU, 0x0BU, 0x0CU, 0x0DU, 0x0EU, 0x0FU
+};
+/* SP 800-38A F.2.1 and F.5.1 */
+static const uint8_t plain[64U] =
+{
+  0x6BU, 0xC1U, 0xBEU, 0xE2U, 0x2EU, 0x40U, 0x9FU, 0x96U, 0xE9U, 0x3DU, 0x7EU, 0x11U, 0x73U, 0x93U, 0x17U, 0x2AU,
+  0xAEU, 0x2DU, 0x8AU, 0x57U, 0x1EU, 0x03U, 0xACU, 0x9CU, 0x9EU, 0xB7U, 0x6FU, 0xACU, 0x45U, 0xAFU, 0x8EU, 0x51U,
+  0x30U, 0xC8U, 0x1CU, 0x46U, 0xA3U, 0x5CU, 0xE4U, 0x11U, 0xE5U, 0xFBU, 0xC1U, 0x19U, 0x1AU, 0x0AU, 0x52U, 0xEFU,
+  0xF6U, 0x9FU, 0x24U, 0x45U, 0xDFU, 0x4FU, 0x9BU, 0x17U, 0xADU, 0x2BU, 0x41U, 0x7BU, 0xE6U, 0x6CU, 0x37U, 0x10U
+};
+static const uint8_t cbc[64U] =
+{
+  0x76U, 0x49U, 0xABU, 0xACU, 0x81U, 0x19U, 0xB2U, 0x46U, 0xCEU, 0xE9U, 0x8EU, 0x9BU, 0x12U, 0xE9U, 0x19U, 0x7DU,
+  0x50U, 0x86U, 0xCBU, 0x9BU, 0x50U, 0x72U, 0x19U, 0xEEU, 0x95U, 0xDBU, 0x11U, 0x3AU, 0x91U, 0x76U, 0x78U, 0xB2U,
+  0x73U, 0xBEU, 0xD6U, 0xB8U, 0xE3U, 0xC1U, 0x74U, 0x3BU, 0x71U, 0x16U, 0xE6U, 0x9EU, 0x22U, 0x22U, 0x95U, 0x16U,
+  0x3FU, 0xF1U, 0xCAU, 0xA1U, 0x68U, 0x1FU, 0xACU, 0x09U, 0x12U, 0x0EU, 0xCAU, 0x30U, 0x75U, 0x86U, 0xE1U, 0xA7U
+};
+static const uint8_t ctr[64U] =
+{
+  0x87U, 0x4DU, 0x61U, 0x91U, 0xB6U, 0x20U, 0xE3U, 0x26U, 0x1BU, 0xEFU, 0x68U, 0x64U, 0x99U, 0x0DU, 0xB6U, 0xCEU,
+  0x98U, 0x06U, 0xF6U, 0x6BU, 0x79U, 0x70U, 0xFDU, 0xFFU, 0x86U, 0x17U, 0x18U, 0x7BU, 0xB9U, 0xFFU, 0xFDU, 0xFFU,
+  0x5AU, 0xE4U, 0xDFU, 0x3EU, 0xDBU, 0xD5U, 0xD3U, 0x5EU, 0x5BU, 0x4FU, 0x09U, 0x02U, 0x0DU, 0xB0U, 0x3EU, 0xABU,
+  0x1EU, 0x03U, 0x1DU, 0xDAU, 0x2FU, 0xBEU, 0x03U, 0xD1U, 0x79U, 0x21U, 0x70U, 0xA0U, 0xF3U, 0x00U, 0x9CU, 0xEEU
+};
+static const uint8_t ctrIv[AES_BLOCKLEN] =
+{
+  0xF0U, 0xF1U, 0xF2U, 0xF3U, 0xF4U, 0xF5U, 0xF6U, 0xF7U, 0xF8U, 0xF9U, 0xFAU, 0xFBU, 0xFCU, 0xFDU, 0xFEU, 0xFFU
+};
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t work[IMAGE_SIZE];
+static uint8_t other[IMAGE_SIZE];
+static char    msg[200];
+
+void setUp( void )
+{
+}
+
+void tearDown( void )
+{
+}
+
+static uint64_t HostNs( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( ( uint64_t )ts.tv_sec * 1000000000ULL ) + ( uint64_t )ts.tv_nsec;
+}
+
+/* Host time of one block of AES_BLOCKLEN, the buffer decrypted in pieces of length */
+static double DecryptNs( DecryptTypeDef decrypt, uint32_t length, uint32_t runs )
+{
+  struct AES_ctx ctx;
+  uint64_t       best = UINT64_MAX;
+
+  /* Same round keys for both backends, DecKey only read by the T-table */
+  AES_init_ctx_iv( &ctx, key, iv );
+  for ( uint32_t r=0U; r<3U; r++ )
+  {
+    uint64_t t = HostNs();
+
+    for ( uint32_t i=0U; i<runs; i++ )
+    {
+      decrypt( &ctx, &work[( i * length ) % IMAGE_SIZE], length );
+    }
+    t = HostNs() - t;
+    best = ( t < best ) ? t : best;
+  }
+  return ( double )best / ( ( double )runs * length / AES_BLOCKLEN );
+}
+
+/* Host time of one block of AES_BLOCKLEN in CTR, the buffer taken in pieces of length */
+static double XcryptNs( XcryptTypeDef xcrypt, uint32_t length, uint32_t runs )
+{
+  struct AES_ctx ctx;
+  uint64_t       best = UINT64_MAX;
+
+  AES_init_ctx_enc( &ctx, key );
+  AES_ctx_set_iv( &ctx, ctrIv );
+  for ( uint32_t r=0U; r<3U; r++ )
+  {
+    uint64_t t = HostNs();
+
+    for ( uint32_t i=0U; i<runs; i++ )
+    {
+      uint32_t offset = ( i * length ) % IMAGE_SIZE;
+
+      xcrypt( &ctx, &work[offset], length, offset );
+    }
+    t = HostNs() - t;
+    best = ( t < best ) ? t : best;
+  }
+  return ( double )best / ( ( double )runs * length / AES_BLOCKLEN );
+}
+
+void test_cipher_matches_fips197( void )
+{
+  static const uint8_t k[AES_KEYLEN] =
+  {
+    0x00U, 0x01U, 0x02U, 0x03U, 0x04U, 0x05U, 0x06U, 0x07U, 0x08U, 0x09U, 0x0AU, 0x0BU, 0x0CU, 0x0DU, 0x0EU, 0x0FU
+  };
+  static const uint8_t p[AES_BLOCKLEN] =
+  {
+    0x00U, 0x11U, 0x22U, 0x33U, 0x44U, 0x55U, 0x66U, 0x77U, 0x88U, 0x99U, 0xAAU, 0xBBU, 0xCCU, 0xDDU, 0xEEU, 0xFFU
+  };
+  static const uint8_t c[AES_BLOCKLEN] =
+  {
+    0x69U, 0xC4U, 0xE0U, 0xD8U, 0x6AU, 0x7BU, 0x04U, 0x30U, 0xD8U, 0xCDU, 0xB7U, 0x80U, 0x70U, 0xB4U, 0xC5U, 0x5AU
+  };
+  static const uint8_t zero[AES_BLOCKLEN] = { 0U };
+  struct AES_ctx ctx;
+  uint8_t        buf[AES_BLOCKLEN];
+
+  /* One CBC block with a zero IV is the block cipher */
+  memcpy( buf, p, sizeof( buf ) );
+  AES_init_ctx_iv( &ctx, k, zero );
+  AES_CBC_encrypt_buffer( &ctx, buf, sizeof( buf ) );
+  TEST_ASSERT_EQUAL_HEX8_ARRAY( c, buf, sizeof( buf ) );
+  AES_ctx_set_iv( &ctx, zero );
+  AES_CBC_decrypt_buffer( &ctx, buf, sizeof( buf ) );
+  TEST_ASSERT_EQUAL_HEX8_ARRAY( p, buf, sizeof( buf ) );
+}
+
+void test_cbc_matches_sp800_38a( void )
+{
+  struct AES_ctx ctx;
+  uint8_t        buf[sizeof( plain )];
+
+  memcpy( buf, plain, sizeof( buf ) );
+  AES_init_ctx_iv( &ctx, key, iv );
+  AES_CBC_encrypt_buffer( &ctx, buf, sizeof( buf ) );
+  TEST_ASSERT_EQUAL_HEX8_ARRAY( cbc, buf, sizeof( buf ) );
+
+  /* In DNLOAD sized pieces, the IV chained in the context */
+  AES_ctx_set_iv( &ctx, iv );
+  AES_CBC_decrypt_buffer( &ctx, &buf[0U], 16U );
+  AES_CBC_decrypt_buffer( &ctx, &buf[16U], 48U );
+  TEST_ASSERT_EQUAL_HEX8_ARRAY( plain, buf, sizeof( buf ) );
+}
+
+void test_ctr_matches_sp800_38a( void )
+{
+  struct AES_ctx ctx;
+  uint8_t        buf[sizeof( plain )];
+
+  memcpy( buf, plain, sizeof( buf ) );
+  AES_init_ctx_iv( &ctx, key, ctrIv );
+  AES_CTR_xcrypt_buffer( &ctx, buf, sizeof( buf ) );
+  TEST_ASSERT_EQUAL_HEX8_ARRAY( ctr, buf, sizeof( buf ) );
+
+  /* Random access: the last blocks first */
+  memcpy( buf, ctr, sizeof( buf ) );
+  AES_ctx_set_iv( &ctx, ctrIv );
+  AES_CTR_xcrypt_offset( &ctx, &buf[32U], 32U, 32U );
+  AES_CTR_xcrypt_offset( &ctx, &buf[0U], 32U, 0U );
+  TEST_ASSERT_EQUAL_HEX8_ARRAY( plain, buf, sizeof( buf ) );
+}
+
+void test_ctr_counter_wraps( void )
+{
+  static const uint8_t last[AES_BLOCKLEN] = { 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU,
+                                              0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU };
+  struct AES_ctx ctx;
+  struct AES_ctx keys;
+  uint8_t        buf[sizeof( plain )];
+  uint8_t        ref[sizeof( plain )];
+
+  /* The counter after all ones is zero, the keys before Iv are left as they were */
+  memcpy( buf, plain, sizeof( buf ) );
+  memcpy( ref, plain, sizeof( ref ) );
+  AES_init_ctx_iv( &ctx, key, last );
+  keys = ctx;
+  AES_CTR_xcrypt_offset( &ctx, ref, sizeof( ref ), 0U );
+  AES_CTR_xcrypt_buffer( &ctx, buf, sizeof( buf ) );
+  TEST_ASSERT_EQUAL_HEX8_ARRAY( ref, buf, sizeof( buf ) );
+  TEST_ASSERT_EQUAL_MEMORY( &keys, &ctx, offsetof( struct AES_ctx, Iv ) );
+  TEST_ASSERT_EQUAL_UINT8( ( sizeof( buf ) / AES_BLOCKLEN ) - 1U, ctx.Iv[AES_BLOCKLEN - 1U] );
+}
+
+void test_ttable_matches_the_bytewise_cipher( void )
+{
+  struct AES_ctx ctx;
+
+  SIM_Random( image, IMAGE_SIZE, 8U );
+  memcpy( work, image, IMAGE_SIZE );
+  AES_init_ctx_iv( &ctx, key, iv );
+  AES_CBC_encrypt_buffer( &ctx, work, IMAGE_SIZE );
+  memcpy( other, work, IMAGE_SIZE );
+
+  AES_init_ctx_iv( &ctx, key, iv );
+  AES_CBC_decrypt_buffer( &ctx, work, IMAGE_SIZE );
+  AES_BW_init_ctx_iv( &ctx, key, iv );
+  AES_BW_CBC_decrypt_buffer( &ctx, other, IMAGE_SIZE );
+  TEST_ASSERT_EQUAL_MEMORY( image, work, IMAGE_SIZE );
+  TEST_ASSERT_EQUAL_MEMORY( image, other, IMAGE_SIZE );
+}
+
+void test_forward_ttable_matches_the_bytewise_cipher( void )
+{
+  struct AES_ctx  ctx;
+  struct AES_cmac mac;
+  uint8_t         tag[AES_BLOCKLEN];
+  uint8_t         tagBw[AES_BLOCKLEN];
+
+  SIM_Random( image, IMAGE_SIZE, 9U );
+  memcpy( work, image, IMAGE_SIZE );
+  memcpy( other, image, IMAGE_SIZE );
+
+  /* CTR and CMAC with the round keys only, as the firmware sets them up */
+  AES_init_ctx_enc( &ctx, key );
+  AES_ctx_set_iv( &ctx, ctrIv );
+  AES_CTR_xcrypt_offset( &ctx, work, IMAGE_SIZE, 0U );
+  AES_CMAC_init( &mac );
+  AES_CMAC_update( &mac, &ctx, image, IMAGE_SIZE );
+  AES_CMAC_final( &mac, &ctx, tag );
+  AES_BW_init_ctx_enc( &ctx, key );
+  AES_BW_ctx_set_iv( &ctx, ctrIv );
+  AES_BW_CTR_xcrypt_offset( &ctx, other, IMAGE_SIZE, 0U );
+  AES_BW_CMAC_init( &mac );
+  AES_BW_CMAC_update( &mac, &ctx, image, IMAGE_SIZE );
+  AES_BW_CMAC_final( &mac, &ctx, tagBw );
+  TEST_ASSERT_EQUAL_MEMORY( other, work, IMAGE_SIZE );
+  TEST_ASSERT_EQUAL_HEX8_ARRAY( tagBw, tag, sizeof( tag ) );
+}
+
+void test_ttable_decrypts_faster( void )
+{
+  double blockTt = DecryptNs( AES_CBC_decrypt_buffer, BLOCK_SIZE, BLOCK_RUNS );
+  double blockBw = DecryptNs( AES_BW_CBC_decrypt_buffer, BLOCK_SIZE, BLOCK_RUNS );
+  double imageTt = DecryptNs( AES_CBC_decrypt_buffer, IMAGE_SIZE, 1U );
+  double imageBw = DecryptNs( AES_BW_CBC_decrypt_buffer, IMAGE_SIZE, 1U );
+
+  snprintf( msg, sizeof( msg ), "%u B block: T-table %.1f ns/16 B, byte-wise %.1f ns/16 B, %.1fx",
+            BLOCK_SIZE, blockTt, blockBw, blockBw / blockTt );
+  TEST_MESSAGE( msg );
+  snprintf( msg, sizeof( msg ), "%u B image: T-table %.2f ms, byte-wise %.2f ms, %.1fx", ( unsigned )IMAGE_SIZE,
+            imageTt * IMAGE_SIZE / AES_BLOCKLEN / 1e6, imageBw * IMAGE_SIZE / AES_BLOCKLEN / 1e6, imageBw / imageTt );
+  TEST_MESSAGE( msg );
+  TEST_ASSERT_LESS_THAN( ( uint32_t )blockBw, ( uint32_t )blockTt );
+  TEST_ASSERT_LESS_THAN( ( uint32_t )imageBw, ( uint32_t )imageTt );
+}
+
+void test_ttable_xcrypts_faster( void )
+{
+  double blockTt = XcryptNs( AES_CTR_xcrypt_offset, BLOCK_SIZE, BLOCK_RUNS );
+  double blockBw = XcryptNs( AES_BW_CTR_xcrypt_offset, BLOCK_SIZE, BLOCK_RUNS );
+  double imageTt = XcryptNs( AES_CTR_xcrypt_offset, IMAGE_SIZE, 1U );
+  double imageBw = XcryptNs( AES_BW_CTR_xcrypt_offset, IMAGE_SIZE, 1U );
+
+  snprintf( msg, sizeof( msg ), "%u B block CTR: T-table %.1f ns/16 B, byte-wise %.1f ns/16 B, %.1fx",
+            BLOCK_SIZE, blockTt, blockBw, blockBw / blockTt );
+  TEST_MESSAGE( msg );
+  snprintf( msg, sizeof( msg ), "%u B image CTR: T-table %.2f ms, byte-wise %.2f ms, %.1fx", ( unsigned )IMAGE_SIZE,
+            imageTt * IMAGE_SIZE / AES_BLOCKLEN / 1e6, imageBw * IMAGE_SIZE / AES_BLOCKLEN / 1e6, imageBw / imageTt );
+  TEST_MESSAGE( msg );
+  TEST_ASSERT_LESS_THAN( ( uint32_t )blockBw, ( uint32_t )blockTt );
+  TEST_ASSERT_LESS_THAN( ( uint32_t )imageBw, ( uint32_t )imageTt );
+}
+
+void test_decryption_keys_are_set_once( void )
+{
+  struct AES_ctx ctx;
+  uint64_t       initTt = UINT64_MAX;
+  uint64_t       initBw = UINT64_MAX;
+  double         block  = DecryptNs( AES_CBC_decrypt_buffer, BLOCK_SIZE, BLOCK_RUNS ) * BLOCK_SIZE / AES_BLOCKLEN;
+
+  for ( uint32_t r=0U; r<3U; r++ )
+  {
+    uint64_t t = HostNs();
+
+    for ( uint32_t i=0U; i<BLOCK_RUNS; i++ )
+    {
+      AES_init_ctx_iv( &ctx, key, iv );
+    }
+    t = HostNs() - t;
+    initTt = ( t < initTt ) ? t : initTt;
+    t = HostNs();
+    for ( uint32_t i=0U; i<BLOCK_RUNS; i++ )
+    {
+      AES_BW_init_ctx_iv( &ctx, key, iv );
+    }
+    t = HostNs() - t;
+    initBw = ( t < initBw ) ? t : initBw;
+  }
+
+  /* The InvMixColumns of the round keys, once per session instead of once per DNLOAD block */
+  snprintf( msg, sizeof( msg ), "key setup %.0f ns, of it %.0f ns decryption keys; %u B block %.0f ns, "
+            "%.0f B/s, %.0f B/s with the keys per block", ( double )initTt / BLOCK_RUNS,
+            ( double )( initTt - initBw ) / BLOCK_RUNS, BLOCK_SIZE, block, BLOCK_SIZE * 1e9 / block,
+            BLOCK_SIZE * 1e9 / ( block + ( ( double )( initTt - initBw ) / BLOCK_RUNS ) ) );
+  TEST_MESSAGE( msg );
+
+  /* Set by the init, the context decrypts without another key setup */
+  memcpy( work, cbc, sizeof( cbc ) );
+  AES_init_ctx_iv( &ctx, key, iv );
+  AES_CBC_decrypt_buffer( &ctx, work, sizeof( cbc ) );
+  TEST_ASSERT_EQUAL_HEX8_ARRAY( plain, work, sizeof( plain ) );
+}
+
+int main( void )
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_cipher_matches_fips197 );
+  RUN_TEST( test_cbc_matches_sp800_38a );
+  RUN_TEST( test_ctr_matches_sp800_38a );
+  RUN_TEST( test_ctr_counter_wraps );
+  RUN_TEST( test_ttable_matches_the_bytewise_cipher );
+  RUN_TEST( test_forward_ttable_matches_the_bytewise_cipher );
+  RUN_TEST( test_ttable_decrypts_faster );
+  RUN_TEST( test_ttable_xcrypts_faster );
+  RUN_TEST( test_decryption_keys_are_set_once );
+  return UNITY_END();
+}
@@ -0,0 +1,218 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : Boot-time check of the application image.
+  ******************************************************************************
+  * The bootloader starts the application only if the last descriptor of the
+  * image log is valid, and with IMAGE_BOOT_CRC_ENB (test_native_boot_crc) if
+  * the CRC32 of the image matches it as well. A manifestation logs the
+  * descriptor once the AES-CMAC and the CRC32 of the download matched.
+  * The images are put in the emulated flash directly, or downloaded when the
+  * download itself is under test. The boot time, with the CRC32 that of the
+  * emulated CRC unit fed a word per bus access, is reported for several
+  * image sizes.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "sim.h"
+
+#define IMAGE_SIZE              0x00010000U
+#define IMAGE_SIZE_MAX          ( IMAGE_MARKER_ADDRESS - APP_ADDRESS )
+#define IMAGE_VERSION           0x00020000U
+
+static uint8_t image[IMAGE_SIZE_MAX];
+static uint8_t wire[IMAGE_SIZE];
+static char    msg[200];
+
+void setUp( void )
+{
+  SIM_PowerOn();
+  SIM_Random( image, sizeof( image ), 12U );
+  image[0] = 0x00U;
+  image[1] = 0x00U;
+  image[2] = 0x02U;
+  image[3] = 0x20U;
+  SIM_SetBootPins( 1U, 1U );
+}
+
+void tearDown( void )
+{
+}
+
+/* An image and its descriptor as a manifestation leaves them */
+static void LoadImage( uint32_t length )
+{
+  IMAGE_InfoTypeDef info;
+
+  info.length  = length;
+  info.crc     = SIM_Crc32( image, length );
+  info.version = IMAGE_VERSION;
+  info.marker  = SIM_FwImageMarker();
+  SIM_FlashLoad( APP_ADDRESS, image, length );
+  SIM_FlashLoad( IMAGE_MARKER_ADDRESS, &info, sizeof( info ) );
+}
+
+static uint64_t BootNs( void )
+{
+  uint64_t t = SIM_Now();
+
+  SIM_Boot();
+  return SIM_Now() - t;
+}
+
+void test_valid_image_boots( void )
+{
+  LoadImage( IMAGE_SIZE );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_APPLICATION, SIM_State() );
+  TEST_ASSERT_EQUAL_HEX32( 0x20020000U, SIM_AppStack() );
+}
+
+void test_boot_pins_keep_dfu_mode( void )
+{
+  LoadImage( IMAGE_SIZE );
+  SIM_SetBootPins( 0U, 0U );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_BOOTLOADER, SIM_State() );
+}
+
+void test_blank_flash_stays_in_dfu_mode( void )
+{
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_BOOTLOADER, SIM_State() );
+}
+
+void test_unmarked_image_stays_in_dfu_mode( void )
+{
+  SIM_FlashLoad( APP_ADDRESS, image, IMAGE_SIZE );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_BOOTLOADER, SIM_State() );
+}
+
+#if ( IMAGE_BOOT_CRC_ENB > 0U )
+void test_corrupted_image_stays_in_dfu_mode( void )
+{
+  uint32_t word = 0U;
+
+  LoadImage( IMAGE_SIZE );
+  /* One bit of a word left unprogrammed */
+  memcpy( &word, &image[0x8000U], sizeof( word ) );
+  TEST_ASSERT_NOT_EQUAL( 0U, word );
+  SIM_FlashSet( APP_ADDRESS + 0x8000U, word & ( word - 1U ) );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_BOOTLOADER, SIM_State() );
+}
+#else
+void test_flash_change_after_manifestation_is_not_checked( void )
+{
+  uint32_t word = 0U;
+
+  /* The trade-off of the descriptor only check: the image was verified once */
+  LoadImage( IMAGE_SIZE );
+  memcpy( &word, &image[0x8000U], sizeof( word ) );
+  TEST_ASSERT_NOT_EQUAL( 0U, word );
+  SIM_FlashSet( APP_ADDRESS + 0x8000U, word & ( word - 1U ) );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_APPLICATION, SIM_State() );
+}
+#endif
+
+void test_revoked_image_stays_in_dfu_mode( void )
+{
+  LoadImage( IMAGE_SIZE );
+  SIM_FlashSet( IMAGE_MARKER_ADDRESS + 12U, 0U );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_BOOTLOADER, SIM_State() );
+}
+
+void test_wrong_tag_is_refused( void )
+{
+  uint8_t              tag[USBD_DFU_TAG_SIZE];
+  SIM_DfuStatusTypeDef status;
+
+  LoadImage( IMAGE_SIZE );
+  SIM_SetBootPins( 0U, 0U );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  memcpy( wire, image, sizeof( wire ) );
+  SIM_ImageEncrypt( APP_ADDRESS, wire, sizeof( wire ) );
+  SIM_ImageTag( image, sizeof( wire ), IMAGE_VERSION, tag );
+  tag[0] ^= 0x01U;
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Image( tag, sizeof( wire ), SIM_Crc32( image, sizeof( wire ) ), IMAGE_VERSION ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, sizeof( wire ) ) );
+  TEST_ASSERT_EQUAL_INT( 1, SIM_DFU_Manifest() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_VERIFY, status.status );
+
+  SIM_SetBootPins( 1U, 1U );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_BOOTLOADER, SIM_State() );
+}
+
+void test_power_loss_during_download_stays_in_dfu_mode( void )
+{
+  uint8_t tag[USBD_DFU_TAG_SIZE];
+
+  LoadImage( IMAGE_SIZE );
+  SIM_SetBootPins( 0U, 0U );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  memcpy( wire, image, sizeof( wire ) );
+  SIM_ImageEncrypt( APP_ADDRESS, wire, sizeof( wire ) );
+  SIM_ImageTag( image, sizeof( wire ), IMAGE_VERSION, tag );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Image( tag, sizeof( wire ), SIM_Crc32( image, sizeof( wire ) ), IMAGE_VERSION ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, sizeof( wire ) / 2U ) );
+
+  /* Power lost, the flash holds half an image */
+  SIM_SetBootPins( 1U, 1U );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_BOOTLOADER, SIM_State() );
+}
+
+void test_validation_time( void )
+{
+  static const uint32_t sizes[3U] = { 0x00010000U, 0x00040000U, IMAGE_SIZE_MAX };
+  uint64_t least = 0U;
+  uint64_t ns    = 0U;
+
+  /* The boot of a one word image, no check to speak of */
+  LoadImage( 4U );
+  least = BootNs();
+  TEST_ASSERT_EQUAL_INT( SIM_APPLICATION, SIM_State() );
+  for ( uint32_t i=0U; i<3U; i++ )
+  {
+    LoadImage( sizes[i] );
+    ns = BootNs();
+    TEST_ASSERT_EQUAL_INT( SIM_APPLICATION, SIM_State() );
+    ns = ( ns > least ) ? ( ns - least ) : 0U;
+    snprintf( msg, sizeof( msg ), "%u KB image: check %.3f ms", ( unsigned )( sizes[i] / 1024U ), ns / 1e6 );
+    TEST_MESSAGE( msg );
+  }
+  #if ( IMAGE_BOOT_CRC_ENB > 0U )
+    /* The whole application area in a few milliseconds */
+    TEST_ASSERT_LESS_THAN( SIM_MS( 10U ), ns );
+  #else
+    /* The descriptor only, whatever the size of the image */
+    TEST_ASSERT_LESS_THAN( SIM_US( 10U ), ns );
+  #endif
+}
+
+int main( void )
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_valid_image_boots );
+  RUN_TEST( test_boot_pins_keep_dfu_mode );
+  RUN_TEST( test_blank_flash_stays_in_dfu_mode );
+  RUN_TEST( test_unmarked_image_stays_in_dfu_mode );
+#if ( IMAGE_BOOT_CRC_ENB > 0U )
+  RUN_TEST( test_corrupted_image_stays_in_dfu_mode );
+#else
+  RUN_TEST( test_flash_change_after_manifestation_is_not_checked );
+#endif
+  RUN_TEST( test_revoked_image_stays_in_dfu_mode );
+  RUN_TEST( test_wrong_tag_is_refused );
+  RUN_TEST( test_power_loss_during_download_stays_in_dfu_mode );
+  RUN_TEST( test_validation_time );
+  return UNITY_END();
+}
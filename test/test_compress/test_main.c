@@ -0,0 +1,222 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : Compressed download: the image as an LZ4 block.
+  ******************************************************************************
+  * The release tool compresses the image into one LZ4 block and sends it to
+  * IMAGE_LZ4_ADDRESS, the device decompresses it into the flash from
+  * APP_ADDRESS. Wire bytes and time of the whole update are reported against
+  * the uncompressed download of the same image, for machine code and for
+  * data that does not compress. The machine code is that of this test
+  * program, as it is mapped from __executable_start on.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "sim.h"
+#include "lz4.h"
+
+#define IMAGE_SIZE              0x00020000U   /* 128 KB, sectors 2 to 5 */
+#define IMAGE_VERSION           0x00010000U
+
+typedef struct
+{
+  uint64_t ns;
+  uint64_t bytesOut;
+} UpdateTypeDef;
+
+extern const uint8_t __executable_start[];
+extern const uint8_t etext[];
+
+static uint8_t  image[IMAGE_SIZE];
+static uint8_t  wire[IMAGE_SIZE + ( IMAGE_SIZE / 255U ) + 16U];
+static uint32_t codeSize = 0U;
+static char     msg[200];
+
+void setUp( void )
+{
+  SIM_PowerOn();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+}
+
+void tearDown( void )
+{
+}
+
+/* Machine code of the host, the stack pointer and the reset vector of a
+   firmware in front */
+static void CodeImage( void )
+{
+  codeSize = ( uint32_t )( etext - __executable_start );
+  codeSize = ( codeSize < sizeof( image ) ) ? ( codeSize & ~3U ) : sizeof( image );
+  memcpy( image, __executable_start, codeSize );
+  image[0] = 0x00U;
+  image[1] = 0x00U;
+  image[2] = 0x02U;
+  image[3] = 0x20U;
+}
+
+/* Whole update to a blank device, plain or compressed */
+static void Update( uint8_t compressed, const uint8_t* data, uint32_t length, UpdateTypeDef* update )
+{
+  uint64_t t = 0U;
+
+  SIM_PowerOn();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  SIM_USB_ResetStats();
+  t = SIM_Now();
+  if ( compressed != 0U )
+  {
+    TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_FlashLz4( data, length, IMAGE_VERSION ) );
+  }
+  else
+  {
+    TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Flash( data, length, IMAGE_VERSION ) );
+  }
+  update->ns       = SIM_Now() - t;
+  update->bytesOut = SIM_USB_Stats()->bytesOut;
+  TEST_ASSERT_EQUAL_INT( SIM_RESET, SIM_State() );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->errors );
+  TEST_ASSERT_EQUAL_MEMORY( data, ( const void* )APP_ADDRESS, length );
+}
+
+static void Report( const char* name, uint32_t length, const UpdateTypeDef* plain, const UpdateTypeDef* lz4 )
+{
+  snprintf( msg, sizeof( msg ), "%s: %u KB, plain %llu bytes on the wire in %.1f ms, LZ4 %llu bytes (%.0f %%) "
+            "in %.1f ms (%.0f %%)", name, ( unsigned )( length / 1024U ), ( unsigned long long )plain->bytesOut,
+            plain->ns / 1e6, ( unsigned long long )lz4->bytesOut, lz4->bytesOut * 100.0 / plain->bytesOut,
+            lz4->ns / 1e6, lz4->ns * 100.0 / plain->ns );
+  TEST_MESSAGE( msg );
+}
+
+/* Compressed and encrypted stream sent from IMAGE_LZ4_ADDRESS, the status of the last block */
+static int SendStream( uint8_t* data, uint32_t length, SIM_DfuStatusTypeDef* status )
+{
+  uint16_t xfer = SIM_DFU_TransferSize();
+  int      res  = 0;
+
+  SIM_ImageEncrypt( IMAGE_LZ4_ADDRESS, data, length );
+  res = SIM_DFU_SetAddress( IMAGE_LZ4_ADDRESS );
+  for ( uint32_t i=0U; ( res == 0 ) && ( i < length ); i += xfer )
+  {
+    uint16_t n = ( uint16_t )( ( ( length - i ) < xfer ) ? ( length - i ) : xfer );
+
+    res = SIM_DFU_Dnload( ( uint16_t )( 2U + ( i / xfer ) ), &data[i], n );
+    res = ( res < 0 ) ? res : SIM_DFU_Wait( status );
+  }
+  return res;
+}
+
+void test_compressor_round_trip( void )
+{
+  struct LZ4_stream s;
+  static uint8_t    stage[IMAGE_SIZE];
+  uint32_t          n = 0U;
+
+  /* Host decode of the host block, the whole output in one stage */
+  CodeImage();
+  n = SIM_ImageCompress( image, codeSize, wire );
+  LZ4_init( &s, stage, sizeof( stage ), ( uint32_t )stage );
+  TEST_ASSERT_EQUAL_UINT32( n, LZ4_decode( &s, wire, n ) );
+  TEST_ASSERT_EQUAL_UINT8( 1U, LZ4_isEnd( &s ) );
+  TEST_ASSERT_EQUAL_UINT32( codeSize, s.length );
+  TEST_ASSERT_EQUAL_MEMORY( image, stage, codeSize );
+}
+
+void test_code_image_benchmark( void )
+{
+  UpdateTypeDef plain;
+  UpdateTypeDef lz4;
+
+  CodeImage();
+  TEST_ASSERT_GREATER_THAN( 0x4000U, codeSize );
+  Update( 0U, image, codeSize, &plain );
+  Update( 1U, image, codeSize, &lz4 );
+  Report( "code", codeSize, &plain, &lz4 );
+  TEST_ASSERT_LESS_THAN( plain.bytesOut, lz4.bytesOut );
+  /* The reception overlaps the programming: the flash, not the bus, sets
+     the pace of the emulated device and the time stays that of the plain update */
+  TEST_ASSERT_TRUE( lz4.ns < ( plain.ns + ( plain.ns / 20U ) ) );
+}
+
+void test_random_image_benchmark( void )
+{
+  UpdateTypeDef plain;
+  UpdateTypeDef lz4;
+
+  SIM_Random( image, sizeof( image ), 5U );
+  Update( 0U, image, sizeof( image ), &plain );
+  Update( 1U, image, sizeof( image ), &lz4 );
+  Report( "random", sizeof( image ), &plain, &lz4 );
+  /* Literals only: a length byte per 255 */
+  TEST_ASSERT_TRUE( lz4.bytesOut <= ( plain.bytesOut + ( sizeof( image ) / 255U ) + 16U ) );
+  TEST_ASSERT_TRUE( lz4.ns < ( plain.ns + ( plain.ns / 20U ) ) );
+}
+
+void test_compressed_image_boots( void )
+{
+  CodeImage();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_FlashLz4( image, codeSize, IMAGE_VERSION ) );
+  SIM_SetBootPins( 1U, 1U );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_APPLICATION, SIM_State() );
+  TEST_ASSERT_EQUAL_HEX32( 0x20020000U, SIM_AppStack() );
+}
+
+void test_block_out_of_order_fails( void )
+{
+  SIM_DfuStatusTypeDef status;
+  uint16_t             xfer = SIM_DFU_TransferSize();
+
+  CodeImage();
+  ( void )SIM_ImageCompress( image, codeSize, wire );
+  SIM_ImageEncrypt( IMAGE_LZ4_ADDRESS, wire, ( 2U * xfer ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_SetAddress( IMAGE_LZ4_ADDRESS ) );
+  TEST_ASSERT_EQUAL_INT( xfer, SIM_DFU_Dnload( 3U, &wire[xfer], xfer ) );
+  TEST_ASSERT_EQUAL_INT( 1, SIM_DFU_Wait( &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_WRITE, status.status );
+  /* Nothing of it reached the flash */
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->words );
+}
+
+void test_match_before_the_image_fails( void )
+{
+  SIM_DfuStatusTypeDef status;
+  /* One literal, then a match 2 bytes back */
+  uint8_t              stream[] = { 0x10U, 0xAAU, 0x02U, 0x00U };
+
+  TEST_ASSERT_EQUAL_INT( 1, SendStream( stream, sizeof( stream ), &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_WRITE, status.status );
+}
+
+void test_truncated_stream_is_refused( void )
+{
+  SIM_DfuStatusTypeDef status;
+  uint8_t              tag[USBD_DFU_TAG_SIZE];
+  uint32_t             n = 0U;
+
+  CodeImage();
+  n = SIM_ImageCompress( image, codeSize, wire ) - 1U;
+  /* Tag of the image, only the LZ4 block is cut in its last literals */
+  SIM_ImageTag( image, codeSize, IMAGE_VERSION, tag );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Image( tag, codeSize, SIM_Crc32( image, codeSize ), IMAGE_VERSION ) );
+  TEST_ASSERT_EQUAL_INT( 0, SendStream( wire, n, &status ) );
+  TEST_ASSERT_EQUAL_INT( 1, SIM_DFU_Manifest() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_VERIFY, status.status );
+}
+
+int main( void )
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_compressor_round_trip );
+  RUN_TEST( test_code_image_benchmark );
+  RUN_TEST( test_random_image_benchmark );
+  RUN_TEST( test_compressed_image_boots );
+  RUN_TEST( test_block_out_of_order_fails );
+  RUN_TEST( test_match_before_the_image_fails );
+  RUN_TEST( test_truncated_stream_is_refused );
+  return UNITY_END();
+}
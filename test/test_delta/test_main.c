@@ -0,0 +1,282 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : Delta update: only the sectors that differ are sent.
+  ******************************************************************************
+  * The host reads the DFU_CMD_HASH CRC32 of every application sector the new
+  * image covers, compares it with the CRC32 of the sector it would program
+  * and sends the sectors that differ only. Wire bytes and time of the delta
+  * update are reported against the full download of the same image. The
+  * DFU_HASH_CMAC digest of each sector is checked against the host, areas
+  * other than whole application sectors are refused.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "sim.h"
+
+#define IMAGE_SIZE              0x00020000U   /* 128 KB, sectors 2 to 5 */
+#define SECTOR_MAX              0x00020000U
+#define IMAGE_VERSION           0x00010000U
+
+typedef struct
+{
+  uint64_t ns;
+  uint64_t hashNs;
+  uint64_t bytesOut;
+  uint32_t sectors;
+} UpdateTypeDef;
+
+static uint8_t oldImage[IMAGE_SIZE];
+static uint8_t newImage[IMAGE_SIZE];
+static uint8_t wire[IMAGE_SIZE];
+static uint8_t sector[SECTOR_MAX];
+static char    msg[200];
+
+void setUp( void )
+{
+  SIM_PowerOn();
+  SIM_Random( oldImage, sizeof( oldImage ), 3U );
+  oldImage[0] = 0x00U;
+  oldImage[1] = 0x00U;
+  oldImage[2] = 0x02U;
+  oldImage[3] = 0x20U;
+  memcpy( newImage, oldImage, sizeof( newImage ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Flash( oldImage, sizeof( oldImage ), IMAGE_VERSION ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+}
+
+void tearDown( void )
+{
+}
+
+static uint32_t SectorBase( uint32_t number )
+{
+  uint32_t adr = APP_ADDRESS;
+
+  while ( SIM_FlashSector( adr ) < number )
+  {
+    adr += 0x4000U;
+  }
+  return adr;
+}
+
+/* Content of a sector once the image is programmed: the image, erased after its end */
+static uint32_t SectorContent( const uint8_t* image, uint32_t number, uint8_t* content )
+{
+  uint32_t base = SectorBase( number );
+  uint32_t size = SectorBase( number + 1U ) - base;
+  uint32_t from = base - APP_ADDRESS;
+
+  memset( content, 0xFF, size );
+  if ( from < IMAGE_SIZE )
+  {
+    memcpy( content, &image[from], ( ( IMAGE_SIZE - from ) < size ) ? ( IMAGE_SIZE - from ) : size );
+  }
+  return size;
+}
+
+static uint32_t DeviceCrc( uint32_t number, uint32_t size )
+{
+  uint8_t digest[USBD_DFU_DIGEST_SIZE];
+
+  TEST_ASSERT_EQUAL_INT( 4, SIM_DFU_Hash( SectorBase( number ), size, DFU_HASH_CRC32, digest ) );
+  return digest[0] | ( ( uint32_t )digest[1] << 8U ) | ( ( uint32_t )digest[2] << 16U ) |
+         ( ( uint32_t )digest[3] << 24U );
+}
+
+/* The delta update: the hashes first, then the descriptor and the sectors
+   that differ. AES-CTR encrypts each sector at its address, AES-CBC the
+   sectors as one stream in the order sent. The tag is the one of the whole
+   image. Returns the result of the manifestation */
+static int DeltaUpdate( const uint8_t* image, UpdateTypeDef* update )
+{
+  uint8_t  tag[USBD_DFU_TAG_SIZE];
+  int      res   = 0;
+  uint32_t first = SIM_FlashSector( APP_ADDRESS );
+  uint32_t last  = SIM_FlashSector( APP_ADDRESS + IMAGE_SIZE - 1U );
+  uint8_t  send[SIM_FLASH_SECTORS] = { 0U };
+  uint32_t n     = 0U;
+  uint64_t t     = SIM_Now();
+
+  memset( update, 0, sizeof( *update ) );
+  SIM_USB_ResetStats();
+  for ( uint32_t i=first; i<=last; i++ )
+  {
+    uint32_t size = SectorContent( image, i, sector );
+
+    send[i] = ( DeviceCrc( i, size ) != SIM_Crc32( sector, size ) ) ? 1U : 0U;
+  }
+  update->hashNs = SIM_Now() - t;
+
+  for ( uint32_t i=first; i<=last; i++ )
+  {
+    uint32_t from = SectorBase( i ) - APP_ADDRESS;
+    uint32_t size = SectorBase( i + 1U ) - SectorBase( i );
+
+    if ( send[i] != 0U )
+    {
+      size = ( ( IMAGE_SIZE - from ) < size ) ? ( IMAGE_SIZE - from ) : size;
+      memcpy( &wire[n], &image[from], size );
+#if ( ENCRYPTION_CTR > 0U )
+      SIM_ImageEncrypt( SectorBase( i ), &wire[n], size );
+#endif
+      n += size;
+    }
+  }
+#if ( ENCRYPTION_CTR == 0U )
+  SIM_ImageEncrypt( APP_ADDRESS, wire, n );
+#endif
+  SIM_ImageTag( image, IMAGE_SIZE, IMAGE_VERSION, tag );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Image( tag, IMAGE_SIZE, SIM_Crc32( image, IMAGE_SIZE ), IMAGE_VERSION ) );
+  n = 0U;
+  for ( uint32_t i=first; i<=last; i++ )
+  {
+    uint32_t from = SectorBase( i ) - APP_ADDRESS;
+    uint32_t size = SectorBase( i + 1U ) - SectorBase( i );
+
+    if ( send[i] != 0U )
+    {
+      size = ( ( IMAGE_SIZE - from ) < size ) ? ( IMAGE_SIZE - from ) : size;
+      TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( SectorBase( i ), &wire[n], size ) );
+      n += size;
+      update->sectors++;
+    }
+  }
+  res              = SIM_DFU_Manifest();
+  update->ns       = SIM_Now() - t;
+  update->bytesOut = SIM_USB_Stats()->bytesOut;
+  return res;
+}
+
+static void FullUpdate( const uint8_t* image, UpdateTypeDef* update )
+{
+  uint64_t t = SIM_Now();
+
+  memset( update, 0, sizeof( *update ) );
+  SIM_USB_ResetStats();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Flash( image, IMAGE_SIZE, IMAGE_VERSION ) );
+  update->ns       = SIM_Now() - t;
+  update->bytesOut = SIM_USB_Stats()->bytesOut;
+}
+
+static void AssertBoots( const uint8_t* image )
+{
+  SIM_SetBootPins( 1U, 1U );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_APPLICATION, SIM_State() );
+  TEST_ASSERT_EQUAL_MEMORY( image, ( const void* )APP_ADDRESS, IMAGE_SIZE );
+}
+
+void test_sector_hash_matches_the_host( void )
+{
+  uint32_t first = SIM_FlashSector( APP_ADDRESS );
+  uint32_t last  = SIM_FlashSector( APP_ADDRESS + IMAGE_SIZE - 1U );
+
+  for ( uint32_t i=first; i<=last; i++ )
+  {
+    uint32_t size = SectorContent( oldImage, i, sector );
+    uint8_t  digest[USBD_DFU_DIGEST_SIZE];
+    uint8_t  expected[USBD_DFU_DIGEST_SIZE];
+
+    TEST_ASSERT_EQUAL_HEX32( SIM_Crc32( sector, size ), DeviceCrc( i, size ) );
+    TEST_ASSERT_EQUAL_INT( USBD_DFU_DIGEST_SIZE, SIM_DFU_Hash( SectorBase( i ), size, DFU_HASH_CMAC, digest ) );
+    SIM_DigestCmac( sector, size, expected );
+    TEST_ASSERT_EQUAL_HEX8_ARRAY( expected, digest, USBD_DFU_DIGEST_SIZE );
+  }
+}
+
+/* DFU_CMD_HASH of the area refused, the error cleared for the next command */
+static void AssertHashRefused( uint32_t address, uint32_t length, uint8_t algorithm )
+{
+  uint8_t digest[USBD_DFU_DIGEST_SIZE];
+
+  TEST_ASSERT_EQUAL_INT( 1, SIM_DFU_Hash( address, length, algorithm, digest ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_ClrStatus() );
+}
+
+void test_hash_outside_the_application_sectors_is_refused( void )
+{
+  uint8_t digest[USBD_DFU_DIGEST_SIZE];
+
+  /* The bootloader, whole or a word of it */
+  AssertHashRefused( FLASH_BASE, 0x4000U, DFU_HASH_CRC32 );
+  AssertHashRefused( ( FLASH_BASE + 0x1000U ), 4U, DFU_HASH_CRC32 );
+  AssertHashRefused( ( APP_ADDRESS - 0x4000U ), 0x8000U, DFU_HASH_CMAC );
+  /* Part of an application sector */
+  AssertHashRefused( APP_ADDRESS, 4U, DFU_HASH_CRC32 );
+  AssertHashRefused( ( APP_ADDRESS + 0x100U ), ( 0x4000U - 0x100U ), DFU_HASH_CRC32 );
+  AssertHashRefused( APP_ADDRESS, 0x2000U, DFU_HASH_CRC32 );
+  /* Two whole sectors are a valid area */
+  TEST_ASSERT_EQUAL_INT( 4, SIM_DFU_Hash( APP_ADDRESS, 0x8000U, DFU_HASH_CRC32, digest ) );
+}
+
+void test_delta_update_sends_the_changed_sector( void )
+{
+  UpdateTypeDef full;
+  UpdateTypeDef delta;
+
+  /* A patch inside sector 3 */
+  newImage[0x5000U] ^= 0x5AU;
+  newImage[0x6123U] ^= 0x01U;
+
+  FullUpdate( newImage, &full );
+  AssertBoots( newImage );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Flash( oldImage, IMAGE_SIZE, IMAGE_VERSION ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+
+  TEST_ASSERT_EQUAL_INT( 0, DeltaUpdate( newImage, &delta ) );
+  AssertBoots( newImage );
+  TEST_ASSERT_EQUAL_UINT32( 1U, delta.sectors );
+
+  snprintf( msg, sizeof( msg ), "full: %llu bytes out, %.1f ms", ( unsigned long long )full.bytesOut, full.ns / 1e6 );
+  TEST_MESSAGE( msg );
+  snprintf( msg, sizeof( msg ), "delta: %u of %u sectors, %llu bytes out, %.1f ms (hashes %.1f ms), saved %.0f%% bytes "
+            "and %.0f%% time", ( unsigned )delta.sectors,
+            ( unsigned )( SIM_FlashSector( APP_ADDRESS + IMAGE_SIZE - 1U ) - SIM_FlashSector( APP_ADDRESS ) + 1U ),
+            ( unsigned long long )delta.bytesOut, delta.ns / 1e6, delta.hashNs / 1e6,
+            100.0 * ( double )( full.bytesOut - delta.bytesOut ) / ( double )full.bytesOut,
+            100.0 * ( double )( full.ns - delta.ns ) / ( double )full.ns );
+  TEST_MESSAGE( msg );
+  TEST_ASSERT_LESS_THAN( full.bytesOut / 4U, delta.bytesOut );
+  TEST_ASSERT_LESS_THAN( full.ns, delta.ns );
+}
+
+void test_delta_update_of_sectors_apart_boots( void )
+{
+  UpdateTypeDef delta;
+
+  /* Sectors 2 and 5, the sectors between them are not sent */
+  newImage[0x0100U] ^= 0x80U;
+  newImage[0x1A000U] ^= 0x04U;
+
+  /* The tag covers the image in the flash, the gap is the old image */
+  TEST_ASSERT_EQUAL_INT( 0, DeltaUpdate( newImage, &delta ) );
+  TEST_ASSERT_EQUAL_UINT32( 2U, delta.sectors );
+  AssertBoots( newImage );
+}
+
+
+void test_delta_update_of_the_same_image_sends_no_block( void )
+{
+  UpdateTypeDef delta;
+
+  TEST_ASSERT_EQUAL_INT( 0, DeltaUpdate( oldImage, &delta ) );
+  TEST_ASSERT_EQUAL_UINT32( 0U, delta.sectors );
+  AssertBoots( oldImage );
+}
+
+int main( void )
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_sector_hash_matches_the_host );
+  RUN_TEST( test_hash_outside_the_application_sectors_is_refused );
+  RUN_TEST( test_delta_update_sends_the_changed_sector );
+  RUN_TEST( test_delta_update_of_sectors_apart_boots );
+  RUN_TEST( test_delta_update_of_the_same_image_sends_no_block );
+  return UNITY_END();
+}
@@ -0,0 +1,353 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : Download throughput of the bootloader on the emulated device.
+  ******************************************************************************
+  * An update as the release tool sends it, phase by phase: the image
+  * descriptor, the DNLOAD blocks and the manifestation, the device erases the sectors
+  * as they are reached. The times are those of the emulated device and
+  * bus, bytes/s of the DNLOAD phase and of the whole update are reported
+  * for a blank device and for an update over an image.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "sim.h"
+
+#define IMAGE_SIZE              0x00020000U   /* 128 KB, sectors 2 to 5 */
+#define IMAGE_VERSION           0x00010000U
+
+typedef struct
+{
+  uint64_t descriptorNs;
+  uint64_t downloadNs;
+  uint64_t manifestNs;
+  uint32_t blocks;
+  uint64_t busNs;
+  uint64_t pollNs;
+} DownloadTimesTypeDef;
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t wire[IMAGE_SIZE];
+static char    msg[200];
+
+void setUp( void )
+{
+  SIM_PowerOn();
+  SIM_Random( image, sizeof( image ), 1U );
+  image[0] = 0x00U;
+  image[1] = 0x00U;
+  image[2] = 0x02U;
+  image[3] = 0x20U;
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+}
+
+void tearDown( void )
+{
+}
+
+/* The update of SIM_DFU_Flash(), timed phase by phase */
+static void Download( const uint8_t* data, uint32_t length, DownloadTimesTypeDef* times )
+{
+  uint8_t  tag[USBD_DFU_TAG_SIZE];
+  uint64_t t = SIM_Now();
+
+  memcpy( wire, data, length );
+  SIM_ImageEncrypt( APP_ADDRESS, wire, length );
+  SIM_ImageTag( data, length, IMAGE_VERSION, tag );
+
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Image( tag, length, SIM_Crc32( data, length ), IMAGE_VERSION ) );
+  times->descriptorNs = SIM_Now() - t;
+
+  t = SIM_Now();
+  SIM_USB_ResetStats();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, length ) );
+  times->downloadNs = SIM_Now() - t;
+  times->blocks     = SIM_USB_Stats()->dnloads - 1U;  /* The address pointer first */
+  times->busNs      = SIM_USB_Stats()->busNs;
+  times->pollNs     = SIM_USB_Stats()->pollNs;
+
+  t = SIM_Now();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Manifest() );
+  times->manifestNs = SIM_Now() - t;
+}
+
+static void Report( const char* name, const DownloadTimesTypeDef* times, uint32_t length )
+{
+  uint64_t total = times->descriptorNs + times->downloadNs + times->manifestNs;
+
+  snprintf( msg, sizeof( msg ), "%s: %u KB, descriptor %.1f ms, DNLOAD %.1f ms (%.0f B/s), manifest %.1f ms, "
+            "total %.1f ms (%.0f B/s)", name, ( unsigned )( length / 1024U ), times->descriptorNs / 1e6,
+            times->downloadNs / 1e6, length * 1e9 / times->downloadNs, times->manifestNs / 1e6, total / 1e6,
+            length * 1e9 / total );
+  TEST_MESSAGE( msg );
+  snprintf( msg, sizeof( msg ), "%s: per block of %u bytes: %.2f ms, of it %.2f ms on the bus and %.2f ms "
+            "bwPollTimeout", name, SIM_DFU_TransferSize(), times->downloadNs / 1e6 / times->blocks,
+            times->busNs / 1e6 / times->blocks, times->pollNs / 1e6 / times->blocks );
+  TEST_MESSAGE( msg );
+}
+
+void test_enumerates_in_dfu_mode( void )
+{
+  SIM_DfuStatusTypeDef status;
+
+  TEST_ASSERT_EQUAL_INT( SIM_BOOTLOADER, SIM_State() );
+  TEST_ASSERT_EQUAL_UINT( USBD_DFU_XFER_SIZE, SIM_DFU_TransferSize() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_NONE, status.status );
+  TEST_ASSERT_EQUAL_UINT8( DFU_STATE_IDLE, status.state );
+}
+
+void test_download_to_blank_flash( void )
+{
+  DownloadTimesTypeDef times;
+
+  Download( image, sizeof( image ), &times );
+  Report( "blank", &times, sizeof( image ) );
+
+  TEST_ASSERT_EQUAL_INT( SIM_RESET, SIM_State() );
+  TEST_ASSERT_EQUAL_UINT( sizeof( image ) / USBD_DFU_XFER_SIZE, times.blocks );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->errors );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->bootWrites );
+  /* Blank sectors are not erased */
+  TEST_ASSERT_TRUE( SIM_FlashStats()->eraseNs == 0U );
+  TEST_ASSERT_EQUAL_MEMORY( image, ( const void* )APP_ADDRESS, sizeof( image ) );
+  snprintf( msg, sizeof( msg ), "blank: %.2f FLASH register writes per word programmed",
+            ( double )SIM_FlashStats()->regWrites / SIM_FlashStats()->words );
+  TEST_MESSAGE( msg );
+  #if ( FLASH_ASYNC_ENB == 0U ) && ( USBD_DFU_STREAM == 0U )
+    /* PSIZE and PG are set once per block, not per word */
+    TEST_ASSERT_LESS_THAN( SIM_FlashStats()->words / 10U, SIM_FlashStats()->regWrites );
+  #elif ( FLASH_ASYNC_ENB == 0U )
+    /* Once per part of a streamed block, a packet of 16 words at least */
+    TEST_ASSERT_LESS_THAN( SIM_FlashStats()->words / 2U, SIM_FlashStats()->regWrites );
+  #endif
+  /* Regression bound of the blank device */
+  TEST_ASSERT_GREATER_THAN( 130000U, ( uint32_t )( sizeof( image ) * 1e9 / times.downloadNs ) );
+}
+
+void test_download_over_an_image( void )
+{
+  DownloadTimesTypeDef times;
+
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Flash( image, sizeof( image ), IMAGE_VERSION ) );
+  SIM_Random( &image[4], sizeof( image ) - 4U, 2U );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  memset( SIM_FlashStats(), 0, sizeof( SIM_FlashStatsTypeDef ) );
+
+  Download( image, sizeof( image ), &times );
+  Report( "update", &times, sizeof( image ) );
+  snprintf( msg, sizeof( msg ), "update: erase %.1f ms, program %.1f ms, verify by DMA %.1f ms",
+            SIM_FlashStats()->eraseNs / 1e6, SIM_FlashStats()->programNs / 1e6, SIM_FlashStats()->dmaNs / 1e6 );
+  TEST_MESSAGE( msg );
+
+  for ( uint32_t sector=SIM_FlashSector( APP_ADDRESS ); sector<=SIM_FlashSector( APP_ADDRESS + sizeof( image ) - 1U );
+        sector++ )
+  {
+    TEST_ASSERT_EQUAL_UINT32( 1U, SIM_FlashStats()->erases[sector] );
+  }
+  /* The blocks waiting for an erase or a program retried from RAM only */
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->fetches );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->stalls );
+  TEST_ASSERT_EQUAL_MEMORY( image, ( const void* )APP_ADDRESS, sizeof( image ) );
+}
+
+void test_download_of_one_sector_keeps_the_next( void )
+{
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Flash( image, sizeof( image ), IMAGE_VERSION ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  memset( SIM_FlashStats(), 0, sizeof( SIM_FlashStatsTypeDef ) );
+
+  /* The last block ends on the last byte of sector 2 */
+  memcpy( wire, image, 0x4000U );
+  SIM_ImageEncrypt( APP_ADDRESS, wire, 0x4000U );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, 0x4000U ) );
+  /* dnIDLE frees the buffer, the last block is still programmed from the queue */
+  SIM_Run( SIM_MS( 20U ) );
+  TEST_ASSERT_EQUAL_UINT32( 1U, SIM_FlashStats()->erases[SIM_FlashSector( APP_ADDRESS )] );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->erases[SIM_FlashSector( APP_ADDRESS + 0x4000U )] );
+  TEST_ASSERT_EQUAL_MEMORY( image, ( const void* )APP_ADDRESS, sizeof( image ) );
+}
+
+void test_block_over_programmed_flash_fails( void )
+{
+  SIM_DfuStatusTypeDef status;
+
+  /* The sector is erased once per session: the second block keeps the 0
+     bits of the first and the flash differs from the data */
+  memcpy( wire, image, USBD_DFU_XFER_SIZE );
+  SIM_ImageEncrypt( APP_ADDRESS, wire, USBD_DFU_XFER_SIZE );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, USBD_DFU_XFER_SIZE ) );
+  memset( wire, 0xA5, USBD_DFU_XFER_SIZE );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_SetAddress( APP_ADDRESS ) );
+  TEST_ASSERT_EQUAL_INT( USBD_DFU_XFER_SIZE, SIM_DFU_Dnload( 2U, wire, USBD_DFU_XFER_SIZE ) );
+#if ( IMAGE_CRC_ENB > 0U )
+  /* No read back per block, the image check on manifestation refuses it */
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Wait( &status ) );
+  TEST_ASSERT_EQUAL_INT( 1, SIM_DFU_Manifest() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_VERIFY, status.status );
+#else
+  TEST_ASSERT_EQUAL_INT( 1, SIM_DFU_Wait( &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_WRITE, status.status );
+#endif
+}
+
+void test_block_cut_mid_stream_is_dropped( void )
+{
+  SIM_DfuStatusTypeDef status;
+  uint16_t             xfer = SIM_DFU_TransferSize();
+
+  memcpy( wire, image, ( 2U * xfer ) );
+  SIM_ImageEncrypt( APP_ADDRESS, wire, ( 2U * xfer ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_SetAddress( APP_ADDRESS ) );
+
+  /* The host gives up on block 2 after three packets: the block is not
+     taken, the packets left in the buffer are not programmed */
+  TEST_ASSERT_EQUAL_INT( ( 3 * SIM_USB_EP0_SIZE ), SIM_DFU_DnloadCut( 2U, wire, xfer, ( 3U * SIM_USB_EP0_SIZE ) ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_NONE, status.status );
+  TEST_ASSERT_EQUAL_UINT8( DFU_STATE_DNLOAD_IDLE, status.state );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Abort() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_STATE_IDLE, status.state );
+
+  /* Cut again and aborted at once, then the download from the start */
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_SetAddress( APP_ADDRESS ) );
+  TEST_ASSERT_EQUAL_INT( ( 2 * SIM_USB_EP0_SIZE ), SIM_DFU_DnloadCut( 2U, wire, xfer, ( 2U * SIM_USB_EP0_SIZE ) ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Abort() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, ( 2U * xfer ) ) );
+  SIM_Run( SIM_MS( 20U ) );
+  TEST_ASSERT_EQUAL_MEMORY( image, ( const void* )APP_ADDRESS, ( 2U * xfer ) );
+}
+
+void test_download_after_an_aborted_one( void )
+{
+  DownloadTimesTypeDef times;
+
+  /* Half of another image, then the host gives up without a reset: the
+     sectors written so far are erased again for the next download */
+  SIM_Random( wire, ( IMAGE_SIZE / 2U ), 2U );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, ( IMAGE_SIZE / 2U ) ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Abort() );
+
+  Download( image, sizeof( image ), &times );
+  TEST_ASSERT_EQUAL_INT( SIM_RESET, SIM_State() );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->reprograms );
+  TEST_ASSERT_EQUAL_MEMORY( image, ( const void* )APP_ADDRESS, sizeof( image ) );
+}
+
+void test_download_after_a_failed_one( void )
+{
+  DownloadTimesTypeDef times;
+  uint8_t              digest[USBD_DFU_DIGEST_SIZE];
+
+  /* A refused command fails the download half way, CLRSTATUS ends it */
+  SIM_Random( wire, ( IMAGE_SIZE / 2U ), 2U );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, ( IMAGE_SIZE / 2U ) ) );
+  TEST_ASSERT_EQUAL_INT( 1, SIM_DFU_Hash( APP_ADDRESS, 0x100U, DFU_HASH_CRC32, digest ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_ClrStatus() );
+
+  Download( image, sizeof( image ), &times );
+  TEST_ASSERT_EQUAL_INT( SIM_RESET, SIM_State() );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->reprograms );
+  TEST_ASSERT_EQUAL_MEMORY( image, ( const void* )APP_ADDRESS, sizeof( image ) );
+}
+
+void test_getstatus_is_answered_during_an_erase( void )
+{
+  const uint32_t       address = APP_ADDRESS + IMAGE_SIZE - 0x8000U;  /* 128 KB sector 5 */
+  const uint32_t       sector  = SIM_FlashSector( address );
+  uint8_t              cmd[5]  = { DFU_CMD_ERASE, ( uint8_t )address, ( uint8_t )( address >> 8U ),
+                                   ( uint8_t )( address >> 16U ), ( uint8_t )( address >> 24U ) };
+  SIM_DfuStatusTypeDef status;
+  uint32_t             answers = 0U;
+  uint64_t             gap     = 0U;
+  uint64_t             end;
+  uint64_t             t;
+
+  SIM_FlashFill( address, 0x00U, 0x20000U );
+  memset( SIM_FlashStats(), 0, sizeof( SIM_FlashStatsTypeDef ) );
+  TEST_ASSERT_EQUAL_INT( sizeof( cmd ), SIM_DFU_Dnload( 0U, cmd, sizeof( cmd ) ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+  TEST_ASSERT_EQUAL_UINT32( 1U, SIM_FlashStats()->erases[sector] );
+
+  /* The erase started before the first GETSTATUS: a host polling every
+     millisecond until it would end gets every answer while BSY is set */
+  t   = SIM_Now();
+  end = t + SIM_FlashStats()->eraseNs;
+  while ( SIM_Now() < end )
+  {
+    SIM_Run( SIM_MS( 1U ) );
+    TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+    TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_NONE, status.status );
+    gap = ( ( SIM_Now() - t ) > gap ) ? ( SIM_Now() - t ) : gap;
+    t   = SIM_Now();
+    answers++;
+  }
+  snprintf( msg, sizeof( msg ), "erase: %u GETSTATUS answered in %.1f ms, %.1f ms apart at most",
+            ( unsigned )answers, SIM_FlashStats()->eraseNs / 1e6, gap / 1e6 );
+  TEST_MESSAGE( msg );
+
+  /* No call, return or constant read of the device reached the busy flash */
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->fetches );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->stalls );
+  TEST_ASSERT_LESS_THAN( SIM_MS( 5U ), gap );
+  TEST_ASSERT_GREATER_THAN( SIM_FlashStats()->eraseNs / SIM_MS( 5U ), answers );
+}
+
+#if ( ENCRYPTION_CTR > 0U )
+void test_blocks_of_another_nonce_are_refused( void )
+{
+  static const uint8_t earlier[USBD_DFU_NONCE_SIZE] = { 0x01U };
+  static const uint8_t current[USBD_DFU_NONCE_SIZE] = { 0x02U };
+  SIM_DfuStatusTypeDef status;
+  uint8_t              tag[USBD_DFU_TAG_SIZE];
+
+  /* Blocks encrypted for an earlier image, replayed under the descriptor of a new one */
+  memcpy( wire, image, 0x4000U );
+  SIM_ImageNonce( earlier );
+  SIM_ImageEncrypt( APP_ADDRESS, wire, 0x4000U );
+  SIM_ImageTag( image, 0x4000U, IMAGE_VERSION, tag );
+  SIM_ImageNonce( current );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Image( tag, 0x4000U, SIM_Crc32( image, 0x4000U ), IMAGE_VERSION ) );
+  SIM_ImageNonce( NULL );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, 0x4000U ) );
+
+  /* The keystream of the new nonce turns them into noise */
+  TEST_ASSERT_EQUAL_INT( 1, SIM_DFU_Manifest() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+  TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_VERIFY, status.status );
+  TEST_ASSERT_NOT_EQUAL( 0, memcmp( image, ( const void* )APP_ADDRESS, 16U ) );
+}
+#endif
+
+void test_downloaded_image_boots( void )
+{
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Flash( image, sizeof( image ), IMAGE_VERSION ) );
+  SIM_SetBootPins( 1U, 1U );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_APPLICATION, SIM_State() );
+  TEST_ASSERT_EQUAL_HEX32( 0x20020000U, SIM_AppStack() );
+}
+
+int main( void )
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_enumerates_in_dfu_mode );
+  RUN_TEST( test_download_to_blank_flash );
+  RUN_TEST( test_download_over_an_image );
+  RUN_TEST( test_download_of_one_sector_keeps_the_next );
+  RUN_TEST( test_block_over_programmed_flash_fails );
+  RUN_TEST( test_block_cut_mid_stream_is_dropped );
+  RUN_TEST( test_download_after_an_aborted_one );
+  RUN_TEST( test_download_after_a_failed_one );
+  RUN_TEST( test_getstatus_is_answered_during_an_erase );
+#if ( ENCRYPTION_CTR > 0U )
+  RUN_TEST( test_blocks_of_another_nonce_are_refused );
+#endif
+  RUN_TEST( test_downloaded_image_boots );
+  return UNITY_END();
+}
@@ -0,0 +1,94 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : OTG FS FIFO layout of EP0 for the DFU transfers.
+  ******************************************************************************
+  * The FIFO sizes MX_USB_DEVICE_Init leaves in the controller are checked against
+  * the profile of the build (USBD_FIFO_PROFILE_DFU, 0 in the
+  * test_native_fifo_generated environment) and the minimums of RM0033. The
+  * packets each layout buffers per control transfer are reported with the
+  * NAKs and the throughput of 1 KB DNLOAD transfers on the emulated bus.
+  *
+  * The emulated controller hands every packet to the OTG interrupt at once,
+  * so the FIFO is empty before the next one: NAKs and throughput measure the
+  * arming of EP0 by the device library, the FIFO depth only shows in the
+  * model (packets buffered before the CPU has to drain or refill the FIFO).
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "sim.h"
+
+#define FIFO_WORDS              320U          /* OTG FS FIFO RAM, 1.25 KB */
+#define FIFO_PACKET_WORDS       ( SIM_USB_EP0_SIZE / 4U )
+#define FIFO_RX_RESERVE         13U           /* SETUP packets, global OUT NAK and transfer complete entries */
+#define IMAGE_SIZE              0x00010000U
+
+static uint8_t image[IMAGE_SIZE];
+static char    msg[200];
+
+void setUp( void )
+{
+  SIM_PowerOn();
+  SIM_Random( image, sizeof( image ), 14U );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+}
+
+void tearDown( void )
+{
+}
+
+void test_fifo_layout_of_the_profile( void )
+{
+  #if ( USBD_FIFO_PROFILE_DFU == 1U )
+    TEST_ASSERT_EQUAL_UINT32( 0xC0U, SIM_USB_RxFifo() );
+    TEST_ASSERT_EQUAL_UINT32( 0x80U, SIM_USB_TxFifo( 0U ) );
+    TEST_ASSERT_EQUAL_UINT32( 0U, SIM_USB_TxFifo( 1U ) );
+  #else
+    TEST_ASSERT_EQUAL_UINT32( 0x80U, SIM_USB_RxFifo() );
+    TEST_ASSERT_EQUAL_UINT32( 0x40U, SIM_USB_TxFifo( 0U ) );
+    TEST_ASSERT_EQUAL_UINT32( 0x80U, SIM_USB_TxFifo( 1U ) );
+  #endif
+  TEST_ASSERT_LESS_OR_EQUAL( FIFO_WORDS, SIM_USB_RxFifo() + SIM_USB_TxFifo( 0U ) + SIM_USB_TxFifo( 1U ) +
+                             SIM_USB_TxFifo( 2U ) + SIM_USB_TxFifo( 3U ) );
+  /* RM0033: one packet of the largest OUT endpoint and its status word, IN: one packet */
+  TEST_ASSERT_GREATER_OR_EQUAL( FIFO_RX_RESERVE + FIFO_PACKET_WORDS + 1U, SIM_USB_RxFifo() );
+  TEST_ASSERT_GREATER_OR_EQUAL( FIFO_PACKET_WORDS, SIM_USB_TxFifo( 0U ) );
+}
+
+void test_dnload_naks_and_throughput( void )
+{
+  uint32_t rx      = ( SIM_USB_RxFifo() - FIFO_RX_RESERVE ) / ( FIFO_PACKET_WORDS + 1U );
+  uint32_t tx      = SIM_USB_TxFifo( 0U ) / FIFO_PACKET_WORDS;
+  uint32_t packets = SIM_DFU_TransferSize() / SIM_USB_EP0_SIZE;
+  uint64_t t       = 0U;
+
+  SIM_ImageEncrypt( APP_ADDRESS, image, IMAGE_SIZE );
+  SIM_USB_ResetStats();
+  t = SIM_Now();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, image, IMAGE_SIZE ) );
+  t = SIM_Now() - t;
+
+  snprintf( msg, sizeof( msg ), "RX %u words: %u packets of %u per DNLOAD buffered, TX0 %u words: %u packets, "
+            "UPLOAD refills %u", ( unsigned )SIM_USB_RxFifo(), ( unsigned )rx, ( unsigned )packets,
+            ( unsigned )SIM_USB_TxFifo( 0U ), ( unsigned )tx, ( unsigned )( ( packets + tx - 1U ) / tx ) );
+  TEST_MESSAGE( msg );
+  snprintf( msg, sizeof( msg ), "%u B DNLOAD: %u transfers, %u packets, %u NAKs, bus %.0f B/s, DNLOAD %.0f B/s",
+            ( unsigned )SIM_DFU_TransferSize(), ( unsigned )SIM_USB_Stats()->dnloads,
+            ( unsigned )SIM_USB_Stats()->packets, ( unsigned )SIM_USB_Stats()->naks,
+            SIM_USB_Stats()->bytesOut * 1e9 / ( double )SIM_USB_Stats()->busNs, IMAGE_SIZE * 1e9 / ( double )t );
+  TEST_MESSAGE( msg );
+  /* EP0 is armed again in the OTG interrupt of every packet */
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_USB_Stats()->naks );
+  TEST_ASSERT_GREATER_OR_EQUAL( 1U, rx );
+}
+
+int main( void )
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_fifo_layout_of_the_profile );
+  RUN_TEST( test_dnload_naks_and_throughput );
+  return UNITY_END();
+}
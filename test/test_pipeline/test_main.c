@@ -0,0 +1,238 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : Write pipeline: the stages of a DNLOAD block and their cycles.
+  ******************************************************************************
+  * A block to the flash is authenticated, decrypted, clipped to the
+  * application, its sectors erased, its erased ends skipped and programmed;
+  * a block of the compressed window is decompressed in between. The DWT
+  * cycles the firmware counts per stage are reported for a whole update,
+  * on the emulated device they are the virtual time of the flash and the
+  * host time of the firmware code. An image with erased gaps programs only
+  * the words of its data.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "sim.h"
+
+#define IMAGE_SIZE              0x00020000U   /* 128 KB, sectors 2 to 5 */
+#define IMAGE_VERSION           0x00010000U
+#define GAP_START               0x00004064U   /* Erased in the gap image: sector 3 but its first 100 bytes */
+#define GAP_END                 0x0000C024U   /* Into sector 4 */
+#define TAIL_START              0x0001E800U   /* Erased up to the end */
+#define INFO_WORDS              4U            /* Length, CRC, version and marker of the manifested image */
+#define WORD_CYCLES             ( ( SIM_FLASH_WORD_NS * ( SIM_HCLK_HZ / 1000000ULL ) ) / 1000ULL )
+
+typedef struct
+{
+  uint32_t cycles;
+  uint32_t calls;
+} StageTypeDef;
+
+/* Stages of a block to the flash, in order */
+static const char* const flashStage[] =
+{
+  #if defined( ENCRYPTION )
+    "decrypt",
+  #endif
+  "clip",
+  "prepare",
+  #if ( FLASH_SKIP_ERASED_ENB > 0U )
+    "skip",
+  #endif
+  "program"
+};
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t wire[IMAGE_SIZE];
+static char    msg[200];
+
+void setUp( void )
+{
+  SIM_PowerOn();
+  SIM_Random( image, sizeof( image ), 7U );
+  image[0] = 0x00U;
+  image[1] = 0x00U;
+  image[2] = 0x02U;
+  image[3] = 0x20U;
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+}
+
+void tearDown( void )
+{
+}
+
+static void Stage( const char* name, StageTypeDef* stage )
+{
+  TEST_ASSERT_EQUAL_INT( 0, SIM_FwStage( name, &stage->cycles, &stage->calls ) );
+}
+
+static void ReportStage( const char* name, uint32_t length )
+{
+  StageTypeDef stage;
+
+  Stage( name, &stage );
+  snprintf( msg, sizeof( msg ), "%-10s %6u calls, %10u cycles, %8.1f cycles/KB", name, ( unsigned )stage.calls,
+            ( unsigned )stage.cycles, stage.cycles * 1024.0 / length );
+  TEST_MESSAGE( msg );
+}
+
+/* Image with erased gaps: one inside a sector, one up to the end */
+static void GapImage( void )
+{
+  memset( &image[GAP_START], 0xFF, ( GAP_END - GAP_START ) );
+  memset( &image[TAIL_START], 0xFF, ( IMAGE_SIZE - TAIL_START ) );
+}
+
+static uint32_t DataWords( const uint8_t* data, uint32_t length )
+{
+  uint32_t words = 0U;
+  uint32_t word  = 0U;
+
+  for ( uint32_t i=0U; i<length; i += 4U )
+  {
+    memcpy( &word, &data[i], 4U );
+    words += ( word != 0xFFFFFFFFU ) ? 1U : 0U;
+  }
+  return words;
+}
+
+/* Descriptor and DNLOAD blocks of SIM_DFU_Flash(), the words programmed by the
+   blocks: the last of them may still be programmed in the manifestation */
+static uint32_t Download( const uint8_t* data, uint32_t length )
+{
+  uint8_t  tag[USBD_DFU_TAG_SIZE];
+  uint32_t words = 0U;
+
+  memcpy( wire, data, length );
+  SIM_ImageEncrypt( APP_ADDRESS, wire, length );
+  SIM_ImageTag( data, length, IMAGE_VERSION, tag );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Image( tag, length, SIM_Crc32( data, length ), IMAGE_VERSION ) );
+  words = SIM_FlashStats()->words;
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, length ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Manifest() );
+  words = SIM_FlashStats()->words - words - INFO_WORDS;
+  TEST_ASSERT_EQUAL_INT( SIM_RESET, SIM_State() );
+  TEST_ASSERT_EQUAL_MEMORY( data, ( const void* )APP_ADDRESS, length );
+  return words;
+}
+
+void test_every_stage_runs_for_every_block( void )
+{
+  uint32_t     blocks = IMAGE_SIZE / SIM_DFU_TransferSize();
+  StageTypeDef stage;
+
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Flash( image, sizeof( image ), IMAGE_VERSION ) );
+  for ( uint32_t i=0U; i<( sizeof( flashStage ) / sizeof( flashStage[0] ) ); i++ )
+  {
+    ReportStage( flashStage[i], sizeof( image ) );
+    Stage( flashStage[i], &stage );
+    TEST_ASSERT_TRUE( stage.calls >= blocks );
+  }
+  #if ( IMAGE_LZ4_ENB > 0U )
+    /* Not on the way of a plain image */
+    Stage( "decompress", &stage );
+    TEST_ASSERT_EQUAL_UINT32( 0U, stage.calls );
+  #endif
+}
+
+#if ( WRITE_CYCLES_ENB > 0U )
+void test_program_stage_cycles( void )
+{
+  StageTypeDef program;
+  uint64_t     flash = WORD_CYCLES * ( IMAGE_SIZE / 4U );
+
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Flash( image, sizeof( image ), IMAGE_VERSION ) );
+  Stage( "program", &program );
+  #if ( FLASH_ASYNC_ENB > 0U )
+    /* The words are programmed in the background, the stage only starts them */
+    TEST_ASSERT_TRUE( program.cycles < ( flash / 2U ) );
+  #else
+    /* The stage waits for every word */
+    TEST_ASSERT_TRUE( program.cycles >= flash );
+  #endif
+}
+#endif
+
+#if ( IMAGE_LZ4_ENB > 0U )
+void test_decompression_stage_without_the_programming( void )
+{
+  StageTypeDef decompress;
+  StageTypeDef program;
+
+  /* Compresses: 4 KB of random data repeated */
+  for ( uint32_t i=0x1000U; i<IMAGE_SIZE; i++ )
+  {
+    image[i] = image[i & 0x0FFFU];
+  }
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_FlashLz4( image, sizeof( image ), IMAGE_VERSION ) );
+  TEST_ASSERT_EQUAL_MEMORY( image, ( const void* )APP_ADDRESS, sizeof( image ) );
+  Stage( "decompress", &decompress );
+  Stage( "program", &program );
+  ReportStage( "decompress", sizeof( image ) );
+  ReportStage( "program", sizeof( image ) );
+  TEST_ASSERT_TRUE( decompress.calls > 0U );
+  TEST_ASSERT_TRUE( program.calls >= ( IMAGE_SIZE / IMAGE_LZ4_STAGE ) );
+  #if ( ( FLASH_ASYNC_ENB == 0U ) && ( WRITE_CYCLES_ENB > 0U ) )
+    /* The stages it feeds are counted on their own */
+    TEST_ASSERT_TRUE( program.cycles >= ( WORD_CYCLES * ( IMAGE_SIZE / 4U ) ) );
+    TEST_ASSERT_TRUE( decompress.cycles < ( program.cycles / 4U ) );
+  #endif
+}
+#endif
+
+void test_erased_gaps_are_not_programmed( void )
+{
+  uint64_t t     = 0U;
+  uint64_t full  = 0U;
+  uint64_t gaps  = 0U;
+  uint32_t words = 0U;
+
+  t     = SIM_Now();
+  words = Download( image, sizeof( image ) );
+  full  = SIM_Now() - t;
+  TEST_ASSERT_EQUAL_UINT32( ( IMAGE_SIZE / 4U ), words );
+
+  SIM_PowerOn();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  GapImage();
+  t     = SIM_Now();
+  words = Download( image, sizeof( image ) );
+  gaps  = SIM_Now() - t;
+  snprintf( msg, sizeof( msg ), "%u of %u words programmed, update in %.1f ms, %.1f ms without the gaps",
+            ( unsigned )words, ( unsigned )( IMAGE_SIZE / 4U ), gaps / 1e6, full / 1e6 );
+  TEST_MESSAGE( msg );
+  #if ( FLASH_SKIP_ERASED_ENB > 0U )
+    TEST_ASSERT_EQUAL_UINT32( DataWords( image, sizeof( image ) ), words );
+    TEST_ASSERT_TRUE( gaps < full );
+  #else
+    TEST_ASSERT_EQUAL_UINT32( ( IMAGE_SIZE / 4U ), words );
+  #endif
+}
+
+void test_gap_over_an_old_image_is_erased( void )
+{
+  /* Sector 3 programmed before: the gap relies on its erase */
+  SIM_FlashFill( ( APP_ADDRESS + 0x4000U ), 0x00U, 0x4000U );
+  GapImage();
+  ( void )Download( image, sizeof( image ) );
+  TEST_ASSERT_EQUAL_UINT32( 1U, SIM_FlashStats()->erases[3] );
+}
+
+int main( void )
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_every_stage_runs_for_every_block );
+  #if ( WRITE_CYCLES_ENB > 0U )
+    RUN_TEST( test_program_stage_cycles );
+  #endif
+  #if ( IMAGE_LZ4_ENB > 0U )
+    RUN_TEST( test_decompression_stage_without_the_programming );
+  #endif
+  RUN_TEST( test_erased_gaps_are_not_programmed );
+  RUN_TEST( test_gap_over_an_old_image_is_erased );
+  return UNITY_END();
+}
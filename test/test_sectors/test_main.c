@@ -0,0 +1,144 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : Sector map of the flash geometry at every sector boundary.
+  ******************************************************************************
+  * The sector lookup, the DFU descriptor string and the erase command are
+  * generated from the FLASH_*_GEOMETRY lists of usbd_dfu_if.h. They are
+  * checked here against the sector map of the STM32F207xG reference manual,
+  * on both sides of every sector boundary.
+  ******************************************************************************
+  */
+
+#include <string.h>
+#include "unity.h"
+#include "sim.h"
+
+#define SECTOR_APP_FIRST        2U
+#define SECTOR_LOG              11U
+
+/* RM0033, 1 MB: 4 x 16 KB, 1 x 64 KB, 7 x 128 KB */
+static const uint32_t sectorBase[SIM_FLASH_SECTORS + 1U] =
+{
+  0x08000000U, 0x08004000U, 0x08008000U, 0x0800C000U, 0x08010000U, 0x08020000U, 0x08040000U,
+  0x08060000U, 0x08080000U, 0x080A0000U, 0x080C0000U, 0x080E0000U, 0x08100000U
+};
+
+static uint8_t data[0x00002000U];
+static uint8_t wire[0x00002000U];
+
+void setUp( void )
+{
+  SIM_PowerOn();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+}
+
+void tearDown( void )
+{
+}
+
+/* Bytes of an area that are not value */
+static uint32_t Differ( uint32_t address, uint32_t length, uint8_t value )
+{
+  const uint8_t* p = ( const uint8_t* )address;
+  uint32_t       n = 0U;
+
+  for ( uint32_t i=0U; i<length; i++ )
+  {
+    n += ( p[i] != value ) ? 1U : 0U;
+  }
+  return n;
+}
+
+void test_sector_lookup_at_every_boundary( void )
+{
+  for ( uint32_t i=0U; i<SIM_FLASH_SECTORS; i++ )
+  {
+    TEST_ASSERT_EQUAL_UINT32( i, SIM_FwGetSector( sectorBase[i] ) );
+    TEST_ASSERT_EQUAL_UINT32( i, SIM_FwGetSector( sectorBase[i] + 4U ) );
+    TEST_ASSERT_EQUAL_UINT32( i, SIM_FwGetSector( sectorBase[i + 1U] - 1U ) );
+    TEST_ASSERT_EQUAL_UINT32( i, SIM_FwGetSector( sectorBase[i + 1U] - 4U ) );
+    TEST_ASSERT_EQUAL_UINT32( i, SIM_FlashSector( sectorBase[i] ) );
+  }
+}
+
+void test_descriptor_string_of_the_geometry( void )
+{
+  uint8_t config[64U];
+  char    str[96U];
+
+  /* iInterface of the first interface descriptor, after the 9 bytes of the configuration */
+  TEST_ASSERT_GREATER_THAN( 18, SIM_USB_Control( 0x80U, 0x06U, 0x0200U, 0U, sizeof( config ), config ) );
+  TEST_ASSERT_EQUAL_HEX8( 0x04U, config[9U + 1U] );
+  TEST_ASSERT_GREATER_THAN( 0, SIM_USB_String( config[9U + 8U], str, sizeof( str ) ) );
+#if ( IMAGE_LZ4_ENB > 0U )
+  /* The compressed image window follows, written only */
+  TEST_ASSERT_EQUAL_STRING( "@Internal Flash/0x08008000/2*16Kg,1*64Kg,7*128Kg/0x90000000/1*1024Kd", str );
+#else
+  TEST_ASSERT_EQUAL_STRING( "@Internal Flash/0x08008000/2*16Kg,1*64Kg,7*128Kg", str );
+#endif
+}
+
+void test_erase_at_every_application_sector( void )
+{
+  for ( uint32_t i=SECTOR_APP_FIRST; i<SECTOR_LOG; i++ )
+  {
+    uint32_t size = sectorBase[i + 1U] - sectorBase[i];
+
+    SIM_FlashFill( APP_ADDRESS, 0x00U, IMAGE_MARKER_ADDRESS - APP_ADDRESS );
+    memset( SIM_FlashStats(), 0, sizeof( SIM_FlashStatsTypeDef ) );
+    TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Erase( sectorBase[i] ) );
+
+    TEST_ASSERT_EQUAL_UINT32( 1U, SIM_FlashStats()->erases[i] );
+    TEST_ASSERT_EQUAL_UINT32( 0U, Differ( sectorBase[i], size, 0xFFU ) );
+    TEST_ASSERT_EQUAL_UINT32( 0U, Differ( APP_ADDRESS, sectorBase[i] - APP_ADDRESS, 0x00U ) );
+    TEST_ASSERT_EQUAL_UINT32( 0U, Differ( sectorBase[i + 1U], IMAGE_MARKER_ADDRESS - sectorBase[i + 1U], 0x00U ) );
+  }
+}
+
+void test_erase_leaves_the_bootloader( void )
+{
+  SIM_FlashFill( FLASH_BASE, 0x00U, APP_ADDRESS - FLASH_BASE );
+  memset( SIM_FlashStats(), 0, sizeof( SIM_FlashStatsTypeDef ) );
+
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Erase( FLASH_BASE ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Erase( APP_ADDRESS - 4U ) );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->bootWrites );
+  TEST_ASSERT_EQUAL_UINT32( 0U, Differ( FLASH_BASE, APP_ADDRESS - FLASH_BASE, 0x00U ) );
+  for ( uint32_t i=0U; i<SIM_FLASH_SECTORS; i++ )
+  {
+    TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->erases[i] );
+  }
+}
+
+void test_download_across_a_sector_boundary( void )
+{
+  uint32_t address = sectorBase[4U] - ( sizeof( data ) / 2U );
+
+  /* Programmed sectors, a blank one is not erased again */
+  SIM_FlashFill( sectorBase[3U], 0x00U, sectorBase[5U] - sectorBase[3U] );
+  SIM_Random( data, sizeof( data ), 20U );
+  memcpy( wire, data, sizeof( wire ) );
+  SIM_ImageEncrypt( address, wire, sizeof( wire ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( address, wire, sizeof( wire ) ) );
+  /* dnIDLE frees the buffer, the last block is still programmed from the queue */
+  SIM_Run( SIM_MS( 20U ) );
+
+  TEST_ASSERT_EQUAL_MEMORY( data, ( const void* )address, sizeof( data ) );
+  TEST_ASSERT_EQUAL_UINT32( 1U, SIM_FlashStats()->erases[3U] );
+  TEST_ASSERT_EQUAL_UINT32( 1U, SIM_FlashStats()->erases[4U] );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->erases[5U] );
+  TEST_ASSERT_EQUAL_UINT32( 0U, Differ( sectorBase[3U], address - sectorBase[3U], 0xFFU ) );
+  TEST_ASSERT_EQUAL_UINT32( 0U, Differ( address + sizeof( data ), sectorBase[5U] - address - sizeof( data ), 0xFFU ) );
+}
+
+int main( void )
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_sector_lookup_at_every_boundary );
+  RUN_TEST( test_descriptor_string_of_the_geometry );
+  RUN_TEST( test_erase_at_every_application_sector );
+  RUN_TEST( test_erase_leaves_the_bootloader );
+  RUN_TEST( test_download_across_a_sector_boundary );
+  return UNITY_END();
+}
@@ -0,0 +1,155 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : UPLOAD read-back of the flash.
+  ******************************************************************************
+  * An image is read back as the production check does and its throughput
+  * reported, and the READING_POLICY regions are checked. The default build
+  * has no UPLOAD. The test_native_upload_encrypted environment reads out
+  * with READING_ENCRYPT: the line station opens a session, decrypts with
+  * the read-out key and the nonce, and a new nonce is needed after every
+  * change of the flash. The test_native_upload environment reads plaintext.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "sim.h"
+
+#define IMAGE_SIZE              0x00040000U   /* 256 KB, sectors 2 to 6 */
+#define NONCE_SIZE              16U           /* DFU_CMD_SESSION: the first AES-CTR counter block */
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t expected[IMAGE_SIZE];
+static uint8_t readBack[IMAGE_SIZE];
+#if ( READING_ENB > 0U )
+  static char  msg[200];
+#endif
+#if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U )
+  static uint8_t nonce[NONCE_SIZE];
+#endif
+
+void setUp( void )
+{
+  SIM_PowerOn();
+  SIM_Random( image, sizeof( image ), 17U );
+  SIM_FlashLoad( APP_ADDRESS, image, IMAGE_SIZE );
+  memcpy( expected, image, IMAGE_SIZE );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  #if ( READING_ENB > 0U ) && ( READING_ENCRYPT > 0U )
+    TEST_ASSERT_EQUAL_INT( NONCE_SIZE, SIM_DFU_Session( nonce ) );
+  #endif
+}
+
+void tearDown( void )
+{
+}
+
+#if ( READING_ENB == 0U )
+void test_upload_is_refused( void )
+{
+  TEST_ASSERT_EQUAL_INT( SIM_USB_STALL, SIM_DFU_Read( APP_ADDRESS, readBack, SIM_DFU_TransferSize() ) );
+}
+#else
+void test_upload_reads_the_image_back( void )
+{
+  uint64_t t = SIM_Now();
+
+  SIM_USB_ResetStats();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Read( APP_ADDRESS, readBack, IMAGE_SIZE ) );
+  t = SIM_Now() - t;
+  #if ( READING_ENCRYPT > 0U )
+    TEST_ASSERT_TRUE( memcmp( expected, readBack, IMAGE_SIZE ) != 0 );
+    SIM_ReadDecrypt( APP_ADDRESS, readBack, IMAGE_SIZE, nonce );
+  #endif
+  TEST_ASSERT_EQUAL_MEMORY( expected, readBack, IMAGE_SIZE );
+
+  snprintf( msg, sizeof( msg ), "%u KB UPLOAD: %u transfers, %u packets, %u NAKs, %.1f ms, %.0f B/s",
+            ( unsigned )( IMAGE_SIZE / 1024U ), ( unsigned )SIM_USB_Stats()->uploads,
+            ( unsigned )SIM_USB_Stats()->packets, ( unsigned )SIM_USB_Stats()->naks, t / 1e6,
+            IMAGE_SIZE * 1e9 / ( double )t );
+  TEST_MESSAGE( msg );
+  TEST_ASSERT_EQUAL_UINT32( IMAGE_SIZE / SIM_DFU_TransferSize(), SIM_USB_Stats()->uploads );
+}
+
+void test_upload_policy( void )
+{
+  #if ( READING_POLICY > 0U )
+    SIM_DfuStatusTypeDef status;
+
+    /* The bootloader, up to its last block */
+    TEST_ASSERT_EQUAL_INT( SIM_USB_STALL, SIM_DFU_Read( FLASH_BASE, readBack, SIM_DFU_TransferSize() ) );
+    TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_GetStatus( &status ) );
+    TEST_ASSERT_EQUAL_UINT8( DFU_ERROR_ADDRESS, status.status );
+    TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_ClrStatus() );
+    TEST_ASSERT_EQUAL_INT( SIM_USB_STALL, SIM_DFU_Read( APP_ADDRESS - SIM_DFU_TransferSize(), readBack,
+                                                        SIM_DFU_TransferSize() ) );
+    TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_ClrStatus() );
+  #endif
+  /* The image log, up to the end of the flash */
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Read( IMAGE_MARKER_ADDRESS, readBack, SIM_DFU_TransferSize() ) );
+  #if ( READING_ENCRYPT > 0U )
+    SIM_ReadDecrypt( IMAGE_MARKER_ADDRESS, readBack, SIM_DFU_TransferSize(), nonce );
+  #endif
+  TEST_ASSERT_EACH_EQUAL_HEX8( 0xFFU, readBack, SIM_DFU_TransferSize() );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Read( FLASH_END + 1U - SIM_DFU_TransferSize(), readBack,
+                                          SIM_DFU_TransferSize() ) );
+}
+
+#if ( READING_ENCRYPT > 0U )
+void test_upload_needs_a_session( void )
+{
+  uint8_t again[NONCE_SIZE];
+
+  /* A new power-on, no session yet */
+  SIM_PowerOn();
+  SIM_FlashLoad( APP_ADDRESS, image, IMAGE_SIZE );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+  TEST_ASSERT_EQUAL_INT( SIM_USB_STALL, SIM_DFU_Read( APP_ADDRESS, readBack, SIM_DFU_TransferSize() ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_ClrStatus() );
+
+  /* Every session reads out with another keystream */
+  TEST_ASSERT_EQUAL_INT( NONCE_SIZE, SIM_DFU_Session( nonce ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Read( APP_ADDRESS, readBack, SIM_DFU_TransferSize() ) );
+  TEST_ASSERT_EQUAL_INT( NONCE_SIZE, SIM_DFU_Session( again ) );
+  TEST_ASSERT_TRUE( memcmp( nonce, again, NONCE_SIZE ) != 0 );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Read( APP_ADDRESS, expected, SIM_DFU_TransferSize() ) );
+  TEST_ASSERT_TRUE( memcmp( expected, readBack, SIM_DFU_TransferSize() ) != 0 );
+}
+
+void test_erase_ends_the_session( void )
+{
+  uint32_t sector = APP_ADDRESS + IMAGE_SIZE;
+
+  /* Read out erased, the sector gives the keystream of a new session away,
+     not that of the image files */
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Erase( sector ) );
+  TEST_ASSERT_EQUAL_INT( SIM_USB_STALL, SIM_DFU_Read( sector, readBack, SIM_DFU_TransferSize() ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_ClrStatus() );
+  TEST_ASSERT_EQUAL_INT( NONCE_SIZE, SIM_DFU_Session( nonce ) );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Read( sector, readBack, SIM_DFU_TransferSize() ) );
+  memset( expected, 0xFF, SIM_DFU_TransferSize() );
+  SIM_ImageEncrypt( sector, expected, SIM_DFU_TransferSize() );
+  TEST_ASSERT_TRUE( memcmp( expected, readBack, SIM_DFU_TransferSize() ) != 0 );
+  SIM_ReadDecrypt( sector, readBack, SIM_DFU_TransferSize(), nonce );
+  TEST_ASSERT_EACH_EQUAL_HEX8( 0xFFU, readBack, SIM_DFU_TransferSize() );
+}
+#endif
+#endif
+
+int main( void )
+{
+  UNITY_BEGIN();
+  #if ( READING_ENB == 0U )
+    RUN_TEST( test_upload_is_refused );
+  #else
+    RUN_TEST( test_upload_reads_the_image_back );
+    RUN_TEST( test_upload_policy );
+    #if ( READING_ENCRYPT > 0U )
+      RUN_TEST( test_upload_needs_a_session );
+      RUN_TEST( test_erase_ends_the_session );
+    #endif
+  #endif
+  return UNITY_END();
+}
@@ -0,0 +1,96 @@
+/**
+  ******************************************************************************
+  * @file           : test_main.c
+  * @brief          : DNLOAD round trips per image for the DFU transfer size.
+  ******************************************************************************
+  * Built with the transfer size of usbd_conf.h and, in the
+  * test_native_xfer2048/4096 environments, with -DUSBD_DFU_XFER_SIZE.
+  * The functional descriptor has to announce the size the buffer is built
+  * with, a larger block is stalled. The DNLOAD and GETSTATUS round trips of
+  * an image and its throughput are reported for the size of the build.
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "sim.h"
+
+#define IMAGE_SIZE              0x00020000U   /* 128 KB, sectors 2 to 5 */
+#define IMAGE_VERSION           0x00030000U
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t wire[IMAGE_SIZE];
+static char    msg[200];
+
+void setUp( void )
+{
+  SIM_PowerOn();
+  SIM_Random( image, sizeof( image ), 15U );
+  image[0] = 0x00U;
+  image[1] = 0x00U;
+  image[2] = 0x02U;
+  image[3] = 0x20U;
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Enter() );
+}
+
+void tearDown( void )
+{
+}
+
+void test_descriptor_announces_the_transfer_size( void )
+{
+  TEST_ASSERT_EQUAL_UINT( USBD_DFU_XFER_SIZE, SIM_DFU_TransferSize() );
+}
+
+void test_round_trips_per_image( void )
+{
+  uint8_t  tag[USBD_DFU_TAG_SIZE];
+  uint32_t crc    = SIM_Crc32( image, IMAGE_SIZE );
+  uint32_t blocks = 0U;
+  uint64_t t      = 0U;
+
+  memcpy( wire, image, IMAGE_SIZE );
+  SIM_ImageEncrypt( APP_ADDRESS, wire, IMAGE_SIZE );
+  SIM_ImageTag( image, IMAGE_SIZE, IMAGE_VERSION, tag );
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Image( tag, IMAGE_SIZE, crc, IMAGE_VERSION ) );
+
+  SIM_USB_ResetStats();
+  t = SIM_Now();
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Download( APP_ADDRESS, wire, IMAGE_SIZE ) );
+  t = SIM_Now() - t;
+  blocks = SIM_USB_Stats()->dnloads - 1U;  /* The address pointer first */
+
+  snprintf( msg, sizeof( msg ), "wTransferSize %u: %u data blocks, %u round trips (%u DNLOAD, %u GETSTATUS), "
+            "%u packets, %.1f ms, %.0f B/s", ( unsigned )USBD_DFU_XFER_SIZE, ( unsigned )blocks,
+            ( unsigned )SIM_USB_Stats()->transfers, ( unsigned )SIM_USB_Stats()->dnloads,
+            ( unsigned )SIM_USB_Stats()->getstatus, ( unsigned )SIM_USB_Stats()->packets, t / 1e6,
+            IMAGE_SIZE * 1e9 / ( double )t );
+  TEST_MESSAGE( msg );
+  TEST_ASSERT_EQUAL_UINT32( IMAGE_SIZE / USBD_DFU_XFER_SIZE, blocks );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_USB_Stats()->naks );
+
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_Manifest() );
+  SIM_SetBootPins( 1U, 1U );
+  SIM_Boot();
+  TEST_ASSERT_EQUAL_INT( SIM_APPLICATION, SIM_State() );
+  TEST_ASSERT_EQUAL_MEMORY( image, ( const void* )APP_ADDRESS, IMAGE_SIZE );
+}
+
+void test_block_larger_than_the_transfer_size_is_stalled( void )
+{
+  static uint8_t block[USBD_DFU_XFER_SIZE + SIM_USB_EP0_SIZE];
+
+  TEST_ASSERT_EQUAL_INT( 0, SIM_DFU_SetAddress( APP_ADDRESS ) );
+  TEST_ASSERT_EQUAL_INT( SIM_USB_STALL, SIM_DFU_Dnload( 2U, block, sizeof( block ) ) );
+  TEST_ASSERT_EQUAL_UINT32( 0U, SIM_FlashStats()->words );
+}
+
+int main( void )
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_descriptor_announces_the_transfer_size );
+  RUN_TEST( test_round_trips_per_image );
+  RUN_TEST( test_block_larger_than_the_transfer_size_is_stalled );
+  return UNITY_END();
+}